@@ -201,6 +201,7 @@ local function meta_urls_function(task)
 end
 
 local function meta_words_function(task)
+  task:process_text_parts()
   local avg_len = task:get_mempool():get_variable("avg_words_len", "double") or 0.0
   local short_words = task:get_mempool():get_variable("short_words_cnt", "double") or 0.0
   local ret_len = 0
@@ -25,6 +25,7 @@ local rspamd_lua_utils = require "lua_util"
 -- Different text parts
 rspamd_config.R_PARTS_DIFFER = {
   callback = function(task)
+    task:process_text_parts()
     local distance = task:get_mempool():get_variable('parts_distance', 'double')
 
     if distance then
@@ -2573,6 +2573,7 @@ rspamd_controller_handle_stat_common (
 	ucl_object_t *top, *sub;
 	gint i;
 	guint64 spam = 0, ham = 0;
+	gdouble images_avg_time;
 	rspamd_mempool_stat_t mem_st;
 	struct rspamd_stat *stat, stat_copy;
 	struct rspamd_controller_worker_ctx *ctx;
@@ -2666,12 +2667,120 @@ rspamd_controller_handle_stat_common (
 			mem_st.oversized_chunks), "chunks_oversized", 0, false);
 	ucl_object_insert_key (top,
 			ucl_object_fromint (mem_st.fragmented_size), "fragmented", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (mem_st.chain_cache_hits),
+			"chains_cache_hits", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (mem_st.chain_cache_misses),
+			"chains_cache_misses", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (mem_st.chain_cache_bytes),
+			"chains_cache_bytes", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (mem_st.chain_cache_trimmed),
+			"chains_cache_trimmed", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->task_arenas_allocated),
+			"task_arenas_allocated", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->task_arenas_reused),
+			"task_arenas_reused", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->bayes_cache_hits),
+			"bayes_cache_hits", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->bayes_cache_misses),
+			"bayes_cache_misses", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (
+					stat->bayes_cache_hits + stat->bayes_cache_misses > 0 ?
+					(gdouble)stat->bayes_cache_hits /
+					(stat->bayes_cache_hits + stat->bayes_cache_misses) :
+					0.0),
+			"bayes_cache_hit_ratio", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->bayes_cache_saved_bytes),
+			"bayes_cache_saved_bytes", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->learn_cache_lookups),
+			"learn_cache_lookups", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->learn_cache_skipped),
+			"learn_cache_skipped", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->learn_cache_false_positives),
+			"learn_cache_false_positives", 0, false);
+	/* Part of not learned messages that have not been excluded by filter */
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (
+					stat->learn_cache_false_positives +
+					stat->learn_cache_skipped > 0 ?
+					(gdouble)stat->learn_cache_false_positives /
+					(stat->learn_cache_false_positives +
+					stat->learn_cache_skipped) :
+					0.0),
+			"learn_cache_filter_fp_rate", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->text_stages_skipped),
+			"text_stages_skipped", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->text_stages_total),
+			"text_stages_total", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (stat->messages_scanned > 0 ?
+					(gdouble)stat->text_stages_skipped /
+					stat->messages_scanned : 0.0),
+			"text_stages_skipped_per_task", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->part_cache_hits),
+			"part_cache_hits", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->part_cache_misses),
+			"part_cache_misses", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (
+					stat->part_cache_hits + stat->part_cache_misses > 0 ?
+					(gdouble)stat->part_cache_hits /
+					(stat->part_cache_hits + stat->part_cache_misses) :
+					0.0),
+			"part_cache_hit_rate", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->images_normalized),
+			"images_normalized", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromint (stat->images_cache_hits),
+			"images_cache_hits", 0, false);
+	/* Each hit saves average normalization time of an image */
+	images_avg_time = stat->images_normalized > 0 ?
+			stat->images_normalize_time / 1000.0 / stat->images_normalized :
+			0.0;
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (images_avg_time),
+			"images_normalize_avg_time", 0, false);
+	ucl_object_insert_key (top,
+			ucl_object_fromdouble (images_avg_time * stat->images_cache_hits),
+			"images_normalize_time_saved", 0, false);
 
 	if (do_reset) {
 		session->ctx->srv->stat->messages_scanned = 0;
 		session->ctx->srv->stat->messages_learned = 0;
 		session->ctx->srv->stat->connections_count = 0;
 		session->ctx->srv->stat->control_connections_count = 0;
+		session->ctx->srv->stat->task_arenas_allocated = 0;
+		session->ctx->srv->stat->task_arenas_reused = 0;
+		session->ctx->srv->stat->bayes_cache_hits = 0;
+		session->ctx->srv->stat->bayes_cache_misses = 0;
+		session->ctx->srv->stat->bayes_cache_saved_bytes = 0;
+		session->ctx->srv->stat->learn_cache_lookups = 0;
+		session->ctx->srv->stat->learn_cache_skipped = 0;
+		session->ctx->srv->stat->learn_cache_false_positives = 0;
+		session->ctx->srv->stat->text_stages_skipped = 0;
+		session->ctx->srv->stat->text_stages_total = 0;
+		session->ctx->srv->stat->part_cache_hits = 0;
+		session->ctx->srv->stat->part_cache_misses = 0;
+		session->ctx->srv->stat->images_normalized = 0;
+		session->ctx->srv->stat->images_cache_hits = 0;
+		session->ctx->srv->stat->images_normalize_time = 0;
 		rspamd_mempool_stat_reset ();
 	}
 
@@ -44,6 +44,14 @@
 #define DEFAULT_KEYPAIR_CACHE_SIZE 512
 #define DEFAULT_MASTER_TIMEOUT 10.0
 #define DEFAULT_UPDATES_MAXFAIL 3
+#define DEFAULT_BATCH_SIZE 32
+#define DEFAULT_PEER_RING_SIZE 8192
+/* Retry interval for updates that have not fit in the ring */
+#define PEER_RING_OVERFLOW_RETRY 0.01
+/* Time to wait for a producer that is writing a ring being closed */
+#define PEER_RING_CLOSE_TIMEOUT 1.0
+#define MAX_BATCH_SIZE 1024
+#define MAX_DATAGRAM_SIZE 512
 #define COOKIE_SIZE 128
 
 static const gchar *local_db_name = "local";
@@ -98,6 +106,28 @@ struct fuzzy_global_stat {
 	guint64 fuzzy_hashes_found[RSPAMD_FUZZY_EPOCH_MAX];
 	/**< amount of hashes found by epoch				*/
 	guint64 invalid_requests;
+	guint64 replies_delayed;
+	/**< batched replies that waited for a writable socket	*/
+	guint64 replies_failed;
+	/**< batched replies that could not be sent			*/
+	guint64 peer_updates_queued;
+	/**< updates passed to the update worker via ring	*/
+	guint64 peer_updates_fallback;
+	/**< updates sent over the peer socket				*/
+	guint64 peer_updates_delayed;
+	/**< updates queued locally as the ring was full	*/
+	guint64 peer_ring_drains;
+	/**< number of ring drains in the update worker		*/
+	guint64 peer_ring_max_depth;
+	/**< maximum number of commands drained at once		*/
+	guint64 updates_flushes;
+	/**< number of flushes of the updates queue			*/
+	gdouble updates_flush_time;
+	/**< total time spent in flushes					*/
+	gdouble updates_flush_last;
+	/**< time spent in the last flush					*/
+	gdouble updates_flush_max;
+	/**< maximum time spent in a flush					*/
 };
 
 struct fuzzy_key_stat {
@@ -146,6 +176,12 @@ struct rspamd_fuzzy_storage_ctx {
 	guint keypair_cache_size;
 	gint peer_fd;
 	struct event peer_ev;
+	guint peer_ring_size;
+	struct fuzzy_peer_ring *peer_ring;
+	GArray *peer_overflow;
+	struct event peer_overflow_ev;
+	gboolean peer_overflow_armed;
+	GPtrArray *peer_rings;
 	struct event stat_ev;
 	struct timeval stat_tv;
 	/* Local keypair */
@@ -170,6 +206,11 @@ struct rspamd_fuzzy_storage_ctx {
 	const ucl_object_t *skip_map;
 	struct rspamd_hash_map_helper *skip_hashes;
 	guchar cookie[COOKIE_SIZE];
+	guint batch_size;
+	struct fuzzy_recv_batch *recv_batch;
+	struct fuzzy_reply_batch *reply_batch;
+	GQueue *pending_replies;
+	struct fuzzy_check_batch *check_batch;
 };
 
 enum fuzzy_cmd_type {
@@ -209,6 +250,57 @@ struct fuzzy_peer_request {
 	struct fuzzy_peer_cmd cmd;
 };
 
+#define FUZZY_PEER_RING_MAGIC 0x71727a66U
+#define FUZZY_PEER_RING_ALIGN 64
+
+/*
+ * Updates from the fuzzy workers are passed to the update worker (index 0)
+ * via single producer, single consumer rings in shared memory. A producer
+ * wakes the update worker over the peer socket only when the ring becomes
+ * non-empty after a drain (or reaches the half of its capacity), so under
+ * load many updates are drained per wakeup instead of one datagram per
+ * update. When a ring is full, updates are kept in order in a local overflow
+ * queue and moved to the ring once the update worker drains it; they are not
+ * sent over the peer socket, as a datagram could overtake updates still queued
+ * in the ring. The update worker marks rings as closed when it terminates and
+ * waits for a producer that is writing to the ring before the last drain, so
+ * producers recreate rings for the next update worker.
+ */
+struct fuzzy_peer_ring_hdr {
+	guint32 magic;
+	guint32 nslots;
+	gint notified;
+	/* Set by the consumer when it stops reading the ring */
+	gint closed;
+	/* Set by the producer while it writes to the ring */
+	gint busy;
+	guchar pad0[FUZZY_PEER_RING_ALIGN - sizeof (guint32) * 2 - sizeof (gint) * 3];
+	/* Written by the producer only */
+	gint head;
+	guchar pad1[FUZZY_PEER_RING_ALIGN - sizeof (gint)];
+	/* Written by the consumer only */
+	gint tail;
+	guchar pad2[FUZZY_PEER_RING_ALIGN - sizeof (gint)];
+};
+
+struct fuzzy_peer_ring {
+	struct fuzzy_peer_ring_hdr *hdr;
+	struct fuzzy_peer_cmd *slots;
+	gsize size;
+	guint id;
+	gchar shm_name[64];
+};
+
+/*
+ * Wakeup message sent over the peer socket, it is distinguished from
+ * the plain struct fuzzy_peer_cmd by its size
+ */
+struct fuzzy_peer_ring_msg {
+	guint32 magic;
+	guint32 id;
+	gchar shm_name[64];
+};
+
 struct fuzzy_key {
 	struct rspamd_cryptobox_keypair *key;
 	struct rspamd_cryptobox_pubkey *pk;
@@ -228,6 +320,53 @@ struct fuzzy_master_update_session {
 	gint sock;
 };
 
+struct fuzzy_batch_reply {
+	struct rspamd_fuzzy_encrypted_reply data;
+	gsize len;
+	struct sockaddr_storage addr;
+	socklen_t slen;
+};
+
+/*
+ * Replies that are collected while a batch of commands is processed, they
+ * are sent afterwards using a single sendmmsg call
+ */
+struct fuzzy_reply_batch {
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	struct fuzzy_batch_reply *replies;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+#endif
+	guint nreplies;
+	guint nalloc;
+	gint fd;
+	gboolean active;
+	gboolean pending; /* Rest of a batch waiting for a writable socket */
+	struct event io;
+};
+
+/*
+ * Check commands that are collected while a batch of datagrams is processed,
+ * they are passed to the backend at once
+ */
+struct fuzzy_check_batch {
+	GPtrArray *sessions;
+	GPtrArray *cmds;
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	gint fd;
+};
+
+#ifdef HAVE_RECVMMSG
+struct fuzzy_recv_batch {
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	struct sockaddr_storage *addrs;
+	guint8 *bufs;
+	guint nalloc;
+};
+#endif
+
 static void rspamd_fuzzy_write_reply (struct fuzzy_session *session);
 
 static gboolean
@@ -490,6 +629,7 @@ rspamd_fuzzy_send_update_mirror (struct rspamd_fuzzy_storage_ctx *ctx,
 
 struct rspamd_updates_cbdata {
 	GArray *updates_pending;
+	gdouble start;
 	struct rspamd_fuzzy_storage_ctx *ctx;
 	gchar *source;
 };
@@ -533,9 +673,18 @@ rspamd_fuzzy_updates_cb (gboolean success,
 	guint i;
 	struct rspamd_fuzzy_storage_ctx *ctx;
 	const gchar *source;
+	gdouble elapsed;
 
 	ctx = cbdata->ctx;
 	source = cbdata->source;
+	elapsed = rspamd_get_ticks (FALSE) - cbdata->start;
+	ctx->stat.updates_flushes ++;
+	ctx->stat.updates_flush_time += elapsed;
+	ctx->stat.updates_flush_last = elapsed;
+
+	if (elapsed > ctx->stat.updates_flush_max) {
+		ctx->stat.updates_flush_max = elapsed;
+	}
 
 	if (success) {
 		rspamd_fuzzy_backend_count (ctx->backend, fuzzy_count_callback, ctx);
@@ -611,6 +760,7 @@ rspamd_fuzzy_process_updates_queue (struct rspamd_fuzzy_storage_ctx *ctx,
 				sizeof (struct fuzzy_peer_cmd),
 				MAX (cbdata->updates_pending->len, 1024));
 		cbdata->source = g_strdup (source);
+		cbdata->start = rspamd_get_ticks (FALSE);
 		rspamd_fuzzy_backend_process_updates (ctx->backend,
 				cbdata->updates_pending,
 				source, rspamd_fuzzy_updates_cb, cbdata);
@@ -626,12 +776,140 @@ rspamd_fuzzy_reply_io (gint fd, gshort what, gpointer d)
 	REF_RELEASE (session);
 }
 
+static struct fuzzy_reply_batch *
+rspamd_fuzzy_reply_batch_new (struct rspamd_fuzzy_storage_ctx *ctx,
+		guint nalloc)
+{
+	struct fuzzy_reply_batch *batch;
+
+	batch = g_malloc0 (sizeof (*batch));
+	batch->ctx = ctx;
+	batch->nalloc = nalloc;
+	batch->fd = -1;
+	batch->replies = g_malloc (sizeof (*batch->replies) * nalloc);
+#ifdef HAVE_SENDMMSG
+	batch->msgs = g_malloc (sizeof (*batch->msgs) * nalloc);
+	batch->iovs = g_malloc (sizeof (*batch->iovs) * nalloc);
+#endif
+
+	return batch;
+}
+
+static void
+rspamd_fuzzy_reply_batch_free (struct fuzzy_reply_batch *batch)
+{
+	g_free (batch->replies);
+#ifdef HAVE_SENDMMSG
+	g_free (batch->msgs);
+	g_free (batch->iovs);
+#endif
+	g_free (batch);
+}
+
+static gboolean rspamd_fuzzy_reply_batch_flush (struct fuzzy_reply_batch *batch);
+
+static void
+rspamd_fuzzy_reply_batch_io (gint fd, gshort what, gpointer d)
+{
+	struct fuzzy_reply_batch *batch = d;
+
+	event_del (&batch->io);
+
+	if (rspamd_fuzzy_reply_batch_flush (batch)) {
+		g_queue_remove (batch->ctx->pending_replies, batch);
+		rspamd_fuzzy_reply_batch_free (batch);
+	}
+}
+
+/*
+ * Sends collected replies, returns FALSE if a pending batch still has
+ * replies to send and is rescheduled
+ */
+static gboolean
+rspamd_fuzzy_reply_batch_flush (struct fuzzy_reply_batch *batch)
+{
+	struct fuzzy_reply_batch *pending;
+	guint sent = 0;
+	gint r;
+#ifdef HAVE_SENDMMSG
+	guint i;
+
+	for (i = 0; i < batch->nreplies; i ++) {
+		batch->iovs[i].iov_base = &batch->replies[i].data;
+		batch->iovs[i].iov_len = batch->replies[i].len;
+		memset (&batch->msgs[i], 0, sizeof (batch->msgs[i]));
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+		batch->msgs[i].msg_hdr.msg_name = &batch->replies[i].addr;
+		batch->msgs[i].msg_hdr.msg_namelen = batch->replies[i].slen;
+	}
+#else
+	struct fuzzy_batch_reply *rep;
+#endif
+
+	while (sent < batch->nreplies) {
+#ifdef HAVE_SENDMMSG
+		r = sendmmsg (batch->fd, &batch->msgs[sent], batch->nreplies - sent, 0);
+#else
+		rep = &batch->replies[sent];
+		r = sendto (batch->fd, &rep->data, rep->len, 0,
+				(struct sockaddr *)&rep->addr, rep->slen) == -1 ? -1 : 1;
+#endif
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			else if (errno == EWOULDBLOCK || errno == EAGAIN) {
+				/* Send the rest when socket is writable */
+				if (batch->pending) {
+					batch->nreplies -= sent;
+					memmove (batch->replies, &batch->replies[sent],
+							sizeof (*batch->replies) * batch->nreplies);
+					event_add (&batch->io, NULL);
+
+					return FALSE;
+				}
+
+				pending = rspamd_fuzzy_reply_batch_new (batch->ctx,
+						batch->nreplies - sent);
+				memcpy (pending->replies, &batch->replies[sent],
+						sizeof (*pending->replies) * pending->nalloc);
+				pending->nreplies = pending->nalloc;
+				pending->fd = batch->fd;
+				pending->pending = TRUE;
+				event_set (&pending->io, pending->fd, EV_WRITE,
+						rspamd_fuzzy_reply_batch_io, pending);
+				event_base_set (batch->ctx->ev_base, &pending->io);
+				event_add (&pending->io, NULL);
+				g_queue_push_tail (batch->ctx->pending_replies, pending);
+				batch->ctx->stat.replies_delayed += pending->nreplies;
+			}
+			else {
+				msg_err ("error while writing replies: %s", strerror (errno));
+				batch->ctx->stat.replies_failed += batch->nreplies - sent;
+			}
+
+			break;
+		}
+
+		sent += r;
+	}
+
+	batch->nreplies = 0;
+
+	return TRUE;
+}
+
 static void
 rspamd_fuzzy_write_reply (struct fuzzy_session *session)
 {
 	gssize r;
 	gsize len;
 	gconstpointer data;
+	struct fuzzy_reply_batch *batch;
+	struct fuzzy_batch_reply *rep;
+	const struct sockaddr *sa;
 
 	if (session->cmd_type == CMD_ENCRYPTED_NORMAL ||
 				session->cmd_type == CMD_ENCRYPTED_SHINGLE) {
@@ -656,6 +934,23 @@ rspamd_fuzzy_write_reply (struct fuzzy_session *session)
 		}
 	}
 
+	batch = session->ctx->reply_batch;
+
+	if (batch && batch->active && batch->fd == session->fd) {
+		if (batch->nreplies == batch->nalloc) {
+			rspamd_fuzzy_reply_batch_flush (batch);
+		}
+
+		rep = &batch->replies[batch->nreplies ++];
+		memcpy (&rep->data, data, len);
+		rep->len = len;
+		sa = rspamd_inet_address_get_sa (session->addr, &rep->slen);
+		rep->slen = MIN (rep->slen, sizeof (rep->addr));
+		memcpy (&rep->addr, sa, rep->slen);
+
+		return;
+	}
+
 	r = rspamd_inet_address_sendto (session->fd, data, len, 0,
 			session->addr);
 
@@ -690,6 +985,474 @@ fuzzy_peer_send_io (gint fd, gshort what, gpointer d)
 	g_free (up_req);
 }
 
+static void
+fuzzy_peer_ring_free (struct fuzzy_peer_ring *ring, gboolean unlink_shm)
+{
+	if (unlink_shm) {
+#ifdef HAVE_SANE_SHMEM
+		shm_unlink (ring->shm_name);
+#else
+		unlink (ring->shm_name);
+#endif
+	}
+
+	munmap (ring->hdr, ring->size);
+	g_free (ring);
+}
+
+static struct fuzzy_peer_ring *
+fuzzy_peer_ring_create (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct fuzzy_peer_ring *ring;
+	guint nslots;
+	gsize size;
+	gpointer map;
+	gint fd;
+
+	if (ctx->peer_ring_size == 0) {
+		return NULL;
+	}
+
+	/* Round the number of slots to a power of two */
+	nslots = 1;
+
+	while (nslots < ctx->peer_ring_size && nslots < G_MAXINT / 2) {
+		nslots <<= 1;
+	}
+
+	size = sizeof (struct fuzzy_peer_ring_hdr) +
+			sizeof (struct fuzzy_peer_cmd) * nslots;
+	ring = g_malloc0 (sizeof (*ring));
+#ifdef HAVE_SANE_SHMEM
+	rspamd_strlcpy (ring->shm_name, "/rfq.XXXXXXXXXXXXXXXXXXXX",
+			sizeof (ring->shm_name));
+	fd = rspamd_shmem_mkstemp (ring->shm_name);
+#else
+	rspamd_strlcpy (ring->shm_name, "/tmp/rfq.XXXXXXXXXXXXXXXXXXXX",
+			sizeof (ring->shm_name));
+	fd = mkstemp (ring->shm_name);
+#endif
+
+	if (fd == -1) {
+		msg_err ("cannot create updates ring: %s", strerror (errno));
+		g_free (ring);
+
+		return NULL;
+	}
+
+	if (ftruncate (fd, size) == -1 ||
+			(map = mmap (NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
+					fd, 0)) == MAP_FAILED) {
+		msg_err ("cannot allocate %z bytes for updates ring: %s",
+				size, strerror (errno));
+		close (fd);
+#ifdef HAVE_SANE_SHMEM
+		shm_unlink (ring->shm_name);
+#else
+		unlink (ring->shm_name);
+#endif
+		g_free (ring);
+
+		return NULL;
+	}
+
+	close (fd);
+	ring->hdr = map;
+	ring->slots = (struct fuzzy_peer_cmd *)(ring->hdr + 1);
+	ring->size = size;
+	ring->id = ctx->worker->index;
+	ring->hdr->nslots = nslots;
+	ring->hdr->magic = FUZZY_PEER_RING_MAGIC;
+
+	return ring;
+}
+
+static void
+fuzzy_peer_ring_notify (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct fuzzy_peer_ring *ring)
+{
+	struct fuzzy_peer_ring_msg msg;
+
+	memset (&msg, 0, sizeof (msg));
+	msg.magic = FUZZY_PEER_RING_MAGIC;
+	msg.id = ring->id;
+	rspamd_strlcpy (msg.shm_name, ring->shm_name, sizeof (msg.shm_name));
+
+	if (write (ctx->peer_fd, &msg, sizeof (msg)) != sizeof (msg)) {
+		/* Let the next update retry the wakeup */
+		g_atomic_int_set (&ring->hdr->notified, 0);
+
+		if (errno != EAGAIN) {
+			msg_err ("cannot send ring notification to the peer: %s",
+					strerror (errno));
+		}
+	}
+}
+
+static void
+fuzzy_peer_send_datagram (struct rspamd_fuzzy_storage_ctx *ctx,
+		const struct fuzzy_peer_cmd *cmd)
+{
+	struct fuzzy_peer_request *up_req;
+
+	/* We need to send request to the peer */
+	up_req = g_malloc0 (sizeof (*up_req));
+	memcpy (&up_req->cmd, cmd, sizeof (*cmd));
+	event_set (&up_req->io_ev, ctx->peer_fd, EV_WRITE,
+			fuzzy_peer_send_io, up_req);
+	event_base_set (ctx->ev_base, &up_req->io_ev);
+	event_add (&up_req->io_ev, NULL);
+	ctx->stat.peer_updates_fallback ++;
+}
+
+/*
+ * Producer side: returns the ring marked as being written, or NULL if there
+ * is no ring and updates should be sent over the peer socket
+ */
+static struct fuzzy_peer_ring *
+fuzzy_peer_ring_acquire (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct fuzzy_peer_ring *ring = ctx->peer_ring;
+
+	if (ring == NULL) {
+		return NULL;
+	}
+
+	/* Must be set before checking closed flag, see fuzzy_peer_rings_close */
+	g_atomic_int_set (&ring->hdr->busy, 1);
+
+	if (g_atomic_int_get (&ring->hdr->closed)) {
+		/*
+		 * Update worker has drained this ring and terminated, the new one
+		 * attaches to a new ring on the first wakeup
+		 */
+		g_atomic_int_set (&ring->hdr->busy, 0);
+		msg_info ("updates ring has been closed by the update worker, "
+				"recreate it");
+		fuzzy_peer_ring_free (ring, TRUE);
+		ctx->peer_ring = ring = fuzzy_peer_ring_create (ctx);
+
+		if (ring == NULL) {
+			return NULL;
+		}
+
+		g_atomic_int_set (&ring->hdr->busy, 1);
+	}
+
+	return ring;
+}
+
+static void
+fuzzy_peer_ring_release (struct fuzzy_peer_ring *ring)
+{
+	g_atomic_int_set (&ring->hdr->busy, 0);
+}
+
+/*
+ * Puts an update to the ring, returns FALSE if the ring is full
+ */
+static gboolean
+fuzzy_peer_ring_put (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct fuzzy_peer_ring *ring,
+		const struct fuzzy_peer_cmd *cmd)
+{
+	guint head, tail, nslots;
+
+	nslots = ring->hdr->nslots;
+	head = ring->hdr->head;
+	tail = g_atomic_int_get (&ring->hdr->tail);
+
+	if (head - tail >= nslots) {
+		/* Wakeup might have been lost, e.g. on a full peer socket */
+		if (g_atomic_int_compare_and_exchange (&ring->hdr->notified, 0, 1)) {
+			fuzzy_peer_ring_notify (ctx, ring);
+		}
+
+		return FALSE;
+	}
+
+	memcpy (&ring->slots[head & (nslots - 1)], cmd, sizeof (*cmd));
+	g_atomic_int_set (&ring->hdr->head, head + 1);
+	ctx->stat.peer_updates_queued ++;
+
+	if (g_atomic_int_compare_and_exchange (&ring->hdr->notified, 0, 1) ||
+			head + 1 - tail == nslots / 2) {
+		/*
+		 * The second condition covers a lost wakeup, e.g. if the update
+		 * worker has been restarted before draining the ring
+		 */
+		fuzzy_peer_ring_notify (ctx, ring);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Moves updates from the overflow queue to the ring while they fit, or sends
+ * them over the peer socket if there is no ring, returns number of updates
+ * left in the queue
+ */
+static guint
+fuzzy_peer_overflow_flush (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct fuzzy_peer_ring *ring)
+{
+	guint i;
+
+	for (i = 0; i < ctx->peer_overflow->len; i ++) {
+		if (ring == NULL) {
+			fuzzy_peer_send_datagram (ctx, &g_array_index (ctx->peer_overflow,
+					struct fuzzy_peer_cmd, i));
+		}
+		else if (!fuzzy_peer_ring_put (ctx, ring,
+				&g_array_index (ctx->peer_overflow,
+						struct fuzzy_peer_cmd, i))) {
+			break;
+		}
+	}
+
+	if (i > 0) {
+		g_array_remove_range (ctx->peer_overflow, 0, i);
+	}
+
+	return ctx->peer_overflow->len;
+}
+
+static void
+fuzzy_peer_overflow_timer (gint fd, short what, gpointer ud)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = ud;
+	struct fuzzy_peer_ring *ring;
+	struct timeval tv;
+	guint left;
+
+	ring = fuzzy_peer_ring_acquire (ctx);
+	left = fuzzy_peer_overflow_flush (ctx, ring);
+
+	if (ring) {
+		fuzzy_peer_ring_release (ring);
+	}
+
+	if (left > 0) {
+		double_to_tv (PEER_RING_OVERFLOW_RETRY, &tv);
+		event_add (&ctx->peer_overflow_ev, &tv);
+	}
+	else {
+		ctx->peer_overflow_armed = FALSE;
+	}
+}
+
+/*
+ * Producer side: returns FALSE if there is no ring and the update should be
+ * sent over the peer socket
+ */
+static gboolean
+fuzzy_peer_ring_push (struct rspamd_fuzzy_storage_ctx *ctx,
+		const struct fuzzy_peer_cmd *cmd)
+{
+	struct fuzzy_peer_ring *ring;
+	struct timeval tv;
+
+	ring = fuzzy_peer_ring_acquire (ctx);
+
+	if (ring == NULL) {
+		if (ctx->peer_overflow && ctx->peer_overflow->len > 0) {
+			/* Updates queued before must be sent first */
+			fuzzy_peer_overflow_flush (ctx, NULL);
+		}
+
+		return FALSE;
+	}
+
+	/* Updates are put to the ring in order they have been acknowledged */
+	if (fuzzy_peer_overflow_flush (ctx, ring) > 0 ||
+			!fuzzy_peer_ring_put (ctx, ring, cmd)) {
+		g_array_append_val (ctx->peer_overflow, *cmd);
+		ctx->stat.peer_updates_delayed ++;
+
+		if (!ctx->peer_overflow_armed) {
+			double_to_tv (PEER_RING_OVERFLOW_RETRY, &tv);
+			event_add (&ctx->peer_overflow_ev, &tv);
+			ctx->peer_overflow_armed = TRUE;
+		}
+	}
+
+	fuzzy_peer_ring_release (ring);
+
+	return TRUE;
+}
+
+static void
+fuzzy_peer_send_update (struct rspamd_fuzzy_storage_ctx *ctx,
+		const struct fuzzy_peer_cmd *cmd)
+{
+	if (fuzzy_peer_ring_push (ctx, cmd)) {
+		return;
+	}
+
+	fuzzy_peer_send_datagram (ctx, cmd);
+}
+
+/*
+ * Consumer side: moves all updates from the ring to the pending queue
+ */
+static guint
+fuzzy_peer_ring_drain (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct fuzzy_peer_ring *ring)
+{
+	guint head, tail, nslots, depth, pos, nfirst;
+
+	nslots = ring->hdr->nslots;
+	/* Producer sends a new wakeup for anything pushed after this point */
+	g_atomic_int_set (&ring->hdr->notified, 0);
+	head = g_atomic_int_get (&ring->hdr->head);
+	tail = ring->hdr->tail;
+	depth = head - tail;
+
+	if (depth == 0) {
+		return 0;
+	}
+
+	if (depth > nslots) {
+		msg_err ("updates ring of worker %ud is corrupted: %ud commands "
+				"in %ud slots, skip them", ring->id, depth, nslots);
+		g_atomic_int_set (&ring->hdr->tail, head);
+
+		return 0;
+	}
+
+	pos = tail & (nslots - 1);
+	nfirst = MIN (depth, nslots - pos);
+	g_array_append_vals (ctx->updates_pending, &ring->slots[pos], nfirst);
+
+	if (nfirst < depth) {
+		g_array_append_vals (ctx->updates_pending, &ring->slots[0],
+				depth - nfirst);
+	}
+
+	g_atomic_int_set (&ring->hdr->tail, head);
+	ctx->stat.peer_ring_drains ++;
+
+	if (depth > ctx->stat.peer_ring_max_depth) {
+		ctx->stat.peer_ring_max_depth = depth;
+	}
+
+	return depth;
+}
+
+static void
+fuzzy_peer_rings_drain (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	guint i;
+
+	if (ctx->peer_rings) {
+		for (i = 0; i < ctx->peer_rings->len; i ++) {
+			fuzzy_peer_ring_drain (ctx, g_ptr_array_index (ctx->peer_rings, i));
+		}
+	}
+}
+
+/*
+ * Called by the update worker on termination: producers recreate closed rings
+ * instead of filling ones that nobody reads
+ */
+static void
+fuzzy_peer_rings_close (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct fuzzy_peer_ring *ring;
+	struct timespec sleep_ts = {
+			.tv_sec = 0,
+			.tv_nsec = 1000000
+	};
+	guint i, waited;
+
+	if (ctx->peer_rings) {
+		for (i = 0; i < ctx->peer_rings->len; i ++) {
+			ring = g_ptr_array_index (ctx->peer_rings, i);
+			g_atomic_int_set (&ring->hdr->closed, 1);
+		}
+
+		for (i = 0; i < ctx->peer_rings->len; i ++) {
+			ring = g_ptr_array_index (ctx->peer_rings, i);
+			waited = 0;
+
+			/*
+			 * Producer that has set busy flag before the ring was closed
+			 * might still be writing it, later producers see closed flag
+			 */
+			while (g_atomic_int_get (&ring->hdr->busy) &&
+					waited ++ < PEER_RING_CLOSE_TIMEOUT * 1000) {
+				nanosleep (&sleep_ts, NULL);
+			}
+
+			if (g_atomic_int_get (&ring->hdr->busy)) {
+				msg_err ("worker %ud is still writing updates ring, "
+						"drain it anyway", ring->id);
+			}
+
+			fuzzy_peer_ring_drain (ctx, ring);
+		}
+	}
+}
+
+static struct fuzzy_peer_ring *
+fuzzy_peer_ring_attach (struct rspamd_fuzzy_storage_ctx *ctx,
+		struct fuzzy_peer_ring_msg *msg)
+{
+	struct fuzzy_peer_ring *ring, *cur;
+	struct fuzzy_peer_ring_hdr *hdr;
+	gsize size;
+	guint i;
+
+	msg->shm_name[sizeof (msg->shm_name) - 1] = '\0';
+
+	for (i = 0; i < ctx->peer_rings->len; i ++) {
+		cur = g_ptr_array_index (ctx->peer_rings, i);
+
+		if (cur->id == msg->id) {
+			if (strcmp (cur->shm_name, msg->shm_name) == 0) {
+				return cur;
+			}
+
+			/* Worker has been restarted, drop its previous ring */
+			fuzzy_peer_ring_drain (ctx, cur);
+			fuzzy_peer_ring_free (cur, TRUE);
+			g_ptr_array_remove_index_fast (ctx->peer_rings, i);
+			break;
+		}
+	}
+
+	hdr = rspamd_shmem_xmap (msg->shm_name, PROT_READ|PROT_WRITE, &size);
+
+	if (hdr == NULL) {
+		msg_err ("cannot map updates ring %s: %s", msg->shm_name,
+				strerror (errno));
+
+		return NULL;
+	}
+
+	if (size < sizeof (*hdr) || hdr->magic != FUZZY_PEER_RING_MAGIC ||
+			hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) != 0 ||
+			(size - sizeof (*hdr)) / sizeof (struct fuzzy_peer_cmd) <
+			hdr->nslots) {
+		msg_err ("invalid updates ring %s", msg->shm_name);
+		munmap (hdr, size);
+
+		return NULL;
+	}
+
+	ring = g_malloc0 (sizeof (*ring));
+	ring->hdr = hdr;
+	ring->slots = (struct fuzzy_peer_cmd *)(hdr + 1);
+	ring->size = size;
+	ring->id = msg->id;
+	rspamd_strlcpy (ring->shm_name, msg->shm_name, sizeof (ring->shm_name));
+	g_ptr_array_add (ctx->peer_rings, ring);
+	msg_info ("attached updates ring of worker %ud with %ud slots",
+			ring->id, hdr->nslots);
+
+	return ring;
+}
+
 static void
 rspamd_fuzzy_update_stats (struct rspamd_fuzzy_storage_ctx *ctx,
 		enum rspamd_fuzzy_epoch epoch,
@@ -838,45 +1601,26 @@ rspamd_fuzzy_check_callback (struct rspamd_fuzzy_reply *result, void *ud)
 	/* Refresh hash if found with strong confidence */
 	if (result->v1.prob > 0.9 && !session->ctx->read_only) {
 		struct fuzzy_peer_cmd up_cmd;
-		struct fuzzy_peer_request *up_req;
+
+		memset (&up_cmd, 0, sizeof (up_cmd));
+		up_cmd.is_shingle = is_shingle;
+		memcpy (up_cmd.cmd.normal.digest, result->digest,
+				sizeof (up_cmd.cmd.normal.digest));
+		up_cmd.cmd.normal.flag = result->v1.flag;
+		up_cmd.cmd.normal.cmd = FUZZY_REFRESH;
+		up_cmd.cmd.normal.shingles_count = cmd->shingles_count;
+
+		if (is_shingle && shingle) {
+			memcpy (&up_cmd.cmd.shingle.sgl, shingle,
+					sizeof (up_cmd.cmd.shingle.sgl));
+		}
 
 		if (session->worker->index == 0 || session->ctx->peer_fd == -1) {
 			/* Just add to the queue */
-			memset (&up_cmd, 0, sizeof (up_cmd));
-			up_cmd.is_shingle = is_shingle;
-			memcpy (up_cmd.cmd.normal.digest, result->digest,
-					sizeof (up_cmd.cmd.normal.digest));
-			up_cmd.cmd.normal.flag = result->v1.flag;
-			up_cmd.cmd.normal.cmd = FUZZY_REFRESH;
-			up_cmd.cmd.normal.shingles_count = cmd->shingles_count;
-
-			if (is_shingle && shingle) {
-				memcpy (&up_cmd.cmd.shingle.sgl, shingle,
-						sizeof (up_cmd.cmd.shingle.sgl));
-			}
-
 			g_array_append_val (session->ctx->updates_pending, up_cmd);
 		}
 		else {
-			/* We need to send request to the peer */
-			up_req = g_malloc0 (sizeof (*up_req));
-			up_req->cmd.is_shingle = is_shingle;
-
-			memcpy (up_req->cmd.cmd.normal.digest, result->digest,
-					sizeof (up_req->cmd.cmd.normal.digest));
-			up_req->cmd.cmd.normal.flag = result->v1.flag;
-			up_req->cmd.cmd.normal.cmd = FUZZY_REFRESH;
-			up_req->cmd.cmd.normal.shingles_count = cmd->shingles_count;
-
-			if (is_shingle && shingle) {
-				memcpy (&up_req->cmd.cmd.shingle.sgl, shingle,
-						sizeof (up_req->cmd.cmd.shingle.sgl));
-			}
-
-			event_set (&up_req->io_ev, session->ctx->peer_fd, EV_WRITE,
-					fuzzy_peer_send_io, up_req);
-			event_base_set (session->ctx->ev_base, &up_req->io_ev);
-			event_add (&up_req->io_ev, NULL);
+			fuzzy_peer_send_update (session->ctx, &up_cmd);
 		}
 	}
 
@@ -890,7 +1634,6 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 	struct rspamd_fuzzy_cmd *cmd = NULL;
 	struct rspamd_fuzzy_reply result;
 	struct fuzzy_peer_cmd up_cmd;
-	struct fuzzy_peer_request *up_req;
 	struct fuzzy_key_stat *ip_stat = NULL;
 	gchar hexbuf[rspamd_cryptobox_HASHBYTES * 2 + 1];
 	rspamd_inet_addr_t *naddr;
@@ -965,7 +1708,13 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 				result.v1.flag = 0;
 				rspamd_fuzzy_make_reply (cmd, &result, session, encrypted,
 						is_shingle);
-			} else {
+			}
+			else if (session->ctx->check_batch) {
+				REF_RETAIN (session);
+				g_ptr_array_add (session->ctx->check_batch->sessions, session);
+				g_ptr_array_add (session->ctx->check_batch->cmds, cmd);
+			}
+			else {
 				REF_RETAIN (session);
 				rspamd_fuzzy_backend_check (session->ctx->backend, cmd,
 						rspamd_fuzzy_check_callback, session);
@@ -1006,27 +1755,19 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 				}
 			}
 
+			memset (&up_cmd, 0, sizeof (up_cmd));
+			up_cmd.is_shingle = is_shingle;
+			ptr = is_shingle ?
+					(gpointer)&up_cmd.cmd.shingle :
+					(gpointer)&up_cmd.cmd.normal;
+			memcpy (ptr, cmd, up_len);
+
 			if (session->worker->index == 0 || session->ctx->peer_fd == -1) {
 				/* Just add to the queue */
-				up_cmd.is_shingle = is_shingle;
-				ptr = is_shingle ?
-						(gpointer)&up_cmd.cmd.shingle :
-						(gpointer)&up_cmd.cmd.normal;
-				memcpy (ptr, cmd, up_len);
 				g_array_append_val (session->ctx->updates_pending, up_cmd);
 			}
 			else {
-				/* We need to send request to the peer */
-				up_req = g_malloc0 (sizeof (*up_req));
-				up_req->cmd.is_shingle = is_shingle;
-				ptr = is_shingle ?
-						(gpointer)&up_req->cmd.cmd.shingle :
-						(gpointer)&up_req->cmd.cmd.normal;
-				memcpy (ptr, cmd, up_len);
-				event_set (&up_req->io_ev, session->ctx->peer_fd, EV_WRITE,
-						fuzzy_peer_send_io, up_req);
-				event_base_set (session->ctx->ev_base, &up_req->io_ev);
-				event_add (&up_req->io_ev, NULL);
+				fuzzy_peer_send_update (session->ctx, &up_cmd);
 			}
 
 			result.v1.value = 0;
@@ -1871,6 +2612,204 @@ accept_fuzzy_mirror_socket (gint fd, short what, void *arg)
 			ctx->ev_base);
 }
 
+static void
+rspamd_fuzzy_handle_datagram (struct rspamd_worker *worker, gint fd,
+		guint8 *buf, gssize r, rspamd_inet_addr_t *addr)
+{
+	struct fuzzy_session *session;
+	guint64 *nerrors;
+
+	worker->nconns++;
+	session = g_malloc0 (sizeof (*session));
+	REF_INIT_RETAIN (session, fuzzy_session_destroy);
+	session->worker = worker;
+	session->fd = fd;
+	session->ctx = worker->ctx;
+	session->time = (guint64) time (NULL);
+	session->addr = addr;
+
+	if (rspamd_fuzzy_cmd_from_wire (buf, r, session)) {
+		/* Check shingles count sanity */
+		rspamd_fuzzy_process_command (session);
+	}
+	else {
+		/* Discard input */
+		session->ctx->stat.invalid_requests ++;
+		msg_debug ("invalid fuzzy command of size %z received", r);
+
+		nerrors = rspamd_lru_hash_lookup (session->ctx->errors_ips,
+				addr, -1);
+
+		if (nerrors == NULL) {
+			nerrors = g_malloc (sizeof (*nerrors));
+			*nerrors = 1;
+			rspamd_lru_hash_insert (session->ctx->errors_ips,
+					rspamd_inet_address_copy (addr),
+					nerrors, -1, -1);
+		}
+		else {
+			*nerrors = *nerrors + 1;
+		}
+	}
+
+	REF_RELEASE (session);
+}
+
+#ifdef HAVE_RECVMMSG
+static struct fuzzy_recv_batch *
+rspamd_fuzzy_recv_batch_new (guint nalloc)
+{
+	struct fuzzy_recv_batch *rb;
+
+	rb = g_malloc0 (sizeof (*rb));
+	rb->nalloc = nalloc;
+	rb->msgs = g_malloc (sizeof (*rb->msgs) * nalloc);
+	rb->iovs = g_malloc (sizeof (*rb->iovs) * nalloc);
+	rb->addrs = g_malloc (sizeof (*rb->addrs) * nalloc);
+	rb->bufs = g_malloc (MAX_DATAGRAM_SIZE * nalloc);
+
+	return rb;
+}
+
+static void
+rspamd_fuzzy_recv_batch_free (struct fuzzy_recv_batch *rb)
+{
+	g_free (rb->msgs);
+	g_free (rb->iovs);
+	g_free (rb->addrs);
+	g_free (rb->bufs);
+	g_free (rb);
+}
+
+static void
+rspamd_fuzzy_check_batch_free (struct fuzzy_check_batch *cb)
+{
+	g_ptr_array_free (cb->sessions, TRUE);
+	g_ptr_array_free (cb->cmds, TRUE);
+	g_free (cb);
+}
+
+static void
+rspamd_fuzzy_check_many_callback (struct rspamd_fuzzy_reply *reps, guint nreps,
+		void *ud)
+{
+	struct fuzzy_check_batch *cb = ud;
+	struct fuzzy_reply_batch *batch = cb->ctx->reply_batch;
+	gboolean was_active = batch->active;
+	guint i;
+
+	g_assert (nreps == cb->sessions->len);
+
+	if (!was_active) {
+		/* Backend has replied asynchronously, collect replies here */
+		batch->fd = cb->fd;
+		batch->active = TRUE;
+	}
+
+	for (i = 0; i < nreps; i ++) {
+		rspamd_fuzzy_check_callback (&reps[i],
+				g_ptr_array_index (cb->sessions, i));
+	}
+
+	if (!was_active) {
+		batch->active = FALSE;
+		rspamd_fuzzy_reply_batch_flush (batch);
+	}
+
+	rspamd_fuzzy_check_batch_free (cb);
+}
+
+static void
+rspamd_fuzzy_check_batch_flush (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct fuzzy_check_batch *cb = ctx->check_batch;
+
+	/* Do not collect checks issued from the callbacks */
+	ctx->check_batch = NULL;
+
+	if (cb->sessions->len == 0) {
+		rspamd_fuzzy_check_batch_free (cb);
+
+		return;
+	}
+
+	rspamd_fuzzy_backend_check_many (ctx->backend,
+			(const struct rspamd_fuzzy_cmd **)cb->cmds->pdata,
+			cb->cmds->len,
+			rspamd_fuzzy_check_many_callback, cb);
+}
+
+/*
+ * Reads up to `batch_size` datagrams at once, processes them and sends
+ * all replies that are ready at once
+ */
+static void
+rspamd_fuzzy_accept_batch (struct rspamd_worker *worker, gint fd)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	struct fuzzy_recv_batch *rb = ctx->recv_batch;
+	struct fuzzy_reply_batch *batch = ctx->reply_batch;
+	rspamd_inet_addr_t *addr;
+	gint r, i;
+
+	for (;;) {
+		for (i = 0; i < (gint)rb->nalloc; i ++) {
+			rb->iovs[i].iov_base = rb->bufs + i * MAX_DATAGRAM_SIZE;
+			rb->iovs[i].iov_len = MAX_DATAGRAM_SIZE;
+			memset (&rb->msgs[i], 0, sizeof (rb->msgs[i]));
+			rb->msgs[i].msg_hdr.msg_iov = &rb->iovs[i];
+			rb->msgs[i].msg_hdr.msg_iovlen = 1;
+			rb->msgs[i].msg_hdr.msg_name = &rb->addrs[i];
+			rb->msgs[i].msg_hdr.msg_namelen = sizeof (rb->addrs[i]);
+		}
+
+		r = recvmmsg (fd, rb->msgs, rb->nalloc, 0, NULL);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+
+				return;
+			}
+
+			msg_err ("got error while reading from socket: %d, %s",
+					errno,
+					strerror (errno));
+			return;
+		}
+
+		batch->fd = fd;
+		batch->active = TRUE;
+		ctx->check_batch = g_malloc0 (sizeof (*ctx->check_batch));
+		ctx->check_batch->sessions = g_ptr_array_sized_new (r);
+		ctx->check_batch->cmds = g_ptr_array_sized_new (r);
+		ctx->check_batch->ctx = ctx;
+		ctx->check_batch->fd = fd;
+
+		for (i = 0; i < r; i ++) {
+			addr = rspamd_inet_address_from_sa (
+					(struct sockaddr *)&rb->addrs[i],
+					rb->msgs[i].msg_hdr.msg_namelen);
+			rspamd_fuzzy_handle_datagram (worker, fd,
+					rb->bufs + i * MAX_DATAGRAM_SIZE,
+					rb->msgs[i].msg_len, addr);
+		}
+
+		/* Synchronous backends reply here, so replies go to the same batch */
+		rspamd_fuzzy_check_batch_flush (ctx);
+		batch->active = FALSE;
+		rspamd_fuzzy_reply_batch_flush (batch);
+
+		if (r < (gint)rb->nalloc) {
+			/* Socket is drained */
+			return;
+		}
+	}
+}
+#endif
+
 /*
  * Accept new connection and construct task
  */
@@ -1878,18 +2817,23 @@ static void
 accept_fuzzy_socket (gint fd, short what, void *arg)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
-	struct fuzzy_session *session;
 	rspamd_inet_addr_t *addr;
 	gssize r;
-	guint8 buf[512];
-	guint64 *nerrors;
+	guint8 buf[MAX_DATAGRAM_SIZE];
 
 	/* Got some data */
 	if (what == EV_READ) {
+#ifdef HAVE_RECVMMSG
+		struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
 
-		for (;;) {
-			worker->nconns++;
+		if (ctx->recv_batch) {
+			rspamd_fuzzy_accept_batch (worker, fd);
 
+			return;
+		}
+#endif
+
+		for (;;) {
 			r = rspamd_inet_address_recvfrom (fd,
 					buf,
 					sizeof (buf),
@@ -1911,39 +2855,7 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 				return;
 			}
 
-			session = g_malloc0 (sizeof (*session));
-			REF_INIT_RETAIN (session, fuzzy_session_destroy);
-			session->worker = worker;
-			session->fd = fd;
-			session->ctx = worker->ctx;
-			session->time = (guint64) time (NULL);
-			session->addr = addr;
-
-			if (rspamd_fuzzy_cmd_from_wire (buf, r, session)) {
-				/* Check shingles count sanity */
-				rspamd_fuzzy_process_command (session);
-			}
-			else {
-				/* Discard input */
-				session->ctx->stat.invalid_requests ++;
-				msg_debug ("invalid fuzzy command of size %z received", r);
-
-				nerrors = rspamd_lru_hash_lookup (session->ctx->errors_ips,
-						addr, -1);
-
-				if (nerrors == NULL) {
-					nerrors = g_malloc (sizeof (*nerrors));
-					*nerrors = 1;
-					rspamd_lru_hash_insert (session->ctx->errors_ips,
-							rspamd_inet_address_copy (addr),
-							nerrors, -1, -1);
-				}
-				else {
-					*nerrors = *nerrors + 1;
-				}
-			}
-
-			REF_RELEASE (session);
+			rspamd_fuzzy_handle_datagram (worker, fd, buf, r, addr);
 		}
 	}
 }
@@ -1953,6 +2865,9 @@ rspamd_fuzzy_storage_periodic_callback (void *ud)
 {
 	struct rspamd_fuzzy_storage_ctx *ctx = ud;
 
+	/* Do not rely on wakeups only */
+	fuzzy_peer_rings_drain (ctx);
+
 	if (ctx->updates_pending->len > 0) {
 		rspamd_fuzzy_process_updates_queue (ctx, local_db_name, FALSE);
 
@@ -2063,7 +2978,9 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 	struct fuzzy_key *key;
 	rspamd_lru_element_t *lru_elt;
 	ucl_object_t *obj, *keys_obj, *elt, *ip_elt, *ip_cur;
+	struct fuzzy_peer_ring *ring;
 	gpointer k, v;
+	guint64 depth;
 	gint i;
 	gchar keyname[17];
 
@@ -2122,6 +3039,16 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 			"invalid_requests",
 			0,
 			false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromint (ctx->stat.replies_delayed),
+			"replies_delayed",
+			0,
+			false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromint (ctx->stat.replies_failed),
+			"replies_failed",
+			0,
+			false);
 
 	if (ctx->errors_ips && ip_stat) {
 		ip_hash = rspamd_lru_hash_get_htable (ctx->errors_ips);
@@ -2177,6 +3104,60 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 
 	ucl_object_insert_key (obj, elt, "fuzzy_found", 0, false);
 
+	/* Updates queue */
+	elt = ucl_object_typed_new (UCL_OBJECT);
+	depth = 0;
+
+	if (ctx->updates_pending) {
+		depth += ctx->updates_pending->len;
+	}
+
+	if (ctx->peer_ring) {
+		depth += (guint)(ctx->peer_ring->hdr->head -
+				g_atomic_int_get (&ctx->peer_ring->hdr->tail));
+	}
+
+	if (ctx->peer_rings) {
+		for (i = 0; i < ctx->peer_rings->len; i ++) {
+			ring = g_ptr_array_index (ctx->peer_rings, i);
+			depth += (guint)(g_atomic_int_get (&ring->hdr->head) -
+					ring->hdr->tail);
+		}
+	}
+
+	ucl_object_insert_key (elt, ucl_object_fromint (depth),
+			"depth", 0, false);
+	ucl_object_insert_key (elt,
+			ucl_object_fromint (ctx->stat.peer_ring_max_depth),
+			"max_drained", 0, false);
+	ucl_object_insert_key (elt,
+			ucl_object_fromint (ctx->stat.peer_ring_drains),
+			"drains", 0, false);
+	ucl_object_insert_key (elt,
+			ucl_object_fromint (ctx->stat.peer_updates_queued),
+			"queued", 0, false);
+	ucl_object_insert_key (elt,
+			ucl_object_fromint (ctx->stat.peer_updates_fallback),
+			"fallback", 0, false);
+	ucl_object_insert_key (elt,
+			ucl_object_fromint (ctx->stat.peer_updates_delayed),
+			"delayed", 0, false);
+	ucl_object_insert_key (elt,
+			ucl_object_fromint (ctx->stat.updates_flushes),
+			"flushes", 0, false);
+	ucl_object_insert_key (elt,
+			ucl_object_fromdouble (ctx->stat.updates_flush_last),
+			"flush_time_last", 0, false);
+	ucl_object_insert_key (elt,
+			ucl_object_fromdouble (ctx->stat.updates_flushes > 0 ?
+					ctx->stat.updates_flush_time / ctx->stat.updates_flushes :
+					0.0),
+			"flush_time_avg", 0, false);
+	ucl_object_insert_key (elt,
+			ucl_object_fromdouble (ctx->stat.updates_flush_max),
+			"flush_time_max", 0, false);
+	ucl_object_insert_key (obj, elt, "updates_queue", 0, false);
+
 
 	return obj;
 }
@@ -2491,6 +3472,8 @@ init_fuzzy (struct rspamd_config *cfg)
 	rspamd_mempool_add_destructor (cfg->cfg_pool,
 			(rspamd_mempool_destruct_t)rspamd_ptr_array_free_hard, ctx->mirrors);
 	ctx->updates_maxfail = DEFAULT_UPDATES_MAXFAIL;
+	ctx->batch_size = DEFAULT_BATCH_SIZE;
+	ctx->peer_ring_size = DEFAULT_PEER_RING_SIZE;
 	ctx->collection_id_file = RSPAMD_DBDIR "/fuzzy_collection.id";
 
 	rspamd_rcl_register_worker_option (cfg,
@@ -2681,6 +3664,26 @@ init_fuzzy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, skip_map),
 			0,
 			"Skip specific hashes from the map");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"batch_size",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, batch_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of datagrams to read and reply at once, 1 disables "
+			"batching, default: "
+					G_STRINGIFY (DEFAULT_BATCH_SIZE));
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"updates_ring_size",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, peer_ring_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of updates that a worker can queue for the update "
+			"worker in shared memory, 0 disables the queue, default: "
+					G_STRINGIFY (DEFAULT_PEER_RING_SIZE));
 
 	return ctx;
 }
@@ -2688,13 +3691,31 @@ init_fuzzy (struct rspamd_config *cfg)
 static void
 rspamd_fuzzy_peer_io (gint fd, gshort what, gpointer d)
 {
-	struct fuzzy_peer_cmd cmd;
+	union {
+		struct fuzzy_peer_cmd cmd;
+		struct fuzzy_peer_ring_msg ring_msg;
+	} buf;
 	struct rspamd_fuzzy_storage_ctx *ctx = d;
+	struct fuzzy_peer_ring *ring;
 	gssize r;
 
-	r = read (fd, &cmd, sizeof (cmd));
+	G_STATIC_ASSERT (sizeof (struct fuzzy_peer_cmd) !=
+			sizeof (struct fuzzy_peer_ring_msg));
+
+	r = read (fd, &buf, sizeof (buf));
+
+	if (r == sizeof (buf.cmd)) {
+		g_array_append_val (ctx->updates_pending, buf.cmd);
+	}
+	else if (r == sizeof (buf.ring_msg) &&
+			buf.ring_msg.magic == FUZZY_PEER_RING_MAGIC) {
+		ring = fuzzy_peer_ring_attach (ctx, &buf.ring_msg);
 
-	if (r != sizeof (cmd)) {
+		if (ring) {
+			fuzzy_peer_ring_drain (ctx, ring);
+		}
+	}
+	else if (r == -1) {
 		if (errno == EINTR) {
 			rspamd_fuzzy_peer_io (fd, what, d);
 			return;
@@ -2704,7 +3725,7 @@ rspamd_fuzzy_peer_io (gint fd, gshort what, gpointer d)
 		}
 	}
 	else {
-		g_array_append_val (ctx->updates_pending, cmd);
+		msg_err ("got invalid command of size %z from peers", r);
 	}
 }
 
@@ -2772,11 +3793,26 @@ fuzzy_peer_rep (struct rspamd_worker *worker,
 
 	if (worker->index == 0 && ctx->peer_fd != -1) {
 		/* Listen for peer requests */
+		ctx->peer_rings = g_ptr_array_new ();
 		event_set (&ctx->peer_ev, ctx->peer_fd, EV_READ | EV_PERSIST,
 				rspamd_fuzzy_peer_io, ctx);
 		event_base_set (ctx->ev_base, &ctx->peer_ev);
 		event_add (&ctx->peer_ev, NULL);
 	}
+	else if (ctx->peer_fd != -1 && !ctx->read_only) {
+		ctx->peer_ring = fuzzy_peer_ring_create (ctx);
+		ctx->peer_overflow = g_array_new (FALSE, FALSE,
+				sizeof (struct fuzzy_peer_cmd));
+		event_set (&ctx->peer_overflow_ev, -1, EV_TIMEOUT,
+				fuzzy_peer_overflow_timer, ctx);
+		event_base_set (ctx->ev_base, &ctx->peer_overflow_ev);
+
+		if (ctx->peer_ring) {
+			/* Let the update worker attach our ring */
+			g_atomic_int_set (&ctx->peer_ring->hdr->notified, 1);
+			fuzzy_peer_ring_notify (ctx, ctx->peer_ring);
+		}
+	}
 }
 
 /*
@@ -2808,6 +3844,20 @@ start_fuzzy (struct rspamd_worker *worker)
 		ctx->keypair_cache = rspamd_keypair_cache_new (ctx->keypair_cache_size);
 	}
 
+	if (ctx->batch_size > MAX_BATCH_SIZE) {
+		msg_warn ("batch size %ud is too large, use %d",
+				ctx->batch_size, MAX_BATCH_SIZE);
+		ctx->batch_size = MAX_BATCH_SIZE;
+	}
+
+	if (ctx->batch_size > 1) {
+		ctx->reply_batch = rspamd_fuzzy_reply_batch_new (ctx, ctx->batch_size);
+		ctx->pending_replies = g_queue_new ();
+#ifdef HAVE_RECVMMSG
+		ctx->recv_batch = rspamd_fuzzy_recv_batch_new (ctx->batch_size);
+#endif
+	}
+
 	if (!ctx->collection_mode) {
 		/*
 		 * Open DB and perform VACUUM
@@ -2979,6 +4029,35 @@ start_fuzzy (struct rspamd_worker *worker)
 	event_base_loop (ctx->ev_base, 0);
 	rspamd_worker_block_signals ();
 
+	if (worker->index == 0) {
+		fuzzy_peer_rings_close (ctx);
+	}
+
+	if (ctx->peer_overflow) {
+		if (ctx->peer_overflow_armed) {
+			event_del (&ctx->peer_overflow_ev);
+		}
+
+		if (ctx->peer_overflow->len > 0) {
+			struct fuzzy_peer_ring *ring;
+
+			/* Last attempt, update worker might have drained the ring */
+			ring = fuzzy_peer_ring_acquire (ctx);
+
+			if (ring) {
+				fuzzy_peer_overflow_flush (ctx, ring);
+				fuzzy_peer_ring_release (ring);
+			}
+
+			if (ctx->peer_overflow->len > 0) {
+				msg_err ("cannot pass %ud updates to the update worker "
+						"on termination", ctx->peer_overflow->len);
+			}
+		}
+
+		g_array_free (ctx->peer_overflow, TRUE);
+	}
+
 	if (worker->index == 0 && ctx->updates_pending->len > 0) {
 		if (!ctx->collection_mode) {
 			rspamd_fuzzy_process_updates_queue (ctx, local_db_name, FALSE);
@@ -3026,10 +4105,46 @@ start_fuzzy (struct rspamd_worker *worker)
 		close (ctx->peer_fd);
 	}
 
+	if (ctx->peer_ring) {
+		/* Update worker keeps the ring mapped if it has attached to it */
+		fuzzy_peer_ring_free (ctx->peer_ring, TRUE);
+	}
+
+	if (ctx->peer_rings) {
+		guint i;
+
+		/* Rings have been closed and drained above */
+		for (i = 0; i < ctx->peer_rings->len; i ++) {
+			fuzzy_peer_ring_free (g_ptr_array_index (ctx->peer_rings, i),
+					TRUE);
+		}
+
+		g_ptr_array_free (ctx->peer_rings, TRUE);
+	}
+
 	if (ctx->keypair_cache) {
 		rspamd_keypair_cache_destroy (ctx->keypair_cache);
 	}
 
+	if (ctx->reply_batch) {
+		struct fuzzy_reply_batch *pending;
+
+		while ((pending = g_queue_pop_head (ctx->pending_replies)) != NULL) {
+			event_del (&pending->io);
+			ctx->stat.replies_failed += pending->nreplies;
+			rspamd_fuzzy_reply_batch_free (pending);
+		}
+
+		g_queue_free (ctx->pending_replies);
+		rspamd_fuzzy_reply_batch_free (ctx->reply_batch);
+	}
+
+#ifdef HAVE_RECVMMSG
+	if (ctx->recv_batch) {
+		rspamd_fuzzy_recv_batch_free (ctx->recv_batch);
+	}
+#endif
+
 	REF_RELEASE (ctx->cfg);
 
 	exit (EXIT_SUCCESS);
@@ -57,6 +57,7 @@ struct hs_helper_ctx {
 	gboolean loaded;
 	gdouble max_time;
 	gdouble recompile_time;
+	guint max_jobs;
 	struct event recompile_timer;
 };
 
@@ -99,6 +100,15 @@ init_hs_helper (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct hs_helper_ctx, recompile_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"Time between recompilation checks");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"max_jobs",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct hs_helper_ctx, max_jobs),
+			RSPAMD_CL_FLAG_UINT,
+			"Maximum number of processes to compile changed classes in "
+			"parallel, default: number of CPUs");
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"timeout",
@@ -111,56 +121,56 @@ init_hs_helper (struct rspamd_config *cfg)
 	return ctx;
 }
 
-/**
- * Clean
+typedef gboolean (*rspamd_hs_helper_file_check) (struct hs_helper_ctx *ctx,
+		const gchar *path);
+
+static gboolean
+rspamd_hs_helper_check_hs (struct hs_helper_ctx *ctx, const gchar *path)
+{
+	return rspamd_re_cache_is_valid_hyperscan_file (ctx->cfg->re_cache,
+			path, TRUE, TRUE);
+}
+
+/* Shared images are valid only while the corresponding .hs file exists */
+static gboolean
+rspamd_hs_helper_check_hsmp (struct hs_helper_ctx *ctx, const gchar *path)
+{
+	gchar *hs_path;
+	gboolean ret;
+
+	hs_path = g_strndup (path, strlen (path) - (sizeof ("mp") - 1));
+	ret = access (hs_path, R_OK) != -1;
+	g_free (hs_path);
+
+	return ret;
+}
+
+/*
+ * Removes files matching `suffix` in hyperscan cache dir, if `check` is NULL
+ * or `forced` is TRUE all such files are removed, otherwise only the ones that
+ * are not valid according to `check`
  */
 static gboolean
-rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
+rspamd_hs_helper_cleanup_pattern (struct hs_helper_ctx *ctx,
+		const gchar *suffix, gboolean forced,
+		rspamd_hs_helper_file_check check)
 {
-	struct stat st;
 	glob_t globbuf;
-	guint len, i;
-	gint rc;
 	gchar *pattern;
+	guint i;
+	gint rc;
 	gboolean ret = TRUE;
 
-	if (stat (ctx->hs_dir, &st) == -1) {
-		msg_err ("cannot stat path %s, %s",
-				ctx->hs_dir,
-				strerror (errno));
-		return FALSE;
-	}
-
-	globbuf.gl_offs = 0;
-	len = strlen (ctx->hs_dir) + 1 + sizeof ("*.hs.new") + 2;
-	pattern = g_malloc (len);
-	rspamd_snprintf (pattern, len, "%s%c%s", ctx->hs_dir, G_DIR_SEPARATOR, "*.hs");
+	memset (&globbuf, 0, sizeof (globbuf));
+	pattern = g_strdup_printf ("%s%c*%s", ctx->hs_dir, G_DIR_SEPARATOR, suffix);
 
 	if ((rc = glob (pattern, 0, NULL, &globbuf)) == 0) {
 		for (i = 0; i < globbuf.gl_pathc; i++) {
-			if (forced ||
-					!rspamd_re_cache_is_valid_hyperscan_file (ctx->cfg->re_cache,
-						globbuf.gl_pathv[i], TRUE, TRUE)) {
-				if (unlink (globbuf.gl_pathv[i]) == -1) {
-					msg_err ("cannot unlink %s: %s", globbuf.gl_pathv[i],
-							strerror (errno));
-					ret = FALSE;
-				}
+			if (!forced && check != NULL && check (ctx, globbuf.gl_pathv[i])) {
+				continue;
 			}
-		}
-	}
-	else if (rc != GLOB_NOMATCH) {
-		msg_err ("glob %s failed: %s", pattern, strerror (errno));
-		ret = FALSE;
-	}
-
-	globfree (&globbuf);
 
-	memset (&globbuf, 0, sizeof (globbuf));
-	rspamd_snprintf (pattern, len, "%s%c%s", ctx->hs_dir, G_DIR_SEPARATOR, "*.hs.new");
-	if ((rc = glob (pattern, 0, NULL, &globbuf)) == 0) {
-		for (i = 0; i < globbuf.gl_pathc; i++) {
-			if (unlink (globbuf.gl_pathv[i]) == -1) {
+			if (unlink (globbuf.gl_pathv[i]) == -1 && errno != ENOENT) {
 				msg_err ("cannot unlink %s: %s", globbuf.gl_pathv[i],
 						strerror (errno));
 				ret = FALSE;
@@ -168,7 +178,8 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 		}
 	}
 	else if (rc != GLOB_NOMATCH) {
-		msg_err ("glob %s failed: %s", pattern, strerror (errno));
+		msg_err ("glob %s failed: %s", pattern,
+				rc == GLOB_NOSPACE ? "out of memory" : "read error");
 		ret = FALSE;
 	}
 
@@ -178,6 +189,33 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 	return ret;
 }
 
+/**
+ * Clean
+ */
+static gboolean
+rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
+{
+	struct stat st;
+	gboolean ret = TRUE;
+
+	if (stat (ctx->hs_dir, &st) == -1) {
+		msg_err ("cannot stat path %s, %s",
+				ctx->hs_dir,
+				strerror (errno));
+		return FALSE;
+	}
+
+	/* Images are checked after databases as they depend on them */
+	ret &= rspamd_hs_helper_cleanup_pattern (ctx, ".hs", forced,
+			rspamd_hs_helper_check_hs);
+	ret &= rspamd_hs_helper_cleanup_pattern (ctx, ".hs.new", forced, NULL);
+	ret &= rspamd_hs_helper_cleanup_pattern (ctx, ".hsmp", forced,
+			rspamd_hs_helper_check_hsmp);
+	ret &= rspamd_hs_helper_cleanup_pattern (ctx, ".hsmp.new", forced, NULL);
+
+	return ret;
+}
+
 static gboolean
 rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
 		gboolean forced)
@@ -197,7 +235,7 @@ rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
 	}
 
 	if ((ncompiled = rspamd_re_cache_compile_hyperscan (ctx->cfg->re_cache,
-			ctx->hs_dir, ctx->max_time, !forced,
+			ctx->hs_dir, ctx->max_time, !forced, ctx->max_jobs,
 			&err)) == -1) {
 		msg_err ("failed to compile re cache: %e", err);
 		g_error_free (err);
@@ -289,6 +327,14 @@ start_hs_helper (struct rspamd_worker *worker)
 		ctx->hs_dir = RSPAMD_DBDIR "/";
 	}
 
+	if (ctx->max_jobs == 0) {
+#ifdef HAVE_SC_NPROCESSORS_ONLN
+		ctx->max_jobs = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+#else
+		ctx->max_jobs = 1;
+#endif
+	}
+
 	ctx->ev_base = rspamd_prepare_worker (worker,
 			"hs_helper",
 			NULL);
@@ -18,6 +18,7 @@
 #include "message.h"
 #include "task.h"
 #include "archives.h"
+#include "part_cache.h"
 #include <unicode/uchar.h>
 #include <unicode/utf8.h>
 #include <unicode/utf16.h>
@@ -1519,32 +1520,171 @@ rspamd_archive_cheat_detect (struct rspamd_mime_part *part, const gchar *str,
 	return FALSE;
 }
 
+/*
+ * Cached archive consists of a header followed by files records with names,
+ * an empty record means that part is not a valid archive
+ */
+struct rspamd_archive_cached {
+	guint32 type;
+	guint32 flags;
+	guint32 nfiles;
+};
+
+struct rspamd_archive_file_cached {
+	guint64 compressed_size;
+	guint64 uncompressed_size;
+	guint32 flags;
+	guint32 fname_len;
+};
+
+static gboolean
+rspamd_archive_from_cache (struct rspamd_task *task,
+		struct rspamd_mime_part *part)
+{
+	guchar buf[RSPAMD_PART_CACHE_DATA_LEN], *p, *end;
+	struct rspamd_archive_cached hdr;
+	struct rspamd_archive_file_cached fhdr;
+	struct rspamd_archive *arch;
+	struct rspamd_archive_file *f;
+	gssize r;
+	guint i;
+
+	r = rspamd_part_cache_lookup (task, part, RSPAMD_PART_CACHE_ARCHIVE, 0,
+			buf);
+
+	if (r < 0) {
+		return FALSE;
+	}
+
+	if (r < sizeof (hdr)) {
+		return TRUE;
+	}
+
+	p = buf;
+	end = buf + r;
+	memcpy (&hdr, p, sizeof (hdr));
+	p += sizeof (hdr);
+
+	arch = rspamd_mempool_alloc0 (task->task_pool, sizeof (*arch));
+	arch->files = g_ptr_array_sized_new (hdr.nfiles);
+	arch->type = hdr.type;
+	arch->flags = hdr.flags;
+	rspamd_mempool_add_destructor (task->task_pool, rspamd_archive_dtor,
+			arch);
+
+	for (i = 0; i < hdr.nfiles && end - p >= sizeof (fhdr); i ++) {
+		memcpy (&fhdr, p, sizeof (fhdr));
+		p += sizeof (fhdr);
+
+		if (end - p < fhdr.fname_len) {
+			break;
+		}
+
+		f = g_malloc0 (sizeof (*f));
+		f->compressed_size = fhdr.compressed_size;
+		f->uncompressed_size = fhdr.uncompressed_size;
+		f->flags = fhdr.flags;
+		f->fname = g_string_new_len (p, fhdr.fname_len);
+		p += fhdr.fname_len;
+		g_ptr_array_add (arch->files, f);
+	}
+
+	part->flags |= RSPAMD_MIME_PART_ARCHIVE;
+	part->specific.arch = arch;
+
+	if (part->cd) {
+		arch->archive_name = &part->cd->filename;
+	}
+
+	arch->size = part->parsed_data.len;
+	msg_debug_task ("use cached list of %ud files for %s archive",
+			arch->files->len, rspamd_archive_type_str (arch->type));
+
+	return TRUE;
+}
+
+static void
+rspamd_archive_to_cache (struct rspamd_task *task,
+		struct rspamd_mime_part *part)
+{
+	guchar buf[RSPAMD_PART_CACHE_DATA_LEN], *p;
+	struct rspamd_archive_cached hdr;
+	struct rspamd_archive_file_cached fhdr;
+	struct rspamd_archive *arch;
+	struct rspamd_archive_file *f;
+	guint i;
+
+	if (!(part->flags & RSPAMD_MIME_PART_ARCHIVE)) {
+		rspamd_part_cache_insert (task, part, RSPAMD_PART_CACHE_ARCHIVE, 0,
+				buf, 0);
+
+		return;
+	}
+
+	arch = part->specific.arch;
+	hdr.type = arch->type;
+	hdr.flags = arch->flags;
+	hdr.nfiles = arch->files->len;
+	memcpy (buf, &hdr, sizeof (hdr));
+	p = buf + sizeof (hdr);
+
+	for (i = 0; i < arch->files->len; i ++) {
+		f = g_ptr_array_index (arch->files, i);
+		fhdr.compressed_size = f->compressed_size;
+		fhdr.uncompressed_size = f->uncompressed_size;
+		fhdr.flags = f->flags;
+		fhdr.fname_len = f->fname ? f->fname->len : 0;
+
+		if (sizeof (buf) - (p - buf) < sizeof (fhdr) + fhdr.fname_len) {
+			/* Too many files to be cached */
+			return;
+		}
+
+		memcpy (p, &fhdr, sizeof (fhdr));
+		p += sizeof (fhdr);
+
+		if (fhdr.fname_len > 0) {
+			memcpy (p, f->fname->str, fhdr.fname_len);
+			p += fhdr.fname_len;
+		}
+	}
+
+	rspamd_part_cache_insert (task, part, RSPAMD_PART_CACHE_ARCHIVE, 0,
+			buf, p - buf);
+}
+
 void
 rspamd_archives_process (struct rspamd_task *task)
 {
 	guint i;
 	struct rspamd_mime_part *part;
+	void (*process_func) (struct rspamd_task *, struct rspamd_mime_part *);
 	const guchar rar_magic[] = {0x52, 0x61, 0x72, 0x21, 0x1A, 0x07};
 	const guchar zip_magic[] = {0x50, 0x4b, 0x03, 0x04};
 	const guchar sz_magic[] = {'7', 'z', 0xBC, 0xAF, 0x27, 0x1C};
 
 	for (i = 0; i < task->parts->len; i ++) {
 		part = g_ptr_array_index (task->parts, i);
+		process_func = NULL;
 
 		if (part->parsed_data.len > 0) {
 			if (rspamd_archive_cheat_detect (part, "zip",
 					zip_magic, sizeof (zip_magic))) {
-				rspamd_archive_process_zip (task, part);
+				process_func = rspamd_archive_process_zip;
 			}
 			else if (rspamd_archive_cheat_detect (part, "rar",
 					rar_magic, sizeof (rar_magic))) {
-				rspamd_archive_process_rar (task, part);
+				process_func = rspamd_archive_process_rar;
 			}
 			else if (rspamd_archive_cheat_detect (part, "7z",
 					sz_magic, sizeof (sz_magic))) {
-				rspamd_archive_process_7zip (task, part);
+				process_func = rspamd_archive_process_7zip;
 			}
 
+			if (process_func && !rspamd_archive_from_cache (task, part)) {
+				process_func (task, part);
+				rspamd_archive_to_cache (task, part);
+			}
 		}
 	}
 }
@@ -18,17 +18,37 @@
 #include "task.h"
 #include "message.h"
 #include "html.h"
+#include "rspamd.h"
+#include "images_dct.h"
 
 #ifdef USABLE_GD
 #include "gd.h"
-#include "hash.h"
 #include <math.h>
 
 #define RSPAMD_NORMALIZED_DIM 64
-
-static rspamd_lru_hash_t *images_hash = NULL;
 #endif
 
+/*
+ * DCT signatures of images shared by all workers of a node. The cache is
+ * allocated in the main process and is set-associative, so its size is fixed.
+ * Entries are protected by sequence counters: an odd value means that some
+ * process is writing the entry, such entries are skipped by readers and by
+ * other writers. An entry changed while a reader copies it is a miss.
+ */
+#define IMAGES_CACHE_WAYS 4
+#define IMAGES_CACHE_KEY_LEN 16
+
+struct rspamd_images_cache_entry {
+	gint seq;
+	guchar digest[IMAGES_CACHE_KEY_LEN];
+	guchar dct[RSPAMD_DCT_LEN / NBBY];
+};
+
+struct rspamd_images_cache {
+	guint nentries;
+	struct rspamd_images_cache_entry *entries;
+};
+
 static const guint8 png_signature[] = {137, 80, 78, 71, 13, 10, 26, 10};
 static const guint8 jpg_sig1[] = {0xff, 0xd8};
 static const guint8 jpg_sig_jfif[] = {0xff, 0xe0};
@@ -214,192 +234,92 @@ process_bmp_image (struct rspamd_task *task, rspamd_ftok_t *data)
 	return img;
 }
 
-#ifdef USABLE_GD
-/*
- * DCT from Emil Mikulic.
- * http://unix4lyfe.org/dct/
- */
-static void
-rspamd_image_dct_block (gint pixels[8][8], gdouble *out)
+void
+rspamd_images_init_shared (struct rspamd_config *cfg)
 {
-	gint i;
-	gint rows[8][8];
-
-	static const gint c1 = 1004 /* cos(pi/16) << 10 */,
-			s1 = 200 /* sin(pi/16) */,
-			c3 = 851 /* cos(3pi/16) << 10 */,
-			s3 = 569 /* sin(3pi/16) << 10 */,
-			r2c6 = 554 /* sqrt(2)*cos(6pi/16) << 10 */,
-			r2s6 = 1337 /* sqrt(2)*sin(6pi/16) << 10 */,
-			r2 = 181; /* sqrt(2) << 7*/
-
-	gint x0, x1, x2, x3, x4, x5, x6, x7, x8;
-
-	/* transform rows */
-	for (i = 0; i < 8; i++) {
-		x0 = pixels[0][i];
-		x1 = pixels[1][i];
-		x2 = pixels[2][i];
-		x3 = pixels[3][i];
-		x4 = pixels[4][i];
-		x5 = pixels[5][i];
-		x6 = pixels[6][i];
-		x7 = pixels[7][i];
-
-		/* Stage 1 */
-		x8 = x7 + x0;
-		x0 -= x7;
-		x7 = x1 + x6;
-		x1 -= x6;
-		x6 = x2 + x5;
-		x2 -= x5;
-		x5 = x3 + x4;
-		x3 -= x4;
-
-		/* Stage 2 */
-		x4 = x8 + x5;
-		x8 -= x5;
-		x5 = x7 + x6;
-		x7 -= x6;
-		x6 = c1 * (x1 + x2);
-		x2 = (-s1 - c1) * x2 + x6;
-		x1 = (s1 - c1) * x1 + x6;
-		x6 = c3 * (x0 + x3);
-		x3 = (-s3 - c3) * x3 + x6;
-		x0 = (s3 - c3) * x0 + x6;
-
-		/* Stage 3 */
-		x6 = x4 + x5;
-		x4 -= x5;
-		x5 = r2c6 * (x7 + x8);
-		x7 = (-r2s6 - r2c6) * x7 + x5;
-		x8 = (r2s6 - r2c6) * x8 + x5;
-		x5 = x0 + x2;
-		x0 -= x2;
-		x2 = x3 + x1;
-		x3 -= x1;
-
-		/* Stage 4 and output */
-		rows[i][0] = x6;
-		rows[i][4] = x4;
-		rows[i][2] = x8 >> 10;
-		rows[i][6] = x7 >> 10;
-		rows[i][7] = (x2 - x5) >> 10;
-		rows[i][1] = (x2 + x5) >> 10;
-		rows[i][3] = (x3 * r2) >> 17;
-		rows[i][5] = (x0 * r2) >> 17;
-	}
+	struct rspamd_images_cache *cache;
+	guint nentries;
 
-	/* transform columns */
-	for (i = 0; i < 8; i++) {
-		x0 = rows[0][i];
-		x1 = rows[1][i];
-		x2 = rows[2][i];
-		x3 = rows[3][i];
-		x4 = rows[4][i];
-		x5 = rows[5][i];
-		x6 = rows[6][i];
-		x7 = rows[7][i];
-
-		/* Stage 1 */
-		x8 = x7 + x0;
-		x0 -= x7;
-		x7 = x1 + x6;
-		x1 -= x6;
-		x6 = x2 + x5;
-		x2 -= x5;
-		x5 = x3 + x4;
-		x3 -= x4;
-
-		/* Stage 2 */
-		x4 = x8 + x5;
-		x8 -= x5;
-		x5 = x7 + x6;
-		x7 -= x6;
-		x6 = c1 * (x1 + x2);
-		x2 = (-s1 - c1) * x2 + x6;
-		x1 = (s1 - c1) * x1 + x6;
-		x6 = c3 * (x0 + x3);
-		x3 = (-s3 - c3) * x3 + x6;
-		x0 = (s3 - c3) * x0 + x6;
-
-		/* Stage 3 */
-		x6 = x4 + x5;
-		x4 -= x5;
-		x5 = r2c6 * (x7 + x8);
-		x7 = (-r2s6 - r2c6) * x7 + x5;
-		x8 = (r2s6 - r2c6) * x8 + x5;
-		x5 = x0 + x2;
-		x0 -= x2;
-		x2 = x3 + x1;
-		x3 -= x1;
-
-		/* Stage 4 and output */
-		out[i * 8] = (double) ((x6 + 16) >> 3);
-		out[i * 8 + 1] = (double) ((x4 + 16) >> 3);
-		out[i * 8 + 2] = (double) ((x8 + 16384) >> 13);
-		out[i * 8 + 3] = (double) ((x7 + 16384) >> 13);
-		out[i * 8 + 4] = (double) ((x2 - x5 + 16384) >> 13);
-		out[i * 8 + 5] = (double) ((x2 + x5 + 16384) >> 13);
-		out[i * 8 + 6] = (double) (((x3 >> 8) * r2 + 8192) >> 12);
-		out[i * 8 + 7] = (double) (((x0 >> 8) * r2 + 8192) >> 12);
-	}
-}
+	msg_debug_config ("use %s DCT kernel", rspamd_image_dct_load ());
+	nentries = cfg->images_cache_size / IMAGES_CACHE_WAYS * IMAGES_CACHE_WAYS;
 
-struct rspamd_image_cache_entry {
-	guchar digest[64];
-	guchar dct[RSPAMD_DCT_LEN / NBBY];
-};
+	if (nentries == 0) {
+		return;
+	}
 
-static void
-rspamd_image_cache_entry_dtor (gpointer p)
-{
-	struct rspamd_image_cache_entry *entry = p;
-	g_free (entry);
+	cache = rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (*cache));
+	cache->nentries = nentries;
+	cache->entries = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*cache->entries) * nentries);
+	cfg->images_cache = cache;
 }
 
-static guint32
-rspamd_image_dct_hash (gconstpointer p)
+#ifdef USABLE_GD
+static struct rspamd_images_cache_entry *
+rspamd_image_cache_bucket (struct rspamd_images_cache *cache,
+		const guchar *digest)
 {
-	return rspamd_cryptobox_fast_hash (p, rspamd_cryptobox_HASHBYTES,
-			rspamd_hash_seed ());
-}
+	guint64 h;
 
-static gboolean
-rspamd_image_dct_equal (gconstpointer a, gconstpointer b)
-{
-	return memcmp (a, b, rspamd_cryptobox_HASHBYTES) == 0;
+	/* Digests are cryptographic hashes, so any part of them is good */
+	memcpy (&h, digest, sizeof (h));
+
+	return &cache->entries[h % (cache->nentries / IMAGES_CACHE_WAYS) *
+			IMAGES_CACHE_WAYS];
 }
 
-static void
-rspamd_image_create_cache (struct rspamd_config *cfg)
+static struct rspamd_stat *
+rspamd_image_stat (struct rspamd_task *task)
 {
-	images_hash = rspamd_lru_hash_new_full (cfg->images_cache_size, NULL,
-			rspamd_image_cache_entry_dtor,
-			rspamd_image_dct_hash, rspamd_image_dct_equal);
+	if (task->worker && task->worker->srv) {
+		return task->worker->srv->stat;
+	}
+
+	return NULL;
 }
 
 static gboolean
 rspamd_image_check_hash (struct rspamd_task *task, struct rspamd_image *img)
 {
-	struct rspamd_image_cache_entry *found;
+	struct rspamd_images_cache *cache = task->cfg->images_cache;
+	struct rspamd_images_cache_entry *bucket, *elt;
+	struct rspamd_stat *stat;
+	guchar dct[RSPAMD_DCT_LEN / NBBY];
+	guint i;
+	gint s;
 
-	if (images_hash == NULL) {
-		rspamd_image_create_cache (task->cfg);
+	if (cache == NULL) {
+		return FALSE;
 	}
 
-	found = rspamd_lru_hash_lookup (images_hash, img->parent->digest,
-			task->tv.tv_sec);
+	bucket = rspamd_image_cache_bucket (cache, img->parent->digest);
+
+	for (i = 0; i < IMAGES_CACHE_WAYS; i ++) {
+		elt = &bucket[i];
+		s = g_atomic_int_get (&elt->seq);
+
+		if ((s & 1) || memcmp (elt->digest, img->parent->digest,
+				sizeof (elt->digest)) != 0) {
+			continue;
+		}
+
+		memcpy (dct, elt->dct, sizeof (dct));
+
+		if (g_atomic_int_get (&elt->seq) != s) {
+			/* Entry has been replaced while we were copying it */
+			break;
+		}
 
-	if (found) {
-		/* We need to decompress */
 		img->dct = g_malloc (RSPAMD_DCT_LEN / NBBY);
 		rspamd_mempool_add_destructor (task->task_pool, g_free,
 				img->dct);
-		/* Copy as found could be destroyed by LRU */
-		memcpy (img->dct, found->dct, RSPAMD_DCT_LEN / NBBY);
+		memcpy (img->dct, dct, sizeof (dct));
 		img->is_normalized = TRUE;
 
+		if ((stat = rspamd_image_stat (task)) != NULL) {
+			g_atomic_int_inc (&stat->images_cache_hits);
+		}
+
 		return TRUE;
 	}
 
@@ -409,21 +329,57 @@ rspamd_image_check_hash (struct rspamd_task *task, struct rspamd_image *img)
 static void
 rspamd_image_save_hash (struct rspamd_task *task, struct rspamd_image *img)
 {
-	struct rspamd_image_cache_entry *found;
+	struct rspamd_images_cache *cache = task->cfg->images_cache;
+	struct rspamd_images_cache_entry *bucket, *elt = NULL;
+	guint64 h;
+	guint i;
+	gint s;
 
-	if (img->is_normalized) {
-		found = rspamd_lru_hash_lookup (images_hash, img->parent->digest,
-				task->tv.tv_sec);
+	if (cache == NULL || !img->is_normalized) {
+		return;
+	}
 
-		if (!found) {
-			found = g_malloc0 (sizeof (*found));
-			memcpy (found->dct, img->dct, RSPAMD_DCT_LEN / NBBY);
-			memcpy (found->digest, img->parent->digest, sizeof (found->digest));
+	bucket = rspamd_image_cache_bucket (cache, img->parent->digest);
 
-			rspamd_lru_hash_insert (images_hash, found->digest, found,
-					task->tv.tv_sec, 0);
+	for (i = 0; i < IMAGES_CACHE_WAYS; i ++) {
+		/* Same image could be saved by another worker, zero seq is unused */
+		if (bucket[i].seq == 0 || memcmp (bucket[i].digest,
+				img->parent->digest, sizeof (bucket[i].digest)) == 0) {
+			elt = &bucket[i];
+			break;
 		}
 	}
+
+	if (elt == NULL) {
+		/* Evict some pseudo-random way */
+		memcpy (&h, img->parent->digest + sizeof (h), sizeof (h));
+		elt = &bucket[h % IMAGES_CACHE_WAYS];
+	}
+
+	s = g_atomic_int_get (&elt->seq);
+
+	if (!(s & 1) && g_atomic_int_compare_and_exchange (&elt->seq, s, s + 1)) {
+		memcpy (elt->digest, img->parent->digest, sizeof (elt->digest));
+		memcpy (elt->dct, img->dct, sizeof (elt->dct));
+		g_atomic_int_set (&elt->seq, s + 2);
+	}
+}
+
+static void
+rspamd_image_account_time (struct rspamd_task *task, gdouble elapsed)
+{
+	struct rspamd_stat *stat;
+	guint64 usec = elapsed * 1e6;
+
+	if ((stat = rspamd_image_stat (task)) != NULL) {
+		g_atomic_int_inc (&stat->images_normalized);
+#ifndef HAVE_ATOMIC_BUILTINS
+		stat->images_normalize_time += usec;
+#else
+		__atomic_add_fetch (&stat->images_normalize_time,
+				usec, __ATOMIC_RELEASE);
+#endif
+	}
 }
 
 #endif
@@ -434,7 +390,7 @@ rspamd_image_normalize (struct rspamd_task *task, struct rspamd_image *img)
 #ifdef USABLE_GD
 	gdImagePtr src = NULL, dst = NULL;
 	guint i, j, k, l;
-	gdouble *dct;
+	gdouble *dct, t1;
 
 	if (img->data->len == 0 || img->data->len > G_MAXINT32) {
 		return;
@@ -453,6 +409,8 @@ rspamd_image_normalize (struct rspamd_task *task, struct rspamd_image *img)
 		return;
 	}
 
+	t1 = rspamd_get_ticks (FALSE);
+
 	switch (img->type) {
 	case IMAGE_TYPE_JPG:
 		src = gdImageCreateFromJpegPtr (img->data->len, (void *)img->data->begin);
@@ -551,6 +509,11 @@ rspamd_image_normalize (struct rspamd_task *task, struct rspamd_image *img)
 		gdImageDestroy (dst);
 		g_free (dct);
 		rspamd_image_save_hash (task, img);
+		t1 = rspamd_get_ticks (FALSE) - t1;
+		rspamd_image_account_time (task, t1);
+		msg_debug_task ("normalized %s image of size %ud x %ud in %.3f ms",
+				rspamd_image_type_str (img->type), img->width, img->height,
+				t1 * 1000.0);
 	}
 #endif
 }
@@ -624,6 +587,11 @@ process_image (struct rspamd_task *task, struct rspamd_mime_part *part)
 				for (i = 0; i < task->text_parts->len; i ++) {
 					tp = g_ptr_array_index (task->text_parts, i);
 
+					if (IS_PART_HTML (tp)) {
+						rspamd_mime_text_part_process (task, tp,
+								RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
+					}
+
 					if (IS_PART_HTML (tp) && tp->html != NULL &&
 							tp->html->images != NULL) {
 						for (j = 0; j < tp->html->images->len; j ++) {
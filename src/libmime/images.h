@@ -7,6 +7,7 @@
 struct html_image;
 struct rspamd_task;
 struct rspamd_mime_part;
+struct rspamd_config;
 
 #define RSPAMD_DCT_LEN (64 * 64)
 
@@ -42,4 +43,10 @@ const gchar * rspamd_image_type_str (enum rspamd_image_type type);
 
 void rspamd_image_normalize (struct rspamd_task *task, struct rspamd_image *img);
 
+/*
+ * Allocate DCT cache shared by all workers, should be called in the main
+ * process
+ */
+void rspamd_images_init_shared (struct rspamd_config *cfg);
+
 #endif /* IMAGES_H_ */
@@ -0,0 +1,210 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * DCT kernels for images normalization: generic one and SIMD versions
+ * selected at runtime depending on CPU features
+ */
+#include "config.h"
+#include "cryptobox.h"
+#include "platform_config.h"
+#include "images_dct.h"
+
+extern unsigned long cpu_config;
+
+typedef struct rspamd_image_dct_impl {
+	unsigned long cpu_flags;
+	const char *desc;
+
+	void (*block) (gint pixels[8][8], gdouble *out);
+} rspamd_image_dct_impl_t;
+
+#define DCT_KERNEL_DECLARE(ext) \
+    void rspamd_image_dct_block_##ext(gint pixels[8][8], gdouble *out);
+#define DCT_KERNEL_IMPL(cpuflags, desc, ext) \
+    {(cpuflags), desc, rspamd_image_dct_block_##ext}
+
+DCT_KERNEL_DECLARE(ref);
+#define DCT_KERNEL_REF DCT_KERNEL_IMPL(0, "ref", ref)
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+# if defined(HAVE_AVX2)
+void rspamd_image_dct_block_avx2 (gint pixels[8][8], gdouble *out)
+		__attribute__((__target__("avx2")));
+
+DCT_KERNEL_DECLARE(avx2);
+#  define DCT_KERNEL_AVX2 DCT_KERNEL_IMPL(CPUID_AVX2, "avx2", avx2)
+# endif
+#endif
+
+static const rspamd_image_dct_impl_t dct_kernel_list[] = {
+		DCT_KERNEL_REF,
+#ifdef DCT_KERNEL_AVX2
+		DCT_KERNEL_AVX2,
+#endif
+};
+
+static const rspamd_image_dct_impl_t *dct_kernel_opt = &dct_kernel_list[0];
+
+const char *
+rspamd_image_dct_load (void)
+{
+	guint i;
+
+	if (cpu_config != 0) {
+		for (i = 0; i < G_N_ELEMENTS (dct_kernel_list); i++) {
+			if (dct_kernel_list[i].cpu_flags & cpu_config) {
+				dct_kernel_opt = &dct_kernel_list[i];
+				break;
+			}
+		}
+	}
+
+	return dct_kernel_opt->desc;
+}
+
+void
+rspamd_image_dct_block (gint pixels[8][8], gdouble *out)
+{
+	dct_kernel_opt->block (pixels, out);
+}
+
+void
+rspamd_image_dct_block_ref (gint pixels[8][8], gdouble *out)
+{
+	gint i;
+	gint rows[8][8];
+
+	static const gint c1 = RSPAMD_DCT_C1,
+			s1 = RSPAMD_DCT_S1,
+			c3 = RSPAMD_DCT_C3,
+			s3 = RSPAMD_DCT_S3,
+			r2c6 = RSPAMD_DCT_R2C6,
+			r2s6 = RSPAMD_DCT_R2S6,
+			r2 = RSPAMD_DCT_R2;
+
+	gint x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	/* transform rows */
+	for (i = 0; i < 8; i++) {
+		x0 = pixels[0][i];
+		x1 = pixels[1][i];
+		x2 = pixels[2][i];
+		x3 = pixels[3][i];
+		x4 = pixels[4][i];
+		x5 = pixels[5][i];
+		x6 = pixels[6][i];
+		x7 = pixels[7][i];
+
+		/* Stage 1 */
+		x8 = x7 + x0;
+		x0 -= x7;
+		x7 = x1 + x6;
+		x1 -= x6;
+		x6 = x2 + x5;
+		x2 -= x5;
+		x5 = x3 + x4;
+		x3 -= x4;
+
+		/* Stage 2 */
+		x4 = x8 + x5;
+		x8 -= x5;
+		x5 = x7 + x6;
+		x7 -= x6;
+		x6 = c1 * (x1 + x2);
+		x2 = (-s1 - c1) * x2 + x6;
+		x1 = (s1 - c1) * x1 + x6;
+		x6 = c3 * (x0 + x3);
+		x3 = (-s3 - c3) * x3 + x6;
+		x0 = (s3 - c3) * x0 + x6;
+
+		/* Stage 3 */
+		x6 = x4 + x5;
+		x4 -= x5;
+		x5 = r2c6 * (x7 + x8);
+		x7 = (-r2s6 - r2c6) * x7 + x5;
+		x8 = (r2s6 - r2c6) * x8 + x5;
+		x5 = x0 + x2;
+		x0 -= x2;
+		x2 = x3 + x1;
+		x3 -= x1;
+
+		/* Stage 4 and output */
+		rows[i][0] = x6;
+		rows[i][4] = x4;
+		rows[i][2] = x8 >> 10;
+		rows[i][6] = x7 >> 10;
+		rows[i][7] = (x2 - x5) >> 10;
+		rows[i][1] = (x2 + x5) >> 10;
+		rows[i][3] = (x3 * r2) >> 17;
+		rows[i][5] = (x0 * r2) >> 17;
+	}
+
+	/* transform columns */
+	for (i = 0; i < 8; i++) {
+		x0 = rows[0][i];
+		x1 = rows[1][i];
+		x2 = rows[2][i];
+		x3 = rows[3][i];
+		x4 = rows[4][i];
+		x5 = rows[5][i];
+		x6 = rows[6][i];
+		x7 = rows[7][i];
+
+		/* Stage 1 */
+		x8 = x7 + x0;
+		x0 -= x7;
+		x7 = x1 + x6;
+		x1 -= x6;
+		x6 = x2 + x5;
+		x2 -= x5;
+		x5 = x3 + x4;
+		x3 -= x4;
+
+		/* Stage 2 */
+		x4 = x8 + x5;
+		x8 -= x5;
+		x5 = x7 + x6;
+		x7 -= x6;
+		x6 = c1 * (x1 + x2);
+		x2 = (-s1 - c1) * x2 + x6;
+		x1 = (s1 - c1) * x1 + x6;
+		x6 = c3 * (x0 + x3);
+		x3 = (-s3 - c3) * x3 + x6;
+		x0 = (s3 - c3) * x0 + x6;
+
+		/* Stage 3 */
+		x6 = x4 + x5;
+		x4 -= x5;
+		x5 = r2c6 * (x7 + x8);
+		x7 = (-r2s6 - r2c6) * x7 + x5;
+		x8 = (r2s6 - r2c6) * x8 + x5;
+		x5 = x0 + x2;
+		x0 -= x2;
+		x2 = x3 + x1;
+		x3 -= x1;
+
+		/* Stage 4 and output */
+		out[i * 8] = (double) ((x6 + 16) >> 3);
+		out[i * 8 + 1] = (double) ((x4 + 16) >> 3);
+		out[i * 8 + 2] = (double) ((x8 + 16384) >> 13);
+		out[i * 8 + 3] = (double) ((x7 + 16384) >> 13);
+		out[i * 8 + 4] = (double) ((x2 - x5 + 16384) >> 13);
+		out[i * 8 + 5] = (double) ((x2 + x5 + 16384) >> 13);
+		out[i * 8 + 6] = (double) (((x3 >> 8) * r2 + 8192) >> 12);
+		out[i * 8 + 7] = (double) (((x0 >> 8) * r2 + 8192) >> 12);
+	}
+}
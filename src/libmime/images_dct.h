@@ -0,0 +1,48 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBMIME_IMAGES_DCT_H_
+#define SRC_LIBMIME_IMAGES_DCT_H_
+
+#include "config.h"
+
+/*
+ * Integer DCT from Emil Mikulic (http://unix4lyfe.org/dct/), all kernels
+ * must produce exactly the same output as signatures of images are stored
+ * in fuzzy storages
+ */
+#define RSPAMD_DCT_C1 1004 /* cos(pi/16) << 10 */
+#define RSPAMD_DCT_S1 200 /* sin(pi/16) */
+#define RSPAMD_DCT_C3 851 /* cos(3pi/16) << 10 */
+#define RSPAMD_DCT_S3 569 /* sin(3pi/16) << 10 */
+#define RSPAMD_DCT_R2C6 554 /* sqrt(2)*cos(6pi/16) << 10 */
+#define RSPAMD_DCT_R2S6 1337 /* sqrt(2)*sin(6pi/16) << 10 */
+#define RSPAMD_DCT_R2 181 /* sqrt(2) << 7*/
+
+/**
+ * Selects the best DCT kernel for the current CPU, must be called after
+ * cryptobox initialisation
+ * @return name of the kernel
+ */
+const char* rspamd_image_dct_load (void);
+
+/**
+ * Transforms 8x8 block of pixels
+ * @param pixels
+ * @param out 64 coefficients
+ */
+void rspamd_image_dct_block (gint pixels[8][8], gdouble *out);
+
+#endif /* SRC_LIBMIME_IMAGES_DCT_H_ */
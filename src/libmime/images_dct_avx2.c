@@ -0,0 +1,177 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "images_dct.h"
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#ifndef __AVX__
+#define __AVX__
+#endif
+#ifndef __AVX2__
+#define __AVX2__
+#endif
+
+#include <immintrin.h>
+
+/*
+ * Each pass of the reference kernel transforms eight rows one by one, here
+ * lane i of a register holds the i-th row, so the whole pass is done at once
+ * and the block is transposed between passes. Integer overflows wrap in the
+ * same way as in the scalar code, so the results are identical.
+ */
+#define DCT_MUL(c, x) _mm256_mullo_epi32 (_mm256_set1_epi32 (c), (x))
+#define DCT_ADD(a, b) _mm256_add_epi32 ((a), (b))
+#define DCT_SUB(a, b) _mm256_sub_epi32 ((a), (b))
+#define DCT_SHR(a, n) _mm256_srai_epi32 ((a), (n))
+#define DCT_ROUND(a, r, n) DCT_SHR (DCT_ADD ((a), _mm256_set1_epi32 (r)), (n))
+
+#define DCT_STAGES() do { \
+	/* Stage 1 */ \
+	x8 = DCT_ADD (x7, x0); \
+	x0 = DCT_SUB (x0, x7); \
+	x7 = DCT_ADD (x1, x6); \
+	x1 = DCT_SUB (x1, x6); \
+	x6 = DCT_ADD (x2, x5); \
+	x2 = DCT_SUB (x2, x5); \
+	x5 = DCT_ADD (x3, x4); \
+	x3 = DCT_SUB (x3, x4); \
+	/* Stage 2 */ \
+	x4 = DCT_ADD (x8, x5); \
+	x8 = DCT_SUB (x8, x5); \
+	x5 = DCT_ADD (x7, x6); \
+	x7 = DCT_SUB (x7, x6); \
+	x6 = DCT_MUL (RSPAMD_DCT_C1, DCT_ADD (x1, x2)); \
+	x2 = DCT_ADD (DCT_MUL (-RSPAMD_DCT_S1 - RSPAMD_DCT_C1, x2), x6); \
+	x1 = DCT_ADD (DCT_MUL (RSPAMD_DCT_S1 - RSPAMD_DCT_C1, x1), x6); \
+	x6 = DCT_MUL (RSPAMD_DCT_C3, DCT_ADD (x0, x3)); \
+	x3 = DCT_ADD (DCT_MUL (-RSPAMD_DCT_S3 - RSPAMD_DCT_C3, x3), x6); \
+	x0 = DCT_ADD (DCT_MUL (RSPAMD_DCT_S3 - RSPAMD_DCT_C3, x0), x6); \
+	/* Stage 3 */ \
+	x6 = DCT_ADD (x4, x5); \
+	x4 = DCT_SUB (x4, x5); \
+	x5 = DCT_MUL (RSPAMD_DCT_R2C6, DCT_ADD (x7, x8)); \
+	x7 = DCT_ADD (DCT_MUL (-RSPAMD_DCT_R2S6 - RSPAMD_DCT_R2C6, x7), x5); \
+	x8 = DCT_ADD (DCT_MUL (RSPAMD_DCT_R2S6 - RSPAMD_DCT_R2C6, x8), x5); \
+	x5 = DCT_ADD (x0, x2); \
+	x0 = DCT_SUB (x0, x2); \
+	x2 = DCT_ADD (x3, x1); \
+	x3 = DCT_SUB (x3, x1); \
+} while (0)
+
+/* Transposes 8x8 matrix of 32 bit integers from y0..y7 to x0..x7 */
+#define DCT_TRANSPOSE() do { \
+	__m256i t0, t1, t2, t3, t4, t5, t6, t7; \
+	t0 = _mm256_unpacklo_epi32 (y0, y1); \
+	t1 = _mm256_unpackhi_epi32 (y0, y1); \
+	t2 = _mm256_unpacklo_epi32 (y2, y3); \
+	t3 = _mm256_unpackhi_epi32 (y2, y3); \
+	t4 = _mm256_unpacklo_epi32 (y4, y5); \
+	t5 = _mm256_unpackhi_epi32 (y4, y5); \
+	t6 = _mm256_unpacklo_epi32 (y6, y7); \
+	t7 = _mm256_unpackhi_epi32 (y6, y7); \
+	y0 = _mm256_unpacklo_epi64 (t0, t2); \
+	y1 = _mm256_unpackhi_epi64 (t0, t2); \
+	y2 = _mm256_unpacklo_epi64 (t1, t3); \
+	y3 = _mm256_unpackhi_epi64 (t1, t3); \
+	y4 = _mm256_unpacklo_epi64 (t4, t6); \
+	y5 = _mm256_unpackhi_epi64 (t4, t6); \
+	y6 = _mm256_unpacklo_epi64 (t5, t7); \
+	y7 = _mm256_unpackhi_epi64 (t5, t7); \
+	x0 = _mm256_permute2x128_si256 (y0, y4, 0x20); \
+	x1 = _mm256_permute2x128_si256 (y1, y5, 0x20); \
+	x2 = _mm256_permute2x128_si256 (y2, y6, 0x20); \
+	x3 = _mm256_permute2x128_si256 (y3, y7, 0x20); \
+	x4 = _mm256_permute2x128_si256 (y0, y4, 0x31); \
+	x5 = _mm256_permute2x128_si256 (y1, y5, 0x31); \
+	x6 = _mm256_permute2x128_si256 (y2, y6, 0x31); \
+	x7 = _mm256_permute2x128_si256 (y3, y7, 0x31); \
+} while (0)
+
+#define DCT_STORE(p, r) do { \
+	_mm256_storeu_pd ((p), \
+			_mm256_cvtepi32_pd (_mm256_castsi256_si128 (r))); \
+	_mm256_storeu_pd ((p) + 4, \
+			_mm256_cvtepi32_pd (_mm256_extracti128_si256 ((r), 1))); \
+} while (0)
+
+void
+rspamd_image_dct_block_avx2 (gint pixels[8][8], gdouble *out)
+		__attribute__((__target__("avx2")));
+void
+rspamd_image_dct_block_avx2 (gint pixels[8][8], gdouble *out)
+{
+	const __m256i r2 = _mm256_set1_epi32 (RSPAMD_DCT_R2);
+	__m256i x0, x1, x2, x3, x4, x5, x6, x7, x8,
+			y0, y1, y2, y3, y4, y5, y6, y7;
+
+	x0 = _mm256_loadu_si256 ((const __m256i *)pixels[0]);
+	x1 = _mm256_loadu_si256 ((const __m256i *)pixels[1]);
+	x2 = _mm256_loadu_si256 ((const __m256i *)pixels[2]);
+	x3 = _mm256_loadu_si256 ((const __m256i *)pixels[3]);
+	x4 = _mm256_loadu_si256 ((const __m256i *)pixels[4]);
+	x5 = _mm256_loadu_si256 ((const __m256i *)pixels[5]);
+	x6 = _mm256_loadu_si256 ((const __m256i *)pixels[6]);
+	x7 = _mm256_loadu_si256 ((const __m256i *)pixels[7]);
+
+	/* Transform rows, yN holds N-th coefficient of all rows */
+	DCT_STAGES ();
+
+	y0 = x6;
+	y1 = DCT_SHR (DCT_ADD (x2, x5), 10);
+	y2 = DCT_SHR (x8, 10);
+	y3 = DCT_SHR (_mm256_mullo_epi32 (x3, r2), 17);
+	y4 = x4;
+	y5 = DCT_SHR (_mm256_mullo_epi32 (x0, r2), 17);
+	y6 = DCT_SHR (x7, 10);
+	y7 = DCT_SHR (DCT_SUB (x2, x5), 10);
+
+	/* Transform columns */
+	DCT_TRANSPOSE ();
+	DCT_STAGES ();
+
+	y0 = DCT_ROUND (x6, 16, 3);
+	y1 = DCT_ROUND (x4, 16, 3);
+	y2 = DCT_ROUND (x8, 16384, 13);
+	y3 = DCT_ROUND (x7, 16384, 13);
+	y4 = DCT_ROUND (DCT_SUB (x2, x5), 16384, 13);
+	y5 = DCT_ROUND (DCT_ADD (x2, x5), 16384, 13);
+	y6 = DCT_ROUND (_mm256_mullo_epi32 (DCT_SHR (x3, 8), r2), 8192, 12);
+	y7 = DCT_ROUND (_mm256_mullo_epi32 (DCT_SHR (x0, 8), r2), 8192, 12);
+
+	DCT_TRANSPOSE ();
+
+	DCT_STORE (out, x0);
+	DCT_STORE (out + 8, x1);
+	DCT_STORE (out + 16, x2);
+	DCT_STORE (out + 24, x3);
+	DCT_STORE (out + 32, x4);
+	DCT_STORE (out + 40, x5);
+	DCT_STORE (out + 48, x6);
+	DCT_STORE (out + 56, x7);
+}
+
+#pragma GCC pop_options
+#endif
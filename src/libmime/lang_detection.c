@@ -19,6 +19,7 @@
 #include "libcryptobox/cryptobox.h"
 #include "ucl.h"
 #include "khash.h"
+#include "unix-std.h"
 #include <glob.h>
 #include <unicode/utf8.h>
 #include <unicode/ucnv.h>
@@ -30,6 +31,8 @@ static const gsize default_short_text_limit = 200;
 static const gsize default_words = 80;
 static const gdouble update_prob = 0.6;
 static const gchar *default_languages_path = RSPAMD_PLUGINSDIR "/languages";
+/* Language ids are stored in 8 bits of n-gramm entries */
+#define RSPAMD_LANGDET_MAX_LANGUAGES 256
 
 #undef EXTRA_LANGDET_DEBUG
 
@@ -95,6 +98,7 @@ struct rspamd_language_elt {
 	gdouble mean;
 	gdouble std;
 	guint occurencies; /* total number of parts with this language */
+	guint id; /* index in detector languages */
 };
 
 struct rspamd_ngramm_elt {
@@ -109,6 +113,65 @@ struct rspamd_ngramm_chain {
 	gchar *utf;
 };
 
+/*
+ * Compiled n-gramms tables, the same layout is used in memory and on disk:
+ *
+ * header | languages[nlangs] | keys[nkeys] | offsets[nkeys + 1] |
+ * displacements[nbuckets] | entries[nentries]
+ *
+ * Keys are unigramms and trigramms packed to 64 bits, their positions are
+ * defined by a minimal perfect hash (hash and displace): a bucket is selected
+ * by the key hash and its displacement selects the slot. Each slot owns
+ * entries from offsets[slot] to offsets[slot + 1], an entry holds a language
+ * id in the low 8 bits and a quantized log2 of probability in the high 24 bits.
+ */
+#define RSPAMD_LANGDET_MAGIC "rslng001"
+#define RSPAMD_LANGDET_NAME_LEN 16
+/* Probabilities are below 4, so log2 is stored as (2 - log2 (prob)) */
+#define RSPAMD_LANGDET_PROB_BIAS 2.0
+#define RSPAMD_LANGDET_PROB_SCALE 65536.0
+#define RSPAMD_LANGDET_MAX_DISPLACEMENT (1u << 22)
+
+struct rspamd_ngramm_tables_header {
+	gchar magic[8];
+	guint32 nlangs;
+	guint32 nkeys;
+	guint32 nbuckets;
+	guint32 nentries;
+	guint64 seed;
+	/* Digest of the source files, used to detect stale compiled tables */
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+};
+
+struct rspamd_ngramm_tables_lang {
+	gchar name[RSPAMD_LANGDET_NAME_LEN];
+	guint32 flags;
+	guint32 ngramms_total;
+	guint32 unigramms_words;
+	guint32 trigramms_words;
+	gdouble mean;
+	gdouble std;
+};
+
+struct rspamd_ngramm_tables {
+	const struct rspamd_ngramm_tables_header *hdr;
+	const struct rspamd_ngramm_tables_lang *langs;
+	const guint64 *keys;
+	const guint32 *offsets;
+	const guint32 *displacements;
+	const guint32 *entries;
+	gpointer data;
+	gsize len;
+	gboolean mmaped;
+	/*
+	 * Powers of 2 to decode probabilities: quantized value q is
+	 * 2^(bias - (q >> 16)) * 2^(-((q >> 8) & 0xff) / 256) * 2^(-(q & 0xff) / 65536)
+	 */
+	gdouble prob_exp[256];
+	gdouble prob_hi[256];
+	gdouble prob_lo[256];
+};
+
 #define msg_debug_lang_det(...)  rspamd_conditional_debug_fast (NULL, NULL, \
         rspamd_langdet_log_id, "langdet", task->task_pool->tag.uid, \
         G_STRFUNC, \
@@ -180,10 +243,16 @@ KHASH_INIT (rspamd_candidates_hash, const gchar *,
 		struct rspamd_lang_detector_res *, true,
 		rspamd_str_hash, rspamd_str_equal);
 
-struct rspamd_lang_detector {
-	GPtrArray *languages;
+/* Temporary state used while languages are loaded from JSON files */
+struct rspamd_language_sources {
+	rspamd_mempool_t *pool;
 	khash_t(rspamd_unigram_hash) *unigramms; /* unigramms frequencies */
 	khash_t(rspamd_trigram_hash) *trigramms; /* trigramms frequencies */
+};
+
+struct rspamd_lang_detector {
+	GPtrArray *languages; /* indexed by language id */
+	struct rspamd_ngramm_tables ngramms;
 	GHashTable *unicode_scripts; /* indexed by unicode script */
 	UConverter *uchar_converter;
 	gsize short_text_limit;
@@ -225,8 +294,7 @@ struct rspamd_language_ucs_elt {
 };
 
 static void
-rspamd_language_detector_init_ngramm (struct rspamd_config *cfg,
-		struct rspamd_lang_detector *d,
+rspamd_language_detector_init_ngramm (struct rspamd_language_sources *src,
 		struct rspamd_language_elt *lelt,
 		struct rspamd_language_ucs_elt *ucs, guint len, guint freq, guint total)
 {
@@ -238,18 +306,18 @@ rspamd_language_detector_init_ngramm (struct rspamd_config *cfg,
 
 	switch (len) {
 	case 1:
-		k = kh_get (rspamd_unigram_hash, d->unigramms, ucs->s);
-		if (k != kh_end (d->unigramms)) {
-			chain = &kh_value (d->unigramms, k);
+		k = kh_get (rspamd_unigram_hash, src->unigramms, ucs->s);
+		if (k != kh_end (src->unigramms)) {
+			chain = &kh_value (src->unigramms, k);
 		}
 		break;
 	case 2:
 		g_assert_not_reached ();
 		break;
 	case 3:
-		k = kh_get (rspamd_trigram_hash, d->trigramms, ucs->s);
-		if (k != kh_end (d->trigramms)) {
-			chain = &kh_value (d->trigramms, k);
+		k = kh_get (rspamd_trigram_hash, src->trigramms, ucs->s);
+		if (k != kh_end (src->trigramms)) {
+			chain = &kh_value (src->trigramms, k);
 		}
 		break;
 	default:
@@ -262,21 +330,21 @@ rspamd_language_detector_init_ngramm (struct rspamd_config *cfg,
 		chain = &st_chain;
 		memset (chain, 0, sizeof (st_chain));
 		chain->languages = g_ptr_array_sized_new (32);
-		rspamd_mempool_add_destructor (cfg->cfg_pool, rspamd_ptr_array_free_hard,
+		rspamd_mempool_add_destructor (src->pool, rspamd_ptr_array_free_hard,
 				chain->languages);
-		chain->utf = rspamd_mempool_strdup (cfg->cfg_pool, ucs->utf);
-		elt = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (*elt));
+		chain->utf = rspamd_mempool_strdup (src->pool, ucs->utf);
+		elt = rspamd_mempool_alloc (src->pool, sizeof (*elt));
 		elt->elt = lelt;
 		elt->prob = ((gdouble)freq) / ((gdouble)total);
 		g_ptr_array_add (chain->languages, elt);
 
 		if (len == 1) {
-			k = kh_put (rspamd_unigram_hash, d->unigramms, ucs->s, &i);
-			kh_value (d->unigramms, k) = *chain;
+			k = kh_put (rspamd_unigram_hash, src->unigramms, ucs->s, &i);
+			kh_value (src->unigramms, k) = *chain;
 		}
 		else {
-			k = kh_put (rspamd_trigram_hash, d->trigramms, ucs->s, &i);
-			kh_value (d->trigramms, k) = *chain;
+			k = kh_put (rspamd_trigram_hash, src->trigramms, ucs->s, &i);
+			kh_value (src->trigramms, k) = *chain;
 		}
 	}
 	else {
@@ -292,7 +360,7 @@ rspamd_language_detector_init_ngramm (struct rspamd_config *cfg,
 		}
 
 		if (!found) {
-			elt = rspamd_mempool_alloc (cfg->cfg_pool, sizeof (*elt));
+			elt = rspamd_mempool_alloc (src->pool, sizeof (*elt));
 			elt->elt = lelt;
 			elt->prob = ((gdouble)freq) / ((gdouble)total);
 			g_ptr_array_add (chain->languages, elt);
@@ -342,6 +410,7 @@ rspamd_language_detector_cmp_ngramm (gconstpointer a, gconstpointer b)
 static void
 rspamd_language_detector_read_file (struct rspamd_config *cfg,
 		struct rspamd_lang_detector *d,
+		struct rspamd_language_sources *src,
 		const gchar *path)
 {
 	struct ucl_parser *parser;
@@ -377,6 +446,13 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 		return;
 	}
 
+	if (d->languages->len >= RSPAMD_LANGDET_MAX_LANGUAGES) {
+		msg_warn_config ("cannot load %s: too many languages", path);
+		ucl_object_unref (top);
+
+		return;
+	}
+
 	pos = strrchr (path, '/');
 	g_assert (pos != NULL);
 	nelt = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*nelt));
@@ -386,6 +462,13 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 	g_assert (pos != NULL);
 	*pos = '\0';
 
+	if (strlen (nelt->name) >= RSPAMD_LANGDET_NAME_LEN) {
+		msg_warn_config ("cannot load %s: too long language name", path);
+		ucl_object_unref (top);
+
+		return;
+	}
+
 	n_words = ucl_object_lookup (top, "n_words");
 
 	if (n_words == NULL || ucl_object_type (n_words) != UCL_ARRAY ||
@@ -451,7 +534,7 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 			m2 += delta * delta2;
 
 			if (key != NULL) {
-				ucs_elt = rspamd_mempool_alloc (cfg->cfg_pool,
+				ucs_elt = rspamd_mempool_alloc (src->pool,
 						sizeof (*ucs_elt) + (keylen + 1) * sizeof (UChar));
 
 				nsym = ucnv_toUChars (d->uchar_converter,
@@ -523,7 +606,7 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 
 		PTR_ARRAY_FOREACH (ngramms, i, ucs_elt) {
 			if (ucs_elt->freq > 0) {
-				rspamd_language_detector_init_ngramm (cfg, d,
+				rspamd_language_detector_init_ngramm (src,
 						nelt, ucs_elt, nsym,
 						ucs_elt->freq, total);
 			}
@@ -556,6 +639,7 @@ rspamd_language_detector_read_file (struct rspamd_config *cfg,
 				rspamd_language_detector_print_flags (nelt));
 	}
 
+	nelt->id = d->languages->len;
 	g_ptr_array_add (d->languages, nelt);
 	ucl_object_unref (top);
 }
@@ -623,6 +707,542 @@ rspamd_language_detector_process_chain (struct rspamd_config *cfg,
 	}
 }
 
+static inline guint64
+rspamd_language_detector_ngramm_key (const UChar *s, guint len)
+{
+	if (len == 1) {
+		return s[0];
+	}
+
+	/* Trigramms are distinguished from unigramms by the bit 48 */
+	return (1ULL << 48) | ((guint64)s[0]) | ((guint64)s[1] << 16) |
+			((guint64)s[2] << 32);
+}
+
+static inline guint64
+rspamd_language_detector_ngramm_hash (guint64 key, guint64 seed)
+{
+	return rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			&key, sizeof (key), seed);
+}
+
+static inline guint32
+rspamd_language_detector_ngramm_bucket (guint64 h, guint32 nbuckets)
+{
+	return (h >> 32) % nbuckets;
+}
+
+static inline guint32
+rspamd_language_detector_ngramm_slot (guint64 h, guint32 displacement,
+		guint32 nkeys)
+{
+	/* Murmur3 finalizer, each displacement gives an independent slot */
+	h += displacement * 0x9E3779B97F4A7C15ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h % nkeys;
+}
+
+static inline guint32
+rspamd_language_detector_ngramm_entry (guint id, gdouble prob)
+{
+	gdouble q;
+
+	q = round ((RSPAMD_LANGDET_PROB_BIAS - log2 (prob)) *
+			RSPAMD_LANGDET_PROB_SCALE);
+	q = CLAMP (q, 0, 0xffffff);
+
+	return ((guint32)q) << 8 | id;
+}
+
+static inline gdouble
+rspamd_language_detector_entry_prob (const struct rspamd_ngramm_tables *t,
+		guint32 entry)
+{
+	return t->prob_exp[entry >> 24] * t->prob_hi[(entry >> 16) & 0xff] *
+			t->prob_lo[(entry >> 8) & 0xff];
+}
+
+static void
+rspamd_language_detector_init_probs (struct rspamd_ngramm_tables *t)
+{
+	guint i;
+
+	for (i = 0; i < 256; i ++) {
+		t->prob_exp[i] = exp2 (RSPAMD_LANGDET_PROB_BIAS - i);
+		t->prob_hi[i] = exp2 (-(gdouble)i / 256.0);
+		t->prob_lo[i] = exp2 (-(gdouble)i / RSPAMD_LANGDET_PROB_SCALE);
+	}
+}
+
+static inline const guint32 *
+rspamd_language_detector_ngramm_lookup (const struct rspamd_ngramm_tables *t,
+		guint64 key, guint *nentries)
+{
+	const struct rspamd_ngramm_tables_header *hdr = t->hdr;
+	guint64 h;
+	guint32 slot;
+
+	if (hdr->nkeys == 0) {
+		return NULL;
+	}
+
+	h = rspamd_language_detector_ngramm_hash (key, hdr->seed);
+	slot = rspamd_language_detector_ngramm_slot (h,
+			t->displacements[rspamd_language_detector_ngramm_bucket (h,
+					hdr->nbuckets)],
+			hdr->nkeys);
+
+	if (t->keys[slot] != key) {
+		return NULL;
+	}
+
+	*nentries = t->offsets[slot + 1] - t->offsets[slot];
+
+	return &t->entries[t->offsets[slot]];
+}
+
+static gsize
+rspamd_language_detector_tables_size (guint64 nlangs, guint64 nkeys,
+		guint64 nbuckets, guint64 nentries)
+{
+	return sizeof (struct rspamd_ngramm_tables_header) +
+			nlangs * sizeof (struct rspamd_ngramm_tables_lang) +
+			nkeys * sizeof (guint64) +
+			(nkeys + 1) * sizeof (guint32) +
+			nbuckets * sizeof (guint32) +
+			nentries * sizeof (guint32);
+}
+
+/*
+ * Sets pointers to the tables sections, data must have the size computed by
+ * `rspamd_language_detector_tables_size`
+ */
+static void
+rspamd_language_detector_tables_setup (struct rspamd_ngramm_tables *t,
+		gpointer data, gsize len)
+{
+	guchar *p = data;
+
+	t->hdr = data;
+	p += sizeof (*t->hdr);
+	t->langs = (const struct rspamd_ngramm_tables_lang *)p;
+	p += t->hdr->nlangs * sizeof (*t->langs);
+	t->keys = (const guint64 *)p;
+	p += t->hdr->nkeys * sizeof (guint64);
+	t->offsets = (const guint32 *)p;
+	p += (t->hdr->nkeys + 1) * sizeof (guint32);
+	t->displacements = (const guint32 *)p;
+	p += t->hdr->nbuckets * sizeof (guint32);
+	t->entries = (const guint32 *)p;
+	t->data = data;
+	t->len = len;
+	rspamd_language_detector_init_probs (t);
+}
+
+/* Checks untrusted tables, so lookups cannot go out of bounds */
+static gboolean
+rspamd_language_detector_tables_check (gpointer data, gsize len)
+{
+	const struct rspamd_ngramm_tables_header *hdr = data;
+	struct rspamd_ngramm_tables t;
+	guint i;
+
+	if (len < sizeof (*hdr) ||
+			memcmp (hdr->magic, RSPAMD_LANGDET_MAGIC, sizeof (hdr->magic)) != 0) {
+		return FALSE;
+	}
+
+	if (hdr->nlangs > RSPAMD_LANGDET_MAX_LANGUAGES ||
+			(hdr->nkeys > 0 && hdr->nbuckets == 0) ||
+			rspamd_language_detector_tables_size (hdr->nlangs, hdr->nkeys,
+					hdr->nbuckets, hdr->nentries) != len) {
+		return FALSE;
+	}
+
+	rspamd_language_detector_tables_setup (&t, data, len);
+
+	for (i = 0; i < hdr->nlangs; i ++) {
+		if (memchr (t.langs[i].name, '\0', sizeof (t.langs[i].name)) == NULL) {
+			return FALSE;
+		}
+	}
+
+	if (t.offsets[0] != 0 || t.offsets[hdr->nkeys] != hdr->nentries) {
+		return FALSE;
+	}
+
+	for (i = 0; i < hdr->nkeys; i ++) {
+		if (t.offsets[i] > t.offsets[i + 1]) {
+			return FALSE;
+		}
+	}
+
+	for (i = 0; i < hdr->nentries; i ++) {
+		if ((t.entries[i] & 0xff) >= hdr->nlangs) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Builds minimal perfect hash: buckets are placed starting from the largest
+ * ones, for each bucket we search for a displacement that moves all its keys
+ * to free slots
+ */
+static gboolean
+rspamd_language_detector_build_mph (const guint64 *hashes, guint32 nkeys,
+		guint32 nbuckets, guint32 *displacements, guint32 *slots)
+{
+	guint32 *bucket_start, *bucket_keys, *pos, *cur_slots;
+	guint32 i, j, b, s, size, max_size = 0, disp;
+	guchar *taken;
+	gboolean ret = TRUE;
+
+	bucket_start = g_malloc0 ((nbuckets + 1) * sizeof (*bucket_start));
+
+	for (i = 0; i < nkeys; i ++) {
+		bucket_start[rspamd_language_detector_ngramm_bucket (hashes[i],
+				nbuckets) + 1] ++;
+	}
+
+	for (b = 0; b < nbuckets; b ++) {
+		max_size = MAX (max_size, bucket_start[b + 1]);
+		bucket_start[b + 1] += bucket_start[b];
+	}
+
+	pos = g_malloc (nbuckets * sizeof (*pos));
+	memcpy (pos, bucket_start, nbuckets * sizeof (*pos));
+	bucket_keys = g_malloc (nkeys * sizeof (*bucket_keys));
+
+	for (i = 0; i < nkeys; i ++) {
+		b = rspamd_language_detector_ngramm_bucket (hashes[i], nbuckets);
+		bucket_keys[pos[b] ++] = i;
+	}
+
+	taken = g_malloc0 (nkeys);
+	cur_slots = g_malloc (MAX (max_size, 1) * sizeof (*cur_slots));
+
+	for (size = max_size; size > 0 && ret; size --) {
+		for (b = 0; b < nbuckets && ret; b ++) {
+			if (bucket_start[b + 1] - bucket_start[b] != size) {
+				continue;
+			}
+
+			for (disp = 0; disp < RSPAMD_LANGDET_MAX_DISPLACEMENT; disp ++) {
+				for (j = 0; j < size; j ++) {
+					s = rspamd_language_detector_ngramm_slot (
+							hashes[bucket_keys[bucket_start[b] + j]],
+							disp, nkeys);
+
+					if (taken[s]) {
+						break;
+					}
+
+					taken[s] = 1;
+					cur_slots[j] = s;
+				}
+
+				if (j == size) {
+					break;
+				}
+
+				/* Release slots taken by this attempt */
+				while (j > 0) {
+					taken[cur_slots[-- j]] = 0;
+				}
+			}
+
+			if (disp == RSPAMD_LANGDET_MAX_DISPLACEMENT) {
+				ret = FALSE;
+			}
+			else {
+				displacements[b] = disp;
+
+				for (j = 0; j < size; j ++) {
+					slots[bucket_keys[bucket_start[b] + j]] = cur_slots[j];
+				}
+			}
+		}
+	}
+
+	g_free (bucket_start);
+	g_free (pos);
+	g_free (bucket_keys);
+	g_free (taken);
+	g_free (cur_slots);
+
+	return ret;
+}
+
+static gboolean
+rspamd_language_detector_build_tables (struct rspamd_config *cfg,
+		struct rspamd_lang_detector *d,
+		struct rspamd_language_sources *src,
+		const guchar *digest)
+{
+	struct rspamd_ngramm_tables_header *hdr;
+	struct rspamd_ngramm_tables_lang *lrec;
+	struct rspamd_language_elt *lelt;
+	struct rspamd_ngramm_elt *elt;
+	struct rspamd_ngramm_chain chain;
+	struct rspamd_ngramm_tables t;
+	GPtrArray **chains;
+	const UChar *ngramm;
+	guint64 *keys, *hashes, seed = 0, *out_keys;
+	guint32 *slots, *displacements, *offsets, *entries, nkeys, nbuckets;
+	guint32 nentries = 0, i, j, n = 0;
+	gpointer data;
+	gsize len;
+	gboolean built = FALSE;
+
+	nkeys = kh_size (src->unigramms) + kh_size (src->trigramms);
+	nbuckets = nkeys / 4 + 1;
+	keys = g_malloc (MAX (nkeys, 1) * sizeof (*keys));
+	chains = g_malloc (MAX (nkeys, 1) * sizeof (*chains));
+
+	kh_foreach (src->unigramms, ngramm, chain, {
+		keys[n] = rspamd_language_detector_ngramm_key (ngramm, 1);
+		chains[n ++] = chain.languages;
+		nentries += chain.languages->len;
+	});
+	kh_foreach (src->trigramms, ngramm, chain, {
+		keys[n] = rspamd_language_detector_ngramm_key (ngramm, 3);
+		chains[n ++] = chain.languages;
+		nentries += chain.languages->len;
+	});
+
+	hashes = g_malloc (MAX (nkeys, 1) * sizeof (*hashes));
+	slots = g_malloc (MAX (nkeys, 1) * sizeof (*slots));
+	displacements = g_malloc (nbuckets * sizeof (*displacements));
+
+	/* Almost always the first seed is fine */
+	for (seed = 0; seed < 16 && !built; seed ++) {
+		for (i = 0; i < nkeys; i ++) {
+			hashes[i] = rspamd_language_detector_ngramm_hash (keys[i], seed);
+		}
+
+		memset (displacements, 0, nbuckets * sizeof (*displacements));
+		built = rspamd_language_detector_build_mph (hashes, nkeys, nbuckets,
+				displacements, slots);
+	}
+
+	if (!built) {
+		msg_err_config ("cannot build perfect hash for %d ngramms", (gint)nkeys);
+		g_free (keys);
+		g_free (chains);
+		g_free (hashes);
+		g_free (slots);
+		g_free (displacements);
+
+		return FALSE;
+	}
+
+	len = rspamd_language_detector_tables_size (d->languages->len, nkeys,
+			nbuckets, nentries);
+	data = g_malloc0 (len);
+	hdr = data;
+	memcpy (hdr->magic, RSPAMD_LANGDET_MAGIC, sizeof (hdr->magic));
+	hdr->nlangs = d->languages->len;
+	hdr->nkeys = nkeys;
+	hdr->nbuckets = nbuckets;
+	hdr->nentries = nentries;
+	hdr->seed = seed - 1;
+	memcpy (hdr->digest, digest, sizeof (hdr->digest));
+	rspamd_language_detector_tables_setup (&t, data, len);
+
+	PTR_ARRAY_FOREACH (d->languages, i, lelt) {
+		lrec = (struct rspamd_ngramm_tables_lang *)&t.langs[i];
+		rspamd_strlcpy (lrec->name, lelt->name, sizeof (lrec->name));
+		lrec->flags = lelt->flags;
+		lrec->ngramms_total = lelt->ngramms_total;
+		lrec->unigramms_words = lelt->unigramms_words;
+		lrec->trigramms_words = lelt->trigramms_words;
+		lrec->mean = lelt->mean;
+		lrec->std = lelt->std;
+	}
+
+	out_keys = (guint64 *)t.keys;
+	offsets = (guint32 *)t.offsets;
+	entries = (guint32 *)t.entries;
+	memcpy ((guint32 *)t.displacements, displacements,
+			nbuckets * sizeof (*displacements));
+
+	/* Count entries per slot and convert counts to offsets */
+	for (i = 0; i < nkeys; i ++) {
+		out_keys[slots[i]] = keys[i];
+		offsets[slots[i] + 1] = chains[i]->len;
+	}
+
+	for (i = 0; i < nkeys; i ++) {
+		offsets[i + 1] += offsets[i];
+	}
+
+	for (i = 0; i < nkeys; i ++) {
+		n = offsets[slots[i]];
+
+		PTR_ARRAY_FOREACH (chains[i], j, elt) {
+			entries[n ++] = rspamd_language_detector_ngramm_entry (elt->elt->id,
+					elt->prob);
+		}
+	}
+
+	d->ngramms = t;
+	g_free (keys);
+	g_free (chains);
+	g_free (hashes);
+	g_free (slots);
+	g_free (displacements);
+
+	return TRUE;
+}
+
+/* Creates languages stored in compiled tables */
+static void
+rspamd_language_detector_tables_languages (struct rspamd_config *cfg,
+		struct rspamd_lang_detector *d)
+{
+	const struct rspamd_ngramm_tables_lang *lrec;
+	const struct rspamd_language_unicode_match *uc_match;
+	struct rspamd_language_elt *nelt;
+	guint i;
+
+	for (i = 0; i < d->ngramms.hdr->nlangs; i ++) {
+		lrec = &d->ngramms.langs[i];
+		nelt = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*nelt));
+		nelt->name = rspamd_mempool_strdup (cfg->cfg_pool, lrec->name);
+		nelt->flags = lrec->flags;
+		nelt->ngramms_total = lrec->ngramms_total;
+		nelt->unigramms_words = lrec->unigramms_words;
+		nelt->trigramms_words = lrec->trigramms_words;
+		nelt->mean = lrec->mean;
+		nelt->std = lrec->std;
+		nelt->id = i;
+
+		if ((nelt->flags & RS_LANGUAGE_UNISCRIPT) &&
+				(uc_match = rspamd_language_search_unicode_match (nelt->name,
+						unicode_langs, G_N_ELEMENTS (unicode_langs))) != NULL) {
+			g_hash_table_insert (d->unicode_scripts,
+					(gpointer)&uc_match->unicode_code, nelt);
+		}
+
+		g_ptr_array_add (d->languages, nelt);
+	}
+}
+
+static gboolean
+rspamd_language_detector_load_tables (struct rspamd_config *cfg,
+		struct rspamd_lang_detector *d,
+		const gchar *path,
+		const guchar *digest)
+{
+	const struct rspamd_ngramm_tables_header *hdr;
+	gpointer map;
+	gsize len;
+
+	map = rspamd_file_xmap (path, PROT_READ, &len, TRUE);
+
+	if (map == NULL) {
+		msg_info_config ("cannot map compiled languages %s: %s, "
+				"load languages data", path, strerror (errno));
+
+		return FALSE;
+	}
+
+	if (!rspamd_language_detector_tables_check (map, len)) {
+		msg_warn_config ("invalid compiled languages %s, load languages data",
+				path);
+		munmap (map, len);
+
+		return FALSE;
+	}
+
+	hdr = map;
+
+	if (memcmp (hdr->digest, digest, sizeof (hdr->digest)) != 0) {
+		msg_warn_config ("compiled languages %s do not match languages data, "
+				"load languages data", path);
+		munmap (map, len);
+
+		return FALSE;
+	}
+
+	rspamd_language_detector_tables_setup (&d->ngramms, map, len);
+	d->ngramms.mmaped = TRUE;
+	rspamd_language_detector_tables_languages (cfg, d);
+	msg_info_config ("loaded compiled languages from %s", path);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_language_detector_load_sources (struct rspamd_config *cfg,
+		struct rspamd_lang_detector *d,
+		GPtrArray *files,
+		const guchar *digest)
+{
+	struct rspamd_language_sources src;
+	struct rspamd_ngramm_chain *chain, schain;
+	const gchar *fname;
+	guint i;
+	gboolean ret;
+
+	src.pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "langdet");
+	/* Map from ngramm in ucs32 to GPtrArray of rspamd_language_elt */
+	src.unigramms = kh_init (rspamd_unigram_hash);
+	src.trigramms = kh_init (rspamd_trigram_hash);
+
+	PTR_ARRAY_FOREACH (files, i, fname) {
+		rspamd_language_detector_read_file (cfg, d, &src, fname);
+	}
+
+	kh_foreach_value (src.trigramms, schain, {
+		chain = &schain;
+		rspamd_language_detector_process_chain (cfg, chain);
+	});
+
+	ret = rspamd_language_detector_build_tables (cfg, d, &src, digest);
+
+	kh_destroy (rspamd_unigram_hash, src.unigramms);
+	kh_destroy (rspamd_trigram_hash, src.trigramms);
+	rspamd_mempool_delete (src.pool);
+
+	return ret;
+}
+
+/* Digest of enabled languages files, compiled tables are valid for it only */
+static void
+rspamd_language_detector_sources_digest (GPtrArray *files, guchar *digest)
+{
+	rspamd_cryptobox_hash_state_t st;
+	const gchar *fname, *base;
+	gpointer map;
+	gsize len;
+	guint i;
+
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+
+	PTR_ARRAY_FOREACH (files, i, fname) {
+		base = strrchr (fname, '/');
+		base = base ? base + 1 : fname;
+		rspamd_cryptobox_hash_update (&st, base, strlen (base) + 1);
+		map = rspamd_file_xmap (fname, PROT_READ, &len, TRUE);
+
+		if (map != NULL) {
+			rspamd_cryptobox_hash_update (&st, map, len);
+			munmap (map, len);
+		}
+	}
+
+	rspamd_cryptobox_hash_final (&st, digest);
+}
+
 static void
 rspamd_language_detector_dtor (struct rspamd_lang_detector *d)
 {
@@ -635,12 +1255,13 @@ rspamd_language_detector_dtor (struct rspamd_lang_detector *d)
 			g_hash_table_unref (d->unicode_scripts);
 		}
 
-		if (d->unigramms) {
-			kh_destroy (rspamd_unigram_hash, d->unigramms);
-		}
-
-		if (d->trigramms) {
-			kh_destroy (rspamd_trigram_hash, d->trigramms);
+		if (d->ngramms.data) {
+			if (d->ngramms.mmaped) {
+				munmap (d->ngramms.data, d->ngramms.len);
+			}
+			else {
+				g_free (d->ngramms.data);
+			}
 		}
 
 		if (d->languages) {
@@ -654,12 +1275,14 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 {
 	const ucl_object_t *section, *elt, *languages_enable = NULL,
 			*languages_disable = NULL;
-	const gchar *languages_path = default_languages_path;
+	const gchar *languages_path = default_languages_path,
+			*compiled_path = NULL;
 	glob_t gl;
 	size_t i, short_text_limit = default_short_text_limit;
 	UErrorCode uc_err = U_ZERO_ERROR;
 	GString *languages_pattern;
-	struct rspamd_ngramm_chain *chain, schain;
+	GPtrArray *files;
+	guchar digest[rspamd_cryptobox_HASHBYTES];
 	gchar *fname;
 	struct rspamd_lang_detector *ret = NULL;
 
@@ -672,6 +1295,12 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 			languages_path = ucl_object_tostring (elt);
 		}
 
+		elt = ucl_object_lookup (section, "compiled");
+
+		if (elt) {
+			compiled_path = ucl_object_tostring (elt);
+		}
+
 		elt = ucl_object_lookup (section, "short_text_limit");
 
 		if (elt) {
@@ -691,16 +1320,7 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 		goto end;
 	}
 
-	ret = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*ret));
-	ret->languages = g_ptr_array_sized_new (gl.gl_pathc);
-	ret->uchar_converter = ucnv_open ("UTF-8", &uc_err);
-	ret->short_text_limit = short_text_limit;
-	/* Map from ngramm in ucs32 to GPtrArray of rspamd_language_elt */
-	ret->unigramms = kh_init (rspamd_unigram_hash);
-	ret->trigramms = kh_init (rspamd_trigram_hash);
-	ret->unicode_scripts = g_hash_table_new (g_int_hash, g_int_equal);
-
-	g_assert (uc_err == U_ZERO_ERROR);
+	files = g_ptr_array_sized_new (gl.gl_pathc);
 
 	for (i = 0; i < gl.gl_pathc; i ++) {
 		fname = g_path_get_basename (gl.gl_pathv[i]);
@@ -708,7 +1328,7 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 		if (!rspamd_ucl_array_find_str (fname, languages_disable) ||
 				(languages_enable == NULL ||
 						rspamd_ucl_array_find_str (fname, languages_enable))) {
-			rspamd_language_detector_read_file (cfg, ret, gl.gl_pathv[i]);
+			g_ptr_array_add (files, gl.gl_pathv[i]);
 		}
 		else {
 			msg_info_config ("skip language file %s: disabled", fname);
@@ -717,18 +1337,37 @@ rspamd_language_detector_init (struct rspamd_config *cfg)
 		g_free (fname);
 	}
 
-	kh_foreach_value (ret->trigramms, schain, {
-		chain = &schain;
-		rspamd_language_detector_process_chain (cfg, chain);
-	});
+	ret = rspamd_mempool_alloc0 (cfg->cfg_pool, sizeof (*ret));
+	ret->languages = g_ptr_array_sized_new (files->len);
+	ret->uchar_converter = ucnv_open ("UTF-8", &uc_err);
+	ret->short_text_limit = short_text_limit;
+	ret->unicode_scripts = g_hash_table_new (g_int_hash, g_int_equal);
+
+	g_assert (uc_err == U_ZERO_ERROR);
+
+	rspamd_language_detector_sources_digest (files, digest);
+
+	if (compiled_path == NULL ||
+			!rspamd_language_detector_load_tables (cfg, ret, compiled_path,
+					digest)) {
+		if (!rspamd_language_detector_load_sources (cfg, ret, files, digest)) {
+			rspamd_language_detector_dtor (ret);
+			g_ptr_array_free (files, TRUE);
+			ret = NULL;
+
+			goto end;
+		}
+	}
+
+	g_ptr_array_free (files, TRUE);
 
 	msg_info_config ("loaded %d languages, %d unicode only languages, "
-			"%d unigramms, "
-			"%d trigramms",
+			"%d ngramms, %d ngramms entries, %z bytes of tables",
 			(gint)ret->languages->len,
 			(gint)g_hash_table_size (ret->unicode_scripts),
-			(gint)kh_size (ret->unigramms),
-			(gint)kh_size (ret->trigramms));
+			(gint)ret->ngramms.hdr->nkeys,
+			(gint)ret->ngramms.hdr->nentries,
+			ret->ngramms.len);
 
 	REF_INIT_RETAIN (ret, rspamd_language_detector_dtor);
 	rspamd_mempool_add_destructor (cfg->cfg_pool,
@@ -745,6 +1384,68 @@ end:
 	return ret;
 }
 
+static GQuark
+rspamd_language_detector_quark (void)
+{
+	return g_quark_from_static_string ("lang-detector");
+}
+
+gboolean
+rspamd_language_detector_save (struct rspamd_lang_detector *d,
+		const gchar *path, GError **err)
+{
+	gchar tmp_path[PATH_MAX];
+	const guchar *p;
+	gsize remain;
+	gssize r;
+	gint fd;
+
+	rspamd_snprintf (tmp_path, sizeof (tmp_path), "%s.new", path);
+	fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_language_detector_quark (), errno,
+				"cannot open %s: %s", tmp_path, strerror (errno));
+
+		return FALSE;
+	}
+
+	p = d->ngramms.data;
+	remain = d->ngramms.len;
+
+	while (remain > 0) {
+		r = write (fd, p, remain);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			g_set_error (err, rspamd_language_detector_quark (), errno,
+					"cannot write %s: %s", tmp_path, strerror (errno));
+			close (fd);
+			unlink (tmp_path);
+
+			return FALSE;
+		}
+
+		p += r;
+		remain -= r;
+	}
+
+	close (fd);
+
+	if (rename (tmp_path, path) == -1) {
+		g_set_error (err, rspamd_language_detector_quark (), errno,
+				"cannot rename %s to %s: %s", tmp_path, path, strerror (errno));
+		unlink (tmp_path);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 
 void
 rspamd_language_detector_to_ucs (struct rspamd_lang_detector *d,
@@ -912,68 +1613,25 @@ rspamd_language_detector_next_ngramm (rspamd_stat_token_t *tok, UChar *window,
 /*
  * Do full guess for a specific ngramm, checking all languages defined
  */
-static void
-rspamd_language_detector_process_ngramm_full (struct rspamd_task *task,
-		struct rspamd_lang_detector *d,
+static inline void
+rspamd_language_detector_process_ngramm_full (struct rspamd_lang_detector *d,
 		UChar *window, enum rspamd_language_gramm_type type,
-		khash_t(rspamd_candidates_hash) *candidates)
+		gdouble *scores)
 {
-	guint i;
-	gint ret;
-	struct rspamd_ngramm_chain *chain = NULL;
-	struct rspamd_ngramm_elt *elt;
-	struct rspamd_lang_detector_res *cand;
-	khiter_t k;
-	gdouble prob;
-
-	switch (type) {
-	case rs_unigramm:
-		k = kh_get (rspamd_unigram_hash, d->unigramms, window);
-		if (k != kh_end (d->unigramms)) {
-			chain = &kh_value (d->unigramms, k);
-		}
-		break;
-	case rs_trigramm:
-		k = kh_get (rspamd_trigram_hash, d->trigramms, window);
-		if (k != kh_end (d->trigramms)) {
-			chain = &kh_value (d->trigramms, k);
-		}
-		break;
-	}
-
-	if (chain) {
-		PTR_ARRAY_FOREACH (chain->languages, i, elt) {
-			prob = elt->prob;
-
-			if (prob < chain->mean) {
-				continue;
-			}
-
-			k = kh_get (rspamd_candidates_hash, candidates, elt->elt->name);
-			if (k != kh_end (candidates)) {
-				cand = kh_value (candidates, k);
-			}
-			else {
-				cand = NULL;
-			}
-
-#ifdef NGRAMMS_DEBUG
-			msg_err ("gramm: %s, lang: %s, prob: %.3f", chain->utf,
-					elt->elt->name, log2 (elt->prob));
-#endif
-			if (cand == NULL) {
-				cand = rspamd_mempool_alloc (task->task_pool, sizeof (*cand));
-				cand->elt = elt->elt;
-				cand->lang = elt->elt->name;
-				cand->prob = prob;
-
-				k = kh_put (rspamd_candidates_hash, candidates, elt->elt->name,
-						&ret);
-				kh_value (candidates, k) = cand;
-			} else {
-				/* Update guess */
-				cand->prob += prob;
-			}
+	const guint32 *entries;
+	guint i, nentries;
+	guint64 key;
+
+	key = rspamd_language_detector_ngramm_key (window,
+			type == rs_unigramm ? 1 : 3);
+	entries = rspamd_language_detector_ngramm_lookup (&d->ngramms, key,
+			&nentries);
+
+	if (entries) {
+		for (i = 0; i < nentries; i ++) {
+			scores[entries[i] & 0xff] +=
+					rspamd_language_detector_entry_prob (&d->ngramms,
+							entries[i]);
 		}
 	}
 }
@@ -982,7 +1640,7 @@ static void
 rspamd_language_detector_detect_word (struct rspamd_task *task,
 		struct rspamd_lang_detector *d,
 		rspamd_stat_token_t *tok,
-		khash_t(rspamd_candidates_hash) *candidates,
+		gdouble *scores,
 		enum rspamd_language_gramm_type type)
 {
 	guint wlen;
@@ -1001,8 +1659,44 @@ rspamd_language_detector_detect_word (struct rspamd_task *task,
 	/* Split words */
 	while ((cur = rspamd_language_detector_next_ngramm (tok, window, wlen, cur))
 			!= -1) {
-		rspamd_language_detector_process_ngramm_full (task,
-				d, window, type, candidates);
+		rspamd_language_detector_process_ngramm_full (d, window, type, scores);
+	}
+}
+
+/* Moves accumulated scores of languages to candidates */
+static void
+rspamd_language_detector_add_scores (struct rspamd_task *task,
+		struct rspamd_lang_detector *d,
+		const gdouble *scores,
+		khash_t(rspamd_candidates_hash) *candidates)
+{
+	struct rspamd_language_elt *elt;
+	struct rspamd_lang_detector_res *cand;
+	khiter_t k;
+	guint i;
+	gint ret;
+
+	PTR_ARRAY_FOREACH (d->languages, i, elt) {
+		if (scores[i] == 0) {
+			continue;
+		}
+
+		k = kh_get (rspamd_candidates_hash, candidates, elt->name);
+
+		if (k != kh_end (candidates)) {
+			cand = kh_value (candidates, k);
+			/* Update guess */
+			cand->prob += scores[i];
+		}
+		else {
+			cand = rspamd_mempool_alloc (task->task_pool, sizeof (*cand));
+			cand->elt = elt;
+			cand->lang = elt->name;
+			cand->prob = scores[i];
+
+			k = kh_put (rspamd_candidates_hash, candidates, elt->name, &ret);
+			kh_value (candidates, k) = cand;
+		}
 	}
 }
 
@@ -1159,6 +1853,7 @@ rspamd_language_detector_detect_type (struct rspamd_task *task,
 	guint nparts = MIN (ucs_tokens->len, nwords);
 	goffset *selected_words;
 	rspamd_stat_token_t *tok;
+	gdouble scores[RSPAMD_LANGDET_MAX_LANGUAGES];
 	guint i;
 
 	selected_words = g_new0 (goffset, nparts);
@@ -1170,13 +1865,16 @@ rspamd_language_detector_detect_type (struct rspamd_task *task,
 			!rspamd_language_detector_is_unicode (task, d, ucs_tokens,
 					selected_words, nparts, candidates)) {
 
+		memset (scores, 0, sizeof (scores[0]) * d->languages->len);
+
 		for (i = 0; i < nparts; i++) {
 			tok = &g_array_index (ucs_tokens, rspamd_stat_token_t,
 					selected_words[i]);
-			rspamd_language_detector_detect_word (task, d, tok, candidates,
-					type);
+			rspamd_language_detector_detect_word (task, d, tok, scores, type);
 		}
 
+		rspamd_language_detector_add_scores (task, d, scores, candidates);
+
 		/* Filter negligible candidates */
 		rspamd_language_detector_filter_negligible (task, candidates);
 	}
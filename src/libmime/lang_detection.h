@@ -38,6 +38,17 @@ struct rspamd_lang_detector_res {
  */
 struct rspamd_lang_detector* rspamd_language_detector_init (struct rspamd_config *cfg);
 
+/**
+ * Write compiled n-gramms tables of detector to the file, it could be loaded
+ * by using `compiled` option of `lang_detection` section
+ * @param d
+ * @param path
+ * @param err
+ * @return TRUE if tables have been saved
+ */
+gboolean rspamd_language_detector_save (struct rspamd_lang_detector *d,
+		const gchar *path, GError **err);
+
 struct rspamd_lang_detector* rspamd_language_detector_ref (struct rspamd_lang_detector* d);
 void rspamd_language_detector_unref (struct rspamd_lang_detector* d);
 
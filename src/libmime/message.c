@@ -595,6 +595,8 @@ static enum rspamd_action_type
 rspamd_check_gtube (struct rspamd_task *task, struct rspamd_mime_text_part *part)
 {
 	static const gsize max_check_size = 8 * 1024;
+	const gchar *data;
+	gsize len;
 	gint ret;
 	enum rspamd_action_type act = METRIC_ACTION_NOACTION;
 	g_assert (part != NULL);
@@ -615,10 +617,20 @@ rspamd_check_gtube (struct rspamd_task *task, struct rspamd_mime_text_part *part
 		g_assert (rspamd_multipattern_compile (gtube_matcher, NULL));
 	}
 
-	if (part->content && part->content->len >= sizeof (gtube_pattern_reject) &&
-			part->content->len <= max_check_size) {
-		if ((ret = rspamd_multipattern_lookup (gtube_matcher, part->content->data,
-				part->content->len,
+	/* Parts that have not been converted yet are checked as is */
+	if (part->content) {
+		data = (const gchar *)part->content->data;
+		len = part->content->len;
+	}
+	else {
+		data = part->parsed.begin;
+		len = part->parsed.len;
+	}
+
+	if (data && len >= sizeof (gtube_pattern_reject) &&
+			len <= max_check_size) {
+		if ((ret = rspamd_multipattern_lookup (gtube_matcher, data,
+				len,
 				rspamd_multipattern_gtube_cb, NULL, NULL)) > 0) {
 
 			switch (ret) {
@@ -637,9 +649,9 @@ rspamd_check_gtube (struct rspamd_task *task, struct rspamd_mime_text_part *part
 				task->flags |= RSPAMD_TASK_FLAG_SKIP;
 				task->flags |= RSPAMD_TASK_FLAG_GTUBE;
 				msg_info_task (
-						"<%s>: gtube %s pattern has been found in part of length %ud",
+						"<%s>: gtube %s pattern has been found in part of length %z",
 						task->message_id, rspamd_action_to_str (act),
-						part->content->len);
+						len);
 			}
 		}
 	}
@@ -661,7 +673,7 @@ rspamd_message_process_text_part (struct rspamd_task *task,
 {
 	struct rspamd_mime_text_part *text_part;
 	rspamd_ftok_t html_tok, xhtml_tok;
-	gboolean found_html = FALSE, found_txt = FALSE;
+	gboolean found_html = FALSE, found_txt = FALSE, lazy;
 	enum rspamd_action_type act;
 
 	if (IS_CT_TEXT (mime_part->ct)) {
@@ -739,88 +751,45 @@ rspamd_message_process_text_part (struct rspamd_task *task,
 		return;
 	}
 
-	if (found_html) {
-		text_part = rspamd_mempool_alloc0 (task->task_pool,
-				sizeof (struct rspamd_mime_text_part));
-		text_part->raw.begin = mime_part->raw_data.begin;
-		text_part->raw.len = mime_part->raw_data.len;
-		text_part->parsed.begin = mime_part->parsed_data.begin;
-		text_part->parsed.len = mime_part->parsed_data.len;
-		text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_HTML;
-		text_part->mime_part = mime_part;
-
-		if (mime_part->parsed_data.len == 0) {
-			text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_EMPTY;
-			g_ptr_array_add (task->text_parts, text_part);
-			return;
-		}
-
-		rspamd_mime_text_part_maybe_convert (task, text_part);
-
-		if (text_part->utf_raw_content == NULL) {
-			return;
-		}
-
-		text_part->html = rspamd_mempool_alloc0 (task->task_pool,
-				sizeof (*text_part->html));
-		text_part->mime_part = mime_part;
+	if (!found_html && !found_txt) {
+		return;
+	}
 
-		text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_BALANCED;
-		text_part->content = rspamd_html_process_part_full (
-				task->task_pool,
-				text_part->html,
-				text_part->utf_raw_content,
-				&text_part->exceptions,
-				task->urls,
-				task->emails);
+	text_part = rspamd_mempool_alloc0 (task->task_pool,
+			sizeof (struct rspamd_mime_text_part));
+	text_part->raw.begin = mime_part->raw_data.begin;
+	text_part->raw.len = mime_part->raw_data.len;
+	text_part->parsed.begin = mime_part->parsed_data.begin;
+	text_part->parsed.len = mime_part->parsed_data.len;
+	text_part->mime_part = mime_part;
+	text_part->task = task;
 
-		if (text_part->content->len == 0) {
-			text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_EMPTY;
-		}
+	if (found_html) {
+		text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_HTML;
+	}
 
-		rspamd_mempool_add_destructor (task->task_pool,
-			(rspamd_mempool_destruct_t) free_byte_array_callback,
-			text_part->content);
-		g_ptr_array_add (task->text_parts, text_part);
-	}
-	else if (found_txt) {
-		text_part =
-			rspamd_mempool_alloc0 (task->task_pool,
-				sizeof (struct rspamd_mime_text_part));
-		text_part->mime_part = mime_part;
-		text_part->raw.begin = mime_part->raw_data.begin;
-		text_part->raw.len = mime_part->raw_data.len;
-		text_part->parsed.begin = mime_part->parsed_data.begin;
-		text_part->parsed.len = mime_part->parsed_data.len;
-		text_part->mime_part = mime_part;
-
-		if (mime_part->parsed_data.len == 0) {
-			text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_EMPTY;
-			g_ptr_array_add (task->text_parts, text_part);
-			return;
-		}
+	g_ptr_array_add (task->text_parts, text_part);
 
-		rspamd_mime_text_part_maybe_convert (task, text_part);
+	if (mime_part->parsed_data.len == 0) {
+		text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_EMPTY;
+		text_part->stages = RSPAMD_MIME_TEXT_PART_STAGE_ALL;
 
-		if (text_part->utf_raw_content != NULL) {
-			/*
-			 * We ignore unconverted parts from now as it is dangerous
-			 * to treat them as text parts
-			 */
-			text_part->content = text_part->utf_raw_content;
-			g_ptr_array_add (task->text_parts, text_part);
-		}
-		else {
-			return;
-		}
-	}
-	else {
 		return;
 	}
 
-
 	mime_part->flags |= RSPAMD_MIME_PART_TEXT;
 	mime_part->specific.txt = text_part;
+	lazy = task->cfg && task->cfg->lazy_text_parts;
+
+	if (!lazy) {
+		/* Words are built after urls extraction in rspamd_message_process */
+		if (!IS_PART_HTML (text_part)) {
+			text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_BATCH_URLS;
+		}
+
+		rspamd_mime_text_part_process (task, text_part,
+				RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
+	}
 
 	act = rspamd_check_gtube (task, text_part);
 	if (act != METRIC_ACTION_NOACTION) {
@@ -848,26 +817,319 @@ rspamd_message_process_text_part (struct rspamd_task *task,
 		}
 
 		rspamd_task_insert_result (task, GTUBE_SYMBOL, 0, NULL);
+	}
+}
+
+static void
+rspamd_mime_text_part_sort_exceptions (struct rspamd_task *task,
+		struct rspamd_mime_text_part *text_part)
+{
+	if (text_part->exceptions) {
+		text_part->exceptions = g_list_sort (text_part->exceptions,
+				exceptions_compare_func);
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t)g_list_free,
+				text_part->exceptions);
+	}
+}
+
+/* Extracts urls from all parts deferred by the content stage in one pass */
+static void
+rspamd_message_extract_urls (struct rspamd_task *task)
+{
+	struct rspamd_mime_text_part *text_part;
+	GPtrArray *batch;
+	guint i;
+
+	batch = g_ptr_array_sized_new (task->text_parts->len);
+
+	PTR_ARRAY_FOREACH (task->text_parts, i, text_part) {
+		if (text_part->flags & RSPAMD_MIME_TEXT_PART_FLAG_BATCH_URLS) {
+			text_part->flags &= ~RSPAMD_MIME_TEXT_PART_FLAG_BATCH_URLS;
+
+			if (!IS_PART_EMPTY (text_part)) {
+				g_ptr_array_add (batch, text_part);
+			}
+		}
+	}
+
+	rspamd_url_text_extract_parts (task, batch);
+
+	PTR_ARRAY_FOREACH (batch, i, text_part) {
+		rspamd_mime_text_part_sort_exceptions (task, text_part);
+	}
+
+	g_ptr_array_free (batch, TRUE);
+}
+
+/* Charset conversion, html parsing, newlines stripping and urls extraction */
+static void
+rspamd_mime_text_part_process_content (struct rspamd_task *task,
+		struct rspamd_mime_text_part *text_part)
+{
+	rspamd_mime_text_part_maybe_convert (task, text_part);
+
+	if (text_part->utf_raw_content == NULL) {
+		/*
+		 * We ignore unconverted parts from now as it is dangerous
+		 * to treat them as text parts
+		 */
+		text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_EMPTY;
+		text_part->stages = RSPAMD_MIME_TEXT_PART_STAGE_ALL;
 
 		return;
 	}
 
+	if (IS_PART_HTML (text_part)) {
+		text_part->html = rspamd_mempool_alloc0 (task->task_pool,
+				sizeof (*text_part->html));
+		text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_BALANCED;
+		text_part->content = rspamd_html_process_part_full (
+				task->task_pool,
+				text_part->html,
+				text_part->utf_raw_content,
+				&text_part->exceptions,
+				task->urls,
+				task->emails);
+
+		if (text_part->content->len == 0) {
+			text_part->flags |= RSPAMD_MIME_TEXT_PART_FLAG_EMPTY;
+		}
+
+		rspamd_mempool_add_destructor (task->task_pool,
+				(rspamd_mempool_destruct_t) free_byte_array_callback,
+				text_part->content);
+	}
+	else {
+		text_part->content = text_part->utf_raw_content;
+	}
+
 	/* Post process part */
 	rspamd_normalize_text_part (task, text_part);
 
+	if (text_part->flags & RSPAMD_MIME_TEXT_PART_FLAG_BATCH_URLS) {
+		/* See rspamd_message_extract_urls */
+		return;
+	}
+
 	if (!IS_PART_HTML (text_part)) {
 		rspamd_url_text_extract (task->task_pool, task, text_part, FALSE);
 	}
 
-	if (text_part->exceptions) {
-		text_part->exceptions = g_list_sort (text_part->exceptions,
-				exceptions_compare_func);
-		rspamd_mempool_add_destructor (task->task_pool,
-				(rspamd_mempool_destruct_t)g_list_free,
-				text_part->exceptions);
+	rspamd_mime_text_part_sort_exceptions (task, text_part);
+}
+
+/* Detects languages of all text parts, alternative parts share language */
+static void
+rspamd_message_detect_languages (struct rspamd_task *task)
+{
+	struct rspamd_mime_text_part *p1, *p2, *text_part;
+	gdouble diff, *pdiff;
+	guint tw, *ptw, dw, i;
+
+	PTR_ARRAY_FOREACH (task->text_parts, i, text_part) {
+		rspamd_mime_text_part_process (task, text_part,
+				RSPAMD_MIME_TEXT_PART_STAGE_WORDS);
 	}
 
-	text_part->ucs_len = rspamd_mime_part_create_words (task, text_part);
+	/* Calculate distance for 2-parts messages */
+	if (task->text_parts->len == 2) {
+		p1 = g_ptr_array_index (task->text_parts, 0);
+		p2 = g_ptr_array_index (task->text_parts, 1);
+
+		/* First of all check parent object */
+		if (p1->mime_part->parent_part) {
+			rspamd_ftok_t srch;
+
+			srch.begin = "alternative";
+			srch.len = 11;
+
+			if (rspamd_ftok_cmp (&p1->mime_part->parent_part->ct->subtype, &srch) == 0) {
+				if (!IS_PART_EMPTY (p1) && !IS_PART_EMPTY (p2) &&
+					p1->normalized_hashes && p2->normalized_hashes) {
+					/*
+					 * We also detect language on one part and propagate it to
+					 * another one
+					 */
+					struct rspamd_mime_text_part *sel;
+
+					/* Prefer HTML as text part is not displayed normally */
+					if (IS_PART_HTML (p1)) {
+						sel = p1;
+					}
+					else if (IS_PART_HTML (p2)) {
+						sel = p2;
+					}
+					else {
+						if (p1->ucs_len > p2->ucs_len) {
+							sel = p1;
+						}
+						else {
+							sel = p2;
+						}
+					}
+
+					rspamd_mime_part_detect_language (task, sel, sel->ucs_len);
+
+					if (sel->language && sel->language[0]) {
+						/* Propagate language */
+						if (sel == p1) {
+							p2->language = sel->language;
+							p2->languages = g_ptr_array_ref (sel->languages);
+						}
+						else {
+							p1->language = sel->language;
+							p1->languages = g_ptr_array_ref (sel->languages);
+						}
+					}
+
+					tw = p1->normalized_hashes->len + p2->normalized_hashes->len;
+
+					if (tw > 0) {
+						dw = rspamd_words_levenshtein_distance (task,
+								p1->normalized_hashes,
+								p2->normalized_hashes);
+						diff = dw / (gdouble)tw;
+
+						msg_debug_task (
+								"different words: %d, total words: %d, "
+								"got diff between parts of %.2f",
+								dw, tw,
+								diff);
+
+						pdiff = rspamd_mempool_alloc (task->task_pool,
+								sizeof (gdouble));
+						*pdiff = diff;
+						rspamd_mempool_set_variable (task->task_pool,
+								"parts_distance",
+								pdiff,
+								NULL);
+						ptw = rspamd_mempool_alloc (task->task_pool,
+								sizeof (gint));
+						*ptw = tw;
+						rspamd_mempool_set_variable (task->task_pool,
+								"total_words",
+								ptw,
+								NULL);
+					}
+				}
+			}
+		}
+		else {
+			debug_task (
+					"message contains two parts but they are in different multi-parts");
+		}
+	}
+
+	PTR_ARRAY_FOREACH (task->text_parts, i, text_part) {
+		if (!text_part->language) {
+			rspamd_mime_part_detect_language (task, text_part, text_part->ucs_len);
+		}
+
+		text_part->stages |= RSPAMD_MIME_TEXT_PART_STAGE_LANGUAGE;
+	}
+}
+
+/* Calculate average words length and number of short words */
+static void
+rspamd_message_normalize_words (struct rspamd_task *task)
+{
+	struct rspamd_mime_text_part *text_part;
+	gdouble *var;
+	guint i, total_words = 0;
+
+	PTR_ARRAY_FOREACH (task->text_parts, i, text_part) {
+		rspamd_mime_text_part_process (task, text_part,
+				RSPAMD_MIME_TEXT_PART_STAGE_LANGUAGE);
+	}
+
+	PTR_ARRAY_FOREACH (task->text_parts, i, text_part) {
+		rspamd_mime_part_extract_words (task, text_part);
+
+		if (text_part->normalized_words) {
+			total_words += text_part->normalized_words->len;
+		}
+
+		text_part->stages |= RSPAMD_MIME_TEXT_PART_STAGE_NORMALIZED;
+	}
+
+	if (total_words > 0) {
+		var = rspamd_mempool_get_variable (task->task_pool,
+				RSPAMD_MEMPOOL_AVG_WORDS_LEN);
+
+		if (var) {
+			*var /= (double)total_words;
+		}
+
+		var = rspamd_mempool_get_variable (task->task_pool,
+				RSPAMD_MEMPOOL_SHORT_WORDS_CNT);
+
+		if (var) {
+			*var /= (double)total_words;
+		}
+	}
+}
+
+void
+rspamd_mime_text_part_process (struct rspamd_task *task,
+		struct rspamd_mime_text_part *part,
+		enum rspamd_mime_text_part_stage stage)
+{
+	/* Stages are performed in order, so the stage bit means all previous ones */
+	if (part->stages & stage) {
+		return;
+	}
+
+	if (!(part->stages & RSPAMD_MIME_TEXT_PART_STAGE_CONTENT)) {
+		part->stages |= RSPAMD_MIME_TEXT_PART_STAGE_CONTENT;
+		rspamd_mime_text_part_process_content (task, part);
+	}
+
+	if (stage >= RSPAMD_MIME_TEXT_PART_STAGE_WORDS &&
+			!(part->stages & RSPAMD_MIME_TEXT_PART_STAGE_WORDS)) {
+		part->stages |= RSPAMD_MIME_TEXT_PART_STAGE_WORDS;
+		part->ucs_len = rspamd_mime_part_create_words (task, part);
+	}
+
+	/* Languages and words statistics are shared between parts */
+	if (stage >= RSPAMD_MIME_TEXT_PART_STAGE_LANGUAGE &&
+			!(part->stages & RSPAMD_MIME_TEXT_PART_STAGE_LANGUAGE)) {
+		rspamd_message_detect_languages (task);
+	}
+
+	if (stage >= RSPAMD_MIME_TEXT_PART_STAGE_NORMALIZED &&
+			!(part->stages & RSPAMD_MIME_TEXT_PART_STAGE_NORMALIZED)) {
+		rspamd_message_normalize_words (task);
+	}
+}
+
+void
+rspamd_message_process_text_parts (struct rspamd_task *task,
+		enum rspamd_mime_text_part_stage stage)
+{
+	struct rspamd_mime_text_part *text_part;
+	guint i;
+
+	PTR_ARRAY_FOREACH (task->text_parts, i, text_part) {
+		rspamd_mime_text_part_process (task, text_part, stage);
+	}
+}
+
+guint
+rspamd_message_skipped_stages (struct rspamd_task *task)
+{
+	struct rspamd_mime_text_part *text_part;
+	guint i, j, skipped = 0;
+
+	PTR_ARRAY_FOREACH (task->text_parts, i, text_part) {
+		for (j = 0; j < RSPAMD_MIME_TEXT_PART_STAGES_COUNT; j ++) {
+			if (!(text_part->stages & (1u << j))) {
+				skipped ++;
+			}
+		}
+	}
+
+	return skipped;
 }
 
 /* Creates message from various data using libmagic to detect type */
@@ -1164,9 +1426,6 @@ void
 rspamd_message_process (struct rspamd_task *task)
 {
 	guint i;
-	struct rspamd_mime_text_part *p1, *p2;
-	gdouble diff, *pdiff;
-	guint tw, *ptw, dw;
 
 	for (i = 0; i < task->parts->len; i ++) {
 		struct rspamd_mime_part *part;
@@ -1175,129 +1434,18 @@ rspamd_message_process (struct rspamd_task *task)
 		rspamd_message_process_text_part (task, part);
 	}
 
-	rspamd_images_process (task);
-	rspamd_archives_process (task);
-
-	/* Calculate distance for 2-parts messages */
-	if (task->text_parts->len == 2) {
-		p1 = g_ptr_array_index (task->text_parts, 0);
-		p2 = g_ptr_array_index (task->text_parts, 1);
-
-		/* First of all check parent object */
-		if (p1->mime_part->parent_part) {
-			rspamd_ftok_t srch;
-
-			srch.begin = "alternative";
-			srch.len = 11;
-
-			if (rspamd_ftok_cmp (&p1->mime_part->parent_part->ct->subtype, &srch) == 0) {
-				if (!IS_PART_EMPTY (p1) && !IS_PART_EMPTY (p2) &&
-					p1->normalized_hashes && p2->normalized_hashes) {
-					/*
-					 * We also detect language on one part and propagate it to
-					 * another one
-					 */
-					struct rspamd_mime_text_part *sel;
-
-					/* Prefer HTML as text part is not displayed normally */
-					if (IS_PART_HTML (p1)) {
-						sel = p1;
-					}
-					else if (IS_PART_HTML (p2)) {
-						sel = p2;
-					}
-					else {
-						if (p1->ucs_len > p2->ucs_len) {
-							sel = p1;
-						}
-						else {
-							sel = p2;
-						}
-					}
-
-					rspamd_mime_part_detect_language (task, sel, sel->ucs_len);
-
-					if (sel->language && sel->language[0]) {
-						/* Propagate language */
-						if (sel == p1) {
-							p2->language = sel->language;
-							p2->languages = g_ptr_array_ref (sel->languages);
-						}
-						else {
-							p1->language = sel->language;
-							p1->languages = g_ptr_array_ref (sel->languages);
-						}
-					}
-
-					tw = p1->normalized_hashes->len + p2->normalized_hashes->len;
-
-					if (tw > 0) {
-						dw = rspamd_words_levenshtein_distance (task,
-								p1->normalized_hashes,
-								p2->normalized_hashes);
-						diff = dw / (gdouble)tw;
-
-						msg_debug_task (
-								"different words: %d, total words: %d, "
-								"got diff between parts of %.2f",
-								dw, tw,
-								diff);
-
-						pdiff = rspamd_mempool_alloc (task->task_pool,
-								sizeof (gdouble));
-						*pdiff = diff;
-						rspamd_mempool_set_variable (task->task_pool,
-								"parts_distance",
-								pdiff,
-								NULL);
-						ptw = rspamd_mempool_alloc (task->task_pool,
-								sizeof (gint));
-						*ptw = tw;
-						rspamd_mempool_set_variable (task->task_pool,
-								"total_words",
-								ptw,
-								NULL);
-					}
-				}
-			}
-		}
-		else {
-			debug_task (
-					"message contains two parts but they are in different multi-parts");
-		}
-	}
-
-	/* Calculate average words length and number of short words */
-	struct rspamd_mime_text_part *text_part;
-	gdouble *var;
-	guint total_words = 0;
-
-	PTR_ARRAY_FOREACH (task->text_parts, i, text_part) {
-		if (!text_part->language) {
-			rspamd_mime_part_detect_language (task, text_part, text_part->ucs_len);
-		}
-
-		rspamd_mime_part_extract_words (task, text_part);
-
-		if (text_part->normalized_words) {
-			total_words += text_part->normalized_words->len;
-		}
+	if (!(task->cfg && task->cfg->lazy_text_parts)) {
+		rspamd_message_extract_urls (task);
+		rspamd_message_process_text_parts (task,
+				RSPAMD_MIME_TEXT_PART_STAGE_WORDS);
 	}
 
-	if (total_words > 0) {
-		var = rspamd_mempool_get_variable (task->task_pool,
-				RSPAMD_MEMPOOL_AVG_WORDS_LEN);
-
-		if (var) {
-			*var /= (double)total_words;
-		}
-
-		var = rspamd_mempool_get_variable (task->task_pool,
-				RSPAMD_MEMPOOL_SHORT_WORDS_CNT);
+	rspamd_images_process (task);
+	rspamd_archives_process (task);
 
-		if (var) {
-			*var /= (double)total_words;
-		}
+	if (!(task->cfg && task->cfg->lazy_text_parts)) {
+		rspamd_message_process_text_parts (task,
+				RSPAMD_MIME_TEXT_PART_STAGE_NORMALIZED);
 	}
 }
 
@@ -75,12 +75,29 @@ struct rspamd_mime_part {
 #define RSPAMD_MIME_TEXT_PART_FLAG_8BIT_ENCODED (1 << 5)
 #define RSPAMD_MIME_TEXT_PART_HAS_SUBNORMAL (1 << 6)
 #define RSPAMD_MIME_TEXT_PART_NORMALISED (1 << 7)
+/* Urls are extracted from all parts at once after their content is ready */
+#define RSPAMD_MIME_TEXT_PART_FLAG_BATCH_URLS (1 << 8)
 
 #define IS_PART_EMPTY(part) ((part)->flags & RSPAMD_MIME_TEXT_PART_FLAG_EMPTY)
 #define IS_PART_UTF(part) ((part)->flags & RSPAMD_MIME_TEXT_PART_FLAG_UTF)
 #define IS_PART_RAW(part) (!((part)->flags & RSPAMD_MIME_TEXT_PART_FLAG_UTF))
 #define IS_PART_HTML(part) ((part)->flags & RSPAMD_MIME_TEXT_PART_FLAG_HTML)
 
+/*
+ * Processing stages of text parts, each stage requires all previous ones.
+ * Stages are performed when a text part is created unless `lazy_text_parts`
+ * option is set, in this case they are performed on the first access.
+ */
+enum rspamd_mime_text_part_stage {
+	RSPAMD_MIME_TEXT_PART_STAGE_CONTENT = (1 << 0), /* charset conversion, html and urls */
+	RSPAMD_MIME_TEXT_PART_STAGE_WORDS = (1 << 1), /* tokenization */
+	RSPAMD_MIME_TEXT_PART_STAGE_LANGUAGE = (1 << 2), /* language detection */
+	RSPAMD_MIME_TEXT_PART_STAGE_NORMALIZED = (1 << 3), /* stemming and words hashes */
+};
+
+#define RSPAMD_MIME_TEXT_PART_STAGES_COUNT 4
+#define RSPAMD_MIME_TEXT_PART_STAGE_ALL ((1 << RSPAMD_MIME_TEXT_PART_STAGES_COUNT) - 1)
+
 
 struct rspamd_mime_text_part {
 	const gchar *language;
@@ -97,10 +114,12 @@ struct rspamd_mime_text_part {
 	struct html_content *html;
 	GList *exceptions;	/**< list of offsets of urls						*/
 	struct rspamd_mime_part *mime_part;
+	struct rspamd_task *task;
 	GArray *normalized_words;
 	GArray *ucs32_words;
 	GArray *normalized_hashes;
 	guint flags;
+	guint stages;		/**< processed stages						*/
 	guint nlines;
 	guint spaces;
 	guint non_ascii_chars;
@@ -155,6 +174,32 @@ gboolean rspamd_message_parse (struct rspamd_task *task);
  */
 void rspamd_message_process (struct rspamd_task *task);
 
+/**
+ * Performs text part processing up to the specified stage if it has not been
+ * done yet
+ * @param task
+ * @param part
+ * @param stage
+ */
+void rspamd_mime_text_part_process (struct rspamd_task *task,
+		struct rspamd_mime_text_part *part,
+		enum rspamd_mime_text_part_stage stage);
+
+/**
+ * Performs processing of all text parts up to the specified stage
+ * @param task
+ * @param stage
+ */
+void rspamd_message_process_text_parts (struct rspamd_task *task,
+		enum rspamd_mime_text_part_stage stage);
+
+/**
+ * Returns number of text parts processing stages that have not been performed
+ * @param task
+ * @return
+ */
+guint rspamd_message_skipped_stages (struct rspamd_task *task);
+
 /**
  * Get an array of header's values with specified header's name using raw headers
  * @param task worker task structure
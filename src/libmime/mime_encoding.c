@@ -21,6 +21,7 @@
 #include "libserver/task.h"
 #include "mime_encoding.h"
 #include "message.h"
+#include "part_cache.h"
 #include <unicode/ucnv.h>
 #include <unicode/ucsdet.h>
 #include <unicode/unorm2.h>
@@ -641,6 +642,38 @@ rspamd_mime_charset_utf_check (rspamd_ftok_t *charset,
 	return FALSE;
 }
 
+/* Detection result depends on content only, so it is shared between tasks */
+static const gchar *
+rspamd_mime_text_part_find_charset (struct rspamd_task *task,
+		struct rspamd_mime_text_part *text_part, GByteArray *content)
+{
+	gchar buf[RSPAMD_PART_CACHE_DATA_LEN];
+	const gchar *charset;
+	gssize r;
+
+	r = rspamd_part_cache_lookup (task, text_part->mime_part,
+			RSPAMD_PART_CACHE_CHARSET, 0, buf);
+
+	if (r >= 0) {
+		/* Empty string means that charset has not been detected */
+		return r > 0 ? rspamd_mempool_strdup (task->task_pool, buf) : NULL;
+	}
+
+	charset = rspamd_mime_charset_find_by_content (content->data,
+			MIN (RSPAMD_CHARSET_MAX_CONTENT, content->len));
+
+	if (charset) {
+		rspamd_part_cache_insert (task, text_part->mime_part,
+				RSPAMD_PART_CACHE_CHARSET, 0, charset, strlen (charset) + 1);
+	}
+	else {
+		rspamd_part_cache_insert (task, text_part->mime_part,
+				RSPAMD_PART_CACHE_CHARSET, 0, "", 0);
+	}
+
+	return charset;
+}
+
 void
 rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 		struct rspamd_mime_text_part *text_part)
@@ -679,8 +712,8 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 
 	if (part->ct->charset.len == 0) {
 		if (need_charset_heuristic) {
-			charset = rspamd_mime_charset_find_by_content (part_content->data,
-					MIN (RSPAMD_CHARSET_MAX_CONTENT, part_content->len));
+			charset = rspamd_mime_text_part_find_charset (task, text_part,
+					part_content);
 
 			if (charset != NULL) {
 				msg_info_task ("detected charset %s", charset);
@@ -703,8 +736,8 @@ rspamd_mime_text_part_maybe_convert (struct rspamd_task *task,
 				task->task_pool);
 
 		if (charset == NULL) {
-			charset = rspamd_mime_charset_find_by_content (part_content->data,
-					MIN (RSPAMD_CHARSET_MAX_CONTENT, part_content->len));
+			charset = rspamd_mime_text_part_find_charset (task, text_part,
+					part_content);
 			msg_info_task ("detected charset: %s", charset);
 			checked = TRUE;
 		}
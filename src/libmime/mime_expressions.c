@@ -1084,6 +1084,10 @@ rspamd_parts_distance (struct rspamd_task * task, GArray * args, void *unused)
 		}
 	}
 
+	/* Distance is calculated when languages of parts are detected */
+	rspamd_message_process_text_parts (task,
+			RSPAMD_MIME_TEXT_PART_STAGE_LANGUAGE);
+
 	if ((pdiff =
 		rspamd_mempool_get_variable (task->task_pool,
 		"parts_distance")) != NULL) {
@@ -1310,6 +1314,12 @@ rspamd_is_html_balanced (struct rspamd_task * task, GArray * args, void *unused)
 	for (i = 0; i < task->text_parts->len; i ++) {
 
 		p = g_ptr_array_index (task->text_parts, i);
+
+		if (IS_PART_HTML (p)) {
+			rspamd_mime_text_part_process (task, p,
+					RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
+		}
+
 		if (!IS_PART_EMPTY (p) && IS_PART_HTML (p)) {
 			if (p->flags & RSPAMD_MIME_TEXT_PART_FLAG_BALANCED) {
 				res = TRUE;
@@ -1347,6 +1357,11 @@ rspamd_has_html_tag (struct rspamd_task * task, GArray * args, void *unused)
 	for (i = 0; i < task->text_parts->len; i ++) {
 		p = g_ptr_array_index (task->text_parts, i);
 
+		if (IS_PART_HTML (p)) {
+			rspamd_mime_text_part_process (task, p,
+					RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
+		}
+
 		if (!IS_PART_EMPTY (p) && IS_PART_HTML (p) && p->html) {
 			res = rspamd_html_tag_seen (p->html, arg->data);
 		}
@@ -1370,6 +1385,11 @@ rspamd_has_fake_html (struct rspamd_task * task, GArray * args, void *unused)
 	for (i = 0; i < task->text_parts->len; i ++) {
 		p = g_ptr_array_index (task->text_parts, i);
 
+		if (IS_PART_HTML (p)) {
+			rspamd_mime_text_part_process (task, p,
+					RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
+		}
+
 		if (!IS_PART_EMPTY (p) && IS_PART_HTML (p) && p->html->html_tags == NULL) {
 			res = TRUE;
 		}
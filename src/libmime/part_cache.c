@@ -0,0 +1,313 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "part_cache.h"
+#include "message.h"
+#include "task.h"
+#include "rspamd.h"
+
+/* Parts digests are cryptographic hashes, so a prefix is enough as a key */
+#define PART_CACHE_KEY_LEN 16
+/* Each shard has its own lock, buckets and LRU list */
+#define PART_CACHE_SHARDS 32
+
+/*
+ * Elements are stored in a preallocated array, all links are 1-based indexes
+ * in this array, so the cache is usable from any process that maps the pool
+ */
+struct rspamd_part_cache_elt {
+	guchar key[PART_CACHE_KEY_LEN];
+	guint64 extra;
+	guint32 type;
+	guint32 len;
+	guint32 hnext;
+	guint32 lru_prev;
+	guint32 lru_next;
+	guchar data[RSPAMD_PART_CACHE_DATA_LEN];
+};
+
+struct rspamd_part_cache_shard {
+	rspamd_mempool_mutex_t *lock;
+	guint32 nelts;
+	guint32 nbuckets;
+	guint32 used;
+	/* Most and least recently used elements */
+	guint32 lru_head;
+	guint32 lru_tail;
+	guint32 *buckets;
+	struct rspamd_part_cache_elt *elts;
+};
+
+struct rspamd_part_cache {
+	struct rspamd_part_cache_shard shards[PART_CACHE_SHARDS];
+};
+
+#define PART_CACHE_ELT(cache, idx) (&(cache)->elts[(idx) - 1])
+
+struct rspamd_part_cache *
+rspamd_part_cache_new (rspamd_mempool_t *pool, gsize size)
+{
+	struct rspamd_part_cache *cache;
+	struct rspamd_part_cache_shard *shard;
+	gsize nelts;
+	guint i;
+
+	nelts = size / (sizeof (struct rspamd_part_cache_elt) + sizeof (guint32)) /
+			PART_CACHE_SHARDS;
+
+	if (nelts < 16 || nelts > G_MAXUINT32) {
+		return NULL;
+	}
+
+	cache = rspamd_mempool_alloc0_shared (pool, sizeof (*cache));
+
+	for (i = 0; i < PART_CACHE_SHARDS; i ++) {
+		shard = &cache->shards[i];
+		shard->lock = rspamd_mempool_get_mutex (pool);
+		shard->nelts = nelts;
+		shard->nbuckets = nelts;
+		shard->buckets = rspamd_mempool_alloc0_shared (pool,
+				sizeof (guint32) * shard->nbuckets);
+		shard->elts = rspamd_mempool_alloc0_shared (pool,
+				sizeof (struct rspamd_part_cache_elt) * nelts);
+	}
+
+	return cache;
+}
+
+static inline guint64
+rspamd_part_cache_hash (const guchar *key, guint type, guint64 extra)
+{
+	guint64 h;
+
+	memcpy (&h, key, sizeof (h));
+	h ^= extra * 0x9E3779B97F4A7C15ULL;
+	h ^= type;
+
+	return h;
+}
+
+static inline struct rspamd_part_cache_shard *
+rspamd_part_cache_get_shard (struct rspamd_part_cache *cache, guint64 h)
+{
+	return &cache->shards[(h >> 32) % PART_CACHE_SHARDS];
+}
+
+static inline guint32
+rspamd_part_cache_bucket (struct rspamd_part_cache_shard *cache, guint64 h)
+{
+	return (h & G_MAXUINT32) % cache->nbuckets;
+}
+
+static guint32
+rspamd_part_cache_find (struct rspamd_part_cache_shard *cache, guint32 bucket,
+		const guchar *key, guint type, guint64 extra)
+{
+	guint32 idx;
+	struct rspamd_part_cache_elt *elt;
+
+	idx = cache->buckets[bucket];
+
+	while (idx != 0) {
+		elt = PART_CACHE_ELT (cache, idx);
+
+		if (elt->type == type && elt->extra == extra &&
+				memcmp (elt->key, key, sizeof (elt->key)) == 0) {
+			return idx;
+		}
+
+		idx = elt->hnext;
+	}
+
+	return 0;
+}
+
+static void
+rspamd_part_cache_lru_unlink (struct rspamd_part_cache_shard *cache, guint32 idx)
+{
+	struct rspamd_part_cache_elt *elt = PART_CACHE_ELT (cache, idx);
+
+	if (elt->lru_prev) {
+		PART_CACHE_ELT (cache, elt->lru_prev)->lru_next = elt->lru_next;
+	}
+	else {
+		cache->lru_head = elt->lru_next;
+	}
+
+	if (elt->lru_next) {
+		PART_CACHE_ELT (cache, elt->lru_next)->lru_prev = elt->lru_prev;
+	}
+	else {
+		cache->lru_tail = elt->lru_prev;
+	}
+
+	elt->lru_prev = 0;
+	elt->lru_next = 0;
+}
+
+static void
+rspamd_part_cache_lru_push (struct rspamd_part_cache_shard *cache, guint32 idx)
+{
+	struct rspamd_part_cache_elt *elt = PART_CACHE_ELT (cache, idx);
+
+	elt->lru_prev = 0;
+	elt->lru_next = cache->lru_head;
+
+	if (cache->lru_head) {
+		PART_CACHE_ELT (cache, cache->lru_head)->lru_prev = idx;
+	}
+	else {
+		cache->lru_tail = idx;
+	}
+
+	cache->lru_head = idx;
+}
+
+static void
+rspamd_part_cache_hash_unlink (struct rspamd_part_cache_shard *cache,
+		guint32 idx)
+{
+	struct rspamd_part_cache_elt *elt = PART_CACHE_ELT (cache, idx), *cur;
+	guint32 *prev;
+
+	prev = &cache->buckets[rspamd_part_cache_bucket (cache,
+			rspamd_part_cache_hash (elt->key, elt->type, elt->extra))];
+
+	while (*prev != 0) {
+		if (*prev == idx) {
+			*prev = elt->hnext;
+			break;
+		}
+
+		cur = PART_CACHE_ELT (cache, *prev);
+		prev = &cur->hnext;
+	}
+
+	elt->hnext = 0;
+}
+
+static struct rspamd_stat *
+rspamd_part_cache_stat (struct rspamd_task *task)
+{
+	if (task->worker && task->worker->srv) {
+		return task->worker->srv->stat;
+	}
+
+	return NULL;
+}
+
+gssize
+rspamd_part_cache_lookup (struct rspamd_task *task,
+		struct rspamd_mime_part *part,
+		enum rspamd_part_cache_type type,
+		guint64 extra,
+		gpointer buf)
+{
+	struct rspamd_part_cache *pc = task->cfg ? task->cfg->part_cache : NULL;
+	struct rspamd_part_cache_shard *cache;
+	struct rspamd_part_cache_elt *elt;
+	struct rspamd_stat *stat;
+	guint64 h;
+	guint32 idx;
+	gssize ret = -1;
+
+	if (pc == NULL || part->parsed_data.len == 0) {
+		return -1;
+	}
+
+	h = rspamd_part_cache_hash (part->digest, type, extra);
+	cache = rspamd_part_cache_get_shard (pc, h);
+	rspamd_mempool_lock_mutex (cache->lock);
+	idx = rspamd_part_cache_find (cache, rspamd_part_cache_bucket (cache, h),
+			part->digest, type, extra);
+
+	if (idx != 0) {
+		elt = PART_CACHE_ELT (cache, idx);
+		memcpy (buf, elt->data, elt->len);
+		ret = elt->len;
+		rspamd_part_cache_lru_unlink (cache, idx);
+		rspamd_part_cache_lru_push (cache, idx);
+	}
+
+	rspamd_mempool_unlock_mutex (cache->lock);
+	stat = rspamd_part_cache_stat (task);
+
+	if (stat) {
+		if (ret >= 0) {
+			g_atomic_int_inc (&stat->part_cache_hits);
+		}
+		else {
+			g_atomic_int_inc (&stat->part_cache_misses);
+		}
+	}
+
+	return ret;
+}
+
+void
+rspamd_part_cache_insert (struct rspamd_task *task,
+		struct rspamd_mime_part *part,
+		enum rspamd_part_cache_type type,
+		guint64 extra,
+		gconstpointer data,
+		gsize len)
+{
+	struct rspamd_part_cache *pc = task->cfg ? task->cfg->part_cache : NULL;
+	struct rspamd_part_cache_shard *cache;
+	struct rspamd_part_cache_elt *elt;
+	guint64 h;
+	guint32 idx, bucket;
+
+	if (pc == NULL || part->parsed_data.len == 0 ||
+			len > RSPAMD_PART_CACHE_DATA_LEN) {
+		return;
+	}
+
+	h = rspamd_part_cache_hash (part->digest, type, extra);
+	cache = rspamd_part_cache_get_shard (pc, h);
+	bucket = rspamd_part_cache_bucket (cache, h);
+	rspamd_mempool_lock_mutex (cache->lock);
+	idx = rspamd_part_cache_find (cache, bucket, part->digest, type, extra);
+
+	if (idx != 0) {
+		/* Another worker has stored the same result */
+		rspamd_part_cache_lru_unlink (cache, idx);
+	}
+	else {
+		if (cache->used < cache->nelts) {
+			idx = ++cache->used;
+		}
+		else {
+			/* Evict the least recently used element */
+			idx = cache->lru_tail;
+			rspamd_part_cache_lru_unlink (cache, idx);
+			rspamd_part_cache_hash_unlink (cache, idx);
+		}
+
+		elt = PART_CACHE_ELT (cache, idx);
+		memcpy (elt->key, part->digest, sizeof (elt->key));
+		elt->type = type;
+		elt->extra = extra;
+		elt->hnext = cache->buckets[bucket];
+		cache->buckets[bucket] = idx;
+	}
+
+	elt = PART_CACHE_ELT (cache, idx);
+	memcpy (elt->data, data, len);
+	elt->len = len;
+	rspamd_part_cache_lru_push (cache, idx);
+	rspamd_mempool_unlock_mutex (cache->lock);
+}
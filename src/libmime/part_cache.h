@@ -0,0 +1,83 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBMIME_PART_CACHE_H_
+#define SRC_LIBMIME_PART_CACHE_H_
+
+#include "config.h"
+#include "mem_pool.h"
+
+/*
+ * Cache of mime parts processing results shared by all workers. Results are
+ * keyed by digest of the decoded part content, so the same attachment or
+ * image sent in many messages is processed only once per node.
+ */
+
+/* Size of data stored in a single cache element */
+#define RSPAMD_PART_CACHE_DATA_LEN 960
+
+struct rspamd_part_cache;
+struct rspamd_task;
+struct rspamd_mime_part;
+
+enum rspamd_part_cache_type {
+	RSPAMD_PART_CACHE_CHARSET = 0,
+	RSPAMD_PART_CACHE_ARCHIVE,
+	RSPAMD_PART_CACHE_SHINGLES,
+};
+
+/**
+ * Allocate cache in shared memory of the pool
+ * @param pool shared pool (config pool)
+ * @param size maximum size of cache in bytes
+ * @return new cache or NULL if size is too small
+ */
+struct rspamd_part_cache * rspamd_part_cache_new (rspamd_mempool_t *pool,
+		gsize size);
+
+/**
+ * Find cached result for a part, `extra` distinguishes results of the same
+ * type obtained with different settings (e.g. fuzzy keys)
+ * @param task
+ * @param part
+ * @param type
+ * @param extra
+ * @param buf buffer of RSPAMD_PART_CACHE_DATA_LEN bytes to copy data into
+ * @return length of data or -1 if result is not cached
+ */
+gssize rspamd_part_cache_lookup (struct rspamd_task *task,
+		struct rspamd_mime_part *part,
+		enum rspamd_part_cache_type type,
+		guint64 extra,
+		gpointer buf);
+
+/**
+ * Store result for a part, the least recently used result is evicted if
+ * cache is full
+ * @param task
+ * @param part
+ * @param type
+ * @param extra
+ * @param data
+ * @param len should be not more than RSPAMD_PART_CACHE_DATA_LEN
+ */
+void rspamd_part_cache_insert (struct rspamd_task *task,
+		struct rspamd_mime_part *part,
+		enum rspamd_part_cache_type type,
+		guint64 extra,
+		gconstpointer data,
+		gsize len);
+
+#endif /* SRC_LIBMIME_PART_CACHE_H_ */
@@ -39,6 +39,9 @@
 struct expression;
 struct tokenizer;
 struct rspamd_stat_classifier;
+struct rspamd_stat_cache_filter;
+struct rspamd_part_cache;
+struct rspamd_images_cache;
 struct module_s;
 struct worker_s;
 struct rspamd_external_libs_ctx;
@@ -176,6 +179,7 @@ struct rspamd_classifier_config {
 	guint32 max_tokens;                             /**< maximum number of tokens							*/
 	guint min_learns;                               /**< minimum number of learns for each statfile			*/
 	guint flags;
+	struct rspamd_stat_cache_filter *cache_filter;  /**< learned messages filter shared by workers			*/
 };
 
 struct rspamd_worker_bind_conf {
@@ -303,10 +307,12 @@ struct rspamd_config {
 	gboolean raw_mode;                              /**< work in raw mode instead of utf one				*/
 	gboolean one_shot_mode;                         /**< rules add only one symbol							*/
 	gboolean check_text_attachements;               /**< check text attachements as text					*/
+	gboolean lazy_text_parts;                       /**< process text parts on the first access			*/
 	gboolean check_all_filters;                     /**< check all filters									*/
 	gboolean allow_raw_input;                       /**< scan messages with invalid mime					*/
 	gboolean disable_hyperscan;                     /**< disable hyperscan usage							*/
 	gboolean vectorized_hyperscan;                  /**< use vectorized hyperscan matching					*/
+	gboolean eager_hyperscan;                       /**< scan all hyperscan classes in a single pass		*/
 	gboolean enable_shutdown_workaround;            /**< enable workaround for legacy SA clients (exim)		*/
 	gboolean ignore_received;                       /**< Ignore data from the first received header			*/
 	gboolean enable_sessions_cache;                 /**< Enable session cache for debug						*/
@@ -321,7 +327,8 @@ struct rspamd_config {
 	gchar *cores_dir;                               /**< directory for core files							*/
 	gsize max_message;                              /**< maximum size for messages							*/
 	gsize max_pic_size;                             /**< maximum size for a picture to process				*/
-	gsize images_cache_size;                        /**< size of LRU cache for DCT data from images			*/
+	gsize images_cache_size;                        /**< number of DCT signatures in shared cache			*/
+	gsize part_cache_size;                          /**< size of shared cache of parts processing results	*/
 	gint default_max_shots;                         /**< default maximum count of symbols hits permitted (-1 for unlimited) */
 
 	enum rspamd_log_type log_type;                  /**< log type											*/
@@ -408,6 +415,7 @@ struct rspamd_config {
 	guint words_decay;								/**< limit for words for starting adaptive ignoring		*/
 	guint history_rows;								/**< number of history rows stored						*/
 	guint max_sessions_cache;                        /**< maximum number of sessions cache elts				*/
+	gsize mempool_cache_size;						/**< limit of the mempool free chains cache				*/
 
 	GList *classify_headers;						/**< list of headers using for statistics				*/
 	struct module_s **compiled_modules;				/**< list of compiled C modules							*/
@@ -433,6 +441,8 @@ struct rspamd_config {
 	ucl_object_t *neighbours;						/**< other servers in the cluster						*/
 
 	struct rspamd_lang_detector *lang_det;			/**< language detector									*/
+	struct rspamd_part_cache *part_cache;			/**< parts processing results shared by workers			*/
+	struct rspamd_images_cache *images_cache;		/**< DCT signatures of images shared by workers			*/
 
 	ref_entry_t ref;								/**< reference counter									*/
 };
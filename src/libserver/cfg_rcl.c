@@ -1652,6 +1652,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, check_text_attachements),
 				0,
 				"Treat text attachments as normal text parts");
+		rspamd_rcl_add_default_handler (sub,
+				"lazy_text_parts",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, lazy_text_parts),
+				0,
+				"Decode, tokenize and detect language of text parts only when they are used");
 		rspamd_rcl_add_default_handler (sub,
 				"tempdir",
 				rspamd_rcl_parse_struct_string,
@@ -1802,6 +1808,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, vectorized_hyperscan),
 				0,
 				"Use hyperscan in vectorized mode (experimental)");
+		rspamd_rcl_add_default_handler (sub,
+				"eager_hyperscan",
+				rspamd_rcl_parse_struct_boolean,
+				G_STRUCT_OFFSET (struct rspamd_config, eager_hyperscan),
+				0,
+				"Scan all hyperscan regexp classes in a single pass on the first regexp check");
 		rspamd_rcl_add_default_handler (sub,
 				"cores_dir",
 				rspamd_rcl_parse_struct_string,
@@ -1883,9 +1895,15 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 		rspamd_rcl_add_default_handler (sub,
 				"images_cache",
 				rspamd_rcl_parse_struct_integer,
-				G_STRUCT_OFFSET (struct rspamd_config, max_pic_size),
+				G_STRUCT_OFFSET (struct rspamd_config, images_cache_size),
 				RSPAMD_CL_FLAG_INT_SIZE,
-				"Size of DCT data cache for images (256 elements by default)");
+				"Size of DCT data cache for images shared by workers (4096 elements by default)");
+		rspamd_rcl_add_default_handler (sub,
+				"part_cache_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, part_cache_size),
+				RSPAMD_CL_FLAG_INT_SIZE,
+				"Size of parts processing results cache shared by workers (16Mb by default, 0 to disable)");
 		rspamd_rcl_add_default_handler (sub,
 				"zstd_input_dictionary",
 				rspamd_rcl_parse_struct_string,
@@ -1922,6 +1940,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg, GHashTable *skip_sections)
 				G_STRUCT_OFFSET (struct rspamd_config, max_sessions_cache),
 				0,
 				"Maximum number of sessions in cache before warning (default: 100)");
+		rspamd_rcl_add_default_handler (sub,
+				"mempool_cache_size",
+				rspamd_rcl_parse_struct_integer,
+				G_STRUCT_OFFSET (struct rspamd_config, mempool_cache_size),
+				RSPAMD_CL_FLAG_INT_SIZE,
+				"Maximum size of free memory pool chains kept for reuse per process (32Mb by default)");
 
 		/* Neighbours configuration */
 		rspamd_rcl_add_section_doc (&sub->subsections, "neighbours", "name",
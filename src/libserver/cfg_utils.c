@@ -29,6 +29,7 @@
 #include "stat_api.h"
 #include "unix-std.h"
 #include "libutil/multipattern.h"
+#include "libmime/images.h"
 #include "monitored.h"
 #include "ref.h"
 #include <math.h>
@@ -191,7 +192,8 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 	cfg->ssl_ciphers = "HIGH:!aNULL:!kRSA:!PSK:!SRP:!MD5:!RC4";
 	cfg->max_message = DEFAULT_MAX_MESSAGE;
 	cfg->max_pic_size = DEFAULT_MAX_PIC;
-	cfg->images_cache_size = 256;
+	cfg->images_cache_size = 4096;
+	cfg->part_cache_size = 16 * 1024 * 1024;
 	cfg->monitored_ctx = rspamd_monitored_ctx_init ();
 	cfg->neighbours = ucl_object_typed_new (UCL_OBJECT);
 #ifdef WITH_HIREDIS
@@ -199,6 +201,7 @@ rspamd_config_new (enum rspamd_config_init_flags flags)
 #endif
 	cfg->default_max_shots = DEFAULT_MAX_SHOTS;
 	cfg->max_sessions_cache = DEFAULT_MAX_SESSIONS;
+	cfg->mempool_cache_size = RSPAMD_MEMPOOL_CHAIN_CACHE_LIMIT;
 	cfg->maps_cache_dir = rspamd_mempool_strdup (cfg->cfg_pool, RSPAMD_DBDIR);
 	cfg->c_modules = g_ptr_array_new ();
 
@@ -801,6 +804,11 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 
 		/* Init re cache */
 		rspamd_re_cache_init (cfg->re_cache, cfg);
+
+		/* Init statistics caches shared between workers */
+		rspamd_stat_init_shared (cfg);
+
+		rspamd_images_init_shared (cfg);
 	}
 
 	if (opts & RSPAMD_CONFIG_INIT_LIBS) {
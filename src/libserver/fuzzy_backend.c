@@ -18,6 +18,7 @@
 #include "fuzzy_backend.h"
 #include "fuzzy_backend_sqlite.h"
 #include "fuzzy_backend_redis.h"
+#include "fuzzy_backend_memory.h"
 #include "cfg_file.h"
 #include "fuzzy_wire.h"
 
@@ -26,6 +27,7 @@
 enum rspamd_fuzzy_backend_type {
 	RSPAMD_FUZZY_BACKEND_SQLITE = 0,
 	RSPAMD_FUZZY_BACKEND_REDIS = 1,
+	RSPAMD_FUZZY_BACKEND_MEMORY = 2,
 };
 
 static void* rspamd_fuzzy_backend_init_sqlite (struct rspamd_fuzzy_backend *bk,
@@ -34,6 +36,11 @@ static void rspamd_fuzzy_backend_check_sqlite (struct rspamd_fuzzy_backend *bk,
 		const struct rspamd_fuzzy_cmd *cmd,
 		rspamd_fuzzy_check_cb cb, void *ud,
 		void *subr_ud);
+static void rspamd_fuzzy_backend_check_many_sqlite (
+		struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		rspamd_fuzzy_check_many_cb cb, void *ud,
+		void *subr_ud);
 static void rspamd_fuzzy_backend_update_sqlite (struct rspamd_fuzzy_backend *bk,
 		GArray *updates, const gchar *src,
 		rspamd_fuzzy_update_cb cb, void *ud,
@@ -60,6 +67,10 @@ struct rspamd_fuzzy_backend_subr {
 			const struct rspamd_fuzzy_cmd *cmd,
 			rspamd_fuzzy_check_cb cb, void *ud,
 			void *subr_ud);
+	void (*check_many) (struct rspamd_fuzzy_backend *bk,
+			const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+			rspamd_fuzzy_check_many_cb cb, void *ud,
+			void *subr_ud);
 	void (*update) (struct rspamd_fuzzy_backend *bk,
 			GArray *updates, const gchar *src,
 			rspamd_fuzzy_update_cb cb, void *ud,
@@ -80,6 +91,7 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 	[RSPAMD_FUZZY_BACKEND_SQLITE] = {
 		.init = rspamd_fuzzy_backend_init_sqlite,
 		.check = rspamd_fuzzy_backend_check_sqlite,
+		.check_many = rspamd_fuzzy_backend_check_many_sqlite,
 		.update = rspamd_fuzzy_backend_update_sqlite,
 		.count = rspamd_fuzzy_backend_count_sqlite,
 		.version = rspamd_fuzzy_backend_version_sqlite,
@@ -91,14 +103,26 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 	[RSPAMD_FUZZY_BACKEND_REDIS] = {
 		.init = rspamd_fuzzy_backend_init_redis,
 		.check = rspamd_fuzzy_backend_check_redis,
+		.check_many = rspamd_fuzzy_backend_check_many_redis,
 		.update = rspamd_fuzzy_backend_update_redis,
 		.count = rspamd_fuzzy_backend_count_redis,
 		.version = rspamd_fuzzy_backend_version_redis,
 		.id = rspamd_fuzzy_backend_id_redis,
 		.periodic = rspamd_fuzzy_backend_expire_redis,
 		.close = rspamd_fuzzy_backend_close_redis,
-	}
+	},
 #endif
+	[RSPAMD_FUZZY_BACKEND_MEMORY] = {
+		.init = rspamd_fuzzy_backend_init_memory,
+		.check = rspamd_fuzzy_backend_check_memory,
+		.check_many = rspamd_fuzzy_backend_check_many_memory,
+		.update = rspamd_fuzzy_backend_update_memory,
+		.count = rspamd_fuzzy_backend_count_memory,
+		.version = rspamd_fuzzy_backend_version_memory,
+		.id = rspamd_fuzzy_backend_id_memory,
+		.periodic = rspamd_fuzzy_backend_expire_memory,
+		.close = rspamd_fuzzy_backend_close_memory,
+	},
 };
 
 struct rspamd_fuzzy_backend {
@@ -154,6 +178,25 @@ rspamd_fuzzy_backend_check_sqlite (struct rspamd_fuzzy_backend *bk,
 	}
 }
 
+static void
+rspamd_fuzzy_backend_check_many_sqlite (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		rspamd_fuzzy_check_many_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_sqlite *sq = subr_ud;
+	struct rspamd_fuzzy_reply *reps;
+
+	reps = g_malloc (sizeof (*reps) * ncmds);
+	rspamd_fuzzy_backend_sqlite_check_many (sq, cmds, ncmds, bk->expire, reps);
+
+	if (cb) {
+		cb (reps, ncmds, ud);
+	}
+
+	g_free (reps);
+}
+
 static void
 rspamd_fuzzy_backend_update_sqlite (struct rspamd_fuzzy_backend *bk,
 		GArray *updates, const gchar *src,
@@ -291,6 +334,9 @@ rspamd_fuzzy_backend_create (struct event_base *ev_base,
 			else if (strcmp (ucl_object_tostring (elt), "redis") == 0) {
 				type = RSPAMD_FUZZY_BACKEND_REDIS;
 			}
+			else if (strcmp (ucl_object_tostring (elt), "memory") == 0) {
+				type = RSPAMD_FUZZY_BACKEND_MEMORY;
+			}
 			else {
 				g_set_error (err, rspamd_fuzzy_backend_quark (),
 						EINVAL, "invalid backend type: %s",
@@ -332,6 +378,79 @@ rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *bk,
 	bk->subr->check (bk, cmd, cb, ud, bk->subr_ud);
 }
 
+struct rspamd_fuzzy_check_many_cbdata {
+	struct rspamd_fuzzy_reply *reps;
+	guint ncmds;
+	guint nreplies;
+	rspamd_fuzzy_check_many_cb cb;
+	void *ud;
+};
+
+struct rspamd_fuzzy_check_many_elt {
+	struct rspamd_fuzzy_check_many_cbdata *cbdata;
+	guint idx;
+};
+
+static void
+rspamd_fuzzy_backend_check_many_elt_cb (struct rspamd_fuzzy_reply *rep,
+		void *ud)
+{
+	struct rspamd_fuzzy_check_many_elt *elt = ud;
+	struct rspamd_fuzzy_check_many_cbdata *cbdata = elt->cbdata;
+
+	memcpy (&cbdata->reps[elt->idx], rep, sizeof (*rep));
+	g_free (elt);
+
+	if (++cbdata->nreplies == cbdata->ncmds) {
+		if (cbdata->cb) {
+			cbdata->cb (cbdata->reps, cbdata->ncmds, cbdata->ud);
+		}
+
+		g_free (cbdata->reps);
+		g_free (cbdata);
+	}
+}
+
+void
+rspamd_fuzzy_backend_check_many (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		rspamd_fuzzy_check_many_cb cb, void *ud)
+{
+	struct rspamd_fuzzy_check_many_cbdata *cbdata;
+	struct rspamd_fuzzy_check_many_elt *elt;
+	guint i;
+
+	g_assert (bk != NULL);
+
+	if (ncmds == 0) {
+		if (cb) {
+			cb (NULL, 0, ud);
+		}
+
+		return;
+	}
+
+	if (bk->subr->check_many) {
+		bk->subr->check_many (bk, cmds, ncmds, cb, ud, bk->subr_ud);
+	}
+	else {
+		/* Emulate by issuing separate checks */
+		cbdata = g_malloc0 (sizeof (*cbdata));
+		cbdata->reps = g_malloc0 (sizeof (*cbdata->reps) * ncmds);
+		cbdata->ncmds = ncmds;
+		cbdata->cb = cb;
+		cbdata->ud = ud;
+
+		for (i = 0; i < ncmds; i ++) {
+			elt = g_malloc (sizeof (*elt));
+			elt->cbdata = cbdata;
+			elt->idx = i;
+			bk->subr->check (bk, cmds[i], rspamd_fuzzy_backend_check_many_elt_cb,
+					elt, bk->subr_ud);
+		}
+	}
+}
+
 static guint
 rspamd_fuzzy_digest_hash (gconstpointer key)
 {
@@ -27,6 +27,8 @@ struct rspamd_config;
  * Callbacks for fuzzy methods
  */
 typedef void (*rspamd_fuzzy_check_cb) (struct rspamd_fuzzy_reply *rep, void *ud);
+typedef void (*rspamd_fuzzy_check_many_cb) (struct rspamd_fuzzy_reply *reps,
+		guint nreps, void *ud);
 typedef void (*rspamd_fuzzy_update_cb) (gboolean success,
 										guint nadded,
 										guint ndeleted,
@@ -60,6 +62,18 @@ void rspamd_fuzzy_backend_check (struct rspamd_fuzzy_backend *bk,
 		const struct rspamd_fuzzy_cmd *cmd,
 		rspamd_fuzzy_check_cb cb, void *ud);
 
+/**
+ * Check several hashes in storage at once, callback is called once with
+ * replies in the same order as commands
+ * @param cmds array of commands, must be valid until callback is called
+ * @param ncmds number of commands
+ * @param cb
+ * @param ud
+ */
+void rspamd_fuzzy_backend_check_many (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		rspamd_fuzzy_check_many_cb cb, void *ud);
+
 /**
  * Process updates for a specific queue
  * @param bk
@@ -0,0 +1,1706 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * In memory fuzzy backend: digests live in an open addressing hash table,
+ * shingles are stored in a separate (number, hash) -> digest index.
+ *
+ * Persistence is done by two files:
+ * - snapshot (`file` option), an image of the tables that is mapped privately
+ *   on load, so the pages that are not modified are shared by all processes;
+ * - append only log (`file` + ".log") with all updates since the snapshot.
+ *
+ * Both files carry a serial number, so the log is applied only to the
+ * snapshot it belongs to. The periodic (expire) routine writes a new snapshot
+ * and starts a new log. Processes that do not perform updates follow
+ * the log with a timer, and reload everything when the snapshot changes.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_backend.h"
+#include "fuzzy_backend_memory.h"
+#include "cryptobox.h"
+#include "str_util.h"
+#include "unix-std.h"
+
+#define DEFAULT_REFRESH_INTERVAL 1.0
+#define MIN_TABLE_SIZE 1024
+#define SHINGLE_NONE 0
+
+#define msg_err_fuzzy_memory(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
+        "fuzzy_memory", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_warn_fuzzy_memory(...)   rspamd_default_log_function (G_LOG_LEVEL_WARNING, \
+        "fuzzy_memory", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_info_fuzzy_memory(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
+        "fuzzy_memory", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_debug_fuzzy_memory(...)  rspamd_conditional_debug_fast (NULL, NULL, \
+        rspamd_fuzzy_memory_log_id, "fuzzy_memory", backend->id, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+
+INIT_LOG_MODULE(fuzzy_memory)
+
+static const guchar rspamd_fuzzy_mem_snap_magic[8] = {
+		'r', 's', 'f', 'z', 's', 'n', '0', '2'
+};
+static const guchar rspamd_fuzzy_mem_log_magic[8] = {
+		'r', 's', 'f', 'z', 'l', 'g', '0', '1'
+};
+
+/*
+ * On disk structures, snapshot header is followed by entries, digests and
+ * shingles tables in their in memory layout and then by sources
+ */
+struct rspamd_fuzzy_mem_snap_hdr {
+	guchar magic[8];
+	guint64 serial;
+	guint64 nentries;
+	guint64 count;
+	guint64 digests_size;
+	guint64 digests_used;
+	guint64 shingles_size;
+	guint64 shingles_used;
+	guint64 nsources;
+	guint64 reserved[3];
+};
+
+#define RSPAMD_FUZZY_MEM_SOURCE_LEN 120
+struct rspamd_fuzzy_mem_snap_source {
+	gchar name[RSPAMD_FUZZY_MEM_SOURCE_LEN];
+	guint64 version;
+};
+
+struct rspamd_fuzzy_mem_log_hdr {
+	guchar magic[8];
+	guint64 serial;
+};
+
+enum rspamd_fuzzy_mem_log_op {
+	RSPAMD_FUZZY_MEM_LOG_ADD = 1,
+	RSPAMD_FUZZY_MEM_LOG_DEL,
+	RSPAMD_FUZZY_MEM_LOG_REFRESH,
+	RSPAMD_FUZZY_MEM_LOG_VERSION,
+};
+
+/*
+ * ADD records with shingles are followed by RSPAMD_SHINGLE_SIZE hashes,
+ * VERSION records store source name in the digest field
+ */
+struct rspamd_fuzzy_mem_log_rec {
+	guint8 op;
+	guint8 flag;
+	guint8 has_shingles;
+	guint8 reserved;
+	guint32 ts;
+	gint64 value;
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+};
+
+/* In memory structures */
+struct rspamd_fuzzy_mem_entry {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	gint64 value;
+	guint32 flag;
+	guint32 ts;
+	guint32 gen; /* Invalidates shingles pointing to a reused entry */
+	gboolean live;
+};
+
+struct rspamd_fuzzy_mem_shingle {
+	guint64 hash;
+	guint32 number;
+	guint32 entry; /* Entry index + 1, SHINGLE_NONE for empty slots */
+	guint32 gen;
+};
+
+#define DIGEST_SLOT_EMPTY 0
+#define DIGEST_SLOT_DELETED G_MAXUINT32
+
+struct rspamd_fuzzy_backend_memory {
+	gchar *path;
+	gchar *log_path;
+	gchar *id;
+
+	/* Tables are served from the snapshot mapping until they are resized */
+	guchar *snap_map;
+	gsize snap_size;
+	struct rspamd_fuzzy_mem_entry *snap_entries;
+	guint32 snap_nentries;
+
+	struct rspamd_fuzzy_mem_entry *entries; /* Entries after the snapshot ones */
+	guint32 nentries; /* Allocated */
+	guint32 entries_used; /* High watermark, including snapshot entries */
+	GArray *free_entries;
+
+	guint32 *digests; /* Entry index + 1 */
+	guint32 digests_size;
+	guint32 digests_used; /* Including deleted */
+	guint32 count;
+
+	struct rspamd_fuzzy_mem_shingle *shingles;
+	guint32 shingles_size;
+	guint32 shingles_used; /* Including stale */
+
+	GHashTable *sources;
+	guint64 serial;
+	ino_t snap_ino;
+	gint log_fd;
+	goffset log_off;
+
+	gdouble refresh_interval;
+	struct event_base *ev_base;
+	struct event refresh_ev;
+	gboolean has_refresh;
+};
+
+static GQuark
+rspamd_fuzzy_backend_memory_quark (void)
+{
+	return g_quark_from_static_string ("fuzzy-memory");
+}
+
+static inline struct rspamd_fuzzy_mem_entry *
+rspamd_fuzzy_mem_entry (struct rspamd_fuzzy_backend_memory *backend,
+		guint32 idx)
+{
+	if (idx < backend->snap_nentries) {
+		return &backend->snap_entries[idx];
+	}
+
+	return &backend->entries[idx - backend->snap_nentries];
+}
+
+static void
+rspamd_fuzzy_mem_table_free (struct rspamd_fuzzy_backend_memory *backend,
+		gpointer table)
+{
+	guchar *p = table;
+
+	/* Tables that are mapped from the snapshot are not allocated */
+	if (backend->snap_map == NULL || p < backend->snap_map ||
+			p >= backend->snap_map + backend->snap_size) {
+		g_free (table);
+	}
+}
+
+static inline guint32
+rspamd_fuzzy_mem_digest_hash (const guchar *digest)
+{
+	guint32 ret;
+
+	/* Digests are distributed uniformly */
+	memcpy (&ret, digest, sizeof (ret));
+
+	return ret;
+}
+
+static inline guint32
+rspamd_fuzzy_mem_shingle_hash (guint64 hash, guint32 number)
+{
+	hash ^= (number + 1) * 0x9E3779B97F4A7C15ULL;
+	hash ^= hash >> 31;
+	hash *= 0xBF58476D1CE4E5B9ULL;
+	hash ^= hash >> 29;
+
+	return (guint32)hash;
+}
+
+static inline gboolean
+rspamd_fuzzy_mem_shingle_valid (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_mem_shingle *sh)
+{
+	const struct rspamd_fuzzy_mem_entry *ent;
+
+	if (sh->entry == SHINGLE_NONE) {
+		return FALSE;
+	}
+
+	ent = rspamd_fuzzy_mem_entry (backend, sh->entry - 1);
+
+	return ent->live && ent->gen == sh->gen;
+}
+
+/*
+ * Returns slot index for the digest, if not found returns the first
+ * slot suitable for insertion and sets `found` to FALSE
+ */
+static guint32
+rspamd_fuzzy_mem_digest_slot (struct rspamd_fuzzy_backend_memory *backend,
+		const guchar *digest, gboolean *found)
+{
+	guint32 mask = backend->digests_size - 1, pos, slot, ins = G_MAXUINT32;
+
+	pos = rspamd_fuzzy_mem_digest_hash (digest) & mask;
+
+	for (;;) {
+		slot = backend->digests[pos];
+
+		if (slot == DIGEST_SLOT_EMPTY) {
+			*found = FALSE;
+
+			return ins != G_MAXUINT32 ? ins : pos;
+		}
+		else if (slot == DIGEST_SLOT_DELETED) {
+			if (ins == G_MAXUINT32) {
+				ins = pos;
+			}
+		}
+		else if (memcmp (rspamd_fuzzy_mem_entry (backend, slot - 1)->digest, digest,
+				rspamd_cryptobox_HASHBYTES) == 0) {
+			*found = TRUE;
+
+			return pos;
+		}
+
+		pos = (pos + 1) & mask;
+	}
+}
+
+static struct rspamd_fuzzy_mem_entry *
+rspamd_fuzzy_mem_lookup (struct rspamd_fuzzy_backend_memory *backend,
+		const guchar *digest)
+{
+	gboolean found;
+	guint32 pos;
+
+	pos = rspamd_fuzzy_mem_digest_slot (backend, digest, &found);
+
+	if (found) {
+		return rspamd_fuzzy_mem_entry (backend, backend->digests[pos] - 1);
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_fuzzy_mem_digests_resize (struct rspamd_fuzzy_backend_memory *backend,
+		guint32 nsize)
+{
+	guint32 *old = backend->digests, old_size = backend->digests_size, i;
+	guint32 pos, mask = nsize - 1;
+
+	backend->digests = g_malloc0 (sizeof (*backend->digests) * nsize);
+	backend->digests_size = nsize;
+	backend->digests_used = 0;
+
+	for (i = 0; i < old_size; i ++) {
+		if (old[i] != DIGEST_SLOT_EMPTY && old[i] != DIGEST_SLOT_DELETED) {
+			pos = rspamd_fuzzy_mem_digest_hash (
+					rspamd_fuzzy_mem_entry (backend, old[i] - 1)->digest) & mask;
+
+			while (backend->digests[pos] != DIGEST_SLOT_EMPTY) {
+				pos = (pos + 1) & mask;
+			}
+
+			backend->digests[pos] = old[i];
+			backend->digests_used ++;
+		}
+	}
+
+	rspamd_fuzzy_mem_table_free (backend, old);
+}
+
+static void
+rspamd_fuzzy_mem_shingles_resize (struct rspamd_fuzzy_backend_memory *backend,
+		guint32 nsize)
+{
+	struct rspamd_fuzzy_mem_shingle *old = backend->shingles, *sh;
+	guint32 old_size = backend->shingles_size, i, pos, mask = nsize - 1;
+
+	backend->shingles = g_malloc0 (sizeof (*backend->shingles) * nsize);
+	backend->shingles_size = nsize;
+	backend->shingles_used = 0;
+
+	for (i = 0; i < old_size; i ++) {
+		sh = &old[i];
+
+		/* Stale shingles are dropped here */
+		if (rspamd_fuzzy_mem_shingle_valid (backend, sh)) {
+			pos = rspamd_fuzzy_mem_shingle_hash (sh->hash, sh->number) & mask;
+
+			while (backend->shingles[pos].entry != SHINGLE_NONE) {
+				pos = (pos + 1) & mask;
+			}
+
+			backend->shingles[pos] = *sh;
+			backend->shingles_used ++;
+		}
+	}
+
+	rspamd_fuzzy_mem_table_free (backend, old);
+}
+
+static guint32
+rspamd_fuzzy_mem_table_size (guint32 nelts)
+{
+	guint32 size = MIN_TABLE_SIZE;
+
+	/* Keep load factor below 0.5 after resize */
+	while (size < nelts * 2) {
+		size <<= 1;
+	}
+
+	return size;
+}
+
+static guint32
+rspamd_fuzzy_mem_shingle_find (struct rspamd_fuzzy_backend_memory *backend,
+		guint64 hash, guint32 number)
+{
+	guint32 mask = backend->shingles_size - 1, pos;
+	struct rspamd_fuzzy_mem_shingle *sh;
+
+	pos = rspamd_fuzzy_mem_shingle_hash (hash, number) & mask;
+
+	for (;;) {
+		sh = &backend->shingles[pos];
+
+		if (sh->entry == SHINGLE_NONE) {
+			return SHINGLE_NONE;
+		}
+
+		if (sh->hash == hash && sh->number == number) {
+			return rspamd_fuzzy_mem_shingle_valid (backend, sh) ?
+					sh->entry : SHINGLE_NONE;
+		}
+
+		pos = (pos + 1) & mask;
+	}
+}
+
+static void
+rspamd_fuzzy_mem_shingle_insert (struct rspamd_fuzzy_backend_memory *backend,
+		guint64 hash, guint32 number, guint32 entry)
+{
+	guint32 mask, pos;
+	struct rspamd_fuzzy_mem_shingle *sh;
+
+	if ((backend->shingles_used + 1) * 10 > backend->shingles_size * 7) {
+		rspamd_fuzzy_mem_shingles_resize (backend,
+				rspamd_fuzzy_mem_table_size (backend->shingles_used + 1));
+	}
+
+	mask = backend->shingles_size - 1;
+	pos = rspamd_fuzzy_mem_shingle_hash (hash, number) & mask;
+
+	for (;;) {
+		sh = &backend->shingles[pos];
+
+		if (sh->entry == SHINGLE_NONE) {
+			backend->shingles_used ++;
+			break;
+		}
+
+		if (sh->hash == hash && sh->number == number) {
+			if (rspamd_fuzzy_mem_shingle_valid (backend, sh)) {
+				/* As in sqlite backend, the first digest wins */
+				return;
+			}
+
+			break;
+		}
+
+		pos = (pos + 1) & mask;
+	}
+
+	sh->hash = hash;
+	sh->number = number;
+	sh->entry = entry + 1;
+	sh->gen = rspamd_fuzzy_mem_entry (backend, entry)->gen;
+}
+
+static guint32
+rspamd_fuzzy_mem_entry_alloc (struct rspamd_fuzzy_backend_memory *backend)
+{
+	guint32 idx;
+
+	if (backend->free_entries->len > 0) {
+		idx = g_array_index (backend->free_entries, guint32,
+				backend->free_entries->len - 1);
+		g_array_set_size (backend->free_entries,
+				backend->free_entries->len - 1);
+	}
+	else {
+		if (backend->entries_used - backend->snap_nentries == backend->nentries) {
+			backend->nentries = MAX (backend->nentries * 2, MIN_TABLE_SIZE);
+			backend->entries = g_realloc (backend->entries,
+					sizeof (*backend->entries) * backend->nentries);
+		}
+
+		idx = backend->entries_used ++;
+		rspamd_fuzzy_mem_entry (backend, idx)->gen = 0;
+	}
+
+	rspamd_fuzzy_mem_entry (backend, idx)->gen ++;
+	rspamd_fuzzy_mem_entry (backend, idx)->live = TRUE;
+
+	return idx;
+}
+
+static void
+rspamd_fuzzy_mem_add (struct rspamd_fuzzy_backend_memory *backend,
+		const guchar *digest, guint32 flag, gint64 value, guint32 ts,
+		const guint64 *shingles)
+{
+	struct rspamd_fuzzy_mem_entry *ent;
+	gboolean found;
+	guint32 pos, idx, i;
+
+	if ((backend->digests_used + 1) * 10 > backend->digests_size * 7) {
+		rspamd_fuzzy_mem_digests_resize (backend,
+				rspamd_fuzzy_mem_table_size (backend->count + 1));
+	}
+
+	pos = rspamd_fuzzy_mem_digest_slot (backend, digest, &found);
+
+	if (found) {
+		ent = rspamd_fuzzy_mem_entry (backend, backend->digests[pos] - 1);
+
+		if (ent->flag == flag) {
+			/* We need to increase weight */
+			ent->value += value;
+		}
+		else {
+			/* We need to relearn actually */
+			ent->flag = flag;
+			ent->value = value;
+		}
+
+		ent->ts = ts;
+
+		return;
+	}
+
+	idx = rspamd_fuzzy_mem_entry_alloc (backend);
+	ent = rspamd_fuzzy_mem_entry (backend, idx);
+	memcpy (ent->digest, digest, sizeof (ent->digest));
+	ent->flag = flag;
+	ent->value = value;
+	ent->ts = ts;
+
+	if (backend->digests[pos] == DIGEST_SLOT_EMPTY) {
+		backend->digests_used ++;
+	}
+
+	backend->digests[pos] = idx + 1;
+	backend->count ++;
+
+	if (shingles) {
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			rspamd_fuzzy_mem_shingle_insert (backend, shingles[i], i, idx);
+		}
+	}
+}
+
+static void
+rspamd_fuzzy_mem_del_slot (struct rspamd_fuzzy_backend_memory *backend,
+		guint32 pos)
+{
+	guint32 idx = backend->digests[pos] - 1;
+
+	rspamd_fuzzy_mem_entry (backend, idx)->live = FALSE;
+	g_array_append_val (backend->free_entries, idx);
+	backend->digests[pos] = DIGEST_SLOT_DELETED;
+	backend->count --;
+}
+
+static void
+rspamd_fuzzy_mem_del (struct rspamd_fuzzy_backend_memory *backend,
+		const guchar *digest)
+{
+	gboolean found;
+	guint32 pos;
+
+	pos = rspamd_fuzzy_mem_digest_slot (backend, digest, &found);
+
+	if (found) {
+		rspamd_fuzzy_mem_del_slot (backend, pos);
+	}
+}
+
+static void
+rspamd_fuzzy_mem_set_version (struct rspamd_fuzzy_backend_memory *backend,
+		const gchar *src, guint64 version)
+{
+	guint64 *pver;
+
+	pver = g_hash_table_lookup (backend->sources, src);
+
+	if (pver == NULL) {
+		pver = g_malloc (sizeof (*pver));
+		g_hash_table_insert (backend->sources, g_strdup (src), pver);
+	}
+
+	*pver = version;
+}
+
+static void
+rspamd_fuzzy_mem_free_tables (struct rspamd_fuzzy_backend_memory *backend)
+{
+	g_free (backend->entries);
+	rspamd_fuzzy_mem_table_free (backend, backend->digests);
+	rspamd_fuzzy_mem_table_free (backend, backend->shingles);
+
+	if (backend->snap_map) {
+		munmap (backend->snap_map, backend->snap_size);
+		backend->snap_map = NULL;
+		backend->snap_size = 0;
+	}
+
+	backend->snap_entries = NULL;
+	backend->snap_nentries = 0;
+}
+
+static void
+rspamd_fuzzy_mem_reset (struct rspamd_fuzzy_backend_memory *backend)
+{
+	rspamd_fuzzy_mem_free_tables (backend);
+	backend->nentries = 0;
+	backend->entries_used = 0;
+	backend->entries = NULL;
+	g_array_set_size (backend->free_entries, 0);
+	backend->digests_size = MIN_TABLE_SIZE;
+	backend->digests_used = 0;
+	backend->digests = g_malloc0 (sizeof (*backend->digests) *
+			backend->digests_size);
+	backend->count = 0;
+	backend->shingles_size = MIN_TABLE_SIZE;
+	backend->shingles_used = 0;
+	backend->shingles = g_malloc0 (sizeof (*backend->shingles) *
+			backend->shingles_size);
+	g_hash_table_remove_all (backend->sources);
+	backend->serial = 0;
+	backend->snap_ino = 0;
+}
+
+/*
+ * Applies log records from `data`, returns number of bytes consumed
+ * (incomplete trailing record is not consumed)
+ */
+static gsize
+rspamd_fuzzy_mem_apply_log (struct rspamd_fuzzy_backend_memory *backend,
+		const guchar *data, gsize len)
+{
+	struct rspamd_fuzzy_mem_log_rec rec;
+	guint64 shingles[RSPAMD_SHINGLE_SIZE];
+	gchar src[sizeof (rec.digest) + 1];
+	gsize consumed = 0, reclen;
+
+	while (len - consumed >= sizeof (rec)) {
+		memcpy (&rec, data + consumed, sizeof (rec));
+		reclen = sizeof (rec);
+
+		if (rec.op == RSPAMD_FUZZY_MEM_LOG_ADD && rec.has_shingles) {
+			reclen += sizeof (shingles);
+		}
+
+		if (len - consumed < reclen) {
+			break;
+		}
+
+		switch (rec.op) {
+		case RSPAMD_FUZZY_MEM_LOG_ADD:
+			if (rec.has_shingles) {
+				memcpy (shingles, data + consumed + sizeof (rec),
+						sizeof (shingles));
+			}
+
+			rspamd_fuzzy_mem_add (backend, rec.digest, rec.flag, rec.value,
+					rec.ts, rec.has_shingles ? shingles : NULL);
+			break;
+		case RSPAMD_FUZZY_MEM_LOG_DEL:
+			rspamd_fuzzy_mem_del (backend, rec.digest);
+			break;
+		case RSPAMD_FUZZY_MEM_LOG_REFRESH: {
+			struct rspamd_fuzzy_mem_entry *ent;
+
+			ent = rspamd_fuzzy_mem_lookup (backend, rec.digest);
+
+			if (ent) {
+				ent->ts = rec.ts;
+			}
+			break;
+		}
+		case RSPAMD_FUZZY_MEM_LOG_VERSION:
+			rspamd_strlcpy (src, rec.digest, sizeof (src));
+			rspamd_fuzzy_mem_set_version (backend, src, rec.value);
+			break;
+		default:
+			msg_err_fuzzy_memory ("invalid log record type %d at offset %z, "
+					"ignore the rest of log", (gint)rec.op,
+					(gsize)(backend->log_off + consumed));
+			/* Do not try to read it again */
+			return len;
+		}
+
+		consumed += reclen;
+	}
+
+	return consumed;
+}
+
+/*
+ * Reads new records from the log, returns FALSE if log does not belong
+ * to the loaded snapshot
+ */
+static gboolean
+rspamd_fuzzy_mem_follow_log (struct rspamd_fuzzy_backend_memory *backend)
+{
+	struct rspamd_fuzzy_mem_log_hdr hdr;
+	struct stat st;
+	guchar *buf;
+	gssize r;
+	gsize consumed;
+
+	if (backend->log_fd == -1) {
+		backend->log_fd = rspamd_file_xopen (backend->log_path,
+				O_RDWR | O_APPEND, 0, TRUE);
+
+		if (backend->log_fd == -1) {
+			return FALSE;
+		}
+
+		if (pread (backend->log_fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) ||
+				memcmp (hdr.magic, rspamd_fuzzy_mem_log_magic,
+						sizeof (hdr.magic)) != 0 ||
+				hdr.serial != backend->serial) {
+			/* Log is being rotated */
+			close (backend->log_fd);
+			backend->log_fd = -1;
+
+			return FALSE;
+		}
+
+		backend->log_off = sizeof (hdr);
+	}
+
+	if (fstat (backend->log_fd, &st) == -1 || st.st_size <= backend->log_off) {
+		return TRUE;
+	}
+
+	buf = g_malloc (st.st_size - backend->log_off);
+	r = pread (backend->log_fd, buf, st.st_size - backend->log_off,
+			backend->log_off);
+
+	if (r > 0) {
+		consumed = rspamd_fuzzy_mem_apply_log (backend, buf, r);
+		backend->log_off += consumed;
+	}
+
+	g_free (buf);
+
+	return TRUE;
+}
+
+/* Checks that tables of a mapped snapshot do not refer outside of it */
+static gboolean
+rspamd_fuzzy_mem_snap_valid (const guchar *map, gsize size)
+{
+	const struct rspamd_fuzzy_mem_snap_hdr *hdr;
+	const struct rspamd_fuzzy_mem_entry *sent;
+	const struct rspamd_fuzzy_mem_shingle *ssh;
+	const guint32 *sdig;
+	guint64 i, expected, nused;
+
+	hdr = (const struct rspamd_fuzzy_mem_snap_hdr *)map;
+
+	if (hdr->nentries >= G_MAXUINT32 || hdr->count > hdr->nentries ||
+			hdr->nsources > G_MAXUINT32 ||
+			hdr->digests_size < MIN_TABLE_SIZE ||
+			hdr->digests_size > G_MAXUINT32 / 2 + 1 ||
+			(hdr->digests_size & (hdr->digests_size - 1)) != 0 ||
+			hdr->shingles_size < MIN_TABLE_SIZE ||
+			hdr->shingles_size > G_MAXUINT32 / 2 + 1 ||
+			(hdr->shingles_size & (hdr->shingles_size - 1)) != 0 ||
+			hdr->digests_used >= hdr->digests_size ||
+			hdr->shingles_used >= hdr->shingles_size) {
+		return FALSE;
+	}
+
+	expected = sizeof (*hdr) + hdr->nentries * sizeof (*sent) +
+			hdr->digests_size * sizeof (*sdig) +
+			hdr->shingles_size * sizeof (*ssh) +
+			hdr->nsources * sizeof (struct rspamd_fuzzy_mem_snap_source);
+
+	if (size != expected) {
+		return FALSE;
+	}
+
+	sent = (const struct rspamd_fuzzy_mem_entry *)(map + sizeof (*hdr));
+
+	for (i = 0, nused = 0; i < hdr->nentries; i ++) {
+		if (sent[i].live) {
+			nused ++;
+		}
+	}
+
+	if (nused != hdr->count) {
+		return FALSE;
+	}
+
+	/* Lookups rely on empty slots to stop */
+	sdig = (const guint32 *)(sent + hdr->nentries);
+
+	for (i = 0, nused = 0; i < hdr->digests_size; i ++) {
+		if (sdig[i] != DIGEST_SLOT_EMPTY) {
+			if (sdig[i] != DIGEST_SLOT_DELETED && sdig[i] > hdr->nentries) {
+				return FALSE;
+			}
+
+			nused ++;
+		}
+	}
+
+	if (nused != hdr->digests_used) {
+		return FALSE;
+	}
+
+	ssh = (const struct rspamd_fuzzy_mem_shingle *)(sdig + hdr->digests_size);
+
+	for (i = 0, nused = 0; i < hdr->shingles_size; i ++) {
+		if (ssh[i].entry != SHINGLE_NONE) {
+			if (ssh[i].entry > hdr->nentries) {
+				return FALSE;
+			}
+
+			nused ++;
+		}
+	}
+
+	return nused == hdr->shingles_used;
+}
+
+static gboolean
+rspamd_fuzzy_mem_load_snapshot (struct rspamd_fuzzy_backend_memory *backend,
+		GError **err)
+{
+	const struct rspamd_fuzzy_mem_snap_hdr *hdr;
+	const struct rspamd_fuzzy_mem_snap_source *ssrc;
+	gchar src[RSPAMD_FUZZY_MEM_SOURCE_LEN + 1];
+	struct stat st;
+	guchar *map;
+	guint32 i;
+	gint fd;
+
+	fd = rspamd_file_xopen (backend->path, O_RDONLY, 0, TRUE);
+
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			/* Empty storage */
+			rspamd_fuzzy_mem_reset (backend);
+
+			return TRUE;
+		}
+
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+				"cannot open %s: %s", backend->path, strerror (errno));
+
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+				"cannot stat %s: %s", backend->path, strerror (errno));
+		close (fd);
+
+		return FALSE;
+	}
+
+	if ((gsize)st.st_size < sizeof (*hdr)) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), EINVAL,
+				"invalid snapshot %s", backend->path);
+		close (fd);
+
+		return FALSE;
+	}
+
+	/*
+	 * Private writable mapping: pages are copied when the tables loaded from
+	 * the snapshot are modified, others are shared between processes
+	 */
+	map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), errno,
+				"cannot map %s: %s", backend->path, strerror (errno));
+
+		return FALSE;
+	}
+
+	hdr = (const struct rspamd_fuzzy_mem_snap_hdr *)map;
+
+	if (memcmp (hdr->magic, rspamd_fuzzy_mem_snap_magic,
+			sizeof (hdr->magic)) != 0 ||
+			!rspamd_fuzzy_mem_snap_valid (map, st.st_size)) {
+		munmap (map, st.st_size);
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (), EINVAL,
+				"invalid snapshot %s of %z bytes", backend->path,
+				(gsize)st.st_size);
+
+		return FALSE;
+	}
+
+	rspamd_fuzzy_mem_reset (backend);
+	/* Empty tables are replaced by the mapped ones */
+	g_free (backend->digests);
+	g_free (backend->shingles);
+
+	backend->snap_map = map;
+	backend->snap_size = st.st_size;
+	backend->snap_entries = (struct rspamd_fuzzy_mem_entry *)(map +
+			sizeof (*hdr));
+	backend->snap_nentries = hdr->nentries;
+	backend->entries_used = hdr->nentries;
+	backend->count = hdr->count;
+	backend->digests = (guint32 *)(backend->snap_entries + hdr->nentries);
+	backend->digests_size = hdr->digests_size;
+	backend->digests_used = hdr->digests_used;
+	backend->shingles = (struct rspamd_fuzzy_mem_shingle *)(backend->digests +
+			hdr->digests_size);
+	backend->shingles_size = hdr->shingles_size;
+	backend->shingles_used = hdr->shingles_used;
+
+	for (i = 0; i < backend->snap_nentries; i ++) {
+		if (!backend->snap_entries[i].live) {
+			g_array_append_val (backend->free_entries, i);
+		}
+	}
+
+	ssrc = (const struct rspamd_fuzzy_mem_snap_source *)(backend->shingles +
+			hdr->shingles_size);
+
+	for (i = 0; i < hdr->nsources; i ++) {
+		rspamd_strlcpy (src, ssrc[i].name, sizeof (src));
+		rspamd_fuzzy_mem_set_version (backend, src, ssrc[i].version);
+	}
+
+	backend->serial = hdr->serial;
+	backend->snap_ino = st.st_ino;
+
+	msg_info_fuzzy_memory ("loaded %ud hashes from snapshot %s",
+			backend->count, backend->path);
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_fuzzy_mem_reload (struct rspamd_fuzzy_backend_memory *backend,
+		GError **err)
+{
+	if (backend->log_fd != -1) {
+		close (backend->log_fd);
+		backend->log_fd = -1;
+	}
+
+	if (!rspamd_fuzzy_mem_load_snapshot (backend, err)) {
+		return FALSE;
+	}
+
+	rspamd_fuzzy_mem_follow_log (backend);
+
+	return TRUE;
+}
+
+/*
+ * Writes a new log with the current serial and atomically replaces the old one
+ */
+static gboolean
+rspamd_fuzzy_mem_create_log (struct rspamd_fuzzy_backend_memory *backend,
+		gboolean exclusive)
+{
+	struct rspamd_fuzzy_mem_log_hdr hdr;
+	gchar tmpbuf[PATH_MAX];
+	gint fd;
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, rspamd_fuzzy_mem_log_magic, sizeof (hdr.magic));
+	hdr.serial = backend->serial;
+
+	if (exclusive) {
+		/* Initial creation, another process might be doing the same */
+		fd = rspamd_file_xopen (backend->log_path,
+				O_RDWR | O_APPEND | O_CREAT | O_EXCL, 00644, FALSE);
+
+		if (fd == -1) {
+			return errno == EEXIST;
+		}
+
+		if (write (fd, &hdr, sizeof (hdr)) != sizeof (hdr)) {
+			msg_err_fuzzy_memory ("cannot write log %s: %s",
+					backend->log_path, strerror (errno));
+			close (fd);
+			unlink (backend->log_path);
+
+			return FALSE;
+		}
+
+		close (fd);
+
+		return TRUE;
+	}
+
+	rspamd_snprintf (tmpbuf, sizeof (tmpbuf), "%s.new", backend->log_path);
+	fd = rspamd_file_xopen (tmpbuf, O_WRONLY | O_CREAT | O_TRUNC, 00644, FALSE);
+
+	if (fd == -1) {
+		msg_err_fuzzy_memory ("cannot create log %s: %s",
+				tmpbuf, strerror (errno));
+
+		return FALSE;
+	}
+
+	if (write (fd, &hdr, sizeof (hdr)) != sizeof (hdr)) {
+		msg_err_fuzzy_memory ("cannot write log %s: %s",
+				tmpbuf, strerror (errno));
+		close (fd);
+		unlink (tmpbuf);
+
+		return FALSE;
+	}
+
+	close (fd);
+
+	if (rename (tmpbuf, backend->log_path) == -1) {
+		msg_err_fuzzy_memory ("cannot rename %s to %s: %s",
+				tmpbuf, backend->log_path, strerror (errno));
+		unlink (tmpbuf);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Called by the writer when the log cannot be followed. If the process has
+ * crashed after a new snapshot has been renamed but before the log has been
+ * replaced, the log left belongs to the previous snapshot and all its records
+ * are already in the current one, so it is replaced by an empty log
+ */
+static gboolean
+rspamd_fuzzy_mem_repair_log (struct rspamd_fuzzy_backend_memory *backend)
+{
+	struct rspamd_fuzzy_mem_log_hdr hdr;
+	gboolean stale;
+	gint fd;
+
+	fd = rspamd_file_xopen (backend->log_path, O_RDONLY, 0, TRUE);
+
+	if (fd == -1) {
+		stale = (errno == ENOENT);
+	}
+	else {
+		stale = pread (fd, &hdr, sizeof (hdr), 0) == sizeof (hdr) &&
+				memcmp (hdr.magic, rspamd_fuzzy_mem_log_magic,
+						sizeof (hdr.magic)) == 0 &&
+				hdr.serial < backend->serial;
+		close (fd);
+	}
+
+	if (!stale) {
+		return FALSE;
+	}
+
+	msg_warn_fuzzy_memory ("log %s does not belong to snapshot %s, "
+			"start a new one", backend->log_path, backend->path);
+
+	if (!rspamd_fuzzy_mem_create_log (backend, FALSE)) {
+		return FALSE;
+	}
+
+	return rspamd_fuzzy_mem_follow_log (backend) && backend->log_fd != -1;
+}
+
+static gboolean
+rspamd_fuzzy_mem_write_buf (gint fd, const void *data, gsize len)
+{
+	const guchar *p = data;
+	gssize r;
+
+	while (len > 0) {
+		r = write (fd, p, len);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return FALSE;
+		}
+
+		p += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Appends records to the log, which must be followed up to its end, so
+ * log_off is the end of the last complete record
+ */
+static gboolean
+rspamd_fuzzy_mem_append_log (struct rspamd_fuzzy_backend_memory *backend,
+		const guchar *data, gsize len)
+{
+	struct stat st;
+
+	if (fstat (backend->log_fd, &st) == -1) {
+		msg_err_fuzzy_memory ("cannot stat log %s: %s",
+				backend->log_path, strerror (errno));
+
+		return FALSE;
+	}
+
+	if (st.st_size > backend->log_off) {
+		/* Incomplete record left by an interrupted append */
+		msg_warn_fuzzy_memory ("drop %z bytes of incomplete record at the "
+				"end of log %s", (gsize)(st.st_size - backend->log_off),
+				backend->log_path);
+
+		if (ftruncate (backend->log_fd, backend->log_off) == -1) {
+			msg_err_fuzzy_memory ("cannot truncate log %s: %s",
+					backend->log_path, strerror (errno));
+
+			return FALSE;
+		}
+	}
+
+	if (!rspamd_fuzzy_mem_write_buf (backend->log_fd, data, len)) {
+		msg_err_fuzzy_memory ("cannot append to log %s: %s",
+				backend->log_path, strerror (errno));
+
+		/* Do not leave a partial record that would misalign the next ones */
+		if (ftruncate (backend->log_fd, backend->log_off) == -1) {
+			msg_err_fuzzy_memory ("cannot truncate log %s: %s",
+					backend->log_path, strerror (errno));
+		}
+
+		return FALSE;
+	}
+
+	backend->log_off += len;
+
+	return TRUE;
+}
+
+/*
+ * Rebuilds tables without deleted entries and stale shingles, tables are
+ * sized to keep load factor low after the snapshot is loaded
+ */
+static void
+rspamd_fuzzy_mem_compact (struct rspamd_fuzzy_backend_memory *backend)
+{
+	struct rspamd_fuzzy_mem_entry *entries, *ent;
+	struct rspamd_fuzzy_mem_shingle *shingles, *sh;
+	guint32 *digests, *idx_map, i, pos, nentries = 0, nshingles = 0,
+			digests_size, shingles_size, mask;
+
+	idx_map = g_malloc (sizeof (*idx_map) * MAX (backend->entries_used, 1));
+	entries = g_malloc (sizeof (*entries) * MAX (backend->count, 1));
+
+	for (i = 0; i < backend->entries_used; i ++) {
+		ent = rspamd_fuzzy_mem_entry (backend, i);
+
+		if (ent->live) {
+			entries[nentries] = *ent;
+			entries[nentries].gen = 1;
+			idx_map[i] = nentries ++;
+		}
+	}
+
+	g_assert (nentries == backend->count);
+
+	for (i = 0; i < backend->shingles_size; i ++) {
+		if (rspamd_fuzzy_mem_shingle_valid (backend, &backend->shingles[i])) {
+			nshingles ++;
+		}
+	}
+
+	digests_size = rspamd_fuzzy_mem_table_size (nentries);
+	digests = g_malloc0 (sizeof (*digests) * digests_size);
+	mask = digests_size - 1;
+
+	for (i = 0; i < nentries; i ++) {
+		pos = rspamd_fuzzy_mem_digest_hash (entries[i].digest) & mask;
+
+		while (digests[pos] != DIGEST_SLOT_EMPTY) {
+			pos = (pos + 1) & mask;
+		}
+
+		digests[pos] = i + 1;
+	}
+
+	shingles_size = rspamd_fuzzy_mem_table_size (nshingles);
+	shingles = g_malloc0 (sizeof (*shingles) * shingles_size);
+	mask = shingles_size - 1;
+
+	for (i = 0; i < backend->shingles_size; i ++) {
+		sh = &backend->shingles[i];
+
+		if (rspamd_fuzzy_mem_shingle_valid (backend, sh)) {
+			pos = rspamd_fuzzy_mem_shingle_hash (sh->hash, sh->number) & mask;
+
+			while (shingles[pos].entry != SHINGLE_NONE) {
+				pos = (pos + 1) & mask;
+			}
+
+			shingles[pos].hash = sh->hash;
+			shingles[pos].number = sh->number;
+			shingles[pos].entry = idx_map[sh->entry - 1] + 1;
+			shingles[pos].gen = 1;
+		}
+	}
+
+	g_free (idx_map);
+	rspamd_fuzzy_mem_free_tables (backend);
+
+	backend->entries = entries;
+	backend->nentries = MAX (nentries, 1);
+	backend->entries_used = nentries;
+	g_array_set_size (backend->free_entries, 0);
+	backend->digests = digests;
+	backend->digests_size = digests_size;
+	backend->digests_used = nentries;
+	backend->shingles = shingles;
+	backend->shingles_size = shingles_size;
+	backend->shingles_used = nshingles;
+}
+
+static gboolean
+rspamd_fuzzy_mem_write_snapshot (struct rspamd_fuzzy_backend_memory *backend)
+{
+	struct rspamd_fuzzy_mem_snap_hdr hdr;
+	struct rspamd_fuzzy_mem_snap_source ssrc;
+	gchar tmpbuf[PATH_MAX];
+	GHashTableIter it;
+	gpointer k, v;
+	gboolean ret = FALSE, ok;
+	gint fd;
+
+	rspamd_snprintf (tmpbuf, sizeof (tmpbuf), "%s.new", backend->path);
+	fd = rspamd_file_xopen (tmpbuf, O_WRONLY | O_CREAT | O_TRUNC, 00644,
+			FALSE);
+
+	if (fd == -1) {
+		msg_err_fuzzy_memory ("cannot create snapshot %s: %s",
+				tmpbuf, strerror (errno));
+
+		return FALSE;
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, rspamd_fuzzy_mem_snap_magic, sizeof (hdr.magic));
+	hdr.serial = backend->serial + 1;
+	hdr.nentries = backend->entries_used;
+	hdr.count = backend->count;
+	hdr.digests_size = backend->digests_size;
+	hdr.digests_used = backend->digests_used;
+	hdr.shingles_size = backend->shingles_size;
+	hdr.shingles_used = backend->shingles_used;
+	hdr.nsources = g_hash_table_size (backend->sources);
+
+	/* Tables are written as is, so they can be used from the mapping */
+	ok = rspamd_fuzzy_mem_write_buf (fd, &hdr, sizeof (hdr)) &&
+			rspamd_fuzzy_mem_write_buf (fd, backend->snap_entries,
+					sizeof (*backend->snap_entries) * backend->snap_nentries) &&
+			rspamd_fuzzy_mem_write_buf (fd, backend->entries,
+					sizeof (*backend->entries) *
+					(backend->entries_used - backend->snap_nentries)) &&
+			rspamd_fuzzy_mem_write_buf (fd, backend->digests,
+					sizeof (*backend->digests) * backend->digests_size) &&
+			rspamd_fuzzy_mem_write_buf (fd, backend->shingles,
+					sizeof (*backend->shingles) * backend->shingles_size);
+
+	g_hash_table_iter_init (&it, backend->sources);
+
+	while (ok && g_hash_table_iter_next (&it, &k, &v)) {
+		memset (&ssrc, 0, sizeof (ssrc));
+		rspamd_strlcpy (ssrc.name, k, sizeof (ssrc.name));
+		ssrc.version = *(guint64 *)v;
+		ok = rspamd_fuzzy_mem_write_buf (fd, &ssrc, sizeof (ssrc));
+	}
+
+	if (!ok || fsync (fd) == -1) {
+		msg_err_fuzzy_memory ("cannot write snapshot %s: %s",
+				tmpbuf, strerror (errno));
+		close (fd);
+		unlink (tmpbuf);
+	}
+	else {
+		close (fd);
+
+		if (rename (tmpbuf, backend->path) == -1) {
+			msg_err_fuzzy_memory ("cannot rename %s to %s: %s",
+					tmpbuf, backend->path, strerror (errno));
+			unlink (tmpbuf);
+		}
+		else {
+			ret = TRUE;
+		}
+	}
+
+	return ret;
+}
+
+static void
+rspamd_fuzzy_mem_refresh (gint fd, short what, gpointer ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = ud;
+	struct timeval tv;
+	struct stat st;
+	GError *err = NULL;
+
+	if (stat (backend->path, &st) != -1 && st.st_ino != backend->snap_ino) {
+		/* Snapshot has been replaced by the writer */
+		if (!rspamd_fuzzy_mem_reload (backend, &err)) {
+			msg_err_fuzzy_memory ("cannot reload storage: %e", err);
+			g_error_free (err);
+		}
+	}
+	else {
+		rspamd_fuzzy_mem_follow_log (backend);
+	}
+
+	double_to_tv (backend->refresh_interval, &tv);
+	event_add (&backend->refresh_ev, &tv);
+}
+
+void*
+rspamd_fuzzy_backend_init_memory (struct rspamd_fuzzy_backend *bk,
+		const ucl_object_t *obj, struct rspamd_config *cfg, GError **err)
+{
+	struct rspamd_fuzzy_backend_memory *backend;
+	const ucl_object_t *elt;
+	guchar id_hash[rspamd_cryptobox_HASHBYTES];
+	struct timeval tv;
+
+	elt = ucl_object_lookup_any (obj, "hashfile", "hash_file", "file",
+			"database", NULL);
+
+	if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+		g_set_error (err, rspamd_fuzzy_backend_memory_quark (),
+				EINVAL, "missing snapshot path");
+		return NULL;
+	}
+
+	backend = g_malloc0 (sizeof (*backend));
+	backend->path = g_strdup (ucl_object_tostring (elt));
+	backend->log_path = g_strconcat (backend->path, ".log", NULL);
+	backend->log_fd = -1;
+	backend->free_entries = g_array_new (FALSE, FALSE, sizeof (guint32));
+	backend->sources = g_hash_table_new_full (rspamd_str_hash,
+			rspamd_str_equal, g_free, g_free);
+	backend->refresh_interval = DEFAULT_REFRESH_INTERVAL;
+	backend->ev_base = rspamd_fuzzy_backend_event_base (bk);
+
+	rspamd_cryptobox_hash (id_hash, backend->path, strlen (backend->path),
+			NULL, 0);
+	backend->id = rspamd_encode_base32 (id_hash, sizeof (id_hash));
+
+	elt = ucl_object_lookup (obj, "refresh_interval");
+
+	if (elt) {
+		backend->refresh_interval = ucl_object_todouble (elt);
+	}
+
+	if (!rspamd_fuzzy_mem_load_snapshot (backend, err)) {
+		rspamd_fuzzy_backend_close_memory (bk, backend);
+
+		return NULL;
+	}
+
+	if (access (backend->log_path, F_OK) == -1) {
+		rspamd_fuzzy_mem_create_log (backend, TRUE);
+	}
+
+	rspamd_fuzzy_mem_follow_log (backend);
+
+	if (backend->ev_base && backend->refresh_interval > 0) {
+		event_set (&backend->refresh_ev, -1, EV_TIMEOUT,
+				rspamd_fuzzy_mem_refresh, backend);
+		event_base_set (backend->ev_base, &backend->refresh_ev);
+		double_to_tv (backend->refresh_interval, &tv);
+		event_add (&backend->refresh_ev, &tv);
+		backend->has_refresh = TRUE;
+	}
+
+	return backend;
+}
+
+static gint
+rspamd_fuzzy_mem_uint32_cmp (const void *a, const void *b)
+{
+	guint32 ia = *(const guint32 *)a, ib = *(const guint32 *)b;
+
+	return (ia > ib) - (ia < ib);
+}
+
+static struct rspamd_fuzzy_reply
+rspamd_fuzzy_mem_check (struct rspamd_fuzzy_backend_memory *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gdouble expire)
+{
+	struct rspamd_fuzzy_reply rep;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_mem_entry *ent;
+	guint32 found[RSPAMD_SHINGLE_SIZE], sel = SHINGLE_NONE, i, cur_cnt = 0,
+			max_cnt = 0;
+	time_t now = time (NULL);
+
+	memset (&rep, 0, sizeof (rep));
+	memcpy (rep.digest, cmd->digest, sizeof (rep.digest));
+
+	ent = rspamd_fuzzy_mem_lookup (backend, cmd->digest);
+
+	if (ent == NULL && cmd->shingles_count > 0) {
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			found[i] = rspamd_fuzzy_mem_shingle_find (backend,
+					shcmd->sgl.hashes[i], i);
+		}
+
+		qsort (found, RSPAMD_SHINGLE_SIZE, sizeof (guint32),
+				rspamd_fuzzy_mem_uint32_cmp);
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			if (found[i] == SHINGLE_NONE) {
+				continue;
+			}
+
+			if (i > 0 && found[i] == found[i - 1]) {
+				cur_cnt ++;
+			}
+			else {
+				cur_cnt = 1;
+			}
+
+			if (cur_cnt > max_cnt) {
+				max_cnt = cur_cnt;
+				sel = found[i];
+			}
+		}
+
+		rep.v1.prob = (float)max_cnt / (float)RSPAMD_SHINGLE_SIZE;
+
+		if (sel != SHINGLE_NONE && rep.v1.prob > 0.5) {
+			ent = rspamd_fuzzy_mem_entry (backend, sel - 1);
+			msg_debug_fuzzy_memory ("found fuzzy hash with probability %.2f",
+					rep.v1.prob);
+		}
+		else {
+			rep.v1.prob = 0.0;
+		}
+	}
+	else if (ent != NULL) {
+		rep.v1.prob = 1.0;
+	}
+
+	if (ent != NULL) {
+		if (now - (time_t)ent->ts > expire) {
+			msg_debug_fuzzy_memory ("requested hash has been expired");
+			rep.v1.prob = 0.0;
+		}
+		else {
+			memcpy (rep.digest, ent->digest, sizeof (rep.digest));
+			rep.v1.value = ent->value;
+			rep.v1.flag = ent->flag;
+			rep.ts = ent->ts;
+		}
+	}
+
+	return rep;
+}
+
+void
+rspamd_fuzzy_backend_check_memory (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd *cmd,
+		rspamd_fuzzy_check_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+	struct rspamd_fuzzy_reply rep;
+
+	rep = rspamd_fuzzy_mem_check (backend, cmd,
+			rspamd_fuzzy_backend_get_expire (bk));
+
+	if (cb) {
+		cb (&rep, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_check_many_memory (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		rspamd_fuzzy_check_many_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+	struct rspamd_fuzzy_reply *reps;
+	gdouble expire = rspamd_fuzzy_backend_get_expire (bk);
+	guint i;
+
+	reps = g_malloc (sizeof (*reps) * ncmds);
+
+	for (i = 0; i < ncmds; i ++) {
+		reps[i] = rspamd_fuzzy_mem_check (backend, cmds[i], expire);
+	}
+
+	if (cb) {
+		cb (reps, ncmds, ud);
+	}
+
+	g_free (reps);
+}
+
+void
+rspamd_fuzzy_backend_update_memory (struct rspamd_fuzzy_backend *bk,
+		GArray *updates, const gchar *src,
+		rspamd_fuzzy_update_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+	struct fuzzy_peer_cmd *io_cmd;
+	struct rspamd_fuzzy_cmd *cmd;
+	struct rspamd_fuzzy_mem_log_rec rec;
+	const guint64 *shingles;
+	guint64 shbuf[RSPAMD_SHINGLE_SIZE];
+	GByteArray *log;
+	guint64 *pver, version;
+	guint32 now = time (NULL);
+	guint i, nupdates = 0, nadded = 0, ndeleted = 0, nextended = 0,
+			nignored = 0;
+	gboolean success = TRUE;
+
+	/* Catch up with the log before appending to it */
+	rspamd_fuzzy_mem_follow_log (backend);
+
+	if (backend->log_fd == -1 && !rspamd_fuzzy_mem_repair_log (backend)) {
+		msg_err_fuzzy_memory ("cannot open log %s, refuse updates",
+				backend->log_path);
+
+		if (cb) {
+			cb (FALSE, 0, 0, 0, 0, ud);
+		}
+
+		return;
+	}
+
+	log = g_byte_array_sized_new (updates->len * sizeof (rec));
+
+	for (i = 0; i < updates->len; i ++) {
+		io_cmd = &g_array_index (updates, struct fuzzy_peer_cmd, i);
+
+		if (io_cmd->is_shingle) {
+			cmd = &io_cmd->cmd.shingle.basic;
+			/* Command structure is packed */
+			memcpy (shbuf, io_cmd->cmd.shingle.sgl.hashes, sizeof (shbuf));
+			shingles = shbuf;
+		}
+		else {
+			cmd = &io_cmd->cmd.normal;
+			shingles = NULL;
+		}
+
+		memset (&rec, 0, sizeof (rec));
+		memcpy (rec.digest, cmd->digest, sizeof (rec.digest));
+		rec.flag = cmd->flag;
+		rec.value = cmd->value;
+		rec.ts = now;
+
+		if (cmd->cmd == FUZZY_WRITE) {
+			if (cmd->shingles_count == 0) {
+				shingles = NULL;
+			}
+
+			rec.op = RSPAMD_FUZZY_MEM_LOG_ADD;
+			rec.has_shingles = (shingles != NULL);
+			g_byte_array_append (log, (const guint8 *)&rec, sizeof (rec));
+
+			if (shingles) {
+				g_byte_array_append (log, (const guint8 *)shingles,
+						sizeof (guint64) * RSPAMD_SHINGLE_SIZE);
+			}
+
+			nadded ++;
+			nupdates ++;
+		}
+		else if (cmd->cmd == FUZZY_DEL) {
+			rec.op = RSPAMD_FUZZY_MEM_LOG_DEL;
+			g_byte_array_append (log, (const guint8 *)&rec, sizeof (rec));
+			ndeleted ++;
+			nupdates ++;
+		}
+		else if (cmd->cmd == FUZZY_REFRESH) {
+			if (rspamd_fuzzy_mem_lookup (backend, cmd->digest) != NULL) {
+				rec.op = RSPAMD_FUZZY_MEM_LOG_REFRESH;
+				g_byte_array_append (log, (const guint8 *)&rec, sizeof (rec));
+			}
+
+			nextended ++;
+		}
+		else {
+			nignored ++;
+		}
+	}
+
+	if (nupdates > 0) {
+		pver = g_hash_table_lookup (backend->sources, src);
+		version = pver ? *pver + 1 : 1;
+
+		memset (&rec, 0, sizeof (rec));
+		rec.op = RSPAMD_FUZZY_MEM_LOG_VERSION;
+		rec.value = version;
+		rec.ts = now;
+		rspamd_strlcpy (rec.digest, src, sizeof (rec.digest));
+		g_byte_array_append (log, (const guint8 *)&rec, sizeof (rec));
+	}
+
+	/*
+	 * Tables are changed only when the records are in the log, in the same
+	 * way as other processes replay them
+	 */
+	if (log->len > 0) {
+		success = rspamd_fuzzy_mem_append_log (backend, log->data, log->len);
+
+		if (success) {
+			rspamd_fuzzy_mem_apply_log (backend, log->data, log->len);
+		}
+	}
+
+	g_byte_array_free (log, TRUE);
+
+	if (cb) {
+		cb (success, nadded, ndeleted, nextended, nignored, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_count_memory (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_count_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+
+	if (cb) {
+		cb (backend->count, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_version_memory (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		rspamd_fuzzy_version_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+	guint64 *pver;
+
+	pver = g_hash_table_lookup (backend->sources, src);
+
+	if (cb) {
+		cb (pver ? *pver : 0, ud);
+	}
+}
+
+const gchar*
+rspamd_fuzzy_backend_id_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+
+	return backend->id;
+}
+
+void
+rspamd_fuzzy_backend_expire_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+	gdouble expire = rspamd_fuzzy_backend_get_expire (bk);
+	time_t now = time (NULL);
+	GError *err = NULL;
+	guint32 i, nexpired = 0;
+
+	rspamd_fuzzy_mem_follow_log (backend);
+
+	for (i = 0; i < backend->digests_size; i ++) {
+		if (backend->digests[i] != DIGEST_SLOT_EMPTY &&
+				backend->digests[i] != DIGEST_SLOT_DELETED &&
+				now - (time_t)rspamd_fuzzy_mem_entry (backend,
+					backend->digests[i] - 1)->ts >
+				expire) {
+			rspamd_fuzzy_mem_del_slot (backend, i);
+			nexpired ++;
+		}
+	}
+
+	rspamd_fuzzy_mem_compact (backend);
+
+	/* Snapshot and log rotation, log records are now in the snapshot */
+	if (!rspamd_fuzzy_mem_write_snapshot (backend)) {
+		return;
+	}
+
+	backend->serial ++;
+
+	/*
+	 * If log cannot be created (or we crash here), the old log does not belong
+	 * to the new snapshot: other processes ignore it and the next update
+	 * replaces it with rspamd_fuzzy_mem_repair_log
+	 */
+	rspamd_fuzzy_mem_create_log (backend, FALSE);
+
+	/* Tables are served from the new snapshot as in other processes */
+	if (!rspamd_fuzzy_mem_reload (backend, &err)) {
+		msg_err_fuzzy_memory ("cannot reload storage: %e", err);
+		g_error_free (err);
+	}
+
+	msg_info_fuzzy_memory ("written snapshot with %ud hashes, %ud expired",
+			backend->count, nexpired);
+}
+
+void
+rspamd_fuzzy_backend_close_memory (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_memory *backend = subr_ud;
+
+	if (backend->has_refresh) {
+		event_del (&backend->refresh_ev);
+	}
+
+	if (backend->log_fd != -1) {
+		close (backend->log_fd);
+	}
+
+	rspamd_fuzzy_mem_free_tables (backend);
+	g_array_free (backend->free_entries, TRUE);
+	g_hash_table_unref (backend->sources);
+	g_free (backend->path);
+	g_free (backend->log_path);
+	g_free (backend->id);
+	g_free (backend);
+}
@@ -340,17 +340,91 @@ rspamd_fuzzy_backend_redis_shingles_cmp (const void *a, const void *b)
 	return memcmp (sha->digest, shb->digest, sizeof (sha->digest));
 }
 
+/*
+ * Selects the digest shared by the majority of shingles in MGET reply
+ */
+static gboolean
+rspamd_fuzzy_redis_shingles_select (redisReply *reply, guchar *digest,
+		guint *nfound)
+{
+	redisReply *cur;
+	struct _rspamd_fuzzy_shingles_helper *shingles, *prev = NULL, *sel = NULL;
+	guint i, found = 0, max_found = 0, cur_found = 0;
+
+	if (reply->type != REDIS_REPLY_ARRAY ||
+			reply->elements != RSPAMD_SHINGLE_SIZE) {
+		return FALSE;
+	}
+
+	shingles = g_alloca (sizeof (struct _rspamd_fuzzy_shingles_helper) *
+			RSPAMD_SHINGLE_SIZE);
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		cur = reply->element[i];
+
+		if (cur->type == REDIS_REPLY_STRING) {
+			shingles[i].found = 1;
+			memcpy (shingles[i].digest, cur->str, MIN (64, cur->len));
+			found ++;
+		}
+		else {
+			memset (shingles[i].digest, 0, sizeof (shingles[i].digest));
+			shingles[i].found = 0;
+		}
+	}
+
+	if (found <= RSPAMD_SHINGLE_SIZE / 2) {
+		return FALSE;
+	}
+
+	/* Now sort to find the most frequent element */
+	qsort (shingles, RSPAMD_SHINGLE_SIZE,
+			sizeof (struct _rspamd_fuzzy_shingles_helper),
+			rspamd_fuzzy_backend_redis_shingles_cmp);
+
+	prev = &shingles[0];
+
+	for (i = 1; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		if (!shingles[i].found) {
+			continue;
+		}
+
+		if (memcmp (shingles[i].digest, prev->digest, 64) == 0) {
+			cur_found ++;
+
+			if (cur_found > max_found) {
+				max_found = cur_found;
+				sel = &shingles[i];
+			}
+		}
+		else {
+			cur_found = 1;
+			prev = &shingles[i];
+		}
+	}
+
+	if (max_found > RSPAMD_SHINGLE_SIZE / 2) {
+		g_assert (sel != NULL);
+		memcpy (digest, sel->digest, sizeof (sel->digest));
+		*nfound = max_found;
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 static void
 rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 		gpointer priv)
 {
 	struct rspamd_fuzzy_redis_session *session = priv;
-	redisReply *reply = r, *cur;
+	redisReply *reply = r;
 	struct rspamd_fuzzy_reply rep;
 	struct timeval tv;
 	GString *key;
-	struct _rspamd_fuzzy_shingles_helper *shingles, *prev = NULL, *sel = NULL;
-	guint i, found = 0, max_found = 0, cur_found = 0;
+	guchar sel_digest[64];
+	guint max_found = 0;
 
 	event_del (&session->timeout);
 	memset (&rep, 0, sizeof (rep));
@@ -358,107 +432,57 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 	if (c->err == 0) {
 		rspamd_upstream_ok (session->up);
 
-		if (reply->type == REDIS_REPLY_ARRAY &&
-				reply->elements == RSPAMD_SHINGLE_SIZE) {
-			shingles = g_alloca (sizeof (struct _rspamd_fuzzy_shingles_helper) *
-					RSPAMD_SHINGLE_SIZE);
+		if (rspamd_fuzzy_redis_shingles_select (reply, sel_digest, &max_found)) {
+			session->prob = ((float)max_found) / RSPAMD_SHINGLE_SIZE;
+			rep.v1.prob = session->prob;
+
+			/* Prepare new check command */
+			rspamd_fuzzy_redis_session_free_args (session);
+			session->nargs = 5;
+			session->argv = g_malloc (sizeof (gchar *) * session->nargs);
+			session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
+
+			key = g_string_new (session->backend->redis_object);
+			g_string_append_len (key, sel_digest, sizeof (sel_digest));
+			session->argv[0] = g_strdup ("HMGET");
+			session->argv_lens[0] = 5;
+			session->argv[1] = key->str;
+			session->argv_lens[1] = key->len;
+			session->argv[2] = g_strdup ("V");
+			session->argv_lens[2] = 1;
+			session->argv[3] = g_strdup ("F");
+			session->argv_lens[3] = 1;
+			session->argv[4] = g_strdup ("C");
+			session->argv_lens[4] = 1;
+			g_string_free (key, FALSE); /* Do not free underlying array */
+			memcpy (session->found_digest, sel_digest,
+					sizeof (session->cmd->digest));
+
+			g_assert (session->ctx != NULL);
+			if (redisAsyncCommandArgv (session->ctx,
+					rspamd_fuzzy_redis_check_callback,
+					session, session->nargs,
+					(const gchar **)session->argv,
+					session->argv_lens) != REDIS_OK) {
 
-			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-				cur = reply->element[i];
-
-				if (cur->type == REDIS_REPLY_STRING) {
-					shingles[i].found = 1;
-					memcpy (shingles[i].digest, cur->str, MIN (64, cur->len));
-					found ++;
-				}
-				else {
-					memset (shingles[i].digest, 0, sizeof (shingles[i].digest));
-					shingles[i].found = 0;
-				}
-			}
-
-			if (found > RSPAMD_SHINGLE_SIZE / 2) {
-				/* Now sort to find the most frequent element */
-				qsort (shingles, RSPAMD_SHINGLE_SIZE,
-						sizeof (struct _rspamd_fuzzy_shingles_helper),
-						rspamd_fuzzy_backend_redis_shingles_cmp);
-
-				prev = &shingles[0];
-
-				for (i = 1; i < RSPAMD_SHINGLE_SIZE; i ++) {
-					if (!shingles[i].found) {
-						continue;
-					}
-
-					if (memcmp (shingles[i].digest, prev->digest, 64) == 0) {
-						cur_found ++;
-
-						if (cur_found > max_found) {
-							max_found = cur_found;
-							sel = &shingles[i];
-						}
-					}
-					else {
-						cur_found = 1;
-						prev = &shingles[i];
-					}
+				if (session->callback.cb_check) {
+					memset (&rep, 0, sizeof (rep));
+					session->callback.cb_check (&rep, session->cbdata);
 				}
 
-				if (max_found > RSPAMD_SHINGLE_SIZE / 2) {
-					session->prob = ((float)max_found) / RSPAMD_SHINGLE_SIZE;
-					rep.v1.prob = session->prob;
-
-					g_assert (sel != NULL);
-
-					/* Prepare new check command */
-					rspamd_fuzzy_redis_session_free_args (session);
-					session->nargs = 5;
-					session->argv = g_malloc (sizeof (gchar *) * session->nargs);
-					session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
-
-					key = g_string_new (session->backend->redis_object);
-					g_string_append_len (key, sel->digest, sizeof (sel->digest));
-					session->argv[0] = g_strdup ("HMGET");
-					session->argv_lens[0] = 5;
-					session->argv[1] = key->str;
-					session->argv_lens[1] = key->len;
-					session->argv[2] = g_strdup ("V");
-					session->argv_lens[2] = 1;
-					session->argv[3] = g_strdup ("F");
-					session->argv_lens[3] = 1;
-					session->argv[4] = g_strdup ("C");
-					session->argv_lens[4] = 1;
-					g_string_free (key, FALSE); /* Do not free underlying array */
-					memcpy (session->found_digest, sel->digest,
-							sizeof (session->cmd->digest));
-
-					g_assert (session->ctx != NULL);
-					if (redisAsyncCommandArgv (session->ctx,
-							rspamd_fuzzy_redis_check_callback,
-							session, session->nargs,
-							(const gchar **)session->argv,
-							session->argv_lens) != REDIS_OK) {
-
-						if (session->callback.cb_check) {
-							memset (&rep, 0, sizeof (rep));
-							session->callback.cb_check (&rep, session->cbdata);
-						}
-
-						rspamd_fuzzy_redis_session_dtor (session, TRUE);
-					}
-					else {
-						/* Add timeout */
-						event_set (&session->timeout, -1, EV_TIMEOUT,
-								rspamd_fuzzy_redis_timeout,
-								session);
-						event_base_set (session->ev_base, &session->timeout);
-						double_to_tv (session->backend->timeout, &tv);
-						event_add (&session->timeout, &tv);
-					}
-
-					return;
-				}
+				rspamd_fuzzy_redis_session_dtor (session, TRUE);
+			}
+			else {
+				/* Add timeout */
+				event_set (&session->timeout, -1, EV_TIMEOUT,
+						rspamd_fuzzy_redis_timeout,
+						session);
+				event_base_set (session->ev_base, &session->timeout);
+				double_to_tv (session->backend->timeout, &tv);
+				event_add (&session->timeout, &tv);
 			}
+
+			return;
 		}
 
 		if (session->callback.cb_check) {
@@ -711,6 +735,378 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 	}
 }
 
+/*
+ * Batched check: all digests are requested over a single connection, hiredis
+ * writes queued commands at once, so redis receives them as a pipeline
+ */
+struct rspamd_fuzzy_redis_many_session;
+
+struct rspamd_fuzzy_redis_many_elt {
+	struct rspamd_fuzzy_redis_many_session *session;
+	const struct rspamd_fuzzy_cmd *cmd;
+	struct rspamd_fuzzy_reply *rep;
+	float prob;
+	gboolean shingles_checked;
+	guchar found_digest[rspamd_cryptobox_HASHBYTES];
+};
+
+struct rspamd_fuzzy_redis_many_session {
+	struct rspamd_fuzzy_backend_redis *backend;
+	redisAsyncContext *ctx;
+	struct event timeout;
+	struct event_base *ev_base;
+	struct upstream *up;
+	struct rspamd_fuzzy_redis_many_elt *elts;
+	struct rspamd_fuzzy_reply *reps;
+	guint ncmds;
+	guint npending;
+	gboolean failed;
+	rspamd_fuzzy_check_many_cb cb;
+	void *cbdata;
+};
+
+static void rspamd_fuzzy_redis_many_check_callback (redisAsyncContext *c,
+		gpointer r, gpointer priv);
+
+static void
+rspamd_fuzzy_redis_many_dtor (struct rspamd_fuzzy_redis_many_session *session,
+		gboolean is_fatal)
+{
+	redisAsyncContext *ac;
+
+	if (session->ctx) {
+		ac = session->ctx;
+		session->ctx = NULL;
+		rspamd_redis_pool_release_connection (session->backend->pool,
+				ac, is_fatal);
+	}
+
+	if (event_get_base (&session->timeout)) {
+		event_del (&session->timeout);
+	}
+
+	REF_RELEASE (session->backend);
+	g_free (session->elts);
+	g_free (session->reps);
+	g_free (session);
+}
+
+static void
+rspamd_fuzzy_redis_many_timeout (gint fd, short what, gpointer priv)
+{
+	struct rspamd_fuzzy_redis_many_session *session = priv;
+	redisAsyncContext *ac;
+	static char errstr[128];
+
+	if (session->ctx) {
+		ac = session->ctx;
+		session->ctx = NULL;
+		ac->err = REDIS_ERR_IO;
+		/* Should be safe as in hiredis it is char[128] */
+		rspamd_snprintf (errstr, sizeof (errstr), "%s", strerror (ETIMEDOUT));
+		ac->errstr = errstr;
+
+		/* This will call all pending callbacks and close the session */
+		rspamd_redis_pool_release_connection (session->backend->pool,
+				ac, TRUE);
+	}
+}
+
+static void
+rspamd_fuzzy_redis_many_arm_timeout (
+		struct rspamd_fuzzy_redis_many_session *session)
+{
+	struct timeval tv;
+
+	if (event_get_base (&session->timeout)) {
+		event_del (&session->timeout);
+	}
+
+	event_set (&session->timeout, -1, EV_TIMEOUT,
+			rspamd_fuzzy_redis_many_timeout, session);
+	event_base_set (session->ev_base, &session->timeout);
+	double_to_tv (session->backend->timeout, &tv);
+	event_add (&session->timeout, &tv);
+}
+
+static void
+rspamd_fuzzy_redis_many_elt_done (
+		struct rspamd_fuzzy_redis_many_session *session)
+{
+	g_assert (session->npending > 0);
+
+	if (--session->npending > 0) {
+		return;
+	}
+
+	if (event_get_base (&session->timeout)) {
+		event_del (&session->timeout);
+	}
+
+	if (session->failed) {
+		rspamd_upstream_fail (session->up, FALSE);
+	}
+	else {
+		rspamd_upstream_ok (session->up);
+	}
+
+	if (session->cb) {
+		session->cb (session->reps, session->ncmds, session->cbdata);
+	}
+
+	rspamd_fuzzy_redis_many_dtor (session, session->failed);
+}
+
+static gboolean
+rspamd_fuzzy_redis_many_send_hmget (struct rspamd_fuzzy_redis_many_elt *elt,
+		const guchar *digest)
+{
+	struct rspamd_fuzzy_redis_many_session *session = elt->session;
+	const gchar *argv[5];
+	gsize argv_lens[5];
+	GString *key;
+	gint ret;
+
+	key = g_string_new (session->backend->redis_object);
+	g_string_append_len (key, digest, sizeof (elt->cmd->digest));
+	argv[0] = "HMGET";
+	argv_lens[0] = 5;
+	argv[1] = key->str;
+	argv_lens[1] = key->len;
+	argv[2] = "V";
+	argv_lens[2] = 1;
+	argv[3] = "F";
+	argv_lens[3] = 1;
+	argv[4] = "C";
+	argv_lens[4] = 1;
+
+	/* Hiredis formats command immediately, so arguments could be freed */
+	ret = redisAsyncCommandArgv (session->ctx,
+			rspamd_fuzzy_redis_many_check_callback,
+			elt, G_N_ELEMENTS (argv), argv, argv_lens);
+	g_string_free (key, TRUE);
+
+	return ret == REDIS_OK;
+}
+
+static void
+rspamd_fuzzy_redis_many_shingles_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_many_elt *elt = priv;
+	struct rspamd_fuzzy_redis_many_session *session = elt->session;
+	redisReply *reply = r;
+	guint max_found = 0;
+
+	if (c->err == 0 && reply != NULL) {
+		if (rspamd_fuzzy_redis_shingles_select (reply, elt->found_digest,
+				&max_found)) {
+			elt->prob = ((float)max_found) / RSPAMD_SHINGLE_SIZE;
+			elt->rep->v1.prob = elt->prob;
+
+			if (session->ctx &&
+					rspamd_fuzzy_redis_many_send_hmget (elt, elt->found_digest)) {
+				rspamd_fuzzy_redis_many_arm_timeout (session);
+				/* Element is still pending */
+				return;
+			}
+
+			session->failed = TRUE;
+		}
+	}
+	else {
+		if (c->errstr) {
+			msg_err_redis_session ("error getting shingles: %s", c->errstr);
+		}
+
+		session->failed = TRUE;
+	}
+
+	rspamd_fuzzy_redis_many_elt_done (session);
+}
+
+static gboolean
+rspamd_fuzzy_redis_many_send_shingles (struct rspamd_fuzzy_redis_many_elt *elt)
+{
+	struct rspamd_fuzzy_redis_many_session *session = elt->session;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	gchar *argv[RSPAMD_SHINGLE_SIZE + 1];
+	gsize argv_lens[RSPAMD_SHINGLE_SIZE + 1];
+	GString *key;
+	guint i, init_len;
+	gint ret;
+
+	shcmd = (const struct rspamd_fuzzy_shingle_cmd *)elt->cmd;
+	argv[0] = "MGET";
+	argv_lens[0] = 4;
+	init_len = strlen (session->backend->redis_object);
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		key = g_string_sized_new (init_len + 2 + 2 + sizeof ("18446744073709551616"));
+		rspamd_printf_gstring (key, "%s_%d_%uL", session->backend->redis_object,
+				i, shcmd->sgl.hashes[i]);
+		argv[i + 1] = key->str;
+		argv_lens[i + 1] = key->len;
+		g_string_free (key, FALSE); /* Do not free underlying array */
+	}
+
+	elt->shingles_checked = TRUE;
+	ret = redisAsyncCommandArgv (session->ctx,
+			rspamd_fuzzy_redis_many_shingles_callback,
+			elt, G_N_ELEMENTS (argv), (const gchar **)argv, argv_lens);
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		g_free (argv[i + 1]);
+	}
+
+	return ret == REDIS_OK;
+}
+
+static void
+rspamd_fuzzy_redis_many_check_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_many_elt *elt = priv;
+	struct rspamd_fuzzy_redis_many_session *session = elt->session;
+	redisReply *reply = r, *cur;
+	struct rspamd_fuzzy_reply *rep = elt->rep;
+	guint found_elts = 0;
+
+	if (c->err == 0 && reply != NULL) {
+		if (reply->type == REDIS_REPLY_ARRAY && reply->elements >= 2) {
+			cur = reply->element[0];
+
+			if (cur->type == REDIS_REPLY_STRING) {
+				rep->v1.value = strtoul (cur->str, NULL, 10);
+				found_elts ++;
+			}
+
+			cur = reply->element[1];
+
+			if (cur->type == REDIS_REPLY_STRING) {
+				rep->v1.flag = strtoul (cur->str, NULL, 10);
+				found_elts ++;
+			}
+
+			if (found_elts >= 2) {
+				rep->v1.prob = elt->prob;
+				memcpy (rep->digest, elt->found_digest, sizeof (rep->digest));
+			}
+
+			if (reply->elements > 2) {
+				cur = reply->element[2];
+
+				if (cur->type == REDIS_REPLY_STRING) {
+					rep->ts = strtoul (cur->str, NULL, 10);
+				}
+			}
+		}
+
+		if (found_elts != 2 && elt->cmd->shingles_count > 0 &&
+				!elt->shingles_checked) {
+			/* Previous fields might be partially filled */
+			rep->v1.value = 0;
+			rep->v1.flag = 0;
+			rep->ts = 0;
+
+			if (session->ctx && rspamd_fuzzy_redis_many_send_shingles (elt)) {
+				rspamd_fuzzy_redis_many_arm_timeout (session);
+				/* Element is still pending */
+				return;
+			}
+
+			session->failed = TRUE;
+		}
+	}
+	else {
+		if (c->errstr) {
+			msg_err_redis_session ("error getting hashes: %s", c->errstr);
+		}
+
+		session->failed = TRUE;
+	}
+
+	rspamd_fuzzy_redis_many_elt_done (session);
+}
+
+void
+rspamd_fuzzy_backend_check_many_redis (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		rspamd_fuzzy_check_many_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_redis *backend = subr_ud;
+	struct rspamd_fuzzy_redis_many_session *session;
+	struct rspamd_fuzzy_redis_many_elt *elt;
+	struct upstream *up;
+	rspamd_inet_addr_t *addr;
+	guint i;
+
+	g_assert (backend != NULL);
+
+	session = g_malloc0 (sizeof (*session));
+	session->backend = backend;
+	REF_RETAIN (session->backend);
+
+	session->cb = cb;
+	session->cbdata = ud;
+	session->ncmds = ncmds;
+	session->ev_base = rspamd_fuzzy_backend_event_base (bk);
+	session->elts = g_malloc0 (sizeof (*session->elts) * ncmds);
+	session->reps = g_malloc0 (sizeof (*session->reps) * ncmds);
+
+	for (i = 0; i < ncmds; i ++) {
+		elt = &session->elts[i];
+		elt->session = session;
+		elt->cmd = cmds[i];
+		elt->rep = &session->reps[i];
+		elt->prob = 1.0;
+		memcpy (elt->found_digest, cmds[i]->digest, sizeof (elt->found_digest));
+		memcpy (elt->rep->digest, cmds[i]->digest, sizeof (elt->rep->digest));
+	}
+
+	up = rspamd_upstream_get (backend->read_servers,
+			RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL,
+			0);
+
+	session->up = up;
+	addr = rspamd_upstream_addr (up);
+	g_assert (addr != NULL);
+	session->ctx = rspamd_redis_pool_connect (backend->pool,
+			backend->dbname, backend->password,
+			rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+	if (session->ctx == NULL) {
+		rspamd_upstream_fail (up, TRUE);
+
+		if (cb) {
+			cb (session->reps, ncmds, ud);
+		}
+
+		rspamd_fuzzy_redis_many_dtor (session, TRUE);
+
+		return;
+	}
+
+	/* Extra reference to keep session while commands are being queued */
+	session->npending = ncmds + 1;
+
+	for (i = 0; i < ncmds; i ++) {
+		elt = &session->elts[i];
+
+		if (session->ctx == NULL ||
+				!rspamd_fuzzy_redis_many_send_hmget (elt, elt->cmd->digest)) {
+			session->failed = TRUE;
+			session->npending --;
+		}
+	}
+
+	rspamd_fuzzy_redis_many_arm_timeout (session);
+	rspamd_fuzzy_redis_many_elt_done (session);
+}
+
 static void
 rspamd_fuzzy_redis_count_callback (redisAsyncContext *c, gpointer r,
 		gpointer priv)
@@ -494,8 +494,12 @@ rspamd_fuzzy_backend_sqlite_int64_cmp (const void *a, const void *b)
 	return (ia - ib);
 }
 
-struct rspamd_fuzzy_reply
-rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
+/*
+ * Must be called within a transaction
+ */
+static struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_sqlite_check_unlocked (
+		struct rspamd_fuzzy_backend_sqlite *backend,
 		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
 {
 	struct rspamd_fuzzy_reply rep;
@@ -513,8 +517,6 @@ rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
 	}
 
 	/* Try direct match first of all */
-	rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
-			RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
 	rc = rspamd_fuzzy_backend_sqlite_run_stmt (backend, FALSE,
 			RSPAMD_FUZZY_BACKEND_CHECK,
 			cmd->digest);
@@ -634,12 +636,57 @@ rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
 	}
 
 	rspamd_fuzzy_backend_sqlite_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_CHECK);
+
+	return rep;
+}
+
+struct rspamd_fuzzy_reply
+rspamd_fuzzy_backend_sqlite_check (struct rspamd_fuzzy_backend_sqlite *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gint64 expire)
+{
+	struct rspamd_fuzzy_reply rep;
+
+	if (backend == NULL) {
+		return rspamd_fuzzy_backend_sqlite_check_unlocked (backend, cmd, expire);
+	}
+
+	rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
+	rep = rspamd_fuzzy_backend_sqlite_check_unlocked (backend, cmd, expire);
 	rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
 			RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT);
 
 	return rep;
 }
 
+void
+rspamd_fuzzy_backend_sqlite_check_many (
+		struct rspamd_fuzzy_backend_sqlite *backend,
+		const struct rspamd_fuzzy_cmd **cmds, guint ncmds,
+		gint64 expire, struct rspamd_fuzzy_reply *reps)
+{
+	guint i;
+
+	/*
+	 * Digest lookups are primary key and index hits on the already prepared
+	 * statements, so the main cost saved here is the per-check transaction
+	 */
+	if (backend != NULL) {
+		rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+				RSPAMD_FUZZY_BACKEND_TRANSACTION_START);
+	}
+
+	for (i = 0; i < ncmds; i ++) {
+		reps[i] = rspamd_fuzzy_backend_sqlite_check_unlocked (backend,
+				cmds[i], expire);
+	}
+
+	if (backend != NULL) {
+		rspamd_fuzzy_backend_sqlite_run_stmt (backend, TRUE,
+				RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT);
+	}
+}
+
 gboolean
 rspamd_fuzzy_backend_sqlite_prepare_update (struct rspamd_fuzzy_backend_sqlite *backend,
 		const gchar *source)
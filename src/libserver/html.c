@@ -28,6 +28,10 @@
 #include <unicode/uidna.h>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 static sig_atomic_t tags_sorted = 0;
 static sig_atomic_t entities_sorted = 0;
 static const guint max_tags = 8192; /* Ignore tags if this maximum is reached */
@@ -257,22 +261,60 @@ rspamd_html_library_init (void)
 	}
 }
 
+static void
+rspamd_html_append_tag (struct html_content *hc, struct html_tag *tag,
+		struct html_tag *parent)
+{
+	/*
+	 * Parent is always the last tag or its ancestor, so appending keeps
+	 * tags in pre-order
+	 */
+	tag->parent = parent;
+	tag->idx = hc->html_tags->len;
+	g_ptr_array_add (hc->html_tags, tag);
+}
+
+/*
+ * Returns the previous sibling of a tag which is the last one on its level:
+ * the preceding tag is either its parent or a descendant of that sibling
+ */
+static struct html_tag *
+rspamd_html_tag_prev_sibling (struct html_content *hc, struct html_tag *tag)
+{
+	struct html_tag *cur;
+
+	if (tag->idx == 0) {
+		return NULL;
+	}
+
+	cur = g_ptr_array_index (hc->html_tags, tag->idx - 1);
+
+	while (cur != NULL && cur != tag->parent) {
+		if (cur->parent == tag->parent) {
+			return cur;
+		}
+
+		cur = cur->parent;
+	}
+
+	return NULL;
+}
+
 static gboolean
-rspamd_html_check_balance (GNode * node, GNode ** cur_level)
+rspamd_html_check_balance (struct html_content *hc, struct html_tag *tag,
+		struct html_tag **cur_level)
 {
-	struct html_tag *arg = node->data, *tmp;
-	GNode *cur;
+	struct html_tag *cur;
 
-	if (arg->flags & FL_CLOSING) {
+	if (tag->flags & FL_CLOSING) {
 		/* First of all check whether this tag is closing tag for parent node */
-		cur = node->parent;
-		while (cur && cur->data) {
-			tmp = cur->data;
-			if (tmp->id == arg->id &&
-				(tmp->flags & FL_CLOSED) == 0) {
-				tmp->flags |= FL_CLOSED;
-				/* Destroy current node as we find corresponding parent node */
-				g_node_destroy (node);
+		cur = tag->parent;
+		while (cur) {
+			if (cur->id == tag->id &&
+				(cur->flags & FL_CLOSED) == 0) {
+				cur->flags |= FL_CLOSED;
+				/* Remove closing tag (the last one) as we have found its pair */
+				g_ptr_array_set_size (hc->html_tags, hc->html_tags->len - 1);
 				/* Change level */
 				*cur_level = cur->parent;
 				return TRUE;
@@ -332,13 +374,87 @@ rspamd_html_tag_by_id (gint id)
 	return NULL;
 }
 
+/*
+ * Returns the length of the leading run of text characters that need no
+ * processing: anything but tags, entities and spaces
+ */
+static inline gsize
+rspamd_html_text_run (const guchar *p, gsize len)
+{
+	gsize i = 0;
+
+#ifdef __SSE2__
+	const __m128i lt = _mm_set1_epi8 ('<'), amp = _mm_set1_epi8 ('&'),
+			sp = _mm_set1_epi8 (' '), tab = _mm_set1_epi8 ('\t'),
+			ctl_max = _mm_set1_epi8 ('\r' - '\t');
+	__m128i v, ctl, stop;
+	guint mask;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128 ((const __m128i *)(p + i));
+		/* Characters from '\t' to '\r' */
+		ctl = _mm_sub_epi8 (v, tab);
+		ctl = _mm_cmpeq_epi8 (_mm_min_epu8 (ctl, ctl_max), ctl);
+		stop = _mm_or_si128 (_mm_cmpeq_epi8 (v, lt), _mm_cmpeq_epi8 (v, amp));
+		stop = _mm_or_si128 (stop, _mm_cmpeq_epi8 (v, sp));
+		mask = _mm_movemask_epi8 (_mm_or_si128 (stop, ctl));
+
+		if (mask != 0) {
+			return i + __builtin_ctz (mask);
+		}
+	}
+#endif
+
+	for (; i < len; i ++) {
+		if (p[i] == '<' || p[i] == '&' || g_ascii_isspace (p[i])) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Returns the length of the leading run of characters that are neither `c`
+ * nor the end of a tag
+ */
+static inline gsize
+rspamd_html_tag_run (const guchar *p, gsize len, guchar c)
+{
+	gsize i = 0;
+
+#ifdef __SSE2__
+	const __m128i gt = _mm_set1_epi8 ('>'), vc = _mm_set1_epi8 (c);
+	__m128i v;
+	guint mask;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128 ((const __m128i *)(p + i));
+		mask = _mm_movemask_epi8 (_mm_or_si128 (_mm_cmpeq_epi8 (v, gt),
+				_mm_cmpeq_epi8 (v, vc)));
+
+		if (mask != 0) {
+			return i + __builtin_ctz (mask);
+		}
+	}
+#endif
+
+	for (; i < len; i ++) {
+		if (p[i] == '>' || p[i] == c) {
+			break;
+		}
+	}
+
+	return i;
+}
+
 /* Decode HTML entitles in text */
 guint
 rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 {
 	guint l, rep_len;
 	gchar *t = s, *h = s, *e = s, *end_ptr;
-	const gchar *end;
+	const gchar *end, *next;
 	const gchar *entity;
 	gint state = 0, val, base;
 	khiter_t k;
@@ -363,9 +479,19 @@ rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 				continue;
 			}
 			else {
-				*t = *h;
-				h++;
-				t++;
+				/* Move everything up to the next entity at once */
+				next = memchr (h, '&', end - h);
+
+				if (next == NULL) {
+					next = end;
+				}
+
+				if (t != h) {
+					memmove (t, h, next - h);
+				}
+
+				t += next - h;
+				h += next - h;
 			}
 			break;
 		case 1:
@@ -688,18 +814,14 @@ rspamd_html_url_is_phished (rspamd_mempool_t *pool,
 
 static gboolean
 rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
-		struct html_tag *tag, GNode **cur_level, gboolean *balanced)
+		struct html_tag *tag, struct html_tag **cur_level, gboolean *balanced)
 {
-	GNode *nnode;
 	struct html_tag *parent;
 
 	if (hc->html_tags == NULL) {
-		nnode = g_node_new (NULL);
-		*cur_level = nnode;
-		hc->html_tags = nnode;
-		rspamd_mempool_add_destructor (pool,
-				(rspamd_mempool_destruct_t) g_node_destroy,
-				nnode);
+		hc->html_tags = g_ptr_array_sized_new (128);
+		rspamd_mempool_add_destructor (pool, rspamd_ptr_array_free_hard,
+				hc->html_tags);
 	}
 
 	if (hc->total_tags > max_tags) {
@@ -717,16 +839,10 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 	if (!(tag->flags & CM_INLINE)) {
 		/* Block tag */
 		if (tag->flags & (FL_CLOSING|FL_CLOSED)) {
-			if (!*cur_level) {
-				msg_debug_html ("bad parent node");
-				return FALSE;
-			}
-
 			if (hc->total_tags < max_tags) {
-				nnode = g_node_new (tag);
-				g_node_append (*cur_level, nnode);
+				rspamd_html_append_tag (hc, tag, *cur_level);
 
-				if (!rspamd_html_check_balance (nnode, cur_level)) {
+				if (!rspamd_html_check_balance (hc, tag, cur_level)) {
 					msg_debug_html (
 							"mark part as unbalanced as it has not pairable closing tags");
 					hc->flags |= RSPAMD_HTML_FLAG_UNBALANCED;
@@ -739,7 +855,7 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 			}
 		}
 		else {
-			parent = (*cur_level)->data;
+			parent = *cur_level;
 
 			if (parent) {
 				if ((parent->flags & FL_IGNORE)) {
@@ -756,9 +872,8 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 						tag->parent = parent->parent;
 
 						if (hc->total_tags < max_tags) {
-							nnode = g_node_new (tag);
-							g_node_append (parent->parent, nnode);
-							*cur_level = nnode;
+							rspamd_html_append_tag (hc, tag, parent->parent);
+							*cur_level = tag;
 							hc->total_tags ++;
 						}
 
@@ -770,11 +885,10 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 			}
 
 			if (hc->total_tags < max_tags) {
-				nnode = g_node_new (tag);
-				g_node_append (*cur_level, nnode);
+				rspamd_html_append_tag (hc, tag, *cur_level);
 
 				if ((tag->flags & FL_CLOSED) == 0) {
-					*cur_level = nnode;
+					*cur_level = tag;
 				}
 
 				hc->total_tags ++;
@@ -790,7 +904,7 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 	}
 	else {
 		/* Inline tag */
-		parent = (*cur_level)->data;
+		parent = *cur_level;
 
 		if (parent && (parent->flags & (CM_HEAD|CM_UNKNOWN|FL_IGNORE))) {
 			tag->flags |= FL_IGNORE;
@@ -894,10 +1008,14 @@ rspamd_html_parse_tag_component (rspamd_mempool_t *pool,
 	return ret;
 }
 
-static void
+/*
+ * Processes a character of tag and returns the number of the following
+ * characters that can be skipped as they cannot change the state
+ */
+static gsize
 rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 		struct html_content *hc, struct html_tag *tag, const guchar *in,
-		gint *statep, guchar const **savep)
+		const guchar *end, gint *statep, guchar const **savep)
 {
 	enum {
 		parse_start = 0,
@@ -998,7 +1116,7 @@ rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 				tag->flags |= FL_CLOSED;
 			}
 			else {
-				return;
+				return 0;
 			}
 
 			if (!rspamd_html_parse_tag_component (pool, *savep, in, tag)) {
@@ -1198,6 +1316,20 @@ rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 	}
 
 	*statep = state;
+
+	/* Only quotes and the end of tag are significant within values */
+	switch (state) {
+	case parse_dqvalue:
+		return rspamd_html_tag_run (in + 1, end - in - 1, '"');
+	case parse_sqvalue:
+		return rspamd_html_tag_run (in + 1, end - in - 1, '\'');
+	case ignore_bad_tag:
+		return rspamd_html_tag_run (in + 1, end - in - 1, '>');
+	default:
+		break;
+	}
+
+	return 0;
 }
 
 
@@ -2215,24 +2347,23 @@ rspamd_html_check_displayed_url (rspamd_mempool_t *pool,
 	}
 }
 
-static gboolean
-rspamd_html_propagate_lengths (GNode *node, gpointer _unused)
+static void
+rspamd_html_propagate_lengths (struct html_content *hc)
 {
-	GNode *child;
-	struct html_tag *tag = node->data, *cld_tag;
+	struct html_tag *tag;
+	guint i;
 
-	if (tag) {
-		child = node->children;
+	/*
+	 * Descendants follow a tag in pre-order, so in the reverse order each
+	 * tag has the full length when it is added to its parent
+	 */
+	for (i = hc->html_tags->len; i > 0; i --) {
+		tag = g_ptr_array_index (hc->html_tags, i - 1);
 
-		/* Summarize content length from children */
-		while (child) {
-			cld_tag = child->data;
-			tag->content_length += cld_tag->content_length;
-			child = child->next;
+		if (tag->parent) {
+			tag->parent->content_length += tag->content_length;
 		}
 	}
-
-	return FALSE;
 }
 
 static void
@@ -2324,9 +2455,9 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 	GByteArray *dest;
 	GHashTable *target_tbl;
 	guint obrace = 0, ebrace = 0;
-	GNode *cur_level = NULL;
 	gint substate = 0, len, href_offset = -1;
-	struct html_tag *cur_tag = NULL, *content_tag = NULL;
+	gsize skip;
+	struct html_tag *cur_tag = NULL, *content_tag = NULL, *cur_level = NULL;
 	struct rspamd_url *url = NULL, *turl;
 	GQueue *styles_blocks;
 
@@ -2496,6 +2627,7 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 			}
 			else {
 				ebrace = 0;
+				p += rspamd_html_tag_run (p + 1, end - p - 1, '-');
 			}
 
 			p ++;
@@ -2503,7 +2635,12 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 
 		case content_ignore:
 			if (t != '<') {
-				p ++;
+				/* Skip to the next tag */
+				p = memchr (p, '<', end - p);
+
+				if (p == NULL) {
+					p = end;
+				}
 			}
 			else {
 				if (content_tag) {
@@ -2563,6 +2700,9 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 						}
 						save_space = FALSE;
 					}
+
+					/* Skip the rest of plain text */
+					p += rspamd_html_text_run (p + 1, end - p - 1);
 				}
 			}
 			else {
@@ -2623,12 +2763,12 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 				cur_tag = NULL;
 				continue;
 			}
-			p ++;
+			p += rspamd_html_tag_run (p + 1, end - p - 1, '>') + 1;
 			break;
 
 		case tag_content:
-			rspamd_html_parse_tag_content (pool, hc, cur_tag,
-					p, &substate, &savep);
+			skip = rspamd_html_parse_tag_content (pool, hc, cur_tag,
+					p, end, &substate, &savep);
 			if (t == '>') {
 				if (closing) {
 					cur_tag->flags |= FL_CLOSING;
@@ -2644,7 +2784,7 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 				state = tag_end;
 				continue;
 			}
-			p ++;
+			p += skip + 1;
 			break;
 
 		case tag_end:
@@ -2730,11 +2870,15 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 					}
 
 					if (cur_tag->id == Tag_A) {
-						if (!balanced && cur_level && cur_level->prev) {
-							struct html_tag *prev_tag;
-							struct rspamd_url *prev_url;
+						struct html_tag *prev_tag = NULL;
 
-							prev_tag = cur_level->prev->data;
+						if (!balanced && cur_level) {
+							prev_tag = rspamd_html_tag_prev_sibling (hc,
+									cur_level);
+						}
+
+						if (prev_tag) {
+							struct rspamd_url *prev_url;
 
 							if (prev_tag->id == Tag_A &&
 									!(prev_tag->flags & (FL_CLOSING)) &&
@@ -2770,8 +2914,8 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 				else if (cur_tag->id == Tag_BASE && !(cur_tag->flags & (FL_CLOSING))) {
 					struct html_tag *prev_tag = NULL;
 
-					if (cur_level && cur_level->parent) {
-						prev_tag = cur_level->parent->data;
+					if (cur_level) {
+						prev_tag = cur_level->parent;
 					}
 
 					/*
@@ -2837,8 +2981,7 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 	}
 
 	if (hc->html_tags) {
-		g_node_traverse (hc->html_tags, G_POST_ORDER, G_TRAVERSE_ALL, -1,
-				rspamd_html_propagate_lengths, NULL);
+		rspamd_html_propagate_lengths (hc);
 	}
 
 	g_queue_free (styles_blocks);
@@ -100,7 +100,8 @@ struct html_tag {
 	const gchar *content;
 	GQueue *params;
 	gpointer extra; /** Additional data associated with tag (e.g. image) */
-	GNode *parent;
+	struct html_tag *parent; /** NULL for top level tags */
+	guint idx; /** Position in html_content->html_tags */
 };
 
 /* Forwarded declaration */
@@ -108,7 +109,7 @@ struct rspamd_task;
 
 struct html_content {
 	struct rspamd_url *base_url;
-	GNode *html_tags;
+	GPtrArray *html_tags; /* Tags tree in pre-order */
 	gint flags;
 	guint total_tags;
 	struct html_color bgcolor;
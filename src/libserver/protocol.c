@@ -1147,6 +1147,9 @@ rspamd_protocol_write_ucl (struct rspamd_task *task,
 
 	if (flags & RSPAMD_PROTOCOL_URLS) {
 		if (task->cfg->log_urls || (task->flags & RSPAMD_TASK_FLAG_EXT_URLS)) {
+			rspamd_message_process_text_parts (task,
+					RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
+
 			if (g_hash_table_size (task->urls) > 0) {
 				ucl_object_insert_key (top, rspamd_urls_tree_ucl (task->urls,
 						task), "urls", 0, false);
@@ -1241,8 +1244,9 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 	const struct rspamd_re_cache_stat *restat;
 	gpointer h, v;
 	ucl_object_t *top = NULL;
-	rspamd_fstring_t *reply;
+	rspamd_fstring_t *reply, *classes_stat;
 	gint action, flags = RSPAMD_PROTOCOL_DEFAULT;
+	guint i;
 
 	/* Write custom headers */
 	g_hash_table_iter_init (&hiter, task->reply_headers);
@@ -1281,6 +1285,26 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 				restat->regexp_fast_cached,
 				restat->bytes_scanned_pcre,
 				restat->bytes_scanned);
+
+		classes_stat = rspamd_fstring_new ();
+
+		for (i = 0; i < RSPAMD_RE_MAX; i ++) {
+			if (restat->class_scans[i] > 0) {
+				rspamd_printf_fstring (&classes_stat, "%s%s: %ud scans, %.3f ms",
+						classes_stat->len > 0 ? "; " : "",
+						rspamd_re_cache_type_to_string (i),
+						restat->class_scans[i],
+						restat->class_time[i] * 1000.0);
+			}
+		}
+
+		if (classes_stat->len > 0) {
+			msg_notice_task ("regexp classes statistics: %V; "
+					"single pass scan: %.3f ms",
+					classes_stat, restat->eager_time * 1000.0);
+		}
+
+		rspamd_fstring_free (classes_stat);
 	}
 
 	reply = rspamd_fstring_sized_new (1000);
@@ -66,8 +66,20 @@ INIT_LOG_MODULE(re_cache)
 
 #ifdef WITH_HYPERSCAN
 #define RSPAMD_HS_MAGIC_LEN (sizeof (rspamd_hs_magic))
-static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '1'},
-		rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '1'};
+static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '2'},
+		rspamd_hs_magic_vector[] = {'r', 's', 'h', 's', 'r', 'v', '1', '2'};
+/*
+ * Shared images are hyperscan databases stored in the deserialized form, so
+ * that workers can mmap them read only and share the same physical pages
+ */
+static const guchar rspamd_hs_shared_magic[] = {'r', 's', 'h', 's', 'm', 'p', '1', '1'};
+
+struct rspamd_hs_shared_hdr {
+	guchar magic[RSPAMD_HS_MAGIC_LEN];
+	guint64 crc; /* crc of the corresponding .hs file */
+	guint64 db_len;
+	guchar padding[40]; /* hyperscan requires an aligned database */
+};
 #endif
 
 struct rspamd_re_class {
@@ -78,11 +90,14 @@ struct rspamd_re_class {
 	GHashTable *re;
 	gchar hash[rspamd_cryptobox_HASHBYTES + 1];
 	rspamd_cryptobox_hash_state_t *st;
+	GArray *re_ids; /* cache ids of class expressions, indexed by local id */
 #ifdef WITH_HYPERSCAN
 	hs_database_t *hs_db;
 	hs_scratch_t *hs_scratch;
 	gint *hs_ids;
 	guint nhs;
+	guchar *hs_map; /* shared image, hs_db points inside if not NULL */
+	gsize hs_map_len;
 #endif
 };
 
@@ -108,7 +123,11 @@ struct rspamd_re_cache {
 	gboolean hyperscan_loaded;
 	gboolean disable_hyperscan;
 	gboolean vectorized_hyperscan;
+	gboolean eager_hyperscan;
 	hs_platform_info_t plt;
+	hs_scratch_t *hs_scratch;
+	gsize hs_shared_size;
+	guint hs_generation;
 #endif
 };
 
@@ -118,6 +137,7 @@ struct rspamd_re_runtime {
 	struct rspamd_re_cache *cache;
 	struct rspamd_re_cache_stat stat;
 	gboolean has_hs;
+	gboolean eager_scanned;
 };
 
 static GQuark
@@ -162,8 +182,15 @@ rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
 			g_free (re_class->type_data);
 		}
 
+		if (re_class->re_ids) {
+			g_array_free (re_class->re_ids, TRUE);
+		}
+
 #ifdef WITH_HYPERSCAN
-		if (re_class->hs_db) {
+		if (re_class->hs_map) {
+			munmap (re_class->hs_map, re_class->hs_map_len);
+		}
+		else if (re_class->hs_db) {
 			hs_free_database (re_class->hs_db);
 		}
 		if (re_class->hs_scratch) {
@@ -178,6 +205,11 @@ rspamd_re_cache_destroy (struct rspamd_re_cache *cache)
 
 	g_hash_table_unref (cache->re_classes);
 	g_ptr_array_free (cache->re, TRUE);
+#ifdef WITH_HYPERSCAN
+	if (cache->hs_scratch) {
+		hs_free_scratch (cache->hs_scratch);
+	}
+#endif
 	g_free (cache);
 }
 
@@ -323,7 +355,7 @@ rspamd_re_cache_sort_func (gconstpointer a, gconstpointer b)
 void
 rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 {
-	guint i, fl;
+	guint i, fl, local_id;
 	GHashTableIter it;
 	gpointer k, v;
 	struct rspamd_re_class *re_class;
@@ -350,6 +382,13 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 			rspamd_cryptobox_hash_init (re_class->st, NULL, 0);
 		}
 
+		if (re_class->re_ids == NULL) {
+			re_class->re_ids = g_array_new (FALSE, FALSE, sizeof (gint));
+		}
+
+		local_id = re_class->re_ids->len;
+		g_array_append_val (re_class->re_ids, i);
+
 		/* Update hashes */
 		/* Id of re class */
 		rspamd_cryptobox_hash_update (re_class->st, (gpointer) &re_class->id,
@@ -379,9 +418,13 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 				sizeof (fl));
 		rspamd_cryptobox_hash_update (&st_global, (const guchar *) &fl,
 				sizeof (fl));
-		/* Numberic order */
-		rspamd_cryptobox_hash_update (re_class->st, (const guchar *)&i,
-				sizeof (i));
+		/*
+		 * Numeric order: class hash depends merely on the order inside
+		 * the class, so unrelated changes do not invalidate compiled
+		 * hyperscan databases
+		 */
+		rspamd_cryptobox_hash_update (re_class->st, (const guchar *)&local_id,
+				sizeof (local_id));
 		rspamd_cryptobox_hash_update (&st_global, (const guchar *)&i,
 				sizeof (i));
 	}
@@ -398,13 +441,13 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 
 		if (re_class->st) {
 			/*
-			 * We finally update all classes with the number of expressions
-			 * in the cache to ensure that if even a single re has been changed
-			 * we won't be broken due to id mismatch
+			 * Hyperscan databases use local ids that are translated to
+			 * the cache ids on match, so there is no need to include the
+			 * total number of expressions in the cache here
 			 */
 			rspamd_cryptobox_hash_update (re_class->st,
-					(gpointer)&cache->re->len,
-					sizeof (cache->re->len));
+					(gpointer)&re_class->re_ids->len,
+					sizeof (re_class->re_ids->len));
 			rspamd_cryptobox_hash_final (re_class->st, hash_out);
 			rspamd_snprintf (re_class->hash, sizeof (re_class->hash), "%*xs",
 					(gint) rspamd_cryptobox_HASHBYTES, hash_out);
@@ -419,6 +462,7 @@ rspamd_re_cache_init (struct rspamd_re_cache *cache, struct rspamd_config *cfg)
 
 	cache->disable_hyperscan = cfg->disable_hyperscan;
 	cache->vectorized_hyperscan = cfg->vectorized_hyperscan;
+	cache->eager_hyperscan = cfg->eager_hyperscan;
 
 	g_assert (hs_populate_platform (&cache->plt) == HS_SUCCESS);
 
@@ -559,6 +603,7 @@ struct rspamd_re_hyperscan_cbdata {
 	const guint *lens;
 	guint count;
 	rspamd_regexp_t *re;
+	struct rspamd_re_class *re_class;
 	struct rspamd_task *task;
 };
 
@@ -577,6 +622,8 @@ rspamd_re_cache_hyperscan_cb (unsigned int id,
 
 	rt = cbdata->rt;
 	task = cbdata->task;
+	/* Databases are compiled with ids local to the class */
+	id = g_array_index (cbdata->re_class->re_ids, gint, id);
 	pcre_elt = g_ptr_array_index (rt->cache->re, id);
 	maxhits = rspamd_regexp_get_maxhits (pcre_elt->re);
 
@@ -618,6 +665,116 @@ rspamd_re_cache_hyperscan_cb (unsigned int id,
 }
 #endif
 
+#ifdef WITH_HYPERSCAN
+/*
+ * Processes all regexps of a class covered by its hyperscan database with
+ * pcre, partial results of a failed hyperscan scan are dropped
+ */
+static void
+rspamd_re_cache_scan_class_pcre (struct rspamd_re_runtime *rt,
+		struct rspamd_task *task,
+		struct rspamd_re_class *re_class,
+		const guchar **in, guint *lens,
+		guint count,
+		gboolean is_raw)
+{
+	struct rspamd_re_cache_elt *elt;
+	guint i, j;
+	gint id;
+
+	for (i = 0; i < re_class->re_ids->len; i ++) {
+		id = g_array_index (re_class->re_ids, gint, i);
+		elt = g_ptr_array_index (rt->cache->re, id);
+
+		if (elt->match_type == RSPAMD_RE_CACHE_PCRE) {
+			/* Not in the database, checked on its own */
+			continue;
+		}
+
+		rt->results[id] = 0;
+
+		for (j = 0; j < count; j ++) {
+			rspamd_re_cache_process_pcre (rt, elt->re, task, in[j], lens[j],
+					is_raw);
+		}
+
+		setbit (rt->checked, id);
+	}
+}
+
+/*
+ * Scans all data of a class using its hyperscan database, results of all
+ * hyperscan regexps in the class are updated
+ */
+static void
+rspamd_re_cache_scan_class (struct rspamd_re_runtime *rt,
+		struct rspamd_task *task,
+		struct rspamd_re_class *re_class,
+		hs_scratch_t *scratch,
+		const guchar **in, guint *lens,
+		guint count,
+		gboolean is_raw)
+{
+	struct rspamd_re_cache *cache = rt->cache;
+	struct rspamd_re_hyperscan_cbdata cbdata;
+	hs_error_t ret = HS_SUCCESS;
+	gdouble t1, t2;
+	guint i;
+
+	g_assert (re_class->hs_db != NULL);
+
+	for (i = 0; i < count; i ++) {
+		if (rt->cache->max_re_data > 0 && lens[i] > rt->cache->max_re_data) {
+			lens[i] = rt->cache->max_re_data;
+		}
+
+		rt->stat.bytes_scanned += lens[i];
+	}
+
+	cbdata.rt = rt;
+	cbdata.re = NULL;
+	cbdata.re_class = re_class;
+	cbdata.task = task;
+	t1 = rspamd_get_ticks (FALSE);
+
+	/* Go through hyperscan API */
+	if (!rt->cache->vectorized_hyperscan) {
+		for (i = 0; i < count; i++) {
+			cbdata.ins = &in[i];
+			cbdata.lens = &lens[i];
+			cbdata.count = 1;
+
+			ret = hs_scan (re_class->hs_db, in[i], lens[i], 0, scratch,
+					rspamd_re_cache_hyperscan_cb, &cbdata);
+
+			if (ret != HS_SUCCESS && ret != HS_SCAN_TERMINATED) {
+				break;
+			}
+		}
+	}
+	else {
+		cbdata.ins = in;
+		cbdata.lens = lens;
+		cbdata.count = count;
+
+		ret = hs_scan_vector (re_class->hs_db, (const char **)in, lens, count,
+				0, scratch, rspamd_re_cache_hyperscan_cb, &cbdata);
+	}
+
+	if (ret != HS_SUCCESS && ret != HS_SCAN_TERMINATED) {
+		msg_err_re_cache ("cannot scan %s class with hyperscan: %d, "
+				"fallback to pcre",
+				rspamd_re_cache_type_to_string (re_class->type), ret);
+		rspamd_re_cache_scan_class_pcre (rt, task, re_class, in, lens, count,
+				is_raw);
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rt->stat.class_scans[re_class->type] ++;
+	rt->stat.class_time[re_class->type] += t2 - t1;
+}
+#endif
+
 static guint
 rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 		rspamd_regexp_t *re, struct rspamd_task *task,
@@ -654,7 +811,6 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 #else
 	struct rspamd_re_cache_elt *elt;
 	struct rspamd_re_class *re_class;
-	struct rspamd_re_hyperscan_cbdata cbdata;
 
 	elt = g_ptr_array_index (rt->cache->re, re_id);
 	re_class = rspamd_regexp_get_class (re);
@@ -673,54 +829,10 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 		setbit (rt->checked, re_id);
 	}
 	else {
-		for (i = 0; i < count; i ++) {
-			if (rt->cache->max_re_data > 0 && lens[i] > rt->cache->max_re_data) {
-				lens[i] = rt->cache->max_re_data;
-			}
-
-			rt->stat.bytes_scanned += lens[i];
-		}
-
 		g_assert (re_class->hs_scratch != NULL);
-		g_assert (re_class->hs_db != NULL);
-
-		/* Go through hyperscan API */
-		if (!rt->cache->vectorized_hyperscan) {
-			for (i = 0; i < count; i++) {
-				cbdata.ins = &in[i];
-				cbdata.re = re;
-				cbdata.rt = rt;
-				cbdata.lens = &lens[i];
-				cbdata.count = 1;
-				cbdata.task = task;
-
-				if ((hs_scan (re_class->hs_db, in[i], lens[i], 0,
-						re_class->hs_scratch,
-						rspamd_re_cache_hyperscan_cb, &cbdata)) != HS_SUCCESS) {
-					ret = 0;
-				}
-				else {
-					ret = rt->results[re_id];
-				}
-			}
-		}
-		else {
-			cbdata.ins = in;
-			cbdata.re = re;
-			cbdata.rt = rt;
-			cbdata.lens = lens;
-			cbdata.count = 1;
-			cbdata.task = task;
-
-			if ((hs_scan_vector (re_class->hs_db, (const char **)in, lens, count, 0,
-					re_class->hs_scratch,
-					rspamd_re_cache_hyperscan_cb, &cbdata)) != HS_SUCCESS) {
-				ret = 0;
-			}
-			else {
-				ret = rt->results[re_id];
-			}
-		}
+		rspamd_re_cache_scan_class (rt, task, re_class, re_class->hs_scratch,
+				in, lens, count, is_raw);
+		ret = rt->results[re_id];
 	}
 #endif
 
@@ -748,33 +860,68 @@ rspamd_re_cache_finish_class (struct rspamd_re_runtime *rt,
 #endif
 }
 
+static guint
+rspamd_re_cache_headers_data (struct rspamd_re_class *re_class,
+		GPtrArray *headerlist,
+		const guchar ***pscvec, guint **plenvec, gboolean *praw)
+{
+	struct rspamd_mime_header *rh;
+	const guchar **scvec;
+	const gchar *in, *end;
+	guint *lenvec, i;
+
+	scvec = g_malloc (sizeof (*scvec) * headerlist->len);
+	lenvec = g_malloc (sizeof (*lenvec) * headerlist->len);
+
+	for (i = 0; i < headerlist->len; i ++) {
+		rh = g_ptr_array_index (headerlist, i);
+
+		if (re_class->type == RSPAMD_RE_RAWHEADER) {
+			in = rh->value;
+			*praw = TRUE;
+			lenvec[i] = strlen (rh->value);
+		}
+		else {
+			in = rh->decoded;
+			/* Validate input */
+			if (!in || !g_utf8_validate (in, -1, &end)) {
+				lenvec[i] = 0;
+				scvec[i] = (guchar *)"";
+				continue;
+			}
+			lenvec[i] = end - in;
+		}
+
+		scvec[i] = (guchar *)in;
+	}
+
+	*pscvec = scvec;
+	*plenvec = lenvec;
+
+	return headerlist->len;
+}
+
 /*
- * Calculates the specified regexp for the specified class if it's not calculated
+ * Selects data to be matched by regexps of the specified class, returns number
+ * of elements in the vectors. Vectors should be freed by a caller using g_free.
  */
 static guint
-rspamd_re_cache_exec_re (struct rspamd_task *task,
-		struct rspamd_re_runtime *rt,
-		rspamd_regexp_t *re,
+rspamd_re_cache_class_data (struct rspamd_task *task,
 		struct rspamd_re_class *re_class,
-		gboolean is_strong)
+		gboolean is_strong,
+		const guchar ***pscvec, guint **plenvec, gboolean *praw)
 {
-	guint ret = 0, i, re_id;
+	guint i, cnt = 0, len;
 	GPtrArray *headerlist;
 	GHashTableIter it;
 	struct rspamd_mime_header *rh;
-	const gchar *in, *end;
-	const guchar **scvec;
-	guint *lenvec;
+	const gchar *in;
+	const guchar **scvec = NULL;
+	guint *lenvec = NULL;
 	gboolean raw = FALSE;
 	struct rspamd_mime_text_part *part;
 	struct rspamd_url *url;
 	gpointer k, v;
-	guint len, cnt;
-
-	msg_debug_re_task ("check re type: %s: /%s/",
-			rspamd_re_cache_type_to_string (re_class->type),
-			rspamd_regexp_get_pattern (re));
-	re_id = rspamd_regexp_get_cache_id (re);
 
 	switch (re_class->type) {
 	case RSPAMD_RE_HEADER:
@@ -785,49 +932,17 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 				is_strong);
 
 		if (headerlist && headerlist->len > 0) {
-			scvec = g_malloc (sizeof (*scvec) * headerlist->len);
-			lenvec = g_malloc (sizeof (*lenvec) * headerlist->len);
-
-			for (i = 0; i < headerlist->len; i ++) {
-				rh = g_ptr_array_index (headerlist, i);
-
-				if (re_class->type == RSPAMD_RE_RAWHEADER) {
-					in = rh->value;
-					raw = TRUE;
-					lenvec[i] = strlen (rh->value);
-				}
-				else {
-					in = rh->decoded;
-					/* Validate input */
-					if (!in || !g_utf8_validate (in, -1, &end)) {
-						lenvec[i] = 0;
-						scvec[i] = (guchar *)"";
-						continue;
-					}
-					lenvec[i] = end - in;
-				}
-
-				scvec[i] = (guchar *)in;
-			}
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, headerlist->len, raw);
-			msg_debug_re_task ("checking header %s regexp: %s=%*s -> %d",
-					re_class->type_data,
-					rspamd_regexp_get_pattern (re),
-					(int)lenvec[0], scvec[0], ret);
-			g_free (scvec);
-			g_free (lenvec);
+			cnt = rspamd_re_cache_headers_data (re_class, headerlist,
+					&scvec, &lenvec, &raw);
 		}
 		break;
 	case RSPAMD_RE_ALLHEADER:
 		raw = TRUE;
-		in = task->raw_headers_content.begin;
-		len = task->raw_headers_content.len;
-		ret = rspamd_re_cache_process_regexp_data (rt, re,
-				task, (const guchar **)&in, &len, 1, raw);
-		msg_debug_re_task ("checking allheader regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
+		cnt = 1;
+		scvec = g_malloc (sizeof (*scvec));
+		lenvec = g_malloc (sizeof (*lenvec));
+		scvec[0] = (const guchar *)task->raw_headers_content.begin;
+		lenvec[0] = task->raw_headers_content.len;
 		break;
 	case RSPAMD_RE_MIMEHEADER:
 		headerlist = rspamd_message_get_mime_header_array (task,
@@ -835,38 +950,8 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 				is_strong);
 
 		if (headerlist && headerlist->len > 0) {
-			scvec = g_malloc (sizeof (*scvec) * headerlist->len);
-			lenvec = g_malloc (sizeof (*lenvec) * headerlist->len);
-
-			for (i = 0; i < headerlist->len; i ++) {
-				rh = g_ptr_array_index (headerlist, i);
-
-				if (re_class->type == RSPAMD_RE_RAWHEADER) {
-					in = rh->value;
-					raw = TRUE;
-					lenvec[i] = strlen (rh->value);
-				}
-				else {
-					in = rh->decoded;
-					/* Validate input */
-					if (!in || !g_utf8_validate (in, -1, &end)) {
-						lenvec[i] = 0;
-						scvec[i] = (guchar *)"";
-						continue;
-					}
-					lenvec[i] = end - in;
-				}
-
-				scvec[i] = (guchar *)in;
-			}
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, headerlist->len, raw);
-			msg_debug_re_task ("checking mime header %s regexp: %s -> %d",
-					re_class->type_data,
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
+			cnt = rspamd_re_cache_headers_data (re_class, headerlist,
+					&scvec, &lenvec, &raw);
 		}
 		break;
 	case RSPAMD_RE_MIME:
@@ -894,6 +979,9 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 					raw = TRUE;
 				}
 				else {
+					rspamd_mime_text_part_process (task, part,
+							RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
+
 					/* Skip empty parts */
 					if (IS_PART_EMPTY (part)) {
 						len = 0;
@@ -913,16 +1001,11 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 				scvec[i] = (guchar *) in;
 				lenvec[i] = len;
 			}
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, cnt, raw);
-			msg_debug_re_task ("checking mime regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
 		}
 		break;
 	case RSPAMD_RE_URL:
+		rspamd_message_process_text_parts (task,
+				RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 		cnt = g_hash_table_size (task->urls) + g_hash_table_size (task->emails);
 
 		if (cnt > 0) {
@@ -933,45 +1016,28 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 
 			while (g_hash_table_iter_next (&it, &k, &v)) {
 				url = v;
-				in = url->string;
-				len = url->urllen;
-				raw = FALSE;
-
-				scvec[i] = (guchar *)in;
-				lenvec[i++] = len;
+				scvec[i] = (guchar *)url->string;
+				lenvec[i++] = url->urllen;
 			}
 
 			g_hash_table_iter_init (&it, task->emails);
 
 			while (g_hash_table_iter_next (&it, &k, &v)) {
 				url = v;
-				in = url->string;
-				len = url->urllen;
-				raw = FALSE;
-
-				scvec[i] = (guchar *) in;
-				lenvec[i++] = len;
+				scvec[i] = (guchar *)url->string;
+				lenvec[i++] = url->urllen;
 			}
 
 			g_assert (i == cnt);
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, i, raw);
-			msg_debug_re_task ("checking url regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
 		}
 		break;
 	case RSPAMD_RE_BODY:
 		raw = TRUE;
-		in = task->msg.begin;
-		len = task->msg.len;
-
-		ret = rspamd_re_cache_process_regexp_data (rt, re, task,
-				(const guchar **)&in, &len, 1, raw);
-		msg_debug_re_task ("checking rawbody regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
+		cnt = 1;
+		scvec = g_malloc (sizeof (*scvec));
+		lenvec = g_malloc (sizeof (*lenvec));
+		scvec[0] = (const guchar *)task->msg.begin;
+		lenvec[0] = task->msg.len;
 		break;
 	case RSPAMD_RE_SABODY:
 		/* According to SA docs:
@@ -982,6 +1048,7 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		 * paragraph when running the rules. All HTML tags and line breaks will
 		 * be removed before matching.
 		 */
+		raw = TRUE;
 		cnt = task->text_parts->len + 1;
 		scvec = g_malloc (sizeof (*scvec) * cnt);
 		lenvec = g_malloc (sizeof (*lenvec) * cnt);
@@ -1005,6 +1072,8 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		}
 		for (i = 0; i < task->text_parts->len; i++) {
 			part = g_ptr_array_index (task->text_parts, i);
+			rspamd_mime_text_part_process (task, part,
+					RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 
 			if (part->stripped_content) {
 				scvec[i + 1] = (guchar *)part->stripped_content->data;
@@ -1015,13 +1084,6 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 				lenvec[i + 1] = 0;
 			}
 		}
-
-		ret = rspamd_re_cache_process_regexp_data (rt, re,
-				task, scvec, lenvec, cnt, TRUE);
-		msg_debug_re_task ("checking sa body regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
-		g_free (scvec);
-		g_free (lenvec);
 		break;
 	case RSPAMD_RE_SARAWBODY:
 		/* According to SA docs:
@@ -1031,6 +1093,8 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		 * Multiline expressions will need to be used to match strings that are
 		 * broken by line breaks.
 		 */
+		raw = TRUE;
+
 		if (task->text_parts->len > 0) {
 			cnt = task->text_parts->len;
 			scvec = g_malloc (sizeof (*scvec) * cnt);
@@ -1048,21 +1112,116 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 					lenvec[i] = 0;
 				}
 			}
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, cnt, TRUE);
-			msg_debug_re_task ("checking sa rawbody regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
 		}
 		break;
 	case RSPAMD_RE_MAX:
+		break;
+	}
+
+	*pscvec = scvec;
+	*plenvec = lenvec;
+	*praw = raw;
+
+	return cnt;
+}
+
+#ifdef WITH_HYPERSCAN
+/*
+ * Scans all hyperscan classes at once using the shared scratch, so the
+ * subsequent regexps are served from the results cache
+ */
+static void
+rspamd_re_cache_scan_all (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt,
+		struct rspamd_re_class *cur_class,
+		gboolean is_strong)
+{
+	struct rspamd_re_cache *cache = rt->cache;
+	struct rspamd_re_class *re_class;
+	GHashTableIter it;
+	gpointer k, v;
+	const guchar **scvec;
+	guint *lenvec, cnt;
+	gboolean raw;
+	gdouble t1, t2;
+
+	rt->eager_scanned = TRUE;
+	t1 = rspamd_get_ticks (FALSE);
+	g_hash_table_iter_init (&it, cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+
+		if (re_class->hs_db == NULL || re_class->nhs == 0 ||
+				isset (rt->checked, re_class->hs_ids[0])) {
+			/* Class has no hyperscan regexps or it has been already scanned */
+			continue;
+		}
+
+		/*
+		 * Strong headers lookup is a property of a particular call, for
+		 * other classes we use the default case insensitive one
+		 */
+		cnt = rspamd_re_cache_class_data (task, re_class,
+				re_class == cur_class ? is_strong : FALSE,
+				&scvec, &lenvec, &raw);
+
+		if (cnt > 0) {
+			rspamd_re_cache_scan_class (rt, task, re_class, cache->hs_scratch,
+					scvec, lenvec, cnt, raw);
+		}
+
+		rspamd_re_cache_finish_class (rt, re_class);
+		g_free (scvec);
+		g_free (lenvec);
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rt->stat.eager_time = t2 - t1;
+	msg_debug_re_task ("scanned all hyperscan classes in %.3f ms",
+			(t2 - t1) * 1000.0);
+}
+#endif
+
+/*
+ * Calculates the specified regexp for the specified class if it's not calculated
+ */
+static guint
+rspamd_re_cache_exec_re (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt,
+		rspamd_regexp_t *re,
+		struct rspamd_re_class *re_class,
+		gboolean is_strong)
+{
+	guint ret = 0, re_id, cnt;
+	const guchar **scvec;
+	guint *lenvec;
+	gboolean raw = FALSE;
+
+	msg_debug_re_task ("check re type: %s: /%s/",
+			rspamd_re_cache_type_to_string (re_class->type),
+			rspamd_regexp_get_pattern (re));
+	re_id = rspamd_regexp_get_cache_id (re);
+
+	if (re_class->type == RSPAMD_RE_MAX) {
 		msg_err_task ("regexp of class invalid has been called: %s",
 				rspamd_regexp_get_pattern (re));
-		break;
 	}
 
+	cnt = rspamd_re_cache_class_data (task, re_class, is_strong,
+			&scvec, &lenvec, &raw);
+
+	if (cnt > 0) {
+		ret = rspamd_re_cache_process_regexp_data (rt, re,
+				task, scvec, lenvec, cnt, raw);
+		msg_debug_re_task ("checking %s regexp: %s -> %d",
+				rspamd_re_cache_type_to_string (re_class->type),
+				rspamd_regexp_get_pattern (re), ret);
+	}
+
+	g_free (scvec);
+	g_free (lenvec);
+
 #if WITH_HYPERSCAN
 	if (!rt->cache->disable_hyperscan && rt->has_hs) {
 		rspamd_re_cache_finish_class (rt, re_class);
@@ -1116,6 +1275,17 @@ rspamd_re_cache_process (struct rspamd_task *task,
 			return 0;
 		}
 
+#ifdef WITH_HYPERSCAN
+		if (cache->eager_hyperscan && !rt->eager_scanned && rt->has_hs &&
+				!cache->disable_hyperscan && cache->hs_scratch) {
+			rspamd_re_cache_scan_all (task, rt, re_class, is_strong);
+
+			if (isset (rt->checked, re_id)) {
+				return rt->results[re_id];
+			}
+		}
+#endif
+
 		return rspamd_re_cache_exec_re (task, rt, re, re_class,
 				is_strong);
 	}
@@ -1359,35 +1529,615 @@ rspamd_re_cache_is_finite (struct rspamd_re_cache *cache,
 }
 #endif
 
-gint
-rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
-		const char *cache_dir, gdouble max_time, gboolean silent,
-		GError **err)
+#ifdef WITH_HYPERSCAN
+/*
+ * Finds checksum and serialized database in the mapped .hs file
+ */
+static gboolean
+rspamd_re_cache_hs_file_blob (struct rspamd_re_cache *cache,
+		const guchar *map, gsize len,
+		guint64 *crc, const guchar **blob, gsize *bloblen)
 {
-	g_assert (cache != NULL);
-	g_assert (cache_dir != NULL);
+	const guchar *p;
+	gint n;
 
-#ifndef WITH_HYPERSCAN
-	g_set_error (err, rspamd_re_cache_quark (), EINVAL, "hyperscan is disabled");
-	return -1;
-#else
-	GHashTableIter it, cit;
-	gpointer k, v;
-	struct rspamd_re_class *re_class;
-	gchar path[PATH_MAX], npath[PATH_MAX];
-	hs_database_t *test_db;
-	gint fd, i, n, *hs_ids = NULL, pcre_flags, re_flags;
+	if (len < RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt) + sizeof (n)) {
+		return FALSE;
+	}
+
+	p = map + RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt);
+	memcpy (&n, p, sizeof (n));
+
+	if (n <= 0 || 2 * n * sizeof (gint) + /* IDs + flags */
+			sizeof (guint64) + /* crc */
+			sizeof (n) +
+			RSPAMD_HS_MAGIC_LEN + /* header */
+			sizeof (cache->plt) > len) {
+		return FALSE;
+	}
+
+	p += sizeof (n) + 2 * n * sizeof (gint);
+	memcpy (crc, p, sizeof (*crc));
+	p += sizeof (*crc);
+	*blob = p;
+	*bloblen = len - (p - map);
+
+	return TRUE;
+}
+
+/*
+ * Writes `<hash>.hsmp` image for the specified class from its `.hs` file.
+ * The image is replaced by rename, so workers that have the previous
+ * generation mapped continue to use it until they load the new one.
+ */
+static gboolean
+rspamd_re_cache_write_shared_db (struct rspamd_re_cache *cache,
+		const char *cache_dir, struct rspamd_re_class *re_class)
+{
+	gchar path[PATH_MAX], npath[PATH_MAX];
+	struct rspamd_hs_shared_hdr hdr;
+	guchar *map;
+	const guchar *blob;
+	gsize len, bloblen, dblen;
+	gpointer image = NULL;
+	guint64 crc;
+	gint fd, ret;
+	struct iovec iov[2];
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+	map = rspamd_file_xmap (path, PROT_READ, &len, TRUE);
+
+	if (map == NULL) {
+		msg_err_re_cache ("cannot mmap hyperscan cache file %s: %s",
+				path, strerror (errno));
+		return FALSE;
+	}
+
+	if (!rspamd_re_cache_hs_file_blob (cache, map, len, &crc, &blob,
+			&bloblen)) {
+		msg_err_re_cache ("bad hyperscan cache file %s", path);
+		munmap (map, len);
+
+		return FALSE;
+	}
+
+	rspamd_snprintf (npath, sizeof (npath), "%s%c%s.hsmp", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+	fd = open (npath, O_RDONLY);
+
+	if (fd != -1) {
+		/* Do not rewrite image if it has been built from the same database */
+		if (read (fd, &hdr, sizeof (hdr)) == sizeof (hdr) &&
+				memcmp (hdr.magic, rspamd_hs_shared_magic,
+						sizeof (hdr.magic)) == 0 &&
+				hdr.crc == crc) {
+			close (fd);
+			munmap (map, len);
+
+			return TRUE;
+		}
+
+		close (fd);
+	}
+
+	if ((ret = hs_serialized_database_size ((const char *)blob, bloblen,
+			&dblen)) != HS_SUCCESS) {
+		msg_err_re_cache ("bad hs database in %s: %d", path, ret);
+		munmap (map, len);
+
+		return FALSE;
+	}
+
+	if (posix_memalign (&image, sizeof (hdr), dblen) != 0) {
+		msg_err_re_cache ("cannot allocate %z bytes for hs database: %s",
+				dblen, strerror (errno));
+		munmap (map, len);
+
+		return FALSE;
+	}
+
+	if ((ret = hs_deserialize_database_at ((const char *)blob, bloblen,
+			(hs_database_t *)image)) != HS_SUCCESS) {
+		msg_err_re_cache ("bad hs database in %s: %d", path, ret);
+		munmap (map, len);
+		free (image);
+
+		return FALSE;
+	}
+
+	munmap (map, len);
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, rspamd_hs_shared_magic, sizeof (hdr.magic));
+	hdr.crc = crc;
+	hdr.db_len = dblen;
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hsmp.new", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+	fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
+
+	if (fd == -1) {
+		msg_err_re_cache ("cannot open file %s: %s", path, strerror (errno));
+		free (image);
+
+		return FALSE;
+	}
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof (hdr);
+	iov[1].iov_base = image;
+	iov[1].iov_len = dblen;
+
+	if (writev (fd, iov, G_N_ELEMENTS (iov)) != (gssize)(sizeof (hdr) + dblen)) {
+		msg_err_re_cache ("cannot write shared hs database to %s: %s",
+				path, strerror (errno));
+		close (fd);
+		unlink (path);
+		free (image);
+
+		return FALSE;
+	}
+
+	free (image);
+	fsync (fd);
+	close (fd);
+
+	if (rename (path, npath) == -1) {
+		msg_err_re_cache ("cannot rename %s to %s: %s",
+				path, npath, strerror (errno));
+		unlink (path);
+
+		return FALSE;
+	}
+
+	msg_info_re_cache ("written shared hyperscan image %s, %z bytes",
+			npath, dblen);
+
+	return TRUE;
+}
+
+/*
+ * Maps `<hash>.hsmp` image if it matches the database with the specified crc
+ */
+static hs_database_t *
+rspamd_re_cache_map_shared_db (struct rspamd_re_cache *cache,
+		const char *cache_dir, struct rspamd_re_class *re_class,
+		guint64 crc, guchar **pmap, gsize *plen)
+{
+	gchar path[PATH_MAX];
+	struct rspamd_hs_shared_hdr hdr;
+	struct stat st;
+	guchar *map;
+	gsize dblen;
+	gint fd;
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hsmp", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+	fd = open (path, O_RDONLY);
+
+	if (fd == -1) {
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1 ||
+			read (fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+			memcmp (hdr.magic, rspamd_hs_shared_magic, sizeof (hdr.magic)) != 0 ||
+			hdr.crc != crc ||
+			hdr.db_len + sizeof (hdr) != (guint64)st.st_size) {
+		msg_info_re_cache ("ignore outdated shared hyperscan image %s", path);
+		close (fd);
+
+		return NULL;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		msg_err_re_cache ("cannot mmap %s: %s", path, strerror (errno));
+
+		return NULL;
+	}
+
+	if (hs_database_size ((const hs_database_t *)(map + sizeof (hdr)),
+			&dblen) != HS_SUCCESS || dblen != hdr.db_len) {
+		msg_err_re_cache ("bad shared hyperscan image %s", path);
+		munmap (map, st.st_size);
+
+		return NULL;
+	}
+
+	*pmap = map;
+	*plen = st.st_size;
+
+	return (hs_database_t *)(map + sizeof (hdr));
+}
+#endif
+
+#ifdef WITH_HYPERSCAN
+static gint
+rspamd_re_cache_hs_file_count (struct rspamd_re_cache *cache,
+		const char *path)
+{
+	gint fd, n = 0;
+
+	fd = open (path, O_RDONLY, 00600);
+
+	/* Read number of regexps */
+	g_assert (fd != -1);
+	lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET);
+	g_assert (read (fd, &n, sizeof (n)) == sizeof (n));
+	close (fd);
+
+	return n;
+}
+
+/*
+ * Compiles a single class to `<hash>.hs` file, returns number of compiled
+ * expressions or -1 in case of error
+ */
+static gint
+rspamd_re_cache_compile_class (struct rspamd_re_cache *cache,
+		const char *cache_dir, struct rspamd_re_class *re_class,
+		gdouble max_time, GError **err)
+{
+	gchar path[PATH_MAX], npath[PATH_MAX];
+	hs_database_t *test_db;
+	gint fd, i, n, *hs_ids = NULL, pcre_flags, re_flags;
 	rspamd_cryptobox_fast_hash_state_t crc_st;
 	guint64 crc;
 	rspamd_regexp_t *re;
+	struct rspamd_re_cache_elt *elt;
 	hs_compile_error_t *hs_errors;
-	guint *hs_flags = NULL;
+	guint *hs_flags = NULL, j;
 	const hs_expr_ext_t **hs_exts = NULL;
 	const gchar **hs_pats = NULL;
 	gchar *hs_serialized;
-	gsize serialized_len, total = 0;
+	gsize serialized_len;
+	gdouble t1, t2;
 	struct iovec iov[7];
 
+	t1 = rspamd_get_ticks (FALSE);
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs.new", cache_dir,
+					G_DIR_SEPARATOR, re_class->hash);
+	fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
+				"%s: %s", path, strerror (errno));
+		return -1;
+	}
+
+	n = re_class->re_ids->len;
+	hs_flags = g_malloc0 (sizeof (*hs_flags) * n);
+	hs_ids = g_malloc (sizeof (*hs_ids) * n);
+	hs_pats = g_malloc (sizeof (*hs_pats) * n);
+	hs_exts = g_malloc0 (sizeof (*hs_exts) * n);
+	i = 0;
+
+	/* Expressions are identified by their local id within the class */
+	for (j = 0; j < re_class->re_ids->len; j ++) {
+		elt = g_ptr_array_index (cache->re,
+				g_array_index (re_class->re_ids, gint, j));
+		re = elt->re;
+
+		pcre_flags = rspamd_regexp_get_pcre_flags (re);
+		re_flags = rspamd_regexp_get_flags (re);
+
+		if (re_flags & RSPAMD_REGEXP_FLAG_PCRE_ONLY) {
+			/* Do not try to compile bad regexp */
+			msg_info_re_cache (
+					"do not try compile %s to hyperscan as it is PCRE only",
+					rspamd_regexp_get_pattern (re));
+			continue;
+		}
+
+		hs_flags[i] = 0;
+		hs_exts[i] = NULL;
+#ifndef WITH_PCRE2
+		if (pcre_flags & PCRE_FLAG(UTF8)) {
+			hs_flags[i] |= HS_FLAG_UTF8;
+		}
+#else
+		if (pcre_flags & PCRE_FLAG(UTF)) {
+			hs_flags[i] |= HS_FLAG_UTF8;
+		}
+#endif
+		if (pcre_flags & PCRE_FLAG(CASELESS)) {
+			hs_flags[i] |= HS_FLAG_CASELESS;
+		}
+		if (pcre_flags & PCRE_FLAG(MULTILINE)) {
+			hs_flags[i] |= HS_FLAG_MULTILINE;
+		}
+		if (pcre_flags & PCRE_FLAG(DOTALL)) {
+			hs_flags[i] |= HS_FLAG_DOTALL;
+		}
+		if (rspamd_regexp_get_maxhits (re) == 1) {
+			hs_flags[i] |= HS_FLAG_SINGLEMATCH;
+		}
+
+		if (hs_compile (rspamd_regexp_get_pattern (re),
+				hs_flags[i],
+				cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
+				&cache->plt,
+				&test_db,
+				&hs_errors) != HS_SUCCESS) {
+			msg_info_re_cache ("cannot compile %s to hyperscan, try prefilter match",
+					rspamd_regexp_get_pattern (re));
+			hs_free_compile_error (hs_errors);
+
+			/* The approximation operation might take a significant
+			 * amount of time, so we need to check if it's finite
+			 */
+			if (rspamd_re_cache_is_finite (cache, re, hs_flags[i], max_time)) {
+				hs_flags[i] |= HS_FLAG_PREFILTER;
+				hs_ids[i] = j;
+				hs_pats[i] = rspamd_regexp_get_pattern (re);
+				i++;
+			}
+		}
+		else {
+			hs_ids[i] = j;
+			hs_pats[i] = rspamd_regexp_get_pattern (re);
+			i ++;
+			hs_free_database (test_db);
+		}
+	}
+	/* Adjust real re number */
+	n = i;
+
+	if (n > 0) {
+		/* Create the hs tree */
+		if (hs_compile_ext_multi (hs_pats,
+				hs_flags,
+				hs_ids,
+				hs_exts,
+				n,
+				cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
+				&cache->plt,
+				&test_db,
+				&hs_errors) != HS_SUCCESS) {
+
+			g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+					"cannot create tree of regexp when processing '%s': %s",
+					hs_pats[hs_errors->expression], hs_errors->message);
+			g_free (hs_flags);
+			g_free (hs_ids);
+			g_free (hs_pats);
+			g_free (hs_exts);
+			close (fd);
+			unlink (path);
+			hs_free_compile_error (hs_errors);
+
+			return -1;
+		}
+
+		g_free (hs_pats);
+		g_free (hs_exts);
+
+		if (hs_serialize_database (test_db, &hs_serialized,
+				&serialized_len) != HS_SUCCESS) {
+			g_set_error (err,
+					rspamd_re_cache_quark (),
+					errno,
+					"cannot serialize tree of regexp for %s",
+					re_class->hash);
+
+			close (fd);
+			unlink (path);
+			g_free (hs_ids);
+			g_free (hs_flags);
+			hs_free_database (test_db);
+
+			return -1;
+		}
+
+		hs_free_database (test_db);
+
+		/*
+		 * Magic - 8 bytes
+		 * Platform - sizeof (platform)
+		 * n - number of regexps
+		 * n * <regexp ids>
+		 * n * <regexp flags>
+		 * crc - 8 bytes checksum
+		 * <hyperscan blob>
+		 */
+		rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
+		/* IDs -> Flags -> Hs blob */
+		rspamd_cryptobox_fast_hash_update (&crc_st,
+				hs_ids, sizeof (*hs_ids) * n);
+		rspamd_cryptobox_fast_hash_update (&crc_st,
+				hs_flags, sizeof (*hs_flags) * n);
+		rspamd_cryptobox_fast_hash_update (&crc_st,
+				hs_serialized, serialized_len);
+		crc = rspamd_cryptobox_fast_hash_final (&crc_st);
+
+		if (cache->vectorized_hyperscan) {
+			iov[0].iov_base = (void *) rspamd_hs_magic_vector;
+		}
+		else {
+			iov[0].iov_base = (void *) rspamd_hs_magic;
+		}
+
+		iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
+		iov[1].iov_base = &cache->plt;
+		iov[1].iov_len = sizeof (cache->plt);
+		iov[2].iov_base = &n;
+		iov[2].iov_len = sizeof (n);
+		iov[3].iov_base = hs_ids;
+		iov[3].iov_len = sizeof (*hs_ids) * n;
+		iov[4].iov_base = hs_flags;
+		iov[4].iov_len = sizeof (*hs_flags) * n;
+		iov[5].iov_base = &crc;
+		iov[5].iov_len = sizeof (crc);
+		iov[6].iov_base = hs_serialized;
+		iov[6].iov_len = serialized_len;
+
+		if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
+			g_set_error (err,
+					rspamd_re_cache_quark (),
+					errno,
+					"cannot serialize tree of regexp to %s: %s",
+					path, strerror (errno));
+			close (fd);
+			unlink (path);
+			g_free (hs_ids);
+			g_free (hs_flags);
+			g_free (hs_serialized);
+
+			return -1;
+		}
+
+		t2 = rspamd_get_ticks (FALSE);
+
+		if (re_class->type_len > 0) {
+			msg_info_re_cache (
+					"compiled class %s(%*s) to cache %6s, %d regexps in "
+					"%.2f seconds",
+					rspamd_re_cache_type_to_string (re_class->type),
+					(gint) re_class->type_len - 1,
+					re_class->type_data,
+					re_class->hash,
+					n,
+					t2 - t1);
+		}
+		else {
+			msg_info_re_cache (
+					"compiled class %s to cache %6s, %d regexps in "
+					"%.2f seconds",
+					rspamd_re_cache_type_to_string (re_class->type),
+					re_class->hash,
+					n,
+					t2 - t1);
+		}
+
+		g_free (hs_serialized);
+		g_free (hs_ids);
+		g_free (hs_flags);
+	}
+	else {
+		g_free (hs_pats);
+		g_free (hs_exts);
+		g_free (hs_ids);
+		g_free (hs_flags);
+	}
+
+	fsync (fd);
+
+	/* Now rename temporary file to the new .hs file */
+	rspamd_snprintf (npath, sizeof (npath), "%s%c%s.hs", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+
+	if (rename (path, npath) == -1) {
+		g_set_error (err,
+				rspamd_re_cache_quark (),
+				errno,
+				"cannot rename %s to %s: %s",
+				path, npath, strerror (errno));
+		unlink (path);
+		close (fd);
+
+		return -1;
+	}
+
+	close (fd);
+
+	if (n > 0) {
+		rspamd_re_cache_write_shared_db (cache, cache_dir, re_class);
+	}
+
+	return n;
+}
+
+/*
+ * Compiles classes in `max_jobs` forked processes, classes are independent
+ * and are written to separate files, so we merely wait for children here
+ */
+static gboolean
+rspamd_re_cache_compile_pool (struct rspamd_re_cache *cache,
+		const char *cache_dir, GPtrArray *classes, gdouble max_time,
+		guint max_jobs, GError **err)
+{
+	struct rspamd_re_class *re_class;
+	GError *cerr = NULL;
+	pid_t *pids;
+	guint njobs, i, j, nfailed = 0;
+	gint status;
+	gboolean ret = TRUE;
+
+	njobs = MIN (max_jobs, classes->len);
+	pids = g_malloc0 (sizeof (*pids) * njobs);
+	signal (SIGCHLD, SIG_DFL);
+
+	for (i = 0; i < njobs; i ++) {
+		pids[i] = fork ();
+
+		if (pids[i] == -1) {
+			g_set_error (err, rspamd_re_cache_quark (), errno,
+					"cannot fork compile process: %s", strerror (errno));
+			ret = FALSE;
+			break;
+		}
+		else if (pids[i] == 0) {
+			for (j = i; j < classes->len; j += njobs) {
+				re_class = g_ptr_array_index (classes, j);
+
+				if (rspamd_re_cache_compile_class (cache, cache_dir, re_class,
+						max_time, &cerr) == -1) {
+					msg_err_re_cache ("cannot compile class %s: %e",
+							re_class->hash, cerr);
+					exit (EXIT_FAILURE);
+				}
+			}
+
+			exit (EXIT_SUCCESS);
+		}
+	}
+
+	for (j = 0; j < i; j ++) {
+		if (waitpid (pids[j], &status, 0) == -1 ||
+				!WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS) {
+			nfailed ++;
+		}
+	}
+
+	signal (SIGCHLD, SIG_IGN);
+	g_free (pids);
+
+	if (ret && nfailed > 0) {
+		g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+				"%ud of %ud compile processes have failed", nfailed, njobs);
+		ret = FALSE;
+	}
+
+	return ret;
+}
+#endif
+
+gint
+rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
+		const char *cache_dir, gdouble max_time, gboolean silent,
+		guint max_jobs, GError **err)
+{
+	g_assert (cache != NULL);
+	g_assert (cache_dir != NULL);
+
+#ifndef WITH_HYPERSCAN
+	g_set_error (err, rspamd_re_cache_quark (), EINVAL, "hyperscan is disabled");
+	return -1;
+#else
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	gchar path[PATH_MAX];
+	GPtrArray *classes;
+	gint n, total = 0;
+	guint i;
+	gdouble t1, t2;
+
+	classes = g_ptr_array_new ();
 	g_hash_table_iter_init (&it, cache->re_classes);
 
 	while (g_hash_table_iter_next (&it, &k, &v)) {
@@ -1396,14 +2146,7 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 				G_DIR_SEPARATOR, re_class->hash);
 
 		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, TRUE)) {
-
-			fd = open (path, O_RDONLY, 00600);
-
-			/* Read number of regexps */
-			g_assert (fd != -1);
-			lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET);
-			g_assert (read (fd, &n, sizeof (n)) == sizeof (n));
-			close (fd);
+			n = rspamd_re_cache_hs_file_count (cache, path);
 
 			if (re_class->type_len > 0) {
 				if (!silent) {
@@ -1426,243 +2169,61 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 				}
 			}
 
-			continue;
-		}
-
-		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs.new", cache_dir,
-						G_DIR_SEPARATOR, re_class->hash);
-		fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
+			/* Images are not fatal, workers can deserialize .hs files */
+			rspamd_re_cache_write_shared_db (cache, cache_dir, re_class);
 
-		if (fd == -1) {
-			g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
-					"%s: %s", path, strerror (errno));
-			return -1;
+			continue;
 		}
 
-		g_hash_table_iter_init (&cit, re_class->re);
-		n = g_hash_table_size (re_class->re);
-		hs_flags = g_malloc0 (sizeof (*hs_flags) * n);
-		hs_ids = g_malloc (sizeof (*hs_ids) * n);
-		hs_pats = g_malloc (sizeof (*hs_pats) * n);
-		hs_exts = g_malloc0 (sizeof (*hs_exts) * n);
-		i = 0;
-
-		while (g_hash_table_iter_next (&cit, &k, &v)) {
-			re = v;
-
-			pcre_flags = rspamd_regexp_get_pcre_flags (re);
-			re_flags = rspamd_regexp_get_flags (re);
-
-			if (re_flags & RSPAMD_REGEXP_FLAG_PCRE_ONLY) {
-				/* Do not try to compile bad regexp */
-				msg_info_re_cache (
-						"do not try compile %s to hyperscan as it is PCRE only",
-						rspamd_regexp_get_pattern (re));
-				continue;
-			}
-
-			hs_flags[i] = 0;
-			hs_exts[i] = NULL;
-#ifndef WITH_PCRE2
-			if (pcre_flags & PCRE_FLAG(UTF8)) {
-				hs_flags[i] |= HS_FLAG_UTF8;
-			}
-#else
-			if (pcre_flags & PCRE_FLAG(UTF)) {
-				hs_flags[i] |= HS_FLAG_UTF8;
-			}
-#endif
-			if (pcre_flags & PCRE_FLAG(CASELESS)) {
-				hs_flags[i] |= HS_FLAG_CASELESS;
-			}
-			if (pcre_flags & PCRE_FLAG(MULTILINE)) {
-				hs_flags[i] |= HS_FLAG_MULTILINE;
-			}
-			if (pcre_flags & PCRE_FLAG(DOTALL)) {
-				hs_flags[i] |= HS_FLAG_DOTALL;
-			}
-			if (rspamd_regexp_get_maxhits (re) == 1) {
-				hs_flags[i] |= HS_FLAG_SINGLEMATCH;
-			}
-
-			if (hs_compile (rspamd_regexp_get_pattern (re),
-					hs_flags[i],
-					cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
-					&cache->plt,
-					&test_db,
-					&hs_errors) != HS_SUCCESS) {
-				msg_info_re_cache ("cannot compile %s to hyperscan, try prefilter match",
-						rspamd_regexp_get_pattern (re));
-				hs_free_compile_error (hs_errors);
-
-				/* The approximation operation might take a significant
-				 * amount of time, so we need to check if it's finite
-				 */
-				if (rspamd_re_cache_is_finite (cache, re, hs_flags[i], max_time)) {
-					hs_flags[i] |= HS_FLAG_PREFILTER;
-					hs_ids[i] = rspamd_regexp_get_cache_id (re);
-					hs_pats[i] = rspamd_regexp_get_pattern (re);
-					i++;
-				}
-			}
-			else {
-				hs_ids[i] = rspamd_regexp_get_cache_id (re);
-				hs_pats[i] = rspamd_regexp_get_pattern (re);
-				i ++;
-				hs_free_database (test_db);
-			}
-		}
-		/* Adjust real re number */
-		n = i;
+		g_ptr_array_add (classes, re_class);
+	}
 
-		if (n > 0) {
-			/* Create the hs tree */
-			if (hs_compile_ext_multi (hs_pats,
-					hs_flags,
-					hs_ids,
-					hs_exts,
-					n,
-					cache->vectorized_hyperscan ? HS_MODE_VECTORED : HS_MODE_BLOCK,
-					&cache->plt,
-					&test_db,
-					&hs_errors) != HS_SUCCESS) {
-
-				g_set_error (err, rspamd_re_cache_quark (), EINVAL,
-						"cannot create tree of regexp when processing '%s': %s",
-						hs_pats[hs_errors->expression], hs_errors->message);
-				g_free (hs_flags);
-				g_free (hs_ids);
-				g_free (hs_pats);
-				g_free (hs_exts);
-				close (fd);
-				unlink (path);
-				hs_free_compile_error (hs_errors);
+	if (classes->len == 0) {
+		g_ptr_array_free (classes, TRUE);
 
-				return -1;
-			}
+		return 0;
+	}
 
-			g_free (hs_pats);
-			g_free (hs_exts);
+	t1 = rspamd_get_ticks (FALSE);
 
-			if (hs_serialize_database (test_db, &hs_serialized,
-					&serialized_len) != HS_SUCCESS) {
-				g_set_error (err,
-						rspamd_re_cache_quark (),
-						errno,
-						"cannot serialize tree of regexp for %s",
-						re_class->hash);
+	if (max_jobs <= 1 || classes->len == 1) {
+		for (i = 0; i < classes->len; i ++) {
+			re_class = g_ptr_array_index (classes, i);
+			n = rspamd_re_cache_compile_class (cache, cache_dir, re_class,
+					max_time, err);
 
-				close (fd);
-				unlink (path);
-				g_free (hs_ids);
-				g_free (hs_flags);
-				hs_free_database (test_db);
+			if (n == -1) {
+				g_ptr_array_free (classes, TRUE);
 
 				return -1;
 			}
 
-			hs_free_database (test_db);
-
-			/*
-			 * Magic - 8 bytes
-			 * Platform - sizeof (platform)
-			 * n - number of regexps
-			 * n * <regexp ids>
-			 * n * <regexp flags>
-			 * crc - 8 bytes checksum
-			 * <hyperscan blob>
-			 */
-			rspamd_cryptobox_fast_hash_init (&crc_st, 0xdeadbabe);
-			/* IDs -> Flags -> Hs blob */
-			rspamd_cryptobox_fast_hash_update (&crc_st,
-					hs_ids, sizeof (*hs_ids) * n);
-			rspamd_cryptobox_fast_hash_update (&crc_st,
-					hs_flags, sizeof (*hs_flags) * n);
-			rspamd_cryptobox_fast_hash_update (&crc_st,
-					hs_serialized, serialized_len);
-			crc = rspamd_cryptobox_fast_hash_final (&crc_st);
-
-			if (cache->vectorized_hyperscan) {
-				iov[0].iov_base = (void *) rspamd_hs_magic_vector;
-			}
-			else {
-				iov[0].iov_base = (void *) rspamd_hs_magic;
-			}
-
-			iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
-			iov[1].iov_base = &cache->plt;
-			iov[1].iov_len = sizeof (cache->plt);
-			iov[2].iov_base = &n;
-			iov[2].iov_len = sizeof (n);
-			iov[3].iov_base = hs_ids;
-			iov[3].iov_len = sizeof (*hs_ids) * n;
-			iov[4].iov_base = hs_flags;
-			iov[4].iov_len = sizeof (*hs_flags) * n;
-			iov[5].iov_base = &crc;
-			iov[5].iov_len = sizeof (crc);
-			iov[6].iov_base = hs_serialized;
-			iov[6].iov_len = serialized_len;
-
-			if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
-				g_set_error (err,
-						rspamd_re_cache_quark (),
-						errno,
-						"cannot serialize tree of regexp to %s: %s",
-						path, strerror (errno));
-				close (fd);
-				unlink (path);
-				g_free (hs_ids);
-				g_free (hs_flags);
-				g_free (hs_serialized);
-
-				return -1;
-			}
-
-			if (re_class->type_len > 0) {
-				msg_info_re_cache (
-						"compiled class %s(%*s) to cache %6s, %d regexps",
-						rspamd_re_cache_type_to_string (re_class->type),
-						(gint) re_class->type_len - 1,
-						re_class->type_data,
-						re_class->hash,
-						n);
-			}
-			else {
-				msg_info_re_cache (
-						"compiled class %s to cache %6s, %d regexps",
-						rspamd_re_cache_type_to_string (re_class->type),
-						re_class->hash,
-						n);
-			}
-
 			total += n;
-
-			g_free (hs_serialized);
-			g_free (hs_ids);
-			g_free (hs_flags);
 		}
-
-		fsync (fd);
-
-		/* Now rename temporary file to the new .hs file */
-		rspamd_snprintf (npath, sizeof (path), "%s%c%s.hs", cache_dir,
-				G_DIR_SEPARATOR, re_class->hash);
-
-		if (rename (path, npath) == -1) {
-			g_set_error (err,
-					rspamd_re_cache_quark (),
-					errno,
-					"cannot rename %s to %s: %s",
-					path, npath, strerror (errno));
-			unlink (path);
-			close (fd);
+	}
+	else {
+		if (!rspamd_re_cache_compile_pool (cache, cache_dir, classes, max_time,
+				max_jobs, err)) {
+			g_ptr_array_free (classes, TRUE);
 
 			return -1;
 		}
 
-		close (fd);
+		for (i = 0; i < classes->len; i ++) {
+			re_class = g_ptr_array_index (classes, i);
+			rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+					G_DIR_SEPARATOR, re_class->hash);
+			total += rspamd_re_cache_hs_file_count (cache, path);
+		}
 	}
 
+	t2 = rspamd_get_ticks (FALSE);
+	msg_info_re_cache ("compiled %ud changed classes of %ud, %d regexps "
+			"in %.2f seconds using %ud jobs",
+			classes->len, g_hash_table_size (cache->re_classes), total,
+			t2 - t1, MIN (MAX (max_jobs, 1), classes->len));
+	g_ptr_array_free (classes, TRUE);
+
 	return total;
 #endif
 }
@@ -1843,6 +2404,38 @@ rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 }
 
 
+#ifdef WITH_HYPERSCAN
+struct rspamd_re_class_hs_gen {
+	struct rspamd_re_class *re_class;
+	hs_database_t *db;
+	guchar *map;
+	gsize map_len;
+	gint *ids;
+	gint *flags;
+	gint n;
+};
+
+static void
+rspamd_re_cache_hs_gen_free (struct rspamd_re_class_hs_gen *gen, guint ngen)
+{
+	guint i;
+
+	for (i = 0; i < ngen; i ++) {
+		if (gen[i].map) {
+			munmap (gen[i].map, gen[i].map_len);
+		}
+		else if (gen[i].db) {
+			hs_free_database (gen[i].db);
+		}
+
+		g_free (gen[i].ids);
+		g_free (gen[i].flags);
+	}
+
+	g_free (gen);
+}
+#endif
+
 gboolean
 rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir)
@@ -1854,14 +2447,24 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 	return FALSE;
 #else
 	gchar path[PATH_MAX];
-	gint fd, i, n, *hs_ids = NULL, *hs_flags = NULL, total = 0, ret;
+	gint fd, i, n, total = 0, ret;
 	GHashTableIter it;
 	gpointer k, v;
 	guint8 *map, *p, *end;
 	struct rspamd_re_class *re_class;
 	struct rspamd_re_cache_elt *elt;
+	struct rspamd_re_class_hs_gen *gen, *cur;
+	hs_scratch_t *scratch;
+	guint ngen = 0, j;
+	gsize shared_size = 0;
+	guint64 crc;
 	struct stat st;
 
+	/*
+	 * New generation is loaded side by side with the current one: if any
+	 * class fails to load, the current databases are left untouched
+	 */
+	gen = g_malloc0 (sizeof (*gen) * g_hash_table_size (cache->re_classes));
 	g_hash_table_iter_init (&it, cache->re_classes);
 
 	while (g_hash_table_iter_next (&it, &k, &v)) {
@@ -1884,6 +2487,8 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 			if (map == MAP_FAILED) {
 				msg_err_re_cache ("cannot mmap %s: %s", path, strerror (errno));
 				close (fd);
+				rspamd_re_cache_hs_gen_free (gen, ngen);
+
 				return FALSE;
 			}
 
@@ -1900,82 +2505,144 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 				msg_err_re_cache ("bad number of expressions in %s: %d",
 						path, n);
 				munmap (map, st.st_size);
+				rspamd_re_cache_hs_gen_free (gen, ngen);
+
 				return FALSE;
 			}
 
+			cur = &gen[ngen ++];
+			cur->re_class = re_class;
+			cur->n = n;
 			total += n;
 			p += sizeof (n);
-			hs_ids = g_malloc (n * sizeof (*hs_ids));
-			memcpy (hs_ids, p, n * sizeof (*hs_ids));
-			p += n * sizeof (*hs_ids);
-			hs_flags = g_malloc (n * sizeof (*hs_flags));
-			memcpy (hs_flags, p, n * sizeof (*hs_flags));
-
-			/* Skip crc */
-			p += n * sizeof (*hs_ids) + sizeof (guint64);
-
-			/* Cleanup */
-			if (re_class->hs_scratch != NULL) {
-				hs_free_scratch (re_class->hs_scratch);
-			}
+			cur->ids = g_malloc (n * sizeof (*cur->ids));
+			memcpy (cur->ids, p, n * sizeof (*cur->ids));
+			p += n * sizeof (*cur->ids);
 
-			if (re_class->hs_db != NULL) {
-				hs_free_database (re_class->hs_db);
-			}
-
-			if (re_class->hs_ids) {
-				g_free (re_class->hs_ids);
-			}
-
-			re_class->hs_ids = NULL;
-			re_class->hs_scratch = NULL;
-			re_class->hs_db = NULL;
+			/* Translate local ids to the cache ids */
+			for (i = 0; i < n; i ++) {
+				if (cur->ids[i] < 0 ||
+						cur->ids[i] >= (gint)re_class->re_ids->len) {
+					msg_err_re_cache ("bad expression id in %s: %d",
+							path, cur->ids[i]);
+					munmap (map, st.st_size);
+					rspamd_re_cache_hs_gen_free (gen, ngen);
 
-			if ((ret = hs_deserialize_database (p, end - p, &re_class->hs_db))
-					!= HS_SUCCESS) {
-				msg_err_re_cache ("bad hs database in %s: %d", path, ret);
-				munmap (map, st.st_size);
-				g_free (hs_ids);
-				g_free (hs_flags);
+					return FALSE;
+				}
 
-				return FALSE;
+				cur->ids[i] = g_array_index (re_class->re_ids, gint,
+						cur->ids[i]);
 			}
+			cur->flags = g_malloc (n * sizeof (*cur->flags));
+			memcpy (cur->flags, p, n * sizeof (*cur->flags));
+			p += n * sizeof (*cur->flags);
+			memcpy (&crc, p, sizeof (crc));
+			p += sizeof (crc);
+
+			/* Prefer shared image to avoid a private copy in each worker */
+			cur->db = rspamd_re_cache_map_shared_db (cache, cache_dir,
+					re_class, crc, &cur->map, &cur->map_len);
+
+			if (cur->db == NULL) {
+				if ((ret = hs_deserialize_database (p, end - p, &cur->db))
+						!= HS_SUCCESS) {
+					msg_err_re_cache ("bad hs database in %s: %d", path, ret);
+					munmap (map, st.st_size);
+					rspamd_re_cache_hs_gen_free (gen, ngen);
 
-			munmap (map, st.st_size);
-
-			g_assert (hs_alloc_scratch (re_class->hs_db,
-					&re_class->hs_scratch) == HS_SUCCESS);
-
-			/*
-			 * Now find hyperscan elts that are successfully compiled and
-			 * specify that they should be matched using hyperscan
-			 */
-			for (i = 0; i < n; i ++) {
-				g_assert ((gint)cache->re->len > hs_ids[i] && hs_ids[i] >= 0);
-				elt = g_ptr_array_index (cache->re, hs_ids[i]);
-
-				if (hs_flags[i] & HS_FLAG_PREFILTER) {
-					elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN_PRE;
-				}
-				else {
-					elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN;
+					return FALSE;
 				}
 			}
+			else {
+				shared_size += cur->map_len;
+			}
 
-			re_class->hs_ids = hs_ids;
-			g_free (hs_flags);
-			re_class->nhs = n;
+			munmap (map, st.st_size);
 		}
 		else {
 			msg_err_re_cache ("invalid hyperscan hash file '%s'",
 					path);
+			rspamd_re_cache_hs_gen_free (gen, ngen);
+
 			return FALSE;
 		}
 	}
 
-	msg_info_re_cache ("hyperscan database of %d regexps has been loaded", total);
+	/* Now swap all classes to the new generation */
+	for (j = 0; j < ngen; j ++) {
+		cur = &gen[j];
+		re_class = cur->re_class;
+		scratch = NULL;
+
+		g_assert (hs_alloc_scratch (cur->db, &scratch) == HS_SUCCESS);
+		/* Shared scratch should be large enough for any class */
+		g_assert (hs_alloc_scratch (cur->db,
+				&cache->hs_scratch) == HS_SUCCESS);
+
+		/* Cleanup */
+		if (re_class->hs_scratch != NULL) {
+			hs_free_scratch (re_class->hs_scratch);
+		}
+
+		if (re_class->hs_map != NULL) {
+			munmap (re_class->hs_map, re_class->hs_map_len);
+		}
+		else if (re_class->hs_db != NULL) {
+			hs_free_database (re_class->hs_db);
+		}
+
+		if (re_class->hs_ids) {
+			g_free (re_class->hs_ids);
+		}
+
+		re_class->hs_db = cur->db;
+		re_class->hs_map = cur->map;
+		re_class->hs_map_len = cur->map_len;
+		re_class->hs_scratch = scratch;
+
+		/*
+		 * Now find hyperscan elts that are successfully compiled and
+		 * specify that they should be matched using hyperscan
+		 */
+		for (i = 0; i < cur->n; i ++) {
+			g_assert ((gint)cache->re->len > cur->ids[i] && cur->ids[i] >= 0);
+			elt = g_ptr_array_index (cache->re, cur->ids[i]);
+
+			if (cur->flags[i] & HS_FLAG_PREFILTER) {
+				elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN_PRE;
+			}
+			else {
+				elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN;
+			}
+		}
+
+		re_class->hs_ids = cur->ids;
+		re_class->nhs = cur->n;
+		g_free (cur->flags);
+	}
+
+	g_free (gen);
+	cache->hs_shared_size = shared_size;
+	cache->hs_generation ++;
+
+	msg_info_re_cache ("hyperscan database of %d regexps has been loaded "
+			"(generation %ud), %z bytes are shared between workers",
+			total, cache->hs_generation, shared_size);
 	cache->hyperscan_loaded = TRUE;
 
 	return TRUE;
 #endif
 }
+
+gsize
+rspamd_re_cache_hs_shared_size (struct rspamd_re_cache *cache)
+{
+	g_assert (cache != NULL);
+
+#ifdef WITH_HYPERSCAN
+	return cache->hs_shared_size;
+#else
+	return 0;
+#endif
+}
@@ -45,6 +45,9 @@ struct rspamd_re_cache_stat {
 	guint regexp_matched;
 	guint regexp_total;
 	guint regexp_fast_cached;
+	gdouble eager_time;                 /* time of the single pass scan in seconds */
+	guint class_scans[RSPAMD_RE_MAX];   /* hyperscan scans per class type */
+	gdouble class_time[RSPAMD_RE_MAX];  /* time of hyperscan scans per class type */
 };
 
 /**
@@ -151,11 +154,13 @@ const gchar * rspamd_re_cache_type_to_string (enum rspamd_re_type type);
 enum rspamd_re_type rspamd_re_cache_type_from_string (const char *str);
 
 /**
- * Compile expressions to the hyperscan tree and store in the `cache_dir`
+ * Compile expressions to the hyperscan tree and store in the `cache_dir`.
+ * Only classes without a valid database are compiled, using up to `max_jobs`
+ * processes in parallel
  */
 gint rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir, gdouble max_time, gboolean silent,
-		GError **err);
+		guint max_jobs, GError **err);
 
 
 /**
@@ -169,4 +174,10 @@ gboolean rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
  */
 gboolean rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir);
+
+/**
+ * Returns number of bytes of hyperscan databases that are mapped from
+ * the shared images and thus are not duplicated in each worker
+ */
+gsize rspamd_re_cache_hs_shared_size (struct rspamd_re_cache *cache);
 #endif
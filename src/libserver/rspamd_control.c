@@ -183,6 +183,7 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 	gdouble total_utime = 0, total_systime = 0;
 	struct ucl_parser *parser;
 	guint total_conns = 0;
+	gulong total_hs_shared = 0, max_hs_shared = 0;
 
 	rep = ucl_object_typed_new (UCL_OBJECT);
 	workers = ucl_object_typed_new (UCL_OBJECT);
@@ -213,10 +214,14 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 					elt->reply.reply.stat.uptime), "uptime", 0, false);
 			ucl_object_insert_key (cur, ucl_object_fromint (
 					elt->reply.reply.stat.maxrss), "maxrss", 0, false);
+			ucl_object_insert_key (cur, ucl_object_fromint (
+					elt->reply.reply.stat.hs_shared), "hs_shared", 0, false);
 
 			total_utime += elt->reply.reply.stat.utime;
 			total_systime += elt->reply.reply.stat.systime;
 			total_conns += elt->reply.reply.stat.conns;
+			total_hs_shared += elt->reply.reply.stat.hs_shared;
+			max_hs_shared = MAX (max_hs_shared, elt->reply.reply.stat.hs_shared);
 
 			break;
 
@@ -305,6 +310,9 @@ rspamd_control_write_reply (struct rspamd_control_session *session)
 				total_utime), "utime", 0, false);
 		ucl_object_insert_key (cur, ucl_object_fromdouble (
 				total_systime), "systime", 0, false);
+		/* Only one copy of the shared hyperscan images is really resident */
+		ucl_object_insert_key (cur, ucl_object_fromint (
+				total_hs_shared - max_hs_shared), "hs_saved", 0, false);
 
 		ucl_object_insert_key (rep, cur, "total", 0, false);
 	}
@@ -560,6 +568,12 @@ rspamd_control_default_cmd_handler (gint fd,
 		}
 
 		rep.reply.stat.conns = cd->worker->nconns;
+
+		if (cd->worker->srv->cfg && cd->worker->srv->cfg->re_cache) {
+			rep.reply.stat.hs_shared = rspamd_re_cache_hs_shared_size (
+					cd->worker->srv->cfg->re_cache);
+		}
+
 		rep.reply.stat.uptime = rspamd_get_calendar_ticks () - cd->worker->start_time;
 		break;
 	case RSPAMD_CONTROL_RELOAD:
@@ -93,6 +93,7 @@ struct rspamd_control_reply {
 			gdouble utime;
 			gdouble systime;
 			gulong maxrss;
+			gulong hs_shared;
 		} stat;
 		struct {
 			guint status;
@@ -56,12 +56,50 @@ struct rspamd_symbols_cache_header {
 	guchar unused[128];
 };
 
+/*
+ * Item of the compiled execution plan. It holds everything needed to schedule
+ * a symbol and is packed to 32 bytes, so two items share a cache line.
+ * Callbacks, names and statistics live in the cold `cache_item` and are
+ * touched merely when a symbol is actually executed.
+ */
+struct cache_plan_item {
+	struct cache_item *item;
+	gint id;
+	guint type;
+	gint priority;
+	gint condition_cb;
+	/* Dependencies are `ndeps` indexes in plan->deps starting from `deps_start` */
+	guint deps_start;
+	guint ndeps;
+};
+
+struct cache_plan_range {
+	guint start;
+	guint len;
+};
+
+/*
+ * Execution plan compiled on each resort: all items are stored contiguously
+ * grouped by passes (filters in topological order first), so any dependency
+ * is resolvable as an index in the same array
+ */
 struct symbols_cache_order {
-	GPtrArray *d;
+	struct cache_plan_item *items;
+	guint *deps;
+	guint nitems;
+	guint ndeps;
+	struct cache_plan_range filters;
+	struct cache_plan_range prefilters;
+	struct cache_plan_range postfilters;
+	struct cache_plan_range idempotent;
 	guint id;
 	ref_entry_t ref;
 };
 
+#define PLAN_RANGE_FOREACH(ord, range, i, cur) \
+	for ((i) = 0; (i) < (ord)->range.len && \
+		(((cur) = &(ord)->items[(ord)->range.start + (i)]) || 1); ++(i))
+
 struct symbols_cache {
 	/* Hash table for fast access */
 	GHashTable *items_by_symbol;
@@ -187,12 +225,12 @@ struct rspamd_cache_refresh_cbdata {
 
 static gboolean rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 		struct symbols_cache *cache,
-		struct cache_item *item,
+		struct cache_plan_item *pit,
 		struct cache_savepoint *checkpoint,
 		gdouble *total_diff);
 static gboolean rspamd_symbols_cache_check_deps (struct rspamd_task *task,
 		struct symbols_cache *cache,
-		struct cache_item *item,
+		struct cache_plan_item *pit,
 		struct cache_savepoint *checkpoint,
 		guint recursion,
 		gboolean check_only);
@@ -214,7 +252,9 @@ rspamd_symbols_cache_order_dtor (gpointer p)
 {
 	struct symbols_cache_order *ord = p;
 
-	g_ptr_array_free (ord->d, TRUE);
+	/* Not g_free as items are allocated using posix_memalign */
+	free (ord->items);
+	g_free (ord->deps);
 	g_free (ord);
 }
 
@@ -226,14 +266,96 @@ rspamd_symbols_cache_order_unref (gpointer p)
 	REF_RELEASE (ord);
 }
 
+static void
+rspamd_symbols_cache_plan_append (struct symbols_cache_order *ord,
+		struct cache_plan_range *range,
+		GPtrArray *items,
+		guint *pos_by_id)
+{
+	struct cache_plan_item *pit;
+	struct cache_item *it;
+	guint i;
+
+	range->start = ord->nitems;
+	range->len = 0;
+
+	PTR_ARRAY_FOREACH (items, i, it) {
+		if (pos_by_id[it->id] != G_MAXUINT) {
+			/* Already compiled in some other pass */
+			continue;
+		}
+
+		pit = &ord->items[ord->nitems];
+		pit->item = it;
+		pit->id = it->id;
+		pit->type = it->type;
+		pit->priority = it->priority;
+		pit->condition_cb = it->condition_cb;
+		pos_by_id[it->id] = ord->nitems;
+		ord->nitems ++;
+		range->len ++;
+	}
+}
+
+/*
+ * Compiles execution plan from the topologically sorted filters and the
+ * priority sorted pre/post filters
+ */
 static struct symbols_cache_order *
 rspamd_symbols_cache_order_new (struct symbols_cache *cache,
-		gsize nelts)
+		GPtrArray *filters)
 {
 	struct symbols_cache_order *ord;
+	struct cache_plan_item *pit;
+	struct cache_plan_range rest;
+	struct cache_dependency *dep;
+	guint i, j, *pos_by_id, nitems;
+	gsize ndeps = 0;
 
+	nitems = cache->items_by_id->len;
 	ord = g_malloc0 (sizeof (*ord));
-	ord->d = g_ptr_array_sized_new (nelts);
+
+	if (posix_memalign ((void **)&ord->items, 64,
+			MAX (nitems, 1) * sizeof (*ord->items)) != 0) {
+		abort ();
+	}
+
+	memset (ord->items, 0, MAX (nitems, 1) * sizeof (*ord->items));
+	pos_by_id = g_malloc (MAX (nitems, 1) * sizeof (*pos_by_id));
+	memset (pos_by_id, 0xff, MAX (nitems, 1) * sizeof (*pos_by_id));
+
+	rspamd_symbols_cache_plan_append (ord, &ord->filters, filters, pos_by_id);
+	rspamd_symbols_cache_plan_append (ord, &ord->prefilters, cache->prefilters,
+			pos_by_id);
+	rspamd_symbols_cache_plan_append (ord, &ord->postfilters, cache->postfilters,
+			pos_by_id);
+	rspamd_symbols_cache_plan_append (ord, &ord->idempotent, cache->idempotent,
+			pos_by_id);
+	/* Items that are never scheduled directly but could be dependencies */
+	rspamd_symbols_cache_plan_append (ord, &rest, cache->items_by_id,
+			pos_by_id);
+	g_assert (ord->nitems == nitems);
+
+	for (i = 0; i < nitems; i ++) {
+		ndeps += ord->items[i].item->deps->len;
+	}
+
+	ord->deps = g_malloc (MAX (ndeps, 1) * sizeof (*ord->deps));
+
+	for (i = 0; i < nitems; i ++) {
+		pit = &ord->items[i];
+		pit->deps_start = ord->ndeps;
+
+		PTR_ARRAY_FOREACH (pit->item->deps, j, dep) {
+			if (dep->item != NULL) {
+				ord->deps[ord->ndeps ++] = pos_by_id[dep->item->id];
+			}
+		}
+
+		pit->ndeps = ord->ndeps - pit->deps_start;
+	}
+
+	g_free (pos_by_id);
 	ord->id = cache->id;
 	REF_INIT_RETAIN (ord, rspamd_symbols_cache_order_dtor);
 
@@ -373,11 +495,12 @@ static void
 rspamd_symbols_cache_resort (struct symbols_cache *cache)
 {
 	struct symbols_cache_order *ord;
+	GPtrArray *filters;
 	guint i;
 	guint64 total_hits = 0;
 	struct cache_item *it;
 
-	ord = rspamd_symbols_cache_order_new (cache, cache->used_items);
+	filters = g_ptr_array_sized_new (cache->used_items);
 
 	for (i = 0; i < cache->used_items; i ++) {
 		it = g_ptr_array_index (cache->items_by_id, i);
@@ -388,7 +511,7 @@ rspamd_symbols_cache_resort (struct symbols_cache *cache)
 				SYMBOL_TYPE_COMPOSITE))) {
 			if (it->parent == -1 && it->func) {
 				it->order = 0;
-				g_ptr_array_add (ord->d, it);
+				g_ptr_array_add (filters, it);
 			}
 		}
 	}
@@ -400,7 +523,7 @@ rspamd_symbols_cache_resort (struct symbols_cache *cache)
 	 * can be more complicated than linear - O(N^2) for specially
 	 * crafted data. But I don't care.
 	 */
-	PTR_ARRAY_FOREACH (ord->d, i, it) {
+	PTR_ARRAY_FOREACH (filters, i, it) {
 		if (it->order == 0) {
 			rspamd_symbols_cache_tsort_visit (cache, it, 1);
 		}
@@ -410,9 +533,12 @@ rspamd_symbols_cache_resort (struct symbols_cache *cache)
 	 * Now we have all sorted and can do some heuristical sort, keeping
 	 * topological order invariant
 	 */
-	g_ptr_array_sort_with_data (ord->d, cache_logic_cmp, cache);
+	g_ptr_array_sort_with_data (filters, cache_logic_cmp, cache);
 	cache->total_hits = total_hits;
 
+	ord = rspamd_symbols_cache_order_new (cache, filters);
+	g_ptr_array_free (filters, TRUE);
+
 	if (cache->items_by_order) {
 		REF_RELEASE (cache->items_by_order);
 	}
@@ -1227,6 +1353,11 @@ rspamd_symbols_cache_validate (struct symbols_cache *cache,
 		}
 	}
 
+	if (cache->items_by_order) {
+		/* Weights and priorities might be changed, so recompile execution plan */
+		rspamd_symbols_cache_resort (cache);
+	}
+
 	return ret;
 }
 
@@ -1273,7 +1404,7 @@ static void
 rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 {
 	struct rspamd_task *task = sessiond;
-	struct cache_item *item = ud, *it;
+	struct cache_plan_item *pit = ud, *it;
 	struct cache_savepoint *checkpoint;
 	struct symbols_cache *cache;
 	gint i, remain = 0;
@@ -1282,7 +1413,7 @@ rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 	cache = task->cfg->cache;
 
 	/* Specify that we are done with this item */
-	setbit (checkpoint->processed_bits, item->id * 2 + 1);
+	setbit (checkpoint->processed_bits, pit->id * 2 + 1);
 
 	if (checkpoint->pass > 0) {
 		for (i = 0; i < (gint)checkpoint->waitq->len; i ++) {
@@ -1295,10 +1426,10 @@ rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 				}
 				else {
 					msg_debug_task ("watcher for %d(%s), unblocked item %d(%s)",
-							item->id,
-							item->symbol,
+							pit->id,
+							pit->item->symbol,
 							it->id,
-							it->symbol);
+							it->item->symbol);
 					rspamd_symbols_cache_check_symbol (task, cache, it,
 							checkpoint,
 							NULL);
@@ -1308,14 +1439,14 @@ rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 	}
 
 	msg_debug_task ("finished watcher for %d(%s), %ud symbols waiting",
-			item->id, item->symbol,
+			pit->id, pit->item->symbol,
 			remain);
 }
 
 static gboolean
 rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 		struct symbols_cache *cache,
-		struct cache_item *item,
+		struct cache_plan_item *pit,
 		struct cache_savepoint *checkpoint,
 		gdouble *total_diff)
 {
@@ -1323,6 +1454,7 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 	double t1 = 0, t2 = 0;
 	gdouble diff;
 	struct rspamd_task **ptask;
+	struct cache_item *item = pit->item;
 	lua_State *L;
 	gboolean check = TRUE;
 	const gdouble slow_diff_limit = 0.1;
@@ -1331,16 +1463,16 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 
 		g_assert (item->func != NULL);
 		/* Check has been started */
-		setbit (checkpoint->processed_bits, item->id * 2);
+		setbit (checkpoint->processed_bits, pit->id * 2);
 
 		if (!item->enabled ||
-				(RSPAMD_TASK_IS_EMPTY (task) && !(item->type & SYMBOL_TYPE_EMPTY))) {
+				(RSPAMD_TASK_IS_EMPTY (task) && !(pit->type & SYMBOL_TYPE_EMPTY))) {
 			check = FALSE;
 		}
-		else if (item->condition_cb != -1) {
+		else if (pit->condition_cb != -1) {
 			/* We also executes condition callback to check if we need this symbol */
 			L = task->cfg->lua_state;
-			lua_rawgeti (L, LUA_REGISTRYINDEX, item->condition_cb);
+			lua_rawgeti (L, LUA_REGISTRYINDEX, pit->condition_cb);
 			ptask = lua_newuserdata (L, sizeof (struct rspamd_task *));
 			rspamd_lua_setclass (L, "rspamd{task}", -1);
 			*ptask = task;
@@ -1360,10 +1492,10 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 			pending_before = rspamd_session_events_pending (task->s);
 			/* Watch for events appeared */
 			rspamd_session_watch_start (task->s,
-					item->id,
+					pit->id,
 					rspamd_symbols_cache_watcher_cb,
-					item);
-			msg_debug_task ("execute %s, %d", item->symbol, item->id);
+					pit);
+			msg_debug_task ("execute %s, %d", item->symbol, pit->id);
 			t1 = rspamd_get_ticks (FALSE);
 			item->func (task, item->user_data);
 			t2 = rspamd_get_ticks (FALSE);
@@ -1377,7 +1509,7 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 				*total_diff += diff;
 			}
 
-			if (diff > slow_diff_limit && !(item->type & SYMBOL_TYPE_SQUEEZED)) {
+			if (diff > slow_diff_limit && !(pit->type & SYMBOL_TYPE_SQUEEZED)) {
 				msg_info_task ("slow rule: %s: %.2f ms", item->symbol,
 						diff * 1000);
 			}
@@ -1391,7 +1523,7 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 
 			if (pending_before == pending_after) {
 				/* No new events registered */
-				setbit (checkpoint->processed_bits, item->id * 2 + 1);
+				setbit (checkpoint->processed_bits, pit->id * 2 + 1);
 
 				return TRUE;
 			}
@@ -1401,120 +1533,118 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 		else {
 			msg_debug_task ("skipping check of %s as its start condition is false",
 					item->symbol);
-			setbit (checkpoint->processed_bits, item->id * 2 + 1);
+			setbit (checkpoint->processed_bits, pit->id * 2 + 1);
 
 			return TRUE;
 		}
 	}
 	else {
-		setbit (checkpoint->processed_bits, item->id * 2);
-		setbit (checkpoint->processed_bits, item->id * 2 + 1);
+		setbit (checkpoint->processed_bits, pit->id * 2);
+		setbit (checkpoint->processed_bits, pit->id * 2 + 1);
 
 		return TRUE;
 	}
 }
 
+static void
+rspamd_symbols_cache_wait_item (struct cache_savepoint *checkpoint,
+		struct cache_plan_item *pit)
+{
+	struct cache_plan_item *tmp_it;
+	guint i;
+
+	PTR_ARRAY_FOREACH (checkpoint->waitq, i, tmp_it) {
+		if (pit->id == tmp_it->id) {
+			return;
+		}
+	}
+
+	g_ptr_array_add (checkpoint->waitq, pit);
+}
+
 static gboolean
 rspamd_symbols_cache_check_deps (struct rspamd_task *task,
 		struct symbols_cache *cache,
-		struct cache_item *item,
+		struct cache_plan_item *pit,
 		struct cache_savepoint *checkpoint,
 		guint recursion,
 		gboolean check_only)
 {
-	struct cache_dependency *dep;
+	struct symbols_cache_order *ord = checkpoint->order;
+	struct cache_plan_item *dep;
 	guint i;
 	gboolean ret = TRUE;
 	static const guint max_recursion = 20;
 
 	if (recursion > max_recursion) {
 		msg_err_task ("cyclic dependencies: maximum check level %ud exceed when "
-				"checking dependencies for %s", max_recursion, item->symbol);
+				"checking dependencies for %s", max_recursion, pit->item->symbol);
 
 		return TRUE;
 	}
 
-	if (item->deps != NULL && item->deps->len > 0) {
-		for (i = 0; i < item->deps->len; i ++) {
-			dep = g_ptr_array_index (item->deps, i);
+	for (i = 0; i < pit->ndeps; i ++) {
+		dep = &ord->items[ord->deps[pit->deps_start + i]];
 
-			if (dep->item == NULL) {
-				/* Assume invalid deps as done */
-				msg_debug_task ("symbol %d(%s) has invalid dependencies on %d(%s)",
-						item->id, item->symbol, dep->id, dep->sym);
-				continue;
-			}
+		if (!isset (checkpoint->processed_bits, dep->id * 2 + 1)) {
+			if (!isset (checkpoint->processed_bits, dep->id * 2)) {
+				/* Not started */
+				if (!check_only) {
+					if (!rspamd_symbols_cache_check_deps (task, cache,
+							dep,
+							checkpoint,
+							recursion + 1,
+							check_only)) {
 
-			if (!isset (checkpoint->processed_bits, dep->id * 2 + 1)) {
-				if (!isset (checkpoint->processed_bits, dep->id * 2)) {
-					/* Not started */
-					if (!check_only) {
-						if (!rspamd_symbols_cache_check_deps (task, cache,
-								dep->item,
-								checkpoint,
-								recursion + 1,
-								check_only)) {
-							gboolean found = FALSE;
-							guint j;
-							struct cache_item *tmp_it;
-
-							PTR_ARRAY_FOREACH (checkpoint->waitq, j, tmp_it) {
-								if (item->id == tmp_it->id) {
-									found = TRUE;
-									break;
-								}
-							}
-
-							if (!found) {
-								g_ptr_array_add (checkpoint->waitq, item);
-							}
-
-							ret = FALSE;
-							msg_debug_task ("delayed dependency %d(%s) for "
-											"symbol %d(%s)",
-									dep->id, dep->sym, item->id, item->symbol);
-						}
-						else if (!rspamd_symbols_cache_check_symbol (task, cache,
-								dep->item,
-								checkpoint,
-								NULL)) {
-							/* Now started, but has events pending */
-							ret = FALSE;
-							msg_debug_task ("started check of %d(%s) symbol "
-											"as dep for "
-											"%d(%s)",
-									dep->id, dep->sym, item->id, item->symbol);
-						}
-						else {
-							msg_debug_task ("dependency %d(%s) for symbol %d(%s) is "
-									"already processed",
-									dep->id, dep->sym, item->id, item->symbol);
-						}
+						rspamd_symbols_cache_wait_item (checkpoint, pit);
+						ret = FALSE;
+						msg_debug_task ("delayed dependency %d(%s) for "
+										"symbol %d(%s)",
+								dep->id, dep->item->symbol,
+								pit->id, pit->item->symbol);
 					}
-					else {
-						msg_debug_task ("dependency %d(%s) for symbol %d(%s) "
-										"cannot be started now",
-								dep->id, dep->sym,
-								item->id, item->symbol);
+					else if (!rspamd_symbols_cache_check_symbol (task, cache,
+							dep,
+							checkpoint,
+							NULL)) {
+						/* Now started, but has events pending */
 						ret = FALSE;
+						msg_debug_task ("started check of %d(%s) symbol "
+										"as dep for "
+										"%d(%s)",
+								dep->id, dep->item->symbol,
+								pit->id, pit->item->symbol);
+					}
+					else {
+						msg_debug_task ("dependency %d(%s) for symbol %d(%s) is "
+								"already processed",
+								dep->id, dep->item->symbol,
+								pit->id, pit->item->symbol);
 					}
 				}
 				else {
-					/* Started but not finished */
-					msg_debug_task ("dependency %d(%s) for symbol %d(%s) is "
-									"still executing",
-							dep->id, dep->sym,
-							item->id, item->symbol);
+					msg_debug_task ("dependency %d(%s) for symbol %d(%s) "
+									"cannot be started now",
+							dep->id, dep->item->symbol,
+							pit->id, pit->item->symbol);
 					ret = FALSE;
 				}
 			}
 			else {
-				msg_debug_task ("dependency %d(%s) for symbol %d(%s) is already "
-						"checked",
-						dep->id, dep->sym,
-						item->id, item->symbol);
+				/* Started but not finished */
+				msg_debug_task ("dependency %d(%s) for symbol %d(%s) is "
+								"still executing",
+						dep->id, dep->item->symbol,
+						pit->id, pit->item->symbol);
+				ret = FALSE;
 			}
 		}
+		else {
+			/* Do not touch cold items here, it is the most common case */
+			msg_debug_task ("dependency %d for symbol %d is already "
+					"checked",
+					dep->id, pit->id);
+		}
 	}
 
 	return ret;
@@ -1555,17 +1685,15 @@ rspamd_symbols_cache_make_checkpoint (struct rspamd_task *task,
 
 	checkpoint = rspamd_mempool_alloc0 (task->task_pool, sizeof (*checkpoint));
 	/* Bit 0: check started, Bit 1: check finished */
-	checkpoint->processed_bits = rspamd_mempool_alloc0 (task->task_pool,
+	checkpoint->processed_bits = rspamd_task_arena_bitmap (task,
 			NBYTES (cache->used_items) * 2);
-	checkpoint->waitq = g_ptr_array_new ();
+	checkpoint->waitq = rspamd_task_arena_queue (task);
 	g_assert (cache->items_by_order != NULL);
-	checkpoint->version = cache->items_by_order->d->len;
+	checkpoint->version = cache->items_by_order->filters.len;
 	checkpoint->order = cache->items_by_order;
 	REF_RETAIN (checkpoint->order);
 	rspamd_mempool_add_destructor (task->task_pool,
 			rspamd_symbols_cache_order_unref, checkpoint->order);
-	rspamd_mempool_add_destructor (task->task_pool,
-			rspamd_ptr_array_free_hard, checkpoint->waitq);
 	checkpoint->pass = RSPAMD_CACHE_PASS_INIT;
 	task->checkpoint = checkpoint;
 
@@ -1668,9 +1796,10 @@ gboolean
 rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 	struct symbols_cache *cache, gint stage)
 {
-	struct cache_item *item = NULL;
+	struct cache_plan_item *item = NULL;
 	struct cache_savepoint *checkpoint;
-	gint i;
+	struct symbols_cache_order *ord;
+	guint i;
 	gdouble total_ticks = 0;
 	gboolean all_done;
 	gint saved_priority;
@@ -1687,6 +1816,8 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 		checkpoint = task->checkpoint;
 	}
 
+	ord = checkpoint->order;
+
 	if (stage == RSPAMD_TASK_STAGE_POST_FILTERS && checkpoint->pass <
 			RSPAMD_CACHE_PASS_POSTFILTERS) {
 		checkpoint->pass = RSPAMD_CACHE_PASS_POSTFILTERS;
@@ -1706,9 +1837,7 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 		/* Check for prefilters */
 		saved_priority = G_MININT;
 
-		for (i = 0; i < (gint)cache->prefilters->len; i ++) {
-			item = g_ptr_array_index (cache->prefilters, i);
-
+		PLAN_RANGE_FOREACH (ord, prefilters, i, item) {
 			if (RSPAMD_TASK_IS_SKIPPED (task)) {
 				return TRUE;
 			}
@@ -1742,9 +1871,7 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 	case RSPAMD_CACHE_PASS_WAIT_PREFILTERS:
 		all_done = TRUE;
 
-		for (i = 0; i < (gint)cache->prefilters->len; i ++) {
-			item = g_ptr_array_index (cache->prefilters, i);
-
+		PLAN_RANGE_FOREACH (ord, prefilters, i, item) {
 			if (!isset (checkpoint->processed_bits, item->id * 2 + 1)) {
 				all_done = FALSE;
 				break;
@@ -1765,12 +1892,12 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 		 * If we figure out symbol that has no dependencies satisfied, then
 		 * we just save it for another pass
 		 */
-		for (i = 0; i < (gint)checkpoint->version; i ++) {
+		for (i = 0; i < checkpoint->version; i ++) {
 			if (RSPAMD_TASK_IS_SKIPPED (task)) {
 				return TRUE;
 			}
 
-			item = g_ptr_array_index (checkpoint->order->d, i);
+			item = &ord->items[ord->filters.start + i];
 
 			if (item->type & SYMBOL_TYPE_CLASSIFIER) {
 				continue;
@@ -1790,24 +1917,10 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 			if (!isset (checkpoint->processed_bits, item->id * 2)) {
 				if (!rspamd_symbols_cache_check_deps (task, cache, item,
 						checkpoint, 0, FALSE)) {
-					gboolean found = FALSE;
-					guint j;
-					struct cache_item *tmp_it;
-
 					msg_debug_task ("blocked execution of %d(%s) unless deps are "
 							"resolved",
-							item->id, item->symbol);
-
-					PTR_ARRAY_FOREACH (checkpoint->waitq, j, tmp_it) {
-						if (item->id == tmp_it->id) {
-							found = TRUE;
-							break;
-						}
-					}
-
-					if (!found) {
-						g_ptr_array_add (checkpoint->waitq, item);
-					}
+							item->id, item->item->symbol);
+					rspamd_symbols_cache_wait_item (checkpoint, item);
 
 					continue;
 				}
@@ -1849,7 +1962,7 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 
 	case RSPAMD_CACHE_PASS_WAIT_FILTERS:
 		/* We just go through the blocked symbols and check if they are ready */
-		for (i = 0; i < (gint)checkpoint->waitq->len; i ++) {
+		for (i = 0; i < checkpoint->waitq->len; i ++) {
 			item = g_ptr_array_index (checkpoint->waitq, i);
 
 			if (!isset (checkpoint->processed_bits, item->id * 2)) {
@@ -1889,13 +2002,11 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 		/* Check for postfilters */
 		saved_priority = G_MININT;
 
-		for (i = 0; i < (gint)cache->postfilters->len; i ++) {
+		PLAN_RANGE_FOREACH (ord, postfilters, i, item) {
 			if (RSPAMD_TASK_IS_SKIPPED (task)) {
 				return TRUE;
 			}
 
-			item = g_ptr_array_index (cache->postfilters, i);
-
 			if (!isset (checkpoint->processed_bits, item->id * 2) &&
 					!isset (checkpoint->processed_bits, item->id * 2 + 1)) {
 				/* Check priorities */
@@ -1924,9 +2035,7 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 	case RSPAMD_CACHE_PASS_WAIT_POSTFILTERS:
 		all_done = TRUE;
 
-		for (i = 0; i < (gint)cache->postfilters->len; i ++) {
-			item = g_ptr_array_index (cache->postfilters, i);
-
+		PLAN_RANGE_FOREACH (ord, postfilters, i, item) {
 			if (!isset (checkpoint->processed_bits, item->id * 2 + 1)) {
 				all_done = FALSE;
 				break;
@@ -1952,9 +2061,7 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 		/* Check for postfilters */
 		saved_priority = G_MININT;
 
-		for (i = 0; i < (gint)cache->idempotent->len; i ++) {
-			item = g_ptr_array_index (cache->idempotent, i);
-
+		PLAN_RANGE_FOREACH (ord, idempotent, i, item) {
 			if (!isset (checkpoint->processed_bits, item->id * 2) &&
 					!isset (checkpoint->processed_bits, item->id * 2 + 1)) {
 				/* Check priorities */
@@ -1982,9 +2089,7 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 	case RSPAMD_CACHE_PASS_WAIT_IDEMPOTENT:
 		all_done = TRUE;
 
-		for (i = 0; i < (gint)cache->idempotent->len; i ++) {
-			item = g_ptr_array_index (cache->idempotent, i);
-
+		PLAN_RANGE_FOREACH (ord, idempotent, i, item) {
 			if (!isset (checkpoint->processed_bits, item->id * 2 + 1)) {
 				all_done = FALSE;
 				break;
@@ -57,6 +57,165 @@ rspamd_request_header_dtor (gpointer p)
 	}
 }
 
+/*
+ * Task skeleton that is recycled between tasks: task structure itself and
+ * containers that are reset instead of being freed
+ */
+struct rspamd_task_arena {
+	struct rspamd_task task;
+	GHashTable *raw_headers;
+	GQueue *headers_order;
+	GHashTable *request_headers;
+	GHashTable *reply_headers;
+	GHashTable *emails;
+	GHashTable *urls;
+	GHashTable *lua_cache;
+	GPtrArray *parts;
+	GPtrArray *text_parts;
+	GPtrArray *received;
+	GPtrArray *queue;
+	guchar *bitmap;
+	gsize bitmap_len;
+	struct rspamd_task_arena *next;
+};
+
+/*
+ * Do not keep more than this amount of free arenas per process. Freelist is
+ * not locked: tasks are created and freed only by the event loop thread of
+ * a process, helper threads never deal with tasks
+ */
+static const guint max_free_arenas = 64;
+static struct rspamd_task_arena *free_arenas = NULL;
+static guint nfree_arenas = 0;
+
+static struct rspamd_task_arena *
+rspamd_task_arena_new (void)
+{
+	struct rspamd_task_arena *arena;
+
+	arena = g_malloc0 (sizeof (*arena));
+	arena->raw_headers = g_hash_table_new_full (rspamd_strcase_hash,
+			rspamd_strcase_equal, NULL, rspamd_ptr_array_free_hard);
+	arena->headers_order = g_queue_new ();
+	arena->request_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
+			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
+			rspamd_request_header_dtor);
+	arena->reply_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
+			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
+			rspamd_fstring_mapped_ftok_free);
+	arena->emails = g_hash_table_new (rspamd_email_hash, rspamd_emails_cmp);
+	arena->urls = g_hash_table_new (rspamd_url_hash, rspamd_urls_cmp);
+	arena->lua_cache = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	arena->parts = g_ptr_array_sized_new (4);
+	arena->text_parts = g_ptr_array_sized_new (2);
+	arena->received = g_ptr_array_sized_new (8);
+	arena->queue = g_ptr_array_new ();
+
+	return arena;
+}
+
+static void
+rspamd_task_arena_destroy (struct rspamd_task_arena *arena)
+{
+	g_hash_table_unref (arena->raw_headers);
+	g_queue_free (arena->headers_order);
+	g_hash_table_unref (arena->request_headers);
+	g_hash_table_unref (arena->reply_headers);
+	g_hash_table_unref (arena->emails);
+	g_hash_table_unref (arena->urls);
+	g_hash_table_unref (arena->lua_cache);
+	g_ptr_array_free (arena->parts, TRUE);
+	g_ptr_array_free (arena->text_parts, TRUE);
+	g_ptr_array_free (arena->received, TRUE);
+	g_ptr_array_free (arena->queue, TRUE);
+	g_free (arena->bitmap);
+	g_free (arena);
+}
+
+/*
+ * Resets all containers and returns arena to the freelist
+ */
+static void
+rspamd_task_arena_release (struct rspamd_task_arena *arena)
+{
+	g_hash_table_remove_all (arena->raw_headers);
+	g_queue_clear (arena->headers_order);
+	g_hash_table_remove_all (arena->request_headers);
+	g_hash_table_remove_all (arena->reply_headers);
+	g_hash_table_remove_all (arena->emails);
+	g_hash_table_remove_all (arena->urls);
+	g_hash_table_remove_all (arena->lua_cache);
+	g_ptr_array_set_size (arena->parts, 0);
+	g_ptr_array_set_size (arena->text_parts, 0);
+	g_ptr_array_set_size (arena->received, 0);
+	g_ptr_array_set_size (arena->queue, 0);
+
+	if (nfree_arenas >= max_free_arenas) {
+		rspamd_task_arena_destroy (arena);
+	}
+	else {
+		arena->next = free_arenas;
+		free_arenas = arena;
+		nfree_arenas ++;
+	}
+}
+
+static struct rspamd_task_arena *
+rspamd_task_arena_get (struct rspamd_worker *worker)
+{
+	struct rspamd_task_arena *arena;
+	struct rspamd_stat *stat = NULL;
+
+	if (worker && worker->srv) {
+		stat = worker->srv->stat;
+	}
+
+	if (free_arenas) {
+		arena = free_arenas;
+		free_arenas = arena->next;
+		nfree_arenas --;
+		arena->next = NULL;
+		memset (&arena->task, 0, sizeof (arena->task));
+
+		if (stat) {
+			g_atomic_int_inc (&stat->task_arenas_reused);
+		}
+	}
+	else {
+		arena = rspamd_task_arena_new ();
+
+		if (stat) {
+			g_atomic_int_inc (&stat->task_arenas_allocated);
+		}
+	}
+
+	return arena;
+}
+
+guchar *
+rspamd_task_arena_bitmap (struct rspamd_task *task, gsize len)
+{
+	struct rspamd_task_arena *arena = task->arena;
+
+	if (arena->bitmap_len < len) {
+		g_free (arena->bitmap);
+		arena->bitmap = g_malloc (len);
+		arena->bitmap_len = len;
+	}
+
+	memset (arena->bitmap, 0, len);
+
+	return arena->bitmap;
+}
+
+GPtrArray *
+rspamd_task_arena_queue (struct rspamd_task *task)
+{
+	g_ptr_array_set_size (task->arena->queue, 0);
+
+	return task->arena->queue;
+}
+
 /*
  * Create new task
  */
@@ -66,8 +225,11 @@ rspamd_task_new (struct rspamd_worker *worker, struct rspamd_config *cfg,
 		struct rspamd_lang_detector *lang_det)
 {
 	struct rspamd_task *new_task;
+	struct rspamd_task_arena *arena;
 
-	new_task = g_malloc0 (sizeof (struct rspamd_task));
+	arena = rspamd_task_arena_get (worker);
+	new_task = &arena->task;
+	new_task->arena = arena;
 	new_task->worker = worker;
 	new_task->lang_det = lang_det;
 
@@ -104,44 +266,16 @@ rspamd_task_new (struct rspamd_worker *worker, struct rspamd_config *cfg,
 		new_task->task_pool = pool;
 	}
 
-	new_task->raw_headers = g_hash_table_new_full (rspamd_strcase_hash,
-			rspamd_strcase_equal, NULL, rspamd_ptr_array_free_hard);
-	new_task->headers_order = g_queue_new ();
-	new_task->request_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
-			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
-			rspamd_request_header_dtor);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-		(rspamd_mempool_destruct_t) g_hash_table_unref,
-		new_task->request_headers);
-	new_task->reply_headers = g_hash_table_new_full (rspamd_ftok_icase_hash,
-			rspamd_ftok_icase_equal, rspamd_fstring_mapped_ftok_free,
-			rspamd_fstring_mapped_ftok_free);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
-			new_task->reply_headers);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
-			new_task->raw_headers);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_queue_free,
-			new_task->headers_order);
-	new_task->emails = g_hash_table_new (rspamd_email_hash, rspamd_emails_cmp);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
-			new_task->emails);
-	new_task->urls = g_hash_table_new (rspamd_url_hash, rspamd_urls_cmp);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			(rspamd_mempool_destruct_t) g_hash_table_unref,
-			new_task->urls);
-	new_task->parts = g_ptr_array_sized_new (4);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			rspamd_ptr_array_free_hard, new_task->parts);
-	new_task->text_parts = g_ptr_array_sized_new (2);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			rspamd_ptr_array_free_hard, new_task->text_parts);
-	new_task->received = g_ptr_array_sized_new (8);
-	rspamd_mempool_add_destructor (new_task->task_pool,
-			rspamd_ptr_array_free_hard, new_task->received);
+	/* Containers are owned by arena and are reset in rspamd_task_free */
+	new_task->raw_headers = arena->raw_headers;
+	new_task->headers_order = arena->headers_order;
+	new_task->request_headers = arena->request_headers;
+	new_task->reply_headers = arena->reply_headers;
+	new_task->emails = arena->emails;
+	new_task->urls = arena->urls;
+	new_task->parts = arena->parts;
+	new_task->text_parts = arena->text_parts;
+	new_task->received = arena->received;
 
 	new_task->sock = -1;
 	new_task->flags |= (RSPAMD_TASK_FLAG_MIME|RSPAMD_TASK_FLAG_JSON);
@@ -149,7 +283,7 @@ rspamd_task_new (struct rspamd_worker *worker, struct rspamd_config *cfg,
 
 	new_task->message_id = new_task->queue_id = "undef";
 	new_task->messages = ucl_object_typed_new (UCL_OBJECT);
-	new_task->lua_cache = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+	new_task->lua_cache = arena->lua_cache;
 
 	return new_task;
 }
@@ -204,6 +338,25 @@ rspamd_task_restore (void *arg)
 	/* XXX: not needed now ? */
 }
 
+/* Accounts text parts processing stages that have not been required */
+static void
+rspamd_task_account_text_stages (struct rspamd_task *task)
+{
+	struct rspamd_stat *stat;
+	guint skipped, total;
+
+	skipped = rspamd_message_skipped_stages (task);
+	total = task->text_parts->len * RSPAMD_MIME_TEXT_PART_STAGES_COUNT;
+	msg_debug_task ("skipped %ud of %ud text parts processing stages",
+			skipped, total);
+
+	if (task->worker && task->worker->srv) {
+		stat = task->worker->srv->stat;
+		g_atomic_int_add (&stat->text_stages_skipped, skipped);
+		g_atomic_int_add (&stat->text_stages_total, total);
+	}
+}
+
 /*
  * Free all structures of worker_task
  */
@@ -221,6 +374,10 @@ rspamd_task_free (struct rspamd_task *task)
 	if (task) {
 		debug_task ("free pointer %p", task);
 
+		if (task->text_parts->len > 0) {
+			rspamd_task_account_text_stages (task);
+		}
+
 		for (i = 0; i < task->parts->len; i ++) {
 			p = g_ptr_array_index (task->parts, i);
 
@@ -321,7 +478,6 @@ rspamd_task_free (struct rspamd_task *task)
 							LUA_REGISTRYINDEX, entry->ref);
 				}
 
-				g_hash_table_unref (task->lua_cache);
 			}
 
 			REF_RELEASE (task->cfg);
@@ -331,7 +487,7 @@ rspamd_task_free (struct rspamd_task *task)
 			rspamd_mempool_delete (task->task_pool);
 		}
 
-		g_free (task);
+		rspamd_task_arena_release (task->arena);
 	}
 }
 
@@ -127,6 +127,7 @@ enum rspamd_task_stage {
 
 struct rspamd_email_address;
 struct rspamd_lang_detector;
+struct rspamd_task_arena;
 enum rspamd_newlines_type;
 
 /**
@@ -201,6 +202,7 @@ struct rspamd_task {
 	struct event *guard_ev;							/**< Event for input sanity guard 					*/
 
 	gpointer checkpoint;							/**< Opaque checkpoint data							*/
+	struct rspamd_task_arena *arena;				/**< Recycled task skeleton							*/
 
 	struct {
 		gint action;								/**< Action of pre filters							*/
@@ -226,6 +228,23 @@ struct rspamd_task *rspamd_task_new (struct rspamd_worker *worker,
  */
 void rspamd_task_free (struct rspamd_task *task);
 
+/**
+ * Returns zero filled bitmap of `len` bytes owned by the task arena. Bitmap
+ * is valid until task is freed and its storage is reused by the subsequent tasks
+ * @param task
+ * @param len
+ * @return
+ */
+guchar *rspamd_task_arena_bitmap (struct rspamd_task *task, gsize len);
+
+/**
+ * Returns empty pointers array owned by the task arena, it is valid until
+ * task is freed
+ * @param task
+ * @return
+ */
+GPtrArray *rspamd_task_arena_queue (struct rspamd_task *task);
+
 /**
  * Called if session was restored inside fin callback
  */
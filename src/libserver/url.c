@@ -209,9 +209,33 @@ struct url_callback_data {
 	void *funcd;
 };
 
+/*
+ * Public suffix rules compiled to a tree of labels: a host is resolved by
+ * walking its labels from right to left, each step is a single lookup in
+ * the open addressing table keyed by the parent node and the label
+ */
+#define URL_TLD_RULE (1 << 0)
+#define URL_TLD_WILDCARD (1 << 1)
+#define URL_TLD_EXCEPTION (1 << 2)
+
+struct url_tld_node {
+	const gchar *label;
+	guint32 len;
+	guint32 parent;
+	guint32 flags;
+};
+
+struct url_tld_table {
+	GArray *nodes; /* node 0 is the root */
+	guint32 *buckets;
+	guint32 mask;
+	GStringChunk *labels;
+};
+
 struct url_match_scanner {
 	GArray *matchers;
 	struct rspamd_multipattern *search_trie;
+	struct url_tld_table *tlds;
 };
 
 struct url_match_scanner *url_scanner = NULL;
@@ -381,6 +405,257 @@ rspamd_url_strerror (enum uri_errno err)
 	return NULL;
 }
 
+static struct url_tld_table *
+rspamd_url_tld_table_new (void)
+{
+	struct url_tld_table *tbl;
+	struct url_tld_node root;
+
+	tbl = g_malloc0 (sizeof (*tbl));
+	/* Public suffix list has about 9000 rules, almost all of them are leaves */
+	tbl->nodes = g_array_sized_new (FALSE, TRUE, sizeof (struct url_tld_node),
+			16384);
+	tbl->mask = 32767;
+	tbl->buckets = g_malloc0 ((tbl->mask + 1) * sizeof (guint32));
+	tbl->labels = g_string_chunk_new (65536);
+	memset (&root, 0, sizeof (root));
+	g_array_append_val (tbl->nodes, root);
+
+	return tbl;
+}
+
+static void
+rspamd_url_tld_table_destroy (struct url_tld_table *tbl)
+{
+	g_array_free (tbl->nodes, TRUE);
+	g_free (tbl->buckets);
+	g_string_chunk_free (tbl->labels);
+	g_free (tbl);
+}
+
+static inline guint32
+rspamd_url_tld_bucket (struct url_tld_table *tbl, guint32 parent,
+		const gchar *label, gsize len)
+{
+	return rspamd_icase_hash (label, len, parent) & tbl->mask;
+}
+
+static guint32
+rspamd_url_tld_find (struct url_tld_table *tbl, guint32 parent,
+		const gchar *label, gsize len)
+{
+	struct url_tld_node *node;
+	guint32 i, idx;
+
+	i = rspamd_url_tld_bucket (tbl, parent, label, len);
+
+	while ((idx = tbl->buckets[i]) != 0) {
+		node = &g_array_index (tbl->nodes, struct url_tld_node, idx);
+
+		if (node->parent == parent && node->len == len &&
+				g_ascii_strncasecmp (node->label, label, len) == 0) {
+			return idx;
+		}
+
+		i = (i + 1) & tbl->mask;
+	}
+
+	return 0;
+}
+
+static void
+rspamd_url_tld_rehash (struct url_tld_table *tbl)
+{
+	struct url_tld_node *node;
+	guint32 idx, i;
+
+	g_free (tbl->buckets);
+	tbl->mask = tbl->mask * 2 + 1;
+	tbl->buckets = g_malloc0 ((tbl->mask + 1) * sizeof (guint32));
+
+	for (idx = 1; idx < tbl->nodes->len; idx ++) {
+		node = &g_array_index (tbl->nodes, struct url_tld_node, idx);
+		i = rspamd_url_tld_bucket (tbl, node->parent, node->label, node->len);
+
+		while (tbl->buckets[i] != 0) {
+			i = (i + 1) & tbl->mask;
+		}
+
+		tbl->buckets[i] = idx;
+	}
+}
+
+static guint32
+rspamd_url_tld_insert (struct url_tld_table *tbl, guint32 parent,
+		const gchar *label, gsize len)
+{
+	struct url_tld_node node;
+	guint32 idx, i;
+
+	idx = rspamd_url_tld_find (tbl, parent, label, len);
+
+	if (idx != 0) {
+		return idx;
+	}
+
+	/* Keep load factor below 0.5 */
+	if ((tbl->nodes->len + 1) * 2 > tbl->mask + 1) {
+		rspamd_url_tld_rehash (tbl);
+	}
+
+	node.label = g_string_chunk_insert_len (tbl->labels, label, len);
+	node.len = len;
+	node.parent = parent;
+	node.flags = 0;
+	idx = tbl->nodes->len;
+	g_array_append_val (tbl->nodes, node);
+
+	i = rspamd_url_tld_bucket (tbl, parent, label, len);
+
+	while (tbl->buckets[i] != 0) {
+		i = (i + 1) & tbl->mask;
+	}
+
+	tbl->buckets[i] = idx;
+
+	return idx;
+}
+
+static gboolean
+rspamd_url_tld_add_rule (struct url_tld_table *tbl, const gchar *rule)
+{
+	const gchar *p, *end;
+	guint32 idx = 0, flags = URL_TLD_RULE;
+
+	if (rule[0] == '!') {
+		flags = URL_TLD_EXCEPTION;
+		rule ++;
+	}
+	else if (rule[0] == '*') {
+		if (rule[1] != '.') {
+			return FALSE;
+		}
+
+		flags = URL_TLD_WILDCARD;
+		rule += 2;
+	}
+
+	end = rule + strlen (rule);
+
+	if (end == rule) {
+		return FALSE;
+	}
+
+	while (end > rule) {
+		p = end;
+
+		while (p > rule && p[-1] != '.') {
+			p --;
+		}
+
+		if (p == end) {
+			/* Empty label */
+			return FALSE;
+		}
+
+		idx = rspamd_url_tld_insert (tbl, idx, p, end - p);
+		end = p > rule ? p - 1 : p;
+	}
+
+	g_array_index (tbl->nodes, struct url_tld_node, idx).flags |= flags;
+
+	return TRUE;
+}
+
+static inline const gchar *
+rspamd_url_tld_prev_label (const gchar *host, const gchar *label)
+{
+	const gchar *p;
+
+	if (label == host) {
+		return host;
+	}
+
+	p = label - 1;
+
+	while (p > host && p[-1] != '.') {
+		p --;
+	}
+
+	return p;
+}
+
+/*
+ * Finds the registered domain of a host: the longest public suffix that is
+ * preceded by a dot with one more label. If a host has no more labels, then
+ * the whole host is returned, the trailing dot of a host is ignored.
+ */
+static gboolean
+rspamd_url_tld_resolve (struct url_tld_table *tbl, const gchar *host,
+		gsize hostlen, rspamd_ftok_t *out)
+{
+	const gchar *end, *lbegin, *lend, *tld = NULL;
+	struct url_tld_node *node;
+	guint32 cur = 0, next;
+
+	end = host + hostlen;
+
+	if (hostlen > 0 && end[-1] == '.') {
+		end --;
+	}
+
+	lend = end;
+
+	while (lend > host) {
+		lbegin = lend;
+
+		while (lbegin > host && lbegin[-1] != '.') {
+			lbegin --;
+		}
+
+		if (cur != 0 &&
+				(g_array_index (tbl->nodes, struct url_tld_node, cur).flags &
+				URL_TLD_WILDCARD)) {
+			/* Any label below a wildcard rule is a public suffix */
+			tld = rspamd_url_tld_prev_label (host, lbegin);
+		}
+
+		next = rspamd_url_tld_find (tbl, cur, lbegin, lend - lbegin);
+
+		if (next == 0) {
+			break;
+		}
+
+		node = &g_array_index (tbl->nodes, struct url_tld_node, next);
+
+		if (node->flags & URL_TLD_EXCEPTION) {
+			/* Exception is a registered domain itself */
+			tld = lbegin;
+			break;
+		}
+
+		if ((node->flags & URL_TLD_RULE) && lbegin > host) {
+			tld = rspamd_url_tld_prev_label (host, lbegin);
+		}
+
+		if (lbegin == host) {
+			break;
+		}
+
+		cur = next;
+		lend = lbegin - 1;
+	}
+
+	if (tld == NULL) {
+		return FALSE;
+	}
+
+	out->begin = tld;
+	out->len = end - tld;
+
+	return TRUE;
+}
+
 static void
 rspamd_url_parse_tld_file (const gchar *fname,
 		struct url_match_scanner *scanner)
@@ -411,9 +686,13 @@ rspamd_url_parse_tld_file (const gchar *fname,
 
 		g_strchomp (linebuf);
 
-		/* TODO: add support for ! patterns */
+		if (!rspamd_url_tld_add_rule (scanner->tlds, linebuf)) {
+			msg_err ("got bad TLD line, skip it: %s", linebuf);
+			continue;
+		}
+
+		/* Exceptions are used merely to resolve domains */
 		if (linebuf[0] == '!') {
-			msg_debug ("skip '!' patterns from parsing for now: %s", linebuf);
 			continue;
 		}
 
@@ -480,6 +759,7 @@ rspamd_url_deinit (void)
 	if (url_scanner != NULL) {
 		rspamd_multipattern_destroy (url_scanner->search_trie);
 		g_array_free (url_scanner->matchers, TRUE);
+		rspamd_url_tld_table_destroy (url_scanner->tlds);
 		g_free (url_scanner);
 
 		url_scanner = NULL;
@@ -496,19 +776,22 @@ rspamd_url_init (const gchar *tld_file)
 	}
 
 	url_scanner = g_malloc (sizeof (struct url_match_scanner));
+	url_scanner->tlds = rspamd_url_tld_table_new ();
 
 	if (tld_file) {
 		/* Reserve larger multipattern */
 		url_scanner->matchers = g_array_sized_new (FALSE, TRUE,
 				sizeof (struct url_matcher), 13000);
 		url_scanner->search_trie = rspamd_multipattern_create_sized (13000,
-				RSPAMD_MULTIPATTERN_TLD | RSPAMD_MULTIPATTERN_ICASE);
+				RSPAMD_MULTIPATTERN_TLD | RSPAMD_MULTIPATTERN_ICASE |
+				RSPAMD_MULTIPATTERN_VECTORED);
 	}
 	else {
 		url_scanner->matchers = g_array_sized_new (FALSE, TRUE,
 				sizeof (struct url_matcher), 128);
 		url_scanner->search_trie = rspamd_multipattern_create_sized (128,
-				RSPAMD_MULTIPATTERN_TLD | RSPAMD_MULTIPATTERN_ICASE);
+				RSPAMD_MULTIPATTERN_TLD | RSPAMD_MULTIPATTERN_ICASE |
+				RSPAMD_MULTIPATTERN_VECTORED);
 	}
 
 	rspamd_url_add_static_matchers (url_scanner);
@@ -523,8 +806,8 @@ rspamd_url_init (const gchar *tld_file)
 		g_error_free (err);
 	}
 
-	msg_debug ("initialized trie of %ud elements",
-			url_scanner->matchers->len);
+	msg_debug ("initialized trie of %ud elements, %ud TLD labels",
+			url_scanner->matchers->len, url_scanner->tlds->nodes->len - 1);
 }
 
 #define SET_U(u, field) do {                                                \
@@ -1272,69 +1555,6 @@ rspamd_web_parse (struct http_parser_url *u, const gchar *str, gsize len,
 
 #undef SET_U
 
-static gint
-rspamd_tld_trie_callback (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
-		gsize len,
-		void *context)
-{
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct rspamd_url *url = context;
-	gint ndots = 1;
-
-	matcher = &g_array_index (url_scanner->matchers, struct url_matcher,
-			strnum);
-
-	if (matcher->flags & URL_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots = 2;
-	}
-
-	pos = text + match_start;
-	p = pos - 1;
-	start = url->host;
-
-	if (*pos != '.' || match_pos != (gint) url->hostlen) {
-		/* Something weird has been found */
-		if (match_pos == (gint) url->hostlen - 1) {
-			pos = url->host + match_pos;
-			if (*pos == '.') {
-				/* This is dot at the end of domain */
-				url->hostlen--;
-			}
-			else {
-				return 0;
-			}
-		}
-		else {
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
-		}
-
-		p--;
-	}
-
-	if ((ndots == 0 || p == start - 1) &&
-			url->tldlen < url->host + url->hostlen - pos) {
-		url->tld = (gchar *) pos;
-		url->tldlen = url->host + url->hostlen - pos;
-	}
-
-	return 0;
-}
-
 static gboolean
 rspamd_url_is_ip (struct rspamd_url *uri, rspamd_mempool_t *pool)
 {
@@ -1608,6 +1828,7 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 	struct http_parser_url u;
 	gchar *p, *comp;
 	const gchar *end;
+	rspamd_ftok_t tld;
 	guint i, complen, ret, flags = 0;
 	guint unquoted_len = 0;
 
@@ -1765,9 +1986,13 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 	}
 
 	/* Find TLD part */
-	rspamd_multipattern_lookup (url_scanner->search_trie,
-				uri->host, uri->hostlen,
-				rspamd_tld_trie_callback, uri, NULL);
+	if (rspamd_url_tld_resolve (url_scanner->tlds, uri->host, uri->hostlen,
+			&tld)) {
+		uri->tld = (gchar *)tld.begin;
+		uri->tldlen = tld.len;
+		/* Strip dot at the end of domain */
+		uri->hostlen = tld.begin + tld.len - uri->host;
+	}
 
 	if (uri->tldlen == 0) {
 		/* Ignore URL's without TLD if it is not a numeric URL */
@@ -1783,90 +2008,16 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 	return URI_ERRNO_OK;
 }
 
-struct tld_trie_cbdata {
-	const gchar *begin;
-	gsize len;
-	rspamd_ftok_t *out;
-};
-
-static gint
-rspamd_tld_trie_find_callback (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
-		gsize len,
-		void *context)
-{
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct tld_trie_cbdata *cbdata = context;
-	gint ndots = 1;
-
-	matcher = &g_array_index (url_scanner->matchers, struct url_matcher,
-			strnum);
-
-	if (matcher->flags & URL_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots = 2;
-	}
-
-	pos = text + match_start;
-	p = pos - 1;
-	start = text;
-
-	if (*pos != '.' || match_pos != (gint)cbdata->len) {
-		/* Something weird has been found */
-		if (match_pos != (gint)cbdata->len - 1) {
-			/* Search more */
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
-
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
-		}
-
-		p--;
-	}
-
-	if (ndots == 0 || p == start - 1) {
-		if (cbdata->begin + cbdata->len - pos > cbdata->out->len) {
-			cbdata->out->begin = pos;
-			cbdata->out->len = cbdata->begin + cbdata->len - pos;
-		}
-	}
-
-	return 0;
-}
-
 gboolean
 rspamd_url_find_tld (const gchar *in, gsize inlen, rspamd_ftok_t *out)
 {
-	struct tld_trie_cbdata cbdata;
-
 	g_assert (in != NULL);
 	g_assert (out != NULL);
 	g_assert (url_scanner != NULL);
 
-	cbdata.begin = in;
-	cbdata.len = inlen;
-	cbdata.out = out;
 	out->len = 0;
 
-	rspamd_multipattern_lookup (url_scanner->search_trie, in, inlen,
-			rspamd_tld_trie_find_callback, &cbdata, NULL);
-
-	if (out->len > 0) {
-		return TRUE;
-	}
-
-	return FALSE;
+	return rspamd_url_tld_resolve (url_scanner->tlds, in, inlen, out);
 }
 
 static const gchar url_braces[] = {
@@ -2637,6 +2788,122 @@ rspamd_url_text_extract (rspamd_mempool_t *pool,
 			rspamd_url_text_part_callback, &mcbd);
 }
 
+struct rspamd_url_batch_entry {
+	struct rspamd_url *url;
+	gsize start;
+	gsize end;
+	guint idx;
+};
+
+struct rspamd_url_batch_cbdata {
+	GArray *found;
+	guint idx;
+};
+
+static void
+rspamd_url_batch_callback (struct rspamd_url *url, gsize start_offset,
+		gsize end_offset, gpointer ud)
+{
+	struct rspamd_url_batch_cbdata *bcbd = ud;
+	struct rspamd_url_batch_entry entry;
+
+	entry.url = url;
+	entry.start = start_offset;
+	entry.end = end_offset;
+	entry.idx = bcbd->idx;
+
+	g_array_append_val (bcbd->found, entry);
+}
+
+static gint
+rspamd_url_trie_vectored_callback (struct rspamd_multipattern *mp,
+		guint idx,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	struct url_callback_data *cbs = context;
+
+	return rspamd_url_trie_generic_callback_common (mp, strnum, match_start,
+			match_pos, text, len, &cbs[idx], TRUE);
+}
+
+void
+rspamd_url_text_extract_parts (struct rspamd_task *task, GPtrArray *parts)
+{
+	struct rspamd_mime_text_part *part, **bparts;
+	struct rspamd_url_mimepart_cbdata mcbd;
+	struct rspamd_url_batch_cbdata *bcbds;
+	struct rspamd_url_batch_entry *entry;
+	struct url_callback_data *cbs;
+	const gchar **bufs;
+	gsize *lens;
+	GArray *found;
+	guint i, nbufs = 0;
+
+	if (parts->len == 0) {
+		return;
+	}
+
+	/* Number of parts is not bounded, so avoid alloca here */
+	bufs = g_new (const gchar *, parts->len);
+	lens = g_new (gsize, parts->len);
+	bparts = g_new (struct rspamd_mime_text_part *, parts->len);
+	cbs = g_new0 (struct url_callback_data, parts->len);
+	bcbds = g_new (struct rspamd_url_batch_cbdata, parts->len);
+	found = g_array_sized_new (FALSE, FALSE,
+			sizeof (struct rspamd_url_batch_entry), 16);
+
+	PTR_ARRAY_FOREACH (parts, i, part) {
+		if (part->stripped_content == NULL || part->stripped_content->len == 0) {
+			msg_warn_task ("got empty text part");
+			continue;
+		}
+
+		bufs[nbufs] = part->stripped_content->data;
+		lens[nbufs] = part->stripped_content->len;
+		bparts[nbufs] = part;
+
+		bcbds[nbufs].found = found;
+		bcbds[nbufs].idx = nbufs;
+
+		cbs[nbufs].begin = bufs[nbufs];
+		cbs[nbufs].end = bufs[nbufs] + lens[nbufs];
+		cbs[nbufs].is_html = FALSE;
+		cbs[nbufs].pool = task->task_pool;
+		cbs[nbufs].newlines = part->newlines;
+		cbs[nbufs].func = rspamd_url_batch_callback;
+		cbs[nbufs].funcd = &bcbds[nbufs];
+
+		nbufs ++;
+	}
+
+	/* All parts are scanned at once, offsets are kept per part */
+	rspamd_multipattern_lookup_vectored (url_scanner->search_trie,
+			bufs, lens, nbufs,
+			rspamd_url_trie_vectored_callback, cbs, NULL);
+
+	/* Now insert everything found to the task hashes in one pass */
+	mcbd.task = task;
+
+	for (i = 0; i < found->len; i ++) {
+		entry = &g_array_index (found, struct rspamd_url_batch_entry, i);
+		mcbd.part = bparts[entry->idx];
+		rspamd_url_text_part_callback (entry->url, entry->start, entry->end,
+				&mcbd);
+	}
+
+	g_array_free (found, TRUE);
+	g_free (bufs);
+	g_free (lens);
+	g_free (bparts);
+	g_free (cbs);
+	g_free (bcbds);
+}
+
 void
 rspamd_url_find_multiple (rspamd_mempool_t *pool, const gchar *in,
 		gsize inlen, gboolean is_html, GPtrArray *nlines,
@@ -104,6 +104,15 @@ void rspamd_url_text_extract (rspamd_mempool_t *pool,
 	struct rspamd_mime_text_part *part,
 	gboolean is_html);
 
+/*
+ * Parse urls inside several non-html text parts in a single pass over
+ * all of them, urls found are added to the task once the scan is finished
+ * @param task task object
+ * @param parts array of text parts
+ */
+void rspamd_url_text_extract_parts (struct rspamd_task *task,
+	GPtrArray *parts);
+
 /*
  * Parse a single url into an uri structure
  * @param pool memory pool
@@ -294,6 +294,12 @@ rspamd_worker_init_signals (struct rspamd_worker *worker, struct event_base *bas
 	sigprocmask (SIG_UNBLOCK, &signals.sa_mask, NULL);
 }
 
+static void
+rspamd_worker_mempool_trim (gint fd, short what, gpointer p)
+{
+	rspamd_mempool_chain_cache_trim ();
+}
+
 struct event_base *
 rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	void (*accept_handler)(int, short, void *))
@@ -302,6 +308,10 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	struct event *accept_events;
 	GList *cur;
 	struct rspamd_worker_listen_socket *ls;
+	static struct timeval trim_tv = {
+		.tv_sec = 10,
+		.tv_usec = 0,
+	};
 
 #ifdef WITH_PROFILER
 	extern void _start (void), etext (void);
@@ -322,6 +332,12 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 			worker->srv->cfg, ev_base);
 #endif
 
+	/* Release memory pool chains that are idle in cache */
+	event_set (&worker->trim_ev, -1, EV_TIMEOUT|EV_PERSIST,
+			rspamd_worker_mempool_trim, NULL);
+	event_base_set (ev_base, &worker->trim_ev);
+	event_add (&worker->trim_ev, &trim_tv);
+
 	/* Accept all sockets */
 	if (accept_handler) {
 		cur = worker->cf->listen_socks;
@@ -371,6 +387,12 @@ rspamd_worker_stop_accept (struct rspamd_worker *worker)
 
 	if (worker->accept_events != NULL) {
 		g_list_free (worker->accept_events);
+		worker->accept_events = NULL;
+	}
+
+	/* Persistent timer would keep the terminating worker's loop running */
+	if (event_get_base (&worker->trim_ev)) {
+		event_del (&worker->trim_ev);
 	}
 	/* XXX: we need to do it much later */
 #if 0
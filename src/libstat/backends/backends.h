@@ -18,6 +18,7 @@
 
 #include "config.h"
 #include "ucl.h"
+#include "mem_pool.h"
 
 #define RSPAMD_DEFAULT_BACKEND "mmap"
 
@@ -96,9 +97,33 @@ struct rspamd_stat_backend {
 		void rspamd_##name##_close (gpointer ctx)
 
 RSPAMD_STAT_BACKEND_DEF(mmaped_file);
+
+/* Direct access to mmaped statfiles for tools */
+typedef struct rspamd_mmaped_file_s rspamd_mmaped_file_t;
+
+rspamd_mmaped_file_t * rspamd_mmaped_file_open (rspamd_mempool_t *pool,
+		const gchar *filename, size_t size,
+		struct rspamd_statfile_config *stcf);
+gint rspamd_mmaped_file_create (const gchar *filename, size_t size,
+		struct rspamd_statfile_config *stcf,
+		rspamd_mempool_t *pool);
+gint rspamd_mmaped_file_close_file (rspamd_mempool_t *pool,
+		rspamd_mmaped_file_t *file);
+double rspamd_mmaped_file_get_block (rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2);
+void rspamd_mmaped_file_set_block (rspamd_mempool_t *pool,
+		rspamd_mmaped_file_t *file,
+		guint32 h1, guint32 h2, double value);
+/**
+ * Converts statfile of the previous version to the current format in place
+ * @return 0 on success
+ */
+gint rspamd_mmaped_file_convert (rspamd_mempool_t *pool, const gchar *filename);
 RSPAMD_STAT_BACKEND_DEF(sqlite3);
 #ifdef WITH_HIREDIS
 RSPAMD_STAT_BACKEND_DEF(redis);
+void rspamd_redis_init_shared (struct rspamd_config *cfg,
+		struct rspamd_classifier_config *clcf);
 #endif
 
 #endif /* BACKENDS_H_ */
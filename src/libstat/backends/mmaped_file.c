@@ -17,10 +17,25 @@
 #include "stat_internal.h"
 #include "unix-std.h"
 
-#define CHAIN_LENGTH 128
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Statfile is a bucketized cuckoo hash: each token can live in one of two
+ * buckets of 4 slots, slots store hash2 of a token as a tag and a 32 bit
+ * counter. The primary bucket index is built from the lower `base_bits` of
+ * hash1 and the higher bits are taken from the tag, so the table can be
+ * doubled in place by splitting each bucket by the next bit of its tags.
+ */
+#define BUCKET_SLOTS 4
+#define MAX_KICKS 128
 
 /* Section types */
 #define STATFILE_SECTION_COMMON 1
+#define STATFILE_SECTION_CUCKOO 2
+/* Section of a file that has been replaced by a reindexed one */
+#define STATFILE_SECTION_REPLACED 3
 
 /**
  * Common statfile header
@@ -32,14 +47,14 @@ struct stat_file_header {
 	guint64 create_time;                    /**< create time (time_t->guint64)		*/
 	guint64 revision;                       /**< revision number					*/
 	guint64 rev_time;                       /**< revision time						*/
-	guint64 used_blocks;                    /**< used blocks number					*/
-	guint64 total_blocks;                   /**< total number of blocks				*/
+	guint64 used_blocks;                    /**< used slots number					*/
+	guint64 total_blocks;                   /**< total number of slots				*/
 	guint64 tokenizer_conf_len;				/**< length of tokenizer configuration	*/
 	u_char unused[231];                     /**< some bytes that can be used in future */
 };
 
 /**
- * Section header
+ * Section header (version 1.2)
  */
 struct stat_file_section {
 	guint64 code;                           /**< section's code						*/
@@ -47,7 +62,7 @@ struct stat_file_section {
 };
 
 /**
- * Block of data in statfile
+ * Block of data in statfile (version 1.2)
  */
 struct stat_file_block {
 	guint32 hash1;                          /**< hash1 (also acts as index)			*/
@@ -55,19 +70,49 @@ struct stat_file_block {
 	double value;                           /**< double value                       */
 };
 
+/**
+ * Cuckoo section header
+ */
+struct stat_file_cuckoo_section {
+	guint64 code;                           /**< section's code						*/
+	guint64 length;                         /**< number of buckets (power of 2)		*/
+	guint32 bits;                           /**< log2 of buckets number				*/
+	guint32 base_bits;                      /**< index bits taken from hash1		*/
+	guint64 dropped;                        /**< tokens dropped as table was full	*/
+};
+
+/**
+ * Bucket of data in statfile, tags and counters are stored separately to
+ * compare all tags at once
+ */
+struct stat_file_bucket {
+	guint32 tags[BUCKET_SLOTS];             /**< hash2 of tokens, 0 for free slots	*/
+	guint32 values[BUCKET_SLOTS];           /**< counters							*/
+};
+
 /**
  * Statistic file
  */
 struct stat_file {
 	struct stat_file_header header;         /**< header								*/
-	struct stat_file_section section;       /**< first section						*/
-	struct stat_file_block blocks[1];       /**< first block of data				*/
+	struct stat_file_cuckoo_section section; /**< cuckoo section					*/
+	struct stat_file_bucket buckets[1];     /**< first bucket of data				*/
 };
 
+/* Buckets must not cross cache lines */
+G_STATIC_ASSERT (sizeof (struct stat_file_bucket) == 32);
+G_STATIC_ASSERT ((sizeof (struct stat_file_header) +
+		sizeof (struct stat_file_cuckoo_section)) % 64 == 0);
+
+#define STATFILE_DATA_OFFSET (sizeof (struct stat_file) - \
+		sizeof (struct stat_file_bucket))
+#define STATFILE_OLD_DATA_OFFSET (sizeof (struct stat_file_header) + \
+		sizeof (struct stat_file_section))
+
 /**
- * Common view of statfile object
+ * Common view of statfile object, typedef is in backends.h
  */
-typedef struct {
+struct rspamd_mmaped_file_s {
 #ifdef HAVE_PATH_MAX
 	gchar filename[PATH_MAX];               /**< name of file						*/
 #else
@@ -76,58 +121,152 @@ typedef struct {
 	rspamd_mempool_t *pool;
 	gint fd;                                /**< descriptor							*/
 	void *map;                              /**< mmaped area						*/
-	off_t seek_pos;                         /**< current seek position				*/
-	struct stat_file_section cur_section;   /**< current section					*/
+	struct stat_file_cuckoo_section *section; /**< cuckoo section				*/
+	struct stat_file_bucket *buckets;       /**< first bucket						*/
+	guint64 mask;                           /**< buckets number - 1					*/
+	guint64 base_mask;                      /**< mask of index bits from hash1		*/
+	guint base_bits;                        /**< number of index bits from hash1	*/
 	size_t len;                             /**< length of file(in bytes)			*/
 	struct rspamd_statfile_config *cf;
-} rspamd_mmaped_file_t;
+};
 
 
-#define RSPAMD_STATFILE_VERSION {'1', '2'}
-#define BACKUP_SUFFIX ".old"
+#define RSPAMD_STATFILE_VERSION {'1', '3'}
+#define RSPAMD_STATFILE_OLD_VERSION {'1', '2'}
 
 static void rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 	   rspamd_mmaped_file_t *file,
 	   guint32 h1, guint32 h2, double value);
+static gint rspamd_mmaped_file_create_common (const gchar *filename,
+		size_t size, gconstpointer tok_conf, gsize tok_conf_len,
+		guint base_bits, rspamd_mempool_t *pool);
 
-rspamd_mmaped_file_t * rspamd_mmaped_file_open (rspamd_mempool_t *pool,
-		const gchar *filename, size_t size,
-		struct rspamd_statfile_config *stcf);
-gint rspamd_mmaped_file_create (const gchar *filename, size_t size,
-		struct rspamd_statfile_config *stcf,
-		rspamd_mempool_t *pool);
-gint rspamd_mmaped_file_close_file (rspamd_mempool_t *pool,
-		rspamd_mmaped_file_t * file);
+static inline guint32
+rspamd_mmaped_file_tag (guint32 h2)
+{
+	/* Zero tag marks free slots */
+	return h2 != 0 ? h2 : 1;
+}
+
+static inline guint64
+rspamd_mmaped_file_bucket (rspamd_mmaped_file_t *file, guint32 h1, guint32 tag)
+{
+	return (h1 & file->base_mask) |
+			(((guint64)tag << file->base_bits) & file->mask);
+}
+
+static inline guint64
+rspamd_mmaped_file_alt_bucket (rspamd_mmaped_file_t *file, guint64 b,
+		guint32 tag)
+{
+	guint64 h;
+
+	/* Must not touch bits taken from tag to keep in place splitting valid */
+	h = (guint64)tag * 0x9E3779B97F4A7C15ULL;
+	h ^= h >> 29;
+
+	return b ^ (h & file->base_mask);
+}
+
+static inline gint
+rspamd_mmaped_file_bucket_find (const struct stat_file_bucket *bk, guint32 tag)
+{
+#ifdef __SSE2__
+	__m128i tags, cmp;
+	gint m;
+
+	tags = _mm_loadu_si128 ((const __m128i *)bk->tags);
+	cmp = _mm_cmpeq_epi32 (tags, _mm_set1_epi32 ((gint)tag));
+	m = _mm_movemask_ps (_mm_castsi128_ps (cmp));
+
+	return m != 0 ? ffs (m) - 1 : -1;
+#else
+	guint i;
+
+	for (i = 0; i < BUCKET_SLOTS; i ++) {
+		if (bk->tags[i] == tag) {
+			return i;
+		}
+	}
+
+	return -1;
+#endif
+}
+
+static inline guint32
+rspamd_mmaped_file_counter (double value)
+{
+	if (value <= 0) {
+		return 0;
+	}
+	else if (value >= (double)G_MAXUINT32) {
+		return G_MAXUINT32;
+	}
+
+	return (guint32)(value + 0.5);
+}
+
+/* Returns log2 of number of buckets that fit in the file of the specified size */
+static guint
+rspamd_mmaped_file_bits (size_t size)
+{
+	guint64 nbuckets;
+	guint bits = 0;
+
+	if (size < sizeof (struct stat_file)) {
+		return 0;
+	}
+
+	nbuckets = (size - STATFILE_DATA_OFFSET) / sizeof (struct stat_file_bucket);
+
+	while ((G_GUINT64_CONSTANT (1) << (bits + 1)) <= nbuckets) {
+		bits ++;
+	}
+
+	return bits;
+}
+
+/* Bits are checked against the file size before they are used in shifts */
+static gboolean
+rspamd_mmaped_file_section_valid (const struct stat_file_cuckoo_section *section,
+		size_t len)
+{
+	if (section->code != STATFILE_SECTION_CUCKOO ||
+			section->bits > rspamd_mmaped_file_bits (len) ||
+			section->base_bits > MIN (section->bits, 32)) {
+		return FALSE;
+	}
+
+	return section->length == (G_GUINT64_CONSTANT (1) << section->bits);
+}
 
 double
 rspamd_mmaped_file_get_block (rspamd_mmaped_file_t * file,
 	guint32 h1,
 	guint32 h2)
 {
-	struct stat_file_block *block;
-	guint i, blocknum;
-	u_char *c;
+	struct stat_file_bucket *bk;
+	guint32 tag;
+	guint64 b;
+	gint slot;
 
 	if (!file->map) {
 		return 0;
 	}
 
-	blocknum = h1 % file->cur_section.length;
-	c = (u_char *) file->map + file->seek_pos + blocknum *
-		sizeof (struct stat_file_block);
-	block = (struct stat_file_block *)c;
+	tag = rspamd_mmaped_file_tag (h2);
+	b = rspamd_mmaped_file_bucket (file, h1, tag);
+	bk = &file->buckets[b];
+	slot = rspamd_mmaped_file_bucket_find (bk, tag);
 
-	for (i = 0; i < CHAIN_LENGTH; i++) {
-		if (i + blocknum >= file->cur_section.length) {
-			break;
-		}
-		if (block->hash1 == h1 && block->hash2 == h2) {
-			return block->value;
-		}
-		c += sizeof (struct stat_file_block);
-		block = (struct stat_file_block *)c;
+	if (slot == -1) {
+		bk = &file->buckets[rspamd_mmaped_file_alt_bucket (file, b, tag)];
+		slot = rspamd_mmaped_file_bucket_find (bk, tag);
 	}
 
+	if (slot != -1) {
+		return bk->values[slot];
+	}
 
 	return 0;
 }
@@ -137,80 +276,116 @@ rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 		rspamd_mmaped_file_t *file,
 		guint32 h1, guint32 h2, double value)
 {
-	struct stat_file_block *block, *to_expire = NULL;
+	struct stat_file_bucket *bk, *bk1, *bk2;
 	struct stat_file_header *header;
-	guint i, blocknum;
-	u_char *c;
-	double min = G_MAXDOUBLE;
+	guint32 tag, cnt, tmp;
+	guint64 b;
+	gint slot, i, min_slot;
 
 	if (!file->map) {
 		return;
 	}
 
-	blocknum = h1 % file->cur_section.length;
 	header = (struct stat_file_header *)file->map;
-	c = (u_char *) file->map + file->seek_pos + blocknum *
-		sizeof (struct stat_file_block);
-	block = (struct stat_file_block *)c;
-
-	for (i = 0; i < CHAIN_LENGTH; i++) {
-		if (i + blocknum >= file->cur_section.length) {
-			/* Need to expire some block in chain */
-			msg_info_pool ("chain %ud is full in statfile %s, starting expire",
-				blocknum,
-				file->filename);
-			break;
+	tag = rspamd_mmaped_file_tag (h2);
+	cnt = rspamd_mmaped_file_counter (value);
+	b = rspamd_mmaped_file_bucket (file, h1, tag);
+	bk1 = &file->buckets[b];
+	bk2 = &file->buckets[rspamd_mmaped_file_alt_bucket (file, b, tag)];
+
+	/* First try to find an existing token */
+	bk = bk1;
+	slot = rspamd_mmaped_file_bucket_find (bk, tag);
+
+	if (slot == -1) {
+		bk = bk2;
+		slot = rspamd_mmaped_file_bucket_find (bk, tag);
+	}
+
+	if (slot != -1) {
+		if (cnt == 0) {
+			/* Release slot */
+			bk->tags[slot] = 0;
+			bk->values[slot] = 0;
+			header->used_blocks --;
 		}
-		/* First try to find block in chain */
-		if (block->hash1 == h1 && block->hash2 == h2) {
-			msg_debug_pool ("%s found existing block %ud in chain %ud, value %.2f",
-					file->filename,
-					i,
-					blocknum,
-					value);
-			block->value = value;
-			return;
+		else {
+			bk->values[slot] = cnt;
 		}
-		/* Check whether we have a free block in chain */
-		if (block->hash1 == 0 && block->hash2 == 0) {
-			/* Write new block here */
-			msg_debug_pool ("%s found free block %ud in chain %ud, set h1=%ud, h2=%ud",
-				file->filename,
-				i,
-				blocknum,
-				h1,
-				h2);
-			block->hash1 = h1;
-			block->hash2 = h2;
-			block->value = value;
-			header->used_blocks++;
 
-			return;
-		}
+		return;
+	}
 
-		/* Expire block with minimum value otherwise */
-		if (block->value < min) {
-			to_expire = block;
-			min = block->value;
-		}
-		c += sizeof (struct stat_file_block);
-		block = (struct stat_file_block *)c;
+	if (cnt == 0) {
+		return;
 	}
 
-	/* Try expire some block */
-	if (to_expire) {
-		block = to_expire;
+	/* Check whether we have a free slot in any of buckets */
+	bk = bk1;
+	slot = rspamd_mmaped_file_bucket_find (bk, 0);
+
+	if (slot == -1) {
+		bk = bk2;
+		slot = rspamd_mmaped_file_bucket_find (bk, 0);
 	}
-	else {
-		/* Expire first block in chain */
-		c = (u_char *) file->map + file->seek_pos + blocknum *
-			sizeof (struct stat_file_block);
-		block = (struct stat_file_block *)c;
+
+	if (slot == -1) {
+		/* Both buckets are full, relocate tokens to their alternate buckets */
+		b = rspamd_mmaped_file_alt_bucket (file, b, tag);
+
+		for (i = 0; i < MAX_KICKS; i ++) {
+			bk = &file->buckets[b];
+			slot = (tag ^ i) % BUCKET_SLOTS;
+			tmp = bk->tags[slot];
+			bk->tags[slot] = tag;
+			tag = tmp;
+			tmp = bk->values[slot];
+			bk->values[slot] = cnt;
+			cnt = tmp;
+
+			b = rspamd_mmaped_file_alt_bucket (file, b, tag);
+			bk = &file->buckets[b];
+			slot = rspamd_mmaped_file_bucket_find (bk, 0);
+
+			if (slot != -1) {
+				break;
+			}
+		}
+
+		if (slot == -1) {
+			/* Table is too full, drop the token with the lowest counter */
+			min_slot = 0;
+
+			for (i = 1; i < BUCKET_SLOTS; i ++) {
+				if (bk->values[i] < bk->values[min_slot]) {
+					min_slot = i;
+				}
+			}
+
+			file->section->dropped ++;
+			msg_info_pool ("statfile %s is full, dropping token with "
+					"counter %ud", file->filename,
+					MIN (cnt, bk->values[min_slot]));
+
+			if (cnt <= bk->values[min_slot]) {
+				return;
+			}
+
+			bk->tags[min_slot] = tag;
+			bk->values[min_slot] = cnt;
+
+			return;
+		}
 	}
 
-	block->hash1 = h1;
-	block->hash2 = h2;
-	block->value = value;
+	msg_debug_pool ("%s found free slot %d in bucket %uL, set tag=%ud",
+			file->filename,
+			slot,
+			(guint64)(bk - file->buckets),
+			tag);
+	bk->tags[slot] = tag;
+	bk->values[slot] = cnt;
+	header->used_blocks ++;
 }
 
 void
@@ -321,26 +496,30 @@ rspamd_mmaped_file_get_total (rspamd_mmaped_file_t *file)
 
 	/* If total blocks is 0 we have old version of header, so set total blocks correctly */
 	if (header->total_blocks == 0) {
-		header->total_blocks = file->cur_section.length;
+		header->total_blocks = file->section->length * BUCKET_SLOTS;
 	}
 
 	return header->total_blocks;
 }
 
-/* Check whether specified file is statistic file and calculate its len in blocks */
+/*
+ * Check whether specified file is statistic file and calculate its len in
+ * buckets, returns 1 if file has the previous version and must be converted
+ */
 static gint
 rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 {
 	struct stat_file *f;
 	gchar *c;
-	static gchar valid_version[] = RSPAMD_STATFILE_VERSION;
+	static gchar valid_version[] = RSPAMD_STATFILE_VERSION,
+			old_version[] = RSPAMD_STATFILE_OLD_VERSION;
 
 
 	if (!file || !file->map) {
 		return -1;
 	}
 
-	if (file->len < sizeof (struct stat_file)) {
+	if (file->len < STATFILE_OLD_DATA_OFFSET) {
 		msg_info_pool ("file %s is too short to be stat file: %z",
 			file->filename,
 			file->len);
@@ -360,6 +539,9 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 	if (*c == 1 && *(c + 1) == 0) {
 		return -1;
 	}
+	else if (memcmp (c, old_version, sizeof (old_version)) == 0) {
+		return 1;
+	}
 	else if (memcmp (c, valid_version, sizeof (valid_version)) != 0) {
 		/* Unknown version */
 		msg_info_pool ("file %s has invalid version %c.%c",
@@ -369,23 +551,242 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 		return -1;
 	}
 
+	if (file->len < sizeof (struct stat_file)) {
+		msg_info_pool ("file %s is too short to be stat file: %z",
+			file->filename,
+			file->len);
+		return -1;
+	}
+
 	/* Check first section and set new offset */
-	file->cur_section.code = f->section.code;
-	file->cur_section.length = f->section.length;
-	if (file->cur_section.length * sizeof (struct stat_file_block) >
-		file->len) {
-		msg_info_pool ("file %s is truncated: %z, must be %z",
+	if (!rspamd_mmaped_file_section_valid (&f->section, file->len)) {
+		msg_info_pool ("file %s has invalid section: %ud bits, size %z",
 			file->filename,
-			file->len,
-			file->cur_section.length * sizeof (struct stat_file_block));
+			(guint)f->section.bits,
+			file->len);
 		return -1;
 	}
-	file->seek_pos = sizeof (struct stat_file) -
-		sizeof (struct stat_file_block);
+
+	file->section = &f->section;
+	file->buckets = f->buckets;
+	file->mask = f->section.length - 1;
+	file->base_bits = f->section.base_bits;
+	file->base_mask = (G_GUINT64_CONSTANT (1) << file->base_bits) - 1;
 
 	return 0;
 }
 
+/*
+ * Copies tokens to a larger table with the same index bits from hash1, each
+ * bucket is split by the bits of tags that become index bits
+ */
+static void
+rspamd_mmaped_file_split (rspamd_mmaped_file_t *new,
+		const struct stat_file *old)
+{
+	const struct stat_file_bucket *src;
+	struct stat_file_bucket *dst;
+	struct stat_file_header *nh;
+	guint64 i;
+	guint j;
+
+	for (i = 0; i < old->section.length; i ++) {
+		src = &old->buckets[i];
+
+		for (j = 0; j < BUCKET_SLOTS; j ++) {
+			if (src->tags[j] != 0) {
+				/* Lower bits of bucket index are kept */
+				dst = &new->buckets[rspamd_mmaped_file_bucket (new,
+						(guint32)i, src->tags[j])];
+				dst->tags[j] = src->tags[j];
+				dst->values[j] = src->values[j];
+			}
+		}
+	}
+
+	nh = new->map;
+	nh->used_blocks = old->header.used_blocks;
+	new->section->dropped = old->section.dropped;
+}
+
+/*
+ * Moves all tokens of a statfile to a new file of the specified size with
+ * the current format, file must be locked. New file is written aside and
+ * renamed over the old one, then the old one is marked as replaced, so
+ * processes that have it mapped can reopen it.
+ */
+static gint
+rspamd_mmaped_file_rehash (rspamd_mempool_t *pool,
+		const gchar *filename,
+		size_t old_size,
+		size_t size)
+{
+	gchar *tmp;
+	gint fd;
+	rspamd_mmaped_file_t *new;
+	u_char *map, *pos;
+	struct stat_file_block *block;
+	struct stat_file *old;
+	struct stat_file_header *header, *nh;
+	guint bits, base_bits, j;
+	guint64 i;
+	gboolean cuckoo = FALSE, split = FALSE;
+
+	if (size < sizeof (struct stat_file)) {
+		msg_err_pool ("file %s is too small to carry any statistic: %z",
+			filename,
+			size);
+		return -1;
+	}
+
+	bits = rspamd_mmaped_file_bits (size);
+	base_bits = MIN (bits, 32);
+
+	fd = open (filename, O_RDWR);
+
+	if (fd == -1) {
+		msg_err_pool ("cannot open file %s: %s", filename, strerror (errno));
+		return -1;
+	}
+
+	if ((map = mmap (NULL, old_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0)) == MAP_FAILED) {
+		msg_err_pool ("cannot mmap file %s: %s", filename, strerror (errno));
+		close (fd);
+		return -1;
+	}
+
+	close (fd);
+	header = (struct stat_file_header *)map;
+	old = (struct stat_file *)map;
+
+	if (old_size >= sizeof (struct stat_file) &&
+			header->version[0] == '1' && header->version[1] == '3') {
+		if (!rspamd_mmaped_file_section_valid (&old->section, old_size)) {
+			msg_err_pool ("file %s has invalid section: %ud bits, size %z",
+					filename, (guint)old->section.bits, old_size);
+			munmap (map, old_size);
+
+			return -1;
+		}
+
+		cuckoo = TRUE;
+
+		if (old->section.bits < bits &&
+				bits - old->section.base_bits < 32) {
+			/* Just split buckets */
+			msg_info_pool ("grow statfile %s from %ud to %ud buckets bits",
+					filename, (guint)old->section.bits, bits);
+			split = TRUE;
+		}
+
+		/* Only index bits from hash1 stored in the old file can be used */
+		base_bits = MIN (base_bits, old->section.base_bits);
+	}
+
+	tmp = g_strconcat (filename, ".new", NULL);
+	/* Leftover of an interrupted reindex */
+	unlink (tmp);
+
+	/* Now create new file with required size */
+	if (rspamd_mmaped_file_create_common (tmp, size, header->unused,
+			header->tokenizer_conf_len, base_bits, pool) != 0) {
+		msg_err_pool ("cannot create new file");
+		munmap (map, old_size);
+		unlink (tmp);
+		g_free (tmp);
+
+		return -1;
+	}
+
+	/* Open new file without any checks */
+	new = g_malloc0 (sizeof (*new));
+	new->fd = open (tmp, O_RDWR);
+	new->len = STATFILE_DATA_OFFSET +
+			(G_GUINT64_CONSTANT (1) << bits) * sizeof (struct stat_file_bucket);
+	rspamd_strlcpy (new->filename, tmp, sizeof (new->filename));
+
+	if (new->fd == -1 || (new->map = mmap (NULL, new->len,
+			PROT_READ | PROT_WRITE, MAP_SHARED, new->fd, 0)) == MAP_FAILED) {
+		msg_err_pool ("cannot open file %s: %s", tmp, strerror (errno));
+
+		if (new->fd != -1) {
+			close (new->fd);
+		}
+
+		g_free (new);
+		munmap (map, old_size);
+		unlink (tmp);
+		g_free (tmp);
+
+		return -1;
+	}
+
+	g_assert (rspamd_mmaped_file_check (pool, new) == 0);
+
+	if (split) {
+		rspamd_mmaped_file_split (new, old);
+	}
+	else if (cuckoo) {
+		for (i = 0; i < old->section.length; i ++) {
+			for (j = 0; j < BUCKET_SLOTS; j ++) {
+				if (old->buckets[i].tags[j] != 0) {
+					/* Lower bits of bucket index are the lower bits of hash1 */
+					rspamd_mmaped_file_set_block_common (pool, new,
+							(guint32)(i & ((G_GUINT64_CONSTANT (1) <<
+									old->section.base_bits) - 1)),
+							old->buckets[i].tags[j],
+							old->buckets[i].values[j]);
+				}
+			}
+		}
+	}
+	else {
+		/* Now start reading blocks from old statfile */
+		pos = map + STATFILE_OLD_DATA_OFFSET;
+
+		while ((gssize)old_size - (pos - map) >=
+				(gssize)sizeof (struct stat_file_block)) {
+			block = (struct stat_file_block *)pos;
+
+			if (block->hash1 != 0 && block->value != 0) {
+				rspamd_mmaped_file_set_block_common (pool,
+						new, block->hash1,
+						block->hash2, block->value);
+			}
+
+			pos += sizeof (*block);
+		}
+	}
+
+	rspamd_mmaped_file_set_revision (new, header->revision, header->rev_time);
+	nh = new->map;
+	nh->create_time = header->create_time;
+
+	if (msync (new->map, new->len, MS_SYNC) == -1 ||
+			rename (tmp, filename) == -1) {
+		msg_err_pool ("cannot replace %s with %s: %s", filename, tmp,
+				strerror (errno));
+		munmap (map, old_size);
+		rspamd_mmaped_file_close_file (pool, new);
+		unlink (tmp);
+		g_free (tmp);
+
+		return -1;
+	}
+
+	if (cuckoo) {
+		/* New file is in place, processes that map the old one reopen it */
+		old->section.code = STATFILE_SECTION_REPLACED;
+		msync (map, old_size, MS_ASYNC);
+	}
+
+	munmap (map, old_size);
+	rspamd_mmaped_file_close_file (pool, new);
+	g_free (tmp);
+
+	return 0;
+}
 
 static rspamd_mmaped_file_t *
 rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
@@ -394,20 +795,14 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 		size_t size,
 		struct rspamd_statfile_config *stcf)
 {
-	gchar *backup, *lock;
-	gint fd, lock_fd;
-	rspamd_mmaped_file_t *new, *old = NULL;
-	u_char *map, *pos;
-	struct stat_file_block *block;
-	struct stat_file_header *header, *nh;
+	gchar *lock;
+	gint lock_fd, ret;
 	struct timespec sleep_ts = {
 			.tv_sec = 0,
 			.tv_nsec = 1000000
 	};
 
-	if (size <
-		sizeof (struct stat_file_header) + sizeof (struct stat_file_section) +
-		sizeof (block)) {
+	if (size < sizeof (struct stat_file)) {
 		msg_err_pool ("file %s is too small to carry any statistic: %z",
 			filename,
 			size);
@@ -432,98 +827,83 @@ rspamd_mmaped_file_reindex (rspamd_mempool_t *pool,
 		}
 	}
 
-	backup = g_strconcat (filename, ".old", NULL);
-	if (rename (filename, backup) == -1) {
-		msg_err_pool ("cannot rename %s to %s: %s", filename, backup, strerror (
-				errno));
-		g_free (backup);
-		unlink (lock);
-		g_free (lock);
-		close (lock_fd);
-
-		return NULL;
-	}
-
-	old = rspamd_mmaped_file_open (pool, backup, old_size, stcf);
-
-	if (old == NULL) {
-		msg_warn_pool ("old file %s is invalid mmapped file, just move it",
-				backup);
-	}
+	ret = rspamd_mmaped_file_rehash (pool, filename, old_size, size);
 
 	/* We need to release our lock here */
 	unlink (lock);
 	close (lock_fd);
 	g_free (lock);
 
-	/* Now create new file with required size */
-	if (rspamd_mmaped_file_create (filename, size, stcf, pool) != 0) {
-		msg_err_pool ("cannot create new file");
-		rspamd_mmaped_file_close (old);
-		g_free (backup);
-
+	if (ret != 0) {
 		return NULL;
 	}
 
-	new = rspamd_mmaped_file_open (pool, filename, size, stcf);
+	return rspamd_mmaped_file_open (pool, filename, size, stcf);
+}
 
-	if (old) {
-		/* Now open new file and start copying */
-		fd = open (backup, O_RDONLY);
-		if (fd == -1 || new == NULL) {
-			if (fd != -1) {
-				close (fd);
-			}
+gint
+rspamd_mmaped_file_convert (rspamd_mempool_t *pool, const gchar *filename)
+{
+	struct stat_file_header header;
+	struct stat st;
+	gchar *lock;
+	gint fd, lock_fd, ret;
 
-			msg_err_pool ("cannot open file: %s", strerror (errno));
-			rspamd_mmaped_file_close (old);
-			g_free (backup);
-			return NULL;
+	if ((fd = open (filename, O_RDONLY)) == -1 || fstat (fd, &st) == -1) {
+		msg_err_pool ("cannot open file %s: %s", filename, strerror (errno));
+
+		if (fd != -1) {
+			close (fd);
 		}
 
+		return -1;
+	}
 
+	if (read (fd, &header, sizeof (header)) != sizeof (header) ||
+			memcmp (header.magic, "rsd", sizeof (header.magic)) != 0) {
+		msg_err_pool ("file %s is invalid stat file", filename);
+		close (fd);
 
-		/* Now start reading blocks from old statfile */
-		if ((map =
-				mmap (NULL, old_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
-			msg_err_pool ("cannot mmap file: %s", strerror (errno));
-			close (fd);
-			rspamd_mmaped_file_close (old);
-			g_free (backup);
-			return NULL;
-		}
+		return -1;
+	}
+
+	close (fd);
 
-		pos = map + (sizeof (struct stat_file) - sizeof (struct stat_file_block));
+	if (header.version[0] == '1' && header.version[1] == '3') {
+		msg_info_pool ("file %s already has the current version", filename);
 
-		if (pos - map < (gssize)old_size) {
-			while ((gssize)old_size - (pos - map) >= (gssize)sizeof (struct stat_file_block)) {
-				block = (struct stat_file_block *)pos;
-				if (block->hash1 != 0 && block->value != 0) {
-					rspamd_mmaped_file_set_block_common (pool,
-							new, block->hash1,
-							block->hash2, block->value);
-				}
-				pos += sizeof (block);
-			}
-		}
+		return 0;
+	}
+	else if (header.version[0] != '1' || header.version[1] != '2') {
+		msg_err_pool ("file %s has unsupported version %c.%c", filename,
+				header.version[0], header.version[1]);
 
-		header = (struct stat_file_header *)map;
-		rspamd_mmaped_file_set_revision (new, header->revision, header->rev_time);
-		nh = new->map;
-		/* Copy tokenizer configuration */
-		memcpy (nh->unused, header->unused, sizeof (header->unused));
-		nh->tokenizer_conf_len = header->tokenizer_conf_len;
+		return -1;
+	}
 
-		munmap (map, old_size);
-		close (fd);
-		rspamd_mmaped_file_close_file (pool, old);
+	lock = g_strconcat (filename, ".lock", NULL);
+	lock_fd = open (lock, O_WRONLY|O_CREAT|O_EXCL, 00600);
+
+	if (lock_fd == -1) {
+		msg_err_pool ("cannot convert file %s, it is locked by another process",
+				filename);
+		g_free (lock);
+
+		return -1;
 	}
 
-	unlink (backup);
-	g_free (backup);
+	/* Keep the same file size that gives twice more slots */
+	ret = rspamd_mmaped_file_rehash (pool, filename, st.st_size, st.st_size);
+
+	unlink (lock);
+	close (lock_fd);
+	g_free (lock);
 
-	return new;
+	if (ret == 0) {
+		msg_info_pool ("converted statfile %s to the current version", filename);
+	}
 
+	return ret;
 }
 
 /*
@@ -565,7 +945,7 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 	struct stat st;
 	rspamd_mmaped_file_t *new_file;
 	gchar *lock;
-	gint lock_fd;
+	gint lock_fd, ret;
 
 	lock = g_strconcat (filename, ".lock", NULL);
 	lock_fd = open (lock, O_WRONLY|O_CREAT|O_EXCL, 00600);
@@ -586,13 +966,8 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 		return NULL;
 	}
 
-	if (labs ((glong)size - st.st_size) > (long)sizeof (struct stat_file) * 2
-		&& size > sizeof (struct stat_file)) {
-		msg_warn_pool ("need to reindex statfile old size: %Hz, new size: %Hz",
-			(size_t)st.st_size, size);
-		return rspamd_mmaped_file_reindex (pool, filename, st.st_size, size, stcf);
-	}
-	else if (size < sizeof (struct stat_file)) {
+	/* Zero size means that the file is opened as is */
+	if (size != 0 && size < sizeof (struct stat_file)) {
 		msg_err_pool ("requested to shrink statfile to %Hz but it is too small",
 			size);
 	}
@@ -636,7 +1011,9 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 		return NULL;
 	}
 
-	if (rspamd_mmaped_file_check (pool, new_file) == -1) {
+	ret = rspamd_mmaped_file_check (pool, new_file);
+
+	if (ret == -1) {
 		close (new_file->fd);
 		rspamd_file_unlock (new_file->fd, FALSE);
 		munmap (new_file->map, st.st_size);
@@ -645,6 +1022,33 @@ rspamd_mmaped_file_open (rspamd_mempool_t *pool,
 	}
 
 	rspamd_file_unlock (new_file->fd, FALSE);
+
+	if (size >= sizeof (struct stat_file) &&
+			(ret == 1 || new_file->section->bits != rspamd_mmaped_file_bits (size))) {
+		if (ret == 1) {
+			msg_warn_pool ("need to convert statfile %s to the new version",
+					filename);
+		}
+		else {
+			msg_warn_pool ("need to reindex statfile old size: %Hz, new size: %Hz",
+					(size_t)st.st_size, size);
+		}
+
+		close (new_file->fd);
+		munmap (new_file->map, st.st_size);
+		g_free (new_file);
+
+		return rspamd_mmaped_file_reindex (pool, filename, st.st_size, size, stcf);
+	}
+	else if (ret == 1) {
+		msg_err_pool ("cannot convert statfile %s to %Hz", filename, size);
+		close (new_file->fd);
+		munmap (new_file->map, st.st_size);
+		g_free (new_file);
+
+		return NULL;
+	}
+
 	new_file->cf = stcf;
 	new_file->pool = pool;
 	rspamd_mmaped_file_preload (new_file);
@@ -674,10 +1078,12 @@ rspamd_mmaped_file_close_file (rspamd_mempool_t *pool,
 	return 0;
 }
 
-gint
-rspamd_mmaped_file_create (const gchar *filename,
+static gint
+rspamd_mmaped_file_create_common (const gchar *filename,
 		size_t size,
-		struct rspamd_statfile_config *stcf,
+		gconstpointer tok_conf,
+		gsize tok_conf_len,
+		guint base_bits,
 		rspamd_mempool_t *pool)
 {
 	struct stat_file_header header = {
@@ -688,25 +1094,20 @@ rspamd_mmaped_file_create (const gchar *filename,
 		.rev_time = 0,
 		.used_blocks = 0
 	};
-	struct stat_file_section section = {
-		.code = STATFILE_SECTION_COMMON,
+	struct stat_file_cuckoo_section section = {
+		.code = STATFILE_SECTION_CUCKOO,
 	};
-	struct stat_file_block block = { 0, 0, 0 };
-	struct rspamd_stat_tokenizer *tokenizer;
 	gint fd, lock_fd;
-	guint buflen = 0, nblocks;
-	gchar *buf = NULL, *lock;
+	guint64 nbuckets;
+	gsize buflen;
+	gchar *buf, *lock;
 	struct stat sb;
-	gpointer tok_conf;
-	gsize tok_conf_len;
 	struct timespec sleep_ts = {
 			.tv_sec = 0,
 			.tv_nsec = 1000000
 	};
 
-	if (size <
-		sizeof (struct stat_file_header) + sizeof (struct stat_file_section) +
-		sizeof (block)) {
+	if (size < sizeof (struct stat_file)) {
 		msg_err_pool ("file %s is too small to carry any statistic: %z",
 			filename,
 			size);
@@ -740,10 +1141,11 @@ rspamd_mmaped_file_create (const gchar *filename,
 create:
 
 	msg_debug_pool ("create statfile %s of size %l", filename, (long)size);
-	nblocks =
-		(size - sizeof (struct stat_file_header) -
-		sizeof (struct stat_file_section)) / sizeof (struct stat_file_block);
-	header.total_blocks = nblocks;
+	section.bits = rspamd_mmaped_file_bits (size);
+	section.base_bits = MIN (base_bits, section.bits);
+	nbuckets = G_GUINT64_CONSTANT (1) << section.bits;
+	section.length = nbuckets;
+	header.total_blocks = nbuckets * BUCKET_SLOTS;
 
 	if ((fd =
 		open (filename, O_RDWR | O_TRUNC | O_CREAT, S_IWUSR | S_IRUSR)) == -1) {
@@ -760,17 +1162,16 @@ create:
 
 	rspamd_fallocate (fd,
 		0,
-		sizeof (header) + sizeof (section) + sizeof (block) * nblocks);
+		sizeof (header) + sizeof (section) +
+		sizeof (struct stat_file_bucket) * nbuckets);
 
 	header.create_time = (guint64) time (NULL);
-	g_assert (stcf->clcf != NULL);
-	g_assert (stcf->clcf->tokenizer != NULL);
-	tokenizer = rspamd_stat_get_tokenizer (stcf->clcf->tokenizer->name);
-	g_assert (tokenizer != NULL);
-	tok_conf = tokenizer->get_config (pool, stcf->clcf->tokenizer, &tok_conf_len);
 	header.tokenizer_conf_len = tok_conf_len;
 	g_assert (tok_conf_len < sizeof (header.unused) - sizeof (guint64));
-	memcpy (header.unused, tok_conf, tok_conf_len);
+
+	if (tok_conf_len > 0) {
+		memcpy (header.unused, tok_conf, tok_conf_len);
+	}
 
 	if (write (fd, &header, sizeof (header)) == -1) {
 		msg_info_pool ("cannot write header to file %s, error %d, %s",
@@ -785,7 +1186,6 @@ create:
 		return -1;
 	}
 
-	section.length = (guint64) nblocks;
 	if (write (fd, &section, sizeof (section)) == -1) {
 		msg_info_pool ("cannot write section header to file %s, error %d, %s",
 			filename,
@@ -799,56 +1199,30 @@ create:
 		return -1;
 	}
 
-	/* Buffer for write 256 blocks at once */
-	if (nblocks > 256) {
-		buflen = sizeof (block) * 256;
-		buf = g_malloc0 (buflen);
-	}
+	/* Buffer for write 256 buckets at once */
+	buflen = sizeof (struct stat_file_bucket) * MIN (nbuckets, 256);
+	buf = g_malloc0 (buflen);
 
-	while (nblocks) {
-		if (nblocks > 256) {
-			/* Just write buffer */
-			if (write (fd, buf, buflen) == -1) {
-				msg_info_pool ("cannot write blocks buffer to file %s, error %d, %s",
-					filename,
-					errno,
-					strerror (errno));
-				close (fd);
-				g_free (buf);
-				unlink (lock);
-				close (lock_fd);
-				g_free (lock);
+	while (nbuckets) {
+		if (write (fd, buf, buflen) == -1) {
+			msg_info_pool ("cannot write buckets buffer to file %s, error %d, %s",
+				filename,
+				errno,
+				strerror (errno));
+			close (fd);
+			g_free (buf);
+			unlink (lock);
+			close (lock_fd);
+			g_free (lock);
 
-				return -1;
-			}
-			nblocks -= 256;
+			return -1;
 		}
-		else {
-			if (write (fd, &block, sizeof (block)) == -1) {
-				msg_info_pool ("cannot write block to file %s, error %d, %s",
-					filename,
-					errno,
-					strerror (errno));
-				close (fd);
-				if (buf) {
-					g_free (buf);
-				}
 
-				unlink (lock);
-				close (lock_fd);
-				g_free (lock);
-
-				return -1;
-			}
-			nblocks--;
-		}
+		nbuckets -= buflen / sizeof (struct stat_file_bucket);
 	}
 
 	close (fd);
-
-	if (buf) {
-		g_free (buf);
-	}
+	g_free (buf);
 
 	unlink (lock);
 	close (lock_fd);
@@ -858,6 +1232,29 @@ create:
 	return 0;
 }
 
+gint
+rspamd_mmaped_file_create (const gchar *filename,
+		size_t size,
+		struct rspamd_statfile_config *stcf,
+		rspamd_mempool_t *pool)
+{
+	struct rspamd_stat_tokenizer *tokenizer;
+	gpointer tok_conf = NULL;
+	gsize tok_conf_len = 0;
+
+	g_assert (stcf->clcf != NULL);
+
+	if (stcf->clcf->tokenizer != NULL) {
+		tokenizer = rspamd_stat_get_tokenizer (stcf->clcf->tokenizer->name);
+		g_assert (tokenizer != NULL);
+		tok_conf = tokenizer->get_config (pool, stcf->clcf->tokenizer,
+				&tok_conf_len);
+	}
+
+	return rspamd_mmaped_file_create_common (filename, size, tok_conf,
+			tok_conf_len, 32, pool);
+}
+
 gpointer
 rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx,
 		struct rspamd_config *cfg, struct rspamd_statfile *st)
@@ -937,6 +1334,38 @@ rspamd_mmaped_file_close (gpointer p)
 
 }
 
+/*
+ * Reopens a statfile that has been replaced by a reindexed one, the old
+ * mapping stays valid until then as its file is never resized
+ */
+static void
+rspamd_mmaped_file_maybe_reopen (rspamd_mmaped_file_t *mf)
+{
+	rspamd_mmaped_file_t *nf;
+	rspamd_mempool_t *pool = mf->pool;
+
+	/* Section is changed by another process */
+	if (mf->map == NULL ||
+			((volatile struct stat_file_cuckoo_section *)mf->section)->code !=
+			STATFILE_SECTION_REPLACED) {
+		return;
+	}
+
+	/* Keep the size of the new file, it is set by the process reindexed it */
+	nf = rspamd_mmaped_file_open (pool, mf->filename, 0, mf->cf);
+
+	if (nf == NULL) {
+		/* New file is likely locked, retry on the next task */
+		return;
+	}
+
+	msg_info_pool ("statfile %s has been reindexed, reopen it", mf->filename);
+	munmap (mf->map, mf->len);
+	close (mf->fd);
+	memcpy (mf, nf, sizeof (*mf));
+	g_free (nf);
+}
+
 gpointer
 rspamd_mmaped_file_runtime (struct rspamd_task *task,
 		struct rspamd_statfile_config *stcf,
@@ -945,6 +1374,10 @@ rspamd_mmaped_file_runtime (struct rspamd_task *task,
 {
 	rspamd_mmaped_file_t *mf = p;
 
+	if (mf != NULL) {
+		rspamd_mmaped_file_maybe_reopen (mf);
+	}
+
 	return (gpointer)mf;
 }
 
@@ -1069,6 +1502,8 @@ rspamd_mmaped_file_get_stat (gpointer runtime,
 				rspamd_mmaped_file_get_total (mf)), "total",  0, false);
 		ucl_object_insert_key (res, ucl_object_fromint (
 				rspamd_mmaped_file_get_used (mf)), "used", 0, false);
+		ucl_object_insert_key (res, ucl_object_fromint (mf->section->dropped),
+				"dropped", 0, false);
 		ucl_object_insert_key (res, ucl_object_fromstring (mf->cf->symbol),
 				"symbol", 0, false);
 		ucl_object_insert_key (res, ucl_object_fromstring ("mmap"),
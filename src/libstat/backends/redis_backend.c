@@ -19,11 +19,13 @@
 #include "upstream.h"
 #include "lua/lua_common.h"
 #include "libserver/mempool_vars_internal.h"
+#include "libserver/redis_pool.h"
 
 #ifdef WITH_HIREDIS
 #include "hiredis.h"
 #include "adapters/libevent.h"
 #include "ref.h"
+#include "khash.h"
 
 #define msg_debug_stat_redis(...)  rspamd_conditional_debug_fast (NULL, NULL, \
         rspamd_stat_redis_log_id, "stat_redis", task->task_pool->tag.uid, \
@@ -40,6 +42,13 @@ INIT_LOG_MODULE(stat_redis)
 #define REDIS_DEFAULT_USERS_OBJECT "%s%l%r"
 #define REDIS_DEFAULT_TIMEOUT 0.5
 #define REDIS_STAT_TIMEOUT 30
+#define REDIS_DEFAULT_TOKENS_CACHE_SIZE 65536
+#define REDIS_DEFAULT_CACHE_LEARNS_TTL 1.0
+#define REDIS_MAX_BATCH_TOKENS 16384
+
+struct rspamd_redis_tokens_cache;
+struct rspamd_redis_batch;
+struct rspamd_redis_batch_req;
 
 struct redis_stat_ctx {
 	struct rspamd_statfile_config *stcf;
@@ -56,6 +65,10 @@ struct redis_stat_ctx {
 	gboolean enable_signatures;
 	guint expiry;
 	gint cbref_user;
+	struct rspamd_redis_tokens_cache *tokens_cache;
+	gdouble batch_window;
+	struct rspamd_redis_batch *batch;
+	struct rspamd_redis_pool *pool;
 };
 
 enum rspamd_redis_connection_state {
@@ -75,9 +88,14 @@ struct redis_stat_runtime {
 	struct rspamd_statfile_config *stcf;
 	gchar *redis_object_expanded;
 	redisAsyncContext *redis;
+	GPtrArray *query_tokens;
+	struct rspamd_redis_batch_req *batch_req;
 	guint64 learned;
+	guint64 cache_obj;
+	guint32 cache_gen;
 	gint id;
 	gboolean has_event;
+	gboolean cached_only;
 	GError *err;
 };
 
@@ -343,6 +361,376 @@ rspamd_redis_expand_object (const gchar *pattern,
 	return tlen;
 }
 
+/*
+ * Token values cache shared by all workers of a node. It is allocated in the
+ * main process, so all workers map it at the same address.
+ *
+ * Entries are keyed by a statfile object (a hash of the expanded redis key and
+ * the class) and a token. Each object has a generation that is changed when
+ * the number of learns reported by redis differs from the previous one or
+ * when a task is learned by this node; entries of older generations are
+ * treated as misses. Number of learns is also cached for `learns_ttl` seconds,
+ * so tasks whose tokens are all cached do not query redis at all.
+ *
+ * Both entries and generations are protected by sequence counters: an odd
+ * value means that some process is writing the element, such elements are
+ * skipped by readers and by other writers.
+ */
+struct rspamd_redis_cache_entry {
+	gint seq;
+	guint32 gen;
+	guint64 obj;
+	guint64 token;
+	gdouble value;
+};
+
+struct rspamd_redis_cache_rev {
+	gint seq;
+	guint32 gen;
+	guint64 obj;
+	guint64 learns;
+	gdouble checked; /* When learns have been received from redis */
+};
+
+struct rspamd_redis_tokens_cache {
+	guint nentries;
+	guint nrevs;
+	gint gen;
+	gdouble learns_ttl;
+	struct rspamd_redis_cache_rev *revs;
+	struct rspamd_redis_cache_entry *entries;
+};
+
+#define REDIS_CACHE_WAYS 4
+
+static inline guint64
+rspamd_redis_cache_hash (guint64 obj, guint64 token)
+{
+	return (obj ^ token) * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15);
+}
+
+static inline gboolean
+rspamd_redis_cache_write_lock (gint *seq, gint *prev)
+{
+	gint s = g_atomic_int_get (seq);
+
+	if (s & 1) {
+		return FALSE;
+	}
+
+	*prev = s;
+
+	return g_atomic_int_compare_and_exchange (seq, s, s + 1);
+}
+
+static guint32
+rspamd_redis_cache_get_gen (struct rspamd_redis_tokens_cache *cache,
+		guint64 obj)
+{
+	struct rspamd_redis_cache_rev *rev;
+	guint32 gen = 0;
+	gint s;
+
+	rev = &cache->revs[rspamd_redis_cache_hash (obj, 0) % cache->nrevs];
+	s = g_atomic_int_get (&rev->seq);
+
+	if (!(s & 1) && rev->obj == obj) {
+		gen = rev->gen;
+
+		if (g_atomic_int_get (&rev->seq) != s) {
+			gen = 0;
+		}
+	}
+
+	return gen;
+}
+
+/* Returns TRUE if learns of the specified generation are fresh enough */
+static gboolean
+rspamd_redis_cache_get_learns (struct rspamd_redis_tokens_cache *cache,
+		guint64 obj, guint32 gen, guint64 *learns)
+{
+	struct rspamd_redis_cache_rev *rev;
+	guint64 l;
+	gdouble checked;
+	gint s;
+
+	if (gen == 0 || cache->learns_ttl <= 0) {
+		return FALSE;
+	}
+
+	rev = &cache->revs[rspamd_redis_cache_hash (obj, 0) % cache->nrevs];
+	s = g_atomic_int_get (&rev->seq);
+
+	if ((s & 1) || rev->obj != obj || rev->gen != gen) {
+		return FALSE;
+	}
+
+	l = rev->learns;
+	checked = rev->checked;
+
+	if (g_atomic_int_get (&rev->seq) != s ||
+			rspamd_get_calendar_ticks () - checked > cache->learns_ttl) {
+		return FALSE;
+	}
+
+	*learns = l;
+
+	return TRUE;
+}
+
+static void
+rspamd_redis_cache_set_learns (struct rspamd_redis_tokens_cache *cache,
+		guint64 obj, guint64 learns)
+{
+	struct rspamd_redis_cache_rev *rev;
+	gint s;
+
+	rev = &cache->revs[rspamd_redis_cache_hash (obj, 0) % cache->nrevs];
+
+	if (rspamd_redis_cache_write_lock (&rev->seq, &s)) {
+		if (rev->obj != obj || rev->learns != learns || rev->gen == 0) {
+			rev->obj = obj;
+			rev->learns = learns;
+			/* Generation 0 means no generation */
+			do {
+				rev->gen = g_atomic_int_add (&cache->gen, 1) + 1;
+			} while (rev->gen == 0);
+		}
+
+		rev->checked = rspamd_get_calendar_ticks ();
+		g_atomic_int_set (&rev->seq, s + 2);
+	}
+}
+
+static gboolean
+rspamd_redis_cache_lookup (struct rspamd_redis_tokens_cache *cache,
+		guint64 obj, guint32 gen, guint64 token, gdouble *value)
+{
+	struct rspamd_redis_cache_entry *bucket, *elt;
+	gdouble v;
+	guint i;
+	gint s;
+
+	bucket = &cache->entries[(rspamd_redis_cache_hash (obj, token) >> 32) %
+			(cache->nentries / REDIS_CACHE_WAYS) * REDIS_CACHE_WAYS];
+
+	for (i = 0; i < REDIS_CACHE_WAYS; i ++) {
+		elt = &bucket[i];
+		s = g_atomic_int_get (&elt->seq);
+
+		if (s & 1) {
+			continue;
+		}
+
+		if (elt->token == token && elt->obj == obj && elt->gen == gen) {
+			v = elt->value;
+
+			if (g_atomic_int_get (&elt->seq) == s) {
+				*value = v;
+
+				return TRUE;
+			}
+		}
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_redis_cache_insert (struct rspamd_redis_tokens_cache *cache,
+		guint64 obj, guint32 gen, guint64 token, gdouble value)
+{
+	struct rspamd_redis_cache_entry *bucket, *elt = NULL;
+	guint64 h;
+	guint i;
+	gint s;
+
+	h = rspamd_redis_cache_hash (obj, token);
+	bucket = &cache->entries[(h >> 32) %
+			(cache->nentries / REDIS_CACHE_WAYS) * REDIS_CACHE_WAYS];
+
+	for (i = 0; i < REDIS_CACHE_WAYS; i ++) {
+		if (bucket[i].token == token && bucket[i].obj == obj) {
+			elt = &bucket[i];
+			break;
+		}
+
+		if (elt == NULL && bucket[i].gen == 0) {
+			elt = &bucket[i];
+		}
+	}
+
+	if (elt == NULL) {
+		/* Evict some pseudo-random way */
+		elt = &bucket[h % REDIS_CACHE_WAYS];
+	}
+
+	if (rspamd_redis_cache_write_lock (&elt->seq, &s)) {
+		elt->obj = obj;
+		elt->token = token;
+		elt->gen = gen;
+		elt->value = value;
+		g_atomic_int_set (&elt->seq, s + 2);
+	}
+}
+
+static guint64
+rspamd_redis_cache_obj (struct redis_stat_runtime *rt)
+{
+	guint64 obj;
+
+	obj = rspamd_cryptobox_fast_hash (rt->redis_object_expanded,
+			strlen (rt->redis_object_expanded), rspamd_hash_seed ());
+	obj ^= rt->stcf->is_spam ? G_GUINT64_CONSTANT (0x5A5A5A5A5A5A5A5A) : 0;
+
+	return obj != 0 ? obj : 1;
+}
+
+/*
+ * Approximate number of bytes sent and received for a token that is not
+ * requested from redis
+ */
+static gsize
+rspamd_redis_cache_saved_bytes (struct redis_stat_runtime *rt,
+		rspamd_token_t *tok, gdouble value)
+{
+	gchar n0[512], n1[64], hdr[32];
+	gsize l0, l1, saved;
+
+	if (rt->ctx->new_schema) {
+		l0 = rspamd_snprintf (n0, sizeof (n0), "%s_%uL",
+				rt->redis_object_expanded, tok->data);
+		/* *3 HGET <key> <S|H>, +QUEUED */
+		saved = sizeof ("*3\r\n$4\r\nHGET\r\n$1\r\nS\r\n") - 1 +
+				sizeof ("+QUEUED\r\n") - 1;
+	}
+	else {
+		l0 = rspamd_snprintf (n0, sizeof (n0), "%uL", tok->data);
+		saved = 0;
+	}
+
+	if (rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER) {
+		l1 = rspamd_snprintf (n1, sizeof (n1), "%L", (gint64)value);
+	}
+	else {
+		l1 = rspamd_snprintf (n1, sizeof (n1), "%f", value);
+	}
+
+	saved += rspamd_snprintf (hdr, sizeof (hdr), "$%z\r\n", l0) + l0 + 2;
+	saved += rspamd_snprintf (hdr, sizeof (hdr), "$%z\r\n", l1) + l1 + 2;
+
+	return saved;
+}
+
+/*
+ * Fills values of the cached tokens and returns tokens that should be
+ * requested from redis
+ */
+static GPtrArray *
+rspamd_redis_cache_filter (struct rspamd_task *task,
+		struct redis_stat_runtime *rt,
+		GPtrArray *tokens)
+{
+	struct rspamd_redis_tokens_cache *cache = rt->ctx->tokens_cache;
+	struct rspamd_stat *stat = NULL;
+	GPtrArray *misses;
+	rspamd_token_t *tok;
+	gdouble value;
+	guint32 gen;
+	guint i, hits = 0;
+	guint64 saved = 0;
+
+	rt->cache_obj = rspamd_redis_cache_obj (rt);
+	/* Unknown generation means that all tokens are missing */
+	gen = rspamd_redis_cache_get_gen (cache, rt->cache_obj);
+	rt->cache_gen = gen;
+	misses = g_ptr_array_sized_new (tokens->len);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_ptr_array_free_hard, misses);
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+
+		if (gen != 0 && rspamd_redis_cache_lookup (cache, rt->cache_obj, gen,
+				tok->data, &value)) {
+			tok->values[rt->id] = value;
+			saved += rspamd_redis_cache_saved_bytes (rt, tok, value);
+			hits ++;
+		}
+		else {
+			g_ptr_array_add (misses, tok);
+		}
+	}
+
+	if (task->worker && task->worker->srv) {
+		stat = task->worker->srv->stat;
+	}
+
+	if (stat) {
+		g_atomic_int_add (&stat->bayes_cache_hits, hits);
+		g_atomic_int_add (&stat->bayes_cache_misses, misses->len);
+#ifndef HAVE_ATOMIC_BUILTINS
+		stat->bayes_cache_saved_bytes += saved;
+#else
+		__atomic_add_fetch (&stat->bayes_cache_saved_bytes,
+				saved, __ATOMIC_RELEASE);
+#endif
+	}
+
+	msg_debug_stat_redis ("found %ud of %ud tokens in cache for %s",
+			hits, tokens->len, rt->redis_object_expanded);
+
+	return misses;
+}
+
+void
+rspamd_redis_init_shared (struct rspamd_config *cfg,
+		struct rspamd_classifier_config *clcf)
+{
+	struct rspamd_redis_tokens_cache *cache;
+	struct rspamd_statfile_config *stcf;
+	const ucl_object_t *elt;
+	guint nentries = REDIS_DEFAULT_TOKENS_CACHE_SIZE;
+	gdouble learns_ttl = REDIS_DEFAULT_CACHE_LEARNS_TTL;
+	GList *cur;
+
+	elt = ucl_object_lookup (clcf->opts, "tokens_cache_size");
+
+	if (elt) {
+		nentries = ucl_object_toint (elt);
+	}
+
+	nentries = nentries / REDIS_CACHE_WAYS * REDIS_CACHE_WAYS;
+
+	if (nentries == 0) {
+		return;
+	}
+
+	cache = rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (*cache));
+	cache->nentries = nentries;
+	cache->nrevs = MAX (nentries / 16, 64);
+	elt = ucl_object_lookup (clcf->opts, "tokens_cache_learns_ttl");
+
+	if (elt) {
+		learns_ttl = ucl_object_todouble (elt);
+	}
+
+	cache->learns_ttl = learns_ttl;
+	cache->entries = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*cache->entries) * cache->nentries);
+	cache->revs = rspamd_mempool_alloc0_shared (cfg->cfg_pool,
+			sizeof (*cache->revs) * cache->nrevs);
+
+	for (cur = clcf->statfiles; cur != NULL; cur = g_list_next (cur)) {
+		stcf = cur->data;
+		stcf->data = cache;
+	}
+
+	msg_info_config ("use shared cache of %ud tokens for %s classifier",
+			nentries, clcf->name);
+}
+
 static void
 rspamd_redis_maybe_auth (struct redis_stat_ctx *ctx, redisAsyncContext *redis)
 {
@@ -1054,6 +1442,44 @@ rspamd_redis_timeout (gint fd, short what, gpointer d)
 	}
 }
 
+static void
+rspamd_redis_set_learned (struct redis_stat_runtime *rt, redisReply *reply)
+{
+	struct rspamd_task *task = rt->task;
+	glong val = 0;
+
+	if (G_UNLIKELY (reply->type == REDIS_REPLY_INTEGER)) {
+		val = reply->integer;
+	}
+	else if (reply->type == REDIS_REPLY_STRING) {
+		rspamd_strtol (reply->str, reply->len, &val);
+	}
+	else {
+		if (reply->type != REDIS_REPLY_NIL) {
+			msg_err_task ("bad learned type for %s: %s, nil expected",
+				rt->stcf->symbol,
+				rspamd_redis_type_to_string (reply->type));
+		}
+
+		val = 0;
+	}
+
+	if (val < 0) {
+		msg_warn_task ("invalid number of learns for %s: %L",
+				rt->stcf->symbol, val);
+		val = 0;
+	}
+
+	rt->learned = val;
+	msg_debug_stat_redis ("connected to redis server, tokens learned for %s: %uL",
+			rt->redis_object_expanded, rt->learned);
+
+	if (rt->ctx->tokens_cache) {
+		rspamd_redis_cache_set_learns (rt->ctx->tokens_cache,
+				rt->cache_obj, rt->learned);
+	}
+}
+
 /* Called when we have connected to the redis server and got stats */
 static void
 rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
@@ -1061,37 +1487,12 @@ rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
 	redisReply *reply = r;
 	struct rspamd_task *task;
-	glong val = 0;
 
 	task = rt->task;
 
 	if (c->err == 0) {
 		if (r != NULL) {
-			if (G_UNLIKELY (reply->type == REDIS_REPLY_INTEGER)) {
-				val = reply->integer;
-			}
-			else if (reply->type == REDIS_REPLY_STRING) {
-				rspamd_strtol (reply->str, reply->len, &val);
-			}
-			else {
-				if (reply->type != REDIS_REPLY_NIL) {
-					msg_err_task ("bad learned type for %s: %s, nil expected",
-						rt->stcf->symbol,
-						rspamd_redis_type_to_string (reply->type));
-				}
-
-				val = 0;
-			}
-
-			if (val < 0) {
-				msg_warn_task ("invalid number of learns for %s: %L",
-						rt->stcf->symbol, val);
-				val = 0;
-			}
-
-			rt->learned = val;
-			msg_debug_stat_redis ("connected to redis server, tokens learned for %s: %uL",
-					rt->redis_object_expanded, rt->learned);
+			rspamd_redis_set_learned (rt, reply);
 			rspamd_upstream_ok (rt->selected);
 		}
 	}
@@ -1107,6 +1508,39 @@ rspamd_redis_connected (redisAsyncContext *c, gpointer r, gpointer priv)
 		}
 	}
 
+	if (rt->cached_only && rt->has_event) {
+		/* No tokens have been requested */
+		rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
+	}
+}
+
+/* Returns TRUE if a token has been found */
+static gboolean
+rspamd_redis_reply_to_value (struct redis_stat_runtime *rt, redisReply *elt,
+		gdouble *value)
+{
+	gulong val;
+
+	if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
+		*value = elt->integer;
+
+		return TRUE;
+	}
+	else if (elt->type == REDIS_REPLY_STRING) {
+		if (rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER) {
+			rspamd_strtoul (elt->str, elt->len, &val);
+			*value = val;
+		}
+		else {
+			*value = strtod (elt->str, NULL);
+		}
+
+		return TRUE;
+	}
+
+	*value = 0;
+
+	return FALSE;
 }
 
 /* Called when we have received tokens values from redis */
@@ -1114,43 +1548,38 @@ static void
 rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (priv);
-	redisReply *reply = r, *elt;
+	redisReply *reply = r;
 	struct rspamd_task *task;
 	rspamd_token_t *tok;
+	GPtrArray *tokens;
 	guint i, processed = 0, found = 0;
-	gulong val;
-	gdouble float_val;
+	guint32 gen = 0;
 
 	task = rt->task;
+	tokens = rt->query_tokens;
 
 	if (c->err == 0) {
 		if (r != NULL) {
 			if (reply->type == REDIS_REPLY_ARRAY) {
 
-				if (reply->elements == task->tokens->len) {
+				if (rt->ctx->tokens_cache) {
+					gen = rspamd_redis_cache_get_gen (rt->ctx->tokens_cache,
+							rt->cache_obj);
+				}
+
+				if (reply->elements == tokens->len) {
 					for (i = 0; i < reply->elements; i ++) {
-						tok = g_ptr_array_index (task->tokens, i);
-						elt = reply->element[i];
+						tok = g_ptr_array_index (tokens, i);
 
-						if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
-							tok->values[rt->id] = elt->integer;
+						if (rspamd_redis_reply_to_value (rt, reply->element[i],
+								&tok->values[rt->id])) {
 							found ++;
 						}
-						else if (elt->type == REDIS_REPLY_STRING) {
-							if (rt->stcf->clcf->flags &
-									RSPAMD_FLAG_CLASSIFIER_INTEGER) {
-								rspamd_strtoul (elt->str, elt->len, &val);
-								tok->values[rt->id] = val;
-							}
-							else {
-								float_val = strtod (elt->str, NULL);
-								tok->values[rt->id] = float_val;
-							}
 
-							found ++;
-						}
-						else {
-							tok->values[rt->id] = 0;
+						if (gen != 0 && tok->values[rt->id] != 0) {
+							rspamd_redis_cache_insert (rt->ctx->tokens_cache,
+									rt->cache_obj, gen, tok->data,
+									tok->values[rt->id]);
 						}
 
 						processed ++;
@@ -1167,7 +1596,7 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 					msg_err_task_check ("got invalid length of reply vector from redis: "
 							"%d, expected: %d",
 							(gint)reply->elements,
-							(gint)task->tokens->len);
+							(gint)tokens->len);
 				}
 			}
 			else {
@@ -1211,6 +1640,12 @@ rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
 
 	if (c->err == 0) {
 		rspamd_upstream_ok (rt->selected);
+
+		if (rt->ctx->tokens_cache) {
+			/* Invalidate cached values of this statfile */
+			rspamd_redis_cache_set_learns (rt->ctx->tokens_cache,
+					rspamd_redis_cache_obj (rt), G_MAXUINT64);
+		}
 	}
 	else {
 		msg_err_task_check ("error getting reply from redis server %s: %s",
@@ -1232,6 +1667,541 @@ rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 }
 
+/*
+ * Lookups of concurrent tasks are collected for batch_window seconds and then
+ * sent using a single pooled connection. Tokens that are requested by several
+ * tasks for the same redis object are requested just once.
+ *
+ * Batching is disabled by default: each task waits up to batch_window more,
+ * and whether fewer requests pay for it depends on the load and the redis
+ * setup, so it should be checked with rspamd-redis-stat-bench first.
+ */
+KHASH_MAP_INIT_INT64 (rspamd_redis_batch_tokens, guint);
+
+struct rspamd_redis_batch;
+
+struct rspamd_redis_batch_req {
+	struct redis_stat_runtime *rt;      /* NULL if the task has gone */
+	GPtrArray *tokens;
+	ref_entry_t ref;
+};
+
+struct rspamd_redis_batch_obj {
+	struct rspamd_redis_batch *batch;
+	gchar *name;
+	khash_t(rspamd_redis_batch_tokens) *tokens;
+	GArray *uniq;
+	GPtrArray *reqs;
+};
+
+struct rspamd_redis_batch {
+	struct redis_stat_ctx *ctx;
+	struct event_base *ev_base;
+	struct event ev;
+	struct upstream *selected;
+	redisAsyncContext *redis;
+	GHashTable *objects;
+	guint npending;
+	guint ntokens;
+	guint nreqs;
+	gboolean timed_out;
+};
+
+static void
+rspamd_redis_batch_req_dtor (struct rspamd_redis_batch_req *req)
+{
+	g_free (req);
+}
+
+static void
+rspamd_redis_batch_req_detach (gpointer p)
+{
+	struct rspamd_redis_batch_req *req = p;
+
+	req->rt = NULL;
+	REF_RELEASE (req);
+}
+
+static void
+rspamd_redis_batch_obj_free (gpointer p)
+{
+	struct rspamd_redis_batch_obj *obj = p;
+	guint i;
+
+	for (i = 0; i < obj->reqs->len; i ++) {
+		struct rspamd_redis_batch_req *req = g_ptr_array_index (obj->reqs, i);
+
+		REF_RELEASE (req);
+	}
+
+	kh_destroy (rspamd_redis_batch_tokens, obj->tokens);
+	g_array_free (obj->uniq, TRUE);
+	g_ptr_array_free (obj->reqs, TRUE);
+	g_free (obj->name);
+	g_free (obj);
+}
+
+static void
+rspamd_redis_batch_free (struct rspamd_redis_batch *batch, gboolean is_fatal)
+{
+	redisAsyncContext *redis;
+
+	if (batch->ctx->batch == batch) {
+		batch->ctx->batch = NULL;
+	}
+
+	if (event_get_base (&batch->ev)) {
+		event_del (&batch->ev);
+	}
+
+	if (batch->redis) {
+		redis = batch->redis;
+		batch->redis = NULL;
+		rspamd_redis_pool_release_connection (batch->ctx->pool, redis, is_fatal);
+	}
+
+	g_hash_table_unref (batch->objects);
+	g_free (batch);
+}
+
+static void
+rspamd_redis_batch_unref (struct rspamd_redis_batch *batch)
+{
+	g_assert (batch->npending > 0);
+
+	if (--batch->npending == 0) {
+		rspamd_redis_batch_free (batch, batch->timed_out);
+	}
+}
+
+/* Fails all tasks that are still waiting for a batch object */
+static void
+rspamd_redis_batch_obj_fail (struct rspamd_redis_batch_obj *obj, gint code,
+		const gchar *errstr)
+{
+	struct rspamd_redis_batch_req *req;
+	struct redis_stat_runtime *rt;
+	guint i;
+
+	for (i = 0; i < obj->reqs->len; i ++) {
+		req = g_ptr_array_index (obj->reqs, i);
+		rt = req->rt;
+
+		if (rt == NULL) {
+			continue;
+		}
+
+		req->rt = NULL;
+		rt->batch_req = NULL;
+
+		if (!rt->err) {
+			g_set_error (&rt->err, rspamd_redis_stat_quark (), code,
+					"cannot get values: error getting reply from redis "
+					"server %s: %s",
+					obj->batch->selected ?
+					rspamd_upstream_name (obj->batch->selected) : "none",
+					errstr);
+		}
+
+		if (rt->has_event) {
+			rspamd_session_remove_event (rt->task->s, rspamd_redis_fin, rt);
+		}
+	}
+}
+
+static void
+rspamd_redis_batch_learns (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_batch_obj *obj = priv;
+	struct rspamd_redis_batch *batch = obj->batch;
+	struct rspamd_redis_batch_req *req;
+	redisReply *reply = r;
+	guint i;
+
+	if (c->err == 0 && r != NULL) {
+		for (i = 0; i < obj->reqs->len; i ++) {
+			req = g_ptr_array_index (obj->reqs, i);
+
+			if (req->rt) {
+				rspamd_redis_set_learned (req->rt, reply);
+			}
+		}
+
+		if (obj->uniq->len == 0) {
+			/* All tokens have been found in the cache */
+			for (i = 0; i < obj->reqs->len; i ++) {
+				req = g_ptr_array_index (obj->reqs, i);
+
+				if (req->rt) {
+					struct redis_stat_runtime *rt = req->rt;
+
+					req->rt = NULL;
+					rt->batch_req = NULL;
+
+					if (rt->has_event) {
+						rspamd_session_remove_event (rt->task->s,
+								rspamd_redis_fin, rt);
+					}
+				}
+			}
+		}
+	}
+	else {
+		rspamd_redis_batch_obj_fail (obj, c->err, c->errstr);
+	}
+
+	rspamd_redis_batch_unref (batch);
+}
+
+static void
+rspamd_redis_batch_processed (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_batch_obj *obj = priv;
+	struct rspamd_redis_batch *batch = obj->batch;
+	struct rspamd_redis_batch_req *req;
+	struct redis_stat_runtime *rt;
+	struct rspamd_task *task;
+	redisReply *reply = r;
+	rspamd_token_t *tok;
+	khiter_t k;
+	guint i, j, idx;
+	guint32 gen = 0;
+
+	if (c->err != 0 || r == NULL) {
+		rspamd_redis_batch_obj_fail (obj, c->err, c->errstr);
+		rspamd_redis_batch_unref (batch);
+
+		return;
+	}
+
+	if (reply->type != REDIS_REPLY_ARRAY ||
+			reply->elements != obj->uniq->len) {
+		msg_err ("got invalid reply from redis for %s: %s, array of %ud "
+				"elements expected", obj->name,
+				rspamd_redis_type_to_string (reply->type), obj->uniq->len);
+		rspamd_redis_batch_obj_fail (obj, EINVAL, "invalid reply");
+		rspamd_redis_batch_unref (batch);
+
+		return;
+	}
+
+	rspamd_upstream_ok (batch->selected);
+
+	for (i = 0; i < obj->reqs->len; i ++) {
+		req = g_ptr_array_index (obj->reqs, i);
+		rt = req->rt;
+
+		if (rt == NULL) {
+			continue;
+		}
+
+		task = rt->task;
+
+		if (rt->ctx->tokens_cache && gen == 0) {
+			gen = rspamd_redis_cache_get_gen (rt->ctx->tokens_cache,
+					rt->cache_obj);
+		}
+
+		for (j = 0; j < req->tokens->len; j ++) {
+			tok = g_ptr_array_index (req->tokens, j);
+			k = kh_get (rspamd_redis_batch_tokens, obj->tokens, tok->data);
+			g_assert (k != kh_end (obj->tokens));
+			idx = kh_value (obj->tokens, k);
+
+			rspamd_redis_reply_to_value (rt, reply->element[idx],
+					&tok->values[rt->id]);
+
+			if (gen != 0 && tok->values[rt->id] != 0) {
+				rspamd_redis_cache_insert (rt->ctx->tokens_cache,
+						rt->cache_obj, gen, tok->data, tok->values[rt->id]);
+			}
+		}
+
+		if (rt->stcf->is_spam) {
+			task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+		}
+		else {
+			task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+		}
+
+		msg_debug_stat_redis ("received %ud tokens for %s in a batch of %ud "
+				"tokens", req->tokens->len, rt->redis_object_expanded,
+				obj->uniq->len);
+		req->rt = NULL;
+		rt->batch_req = NULL;
+
+		if (rt->has_event) {
+			rspamd_session_remove_event (task->s, rspamd_redis_fin, rt);
+		}
+	}
+
+	rspamd_redis_batch_unref (batch);
+}
+
+static void
+rspamd_redis_batch_timeout (gint fd, short what, gpointer d)
+{
+	struct rspamd_redis_batch *batch = d;
+	GHashTableIter it;
+	gpointer v;
+
+	msg_err ("connection to redis server %s timed out",
+			rspamd_upstream_name (batch->selected));
+	rspamd_upstream_fail (batch->selected, FALSE);
+
+	g_hash_table_iter_init (&it, batch->objects);
+
+	while (g_hash_table_iter_next (&it, NULL, &v)) {
+		rspamd_redis_batch_obj_fail (v, ETIMEDOUT, "timeout");
+	}
+
+	batch->timed_out = TRUE;
+
+	if (batch->redis) {
+		redisAsyncContext *redis = batch->redis;
+
+		/*
+		 * Pending callbacks are called with an error while the connection is
+		 * being closed, the last of them frees the batch
+		 */
+		batch->redis = NULL;
+		rspamd_redis_pool_release_connection (batch->ctx->pool, redis, TRUE);
+	}
+}
+
+static gboolean
+rspamd_redis_batch_send_obj (struct rspamd_redis_batch *batch,
+		struct rspamd_redis_batch_obj *obj)
+{
+	struct redis_stat_ctx *ctx = batch->ctx;
+	rspamd_fstring_t *out;
+	const gchar *learned_key = "learns";
+	gchar n0[512];
+	guint i, l0, prefix_len;
+	guint64 token;
+	gint ret;
+
+	if (ctx->new_schema) {
+		learned_key = ctx->stcf->is_spam ? "learns_spam" : "learns_ham";
+	}
+
+	if (redisAsyncCommand (batch->redis, rspamd_redis_batch_learns, obj,
+			"HGET %s %s", obj->name, learned_key) != REDIS_OK) {
+		return FALSE;
+	}
+
+	batch->npending ++;
+
+	if (obj->uniq->len == 0) {
+		return TRUE;
+	}
+
+	prefix_len = strlen (obj->name);
+	out = rspamd_fstring_sized_new (obj->uniq->len * 24 + 64);
+
+	if (ctx->new_schema) {
+		/* Multi + HGET for each token */
+		redisAsyncCommand (batch->redis, NULL, NULL, "MULTI");
+
+		for (i = 0; i < obj->uniq->len; i ++) {
+			token = g_array_index (obj->uniq, guint64, i);
+			l0 = rspamd_snprintf (n0, sizeof (n0), "%*s_%uL",
+					prefix_len, obj->name, token);
+			out->len = 0;
+			rspamd_printf_fstring (&out, ""
+							"*3\r\n"
+							"$4\r\n"
+							"HGET\r\n"
+							"$%d\r\n"
+							"%s\r\n"
+							"$1\r\n"
+							"%s\r\n",
+					l0, n0,
+					ctx->stcf->is_spam ? "S" : "H");
+			redisAsyncFormattedCommand (batch->redis, NULL, NULL,
+					out->str, out->len);
+		}
+
+		ret = redisAsyncCommand (batch->redis, rspamd_redis_batch_processed,
+				obj, "EXEC");
+	}
+	else {
+		rspamd_printf_fstring (&out, ""
+						"*%d\r\n"
+						"$5\r\n"
+						"HMGET\r\n"
+						"$%d\r\n"
+						"%s\r\n",
+				obj->uniq->len + 2,
+				prefix_len, obj->name);
+
+		for (i = 0; i < obj->uniq->len; i ++) {
+			token = g_array_index (obj->uniq, guint64, i);
+			l0 = rspamd_snprintf (n0, sizeof (n0), "%uL", token);
+			rspamd_printf_fstring (&out, ""
+							"$%d\r\n"
+							"%s\r\n", l0, n0);
+		}
+
+		ret = redisAsyncFormattedCommand (batch->redis,
+				rspamd_redis_batch_processed, obj, out->str, out->len);
+	}
+
+	rspamd_fstring_free (out);
+
+	if (ret != REDIS_OK) {
+		return FALSE;
+	}
+
+	batch->npending ++;
+
+	return TRUE;
+}
+
+static void
+rspamd_redis_batch_flush (gint fd, short what, gpointer d)
+{
+	struct rspamd_redis_batch *batch = d;
+	struct redis_stat_ctx *ctx = batch->ctx;
+	rspamd_inet_addr_t *addr;
+	GHashTableIter it;
+	struct timeval tv;
+	gpointer v;
+
+	if (ctx->batch == batch) {
+		ctx->batch = NULL;
+	}
+
+	batch->selected = rspamd_upstream_get (ctx->read_servers,
+			RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL,
+			0);
+
+	if (batch->selected == NULL) {
+		msg_err ("no upstreams reachable");
+		goto err;
+	}
+
+	addr = rspamd_upstream_addr (batch->selected);
+	g_assert (addr != NULL);
+	batch->redis = rspamd_redis_pool_connect (ctx->pool,
+			ctx->dbname, ctx->password,
+			rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+	if (batch->redis == NULL) {
+		msg_err ("cannot connect to redis server %s",
+				rspamd_upstream_name (batch->selected));
+		rspamd_upstream_fail (batch->selected, TRUE);
+		goto err;
+	}
+
+	/* Keep the batch alive while commands are being queued */
+	batch->npending = 1;
+	g_hash_table_iter_init (&it, batch->objects);
+
+	while (g_hash_table_iter_next (&it, NULL, &v)) {
+		if (!rspamd_redis_batch_send_obj (batch, v)) {
+			msg_err ("call to redis failed: %s", batch->redis->errstr);
+			rspamd_redis_batch_obj_fail (v, EINVAL, batch->redis->errstr);
+		}
+	}
+
+	msg_debug ("sent %ud tokens of %ud tasks to redis server %s",
+			batch->ntokens, batch->nreqs,
+			rspamd_upstream_name (batch->selected));
+
+	event_set (&batch->ev, -1, EV_TIMEOUT, rspamd_redis_batch_timeout, batch);
+	event_base_set (batch->ev_base, &batch->ev);
+	double_to_tv (ctx->timeout, &tv);
+	event_add (&batch->ev, &tv);
+	rspamd_redis_batch_unref (batch);
+
+	return;
+
+err:
+	g_hash_table_iter_init (&it, batch->objects);
+
+	while (g_hash_table_iter_next (&it, NULL, &v)) {
+		rspamd_redis_batch_obj_fail (v, ECONNREFUSED, "cannot connect");
+	}
+
+	rspamd_redis_batch_free (batch, TRUE);
+}
+
+static gboolean
+rspamd_redis_batch_add (struct rspamd_task *task,
+		struct redis_stat_runtime *rt)
+{
+	struct redis_stat_ctx *ctx = rt->ctx;
+	struct rspamd_redis_batch *batch = ctx->batch;
+	struct rspamd_redis_batch_obj *obj;
+	struct rspamd_redis_batch_req *req;
+	rspamd_token_t *tok;
+	struct timeval tv;
+	khiter_t k;
+	guint i;
+	gint r;
+
+	if (batch == NULL) {
+		batch = g_malloc0 (sizeof (*batch));
+		batch->ctx = ctx;
+		batch->ev_base = task->ev_base;
+		batch->objects = g_hash_table_new_full (rspamd_str_hash,
+				rspamd_str_equal, NULL, rspamd_redis_batch_obj_free);
+		ctx->batch = batch;
+
+		event_set (&batch->ev, -1, EV_TIMEOUT, rspamd_redis_batch_flush,
+				batch);
+		event_base_set (batch->ev_base, &batch->ev);
+		double_to_tv (ctx->batch_window, &tv);
+		event_add (&batch->ev, &tv);
+	}
+
+	obj = g_hash_table_lookup (batch->objects, rt->redis_object_expanded);
+
+	if (obj == NULL) {
+		obj = g_malloc0 (sizeof (*obj));
+		obj->batch = batch;
+		obj->name = g_strdup (rt->redis_object_expanded);
+		obj->tokens = kh_init (rspamd_redis_batch_tokens);
+		obj->uniq = g_array_sized_new (FALSE, FALSE, sizeof (guint64),
+				rt->query_tokens->len);
+		obj->reqs = g_ptr_array_new ();
+		g_hash_table_insert (batch->objects, obj->name, obj);
+	}
+
+	for (i = 0; i < rt->query_tokens->len; i ++) {
+		tok = g_ptr_array_index (rt->query_tokens, i);
+		k = kh_put (rspamd_redis_batch_tokens, obj->tokens, tok->data, &r);
+
+		if (r != 0) {
+			kh_value (obj->tokens, k) = obj->uniq->len;
+			g_array_append_val (obj->uniq, tok->data);
+			batch->ntokens ++;
+		}
+	}
+
+	/* Referenced by both the batch and the task */
+	req = g_malloc0 (sizeof (*req));
+	REF_INIT_RETAIN (req, rspamd_redis_batch_req_dtor);
+	REF_RETAIN (req);
+	req->rt = rt;
+	req->tokens = rt->query_tokens;
+	rt->batch_req = req;
+	g_ptr_array_add (obj->reqs, req);
+	batch->nreqs ++;
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_redis_batch_req_detach, req);
+
+	if (batch->ntokens >= REDIS_MAX_BATCH_TOKENS) {
+		event_del (&batch->ev);
+		rspamd_redis_batch_flush (-1, EV_TIMEOUT, batch);
+	}
+
+	return TRUE;
+}
+
 static gboolean
 rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 		const ucl_object_t *obj,
@@ -1403,6 +2373,14 @@ rspamd_redis_parse_classifier_opts (struct redis_stat_ctx *backend,
 	else {
 		backend->expiry = 0;
 	}
+
+	elt = ucl_object_lookup (obj, "batch_window");
+	if (elt) {
+		backend->batch_window = ucl_object_todouble (elt);
+	}
+	else {
+		backend->batch_window = 0;
+	}
 }
 
 gpointer
@@ -1463,6 +2441,9 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 	rspamd_redis_parse_classifier_opts (backend, st->classifier->cfg->opts, cfg);
 	stf->clcf->flags |= RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
 	backend->stcf = stf;
+	/* Allocated by rspamd_redis_init_shared in the main process */
+	backend->tokens_cache = stf->data;
+	backend->pool = cfg->redis_pool;
 
 	st_elt = g_malloc0 (sizeof (*st_elt));
 	st_elt->ev_base = ctx->ev_base;
@@ -1523,6 +2504,11 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	rt->ctx = ctx;
 	rt->stcf = stcf;
 
+	if (!learn && ctx->batch_window > 0) {
+		/* Connection is established when a batch is sent */
+		return rt;
+	}
+
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
 
@@ -1550,6 +2536,10 @@ rspamd_redis_close (gpointer p)
 {
 	struct redis_stat_ctx *ctx = REDIS_CTX (p);
 
+	if (ctx->batch) {
+		rspamd_redis_batch_free (ctx->batch, TRUE);
+	}
+
 	if (ctx->read_servers) {
 		rspamd_upstreams_destroy (ctx->read_servers);
 	}
@@ -1576,11 +2566,16 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 		return FALSE;
 	}
 
-	if (tokens == NULL || tokens->len == 0 || rt->redis == NULL) {
+	if (tokens == NULL || tokens->len == 0) {
+		return FALSE;
+	}
+
+	if (rt->redis == NULL && rt->ctx->batch_window <= 0) {
 		return FALSE;
 	}
 
 	rt->id = id;
+	rt->query_tokens = tokens;
 
 	if (rt->ctx->new_schema) {
 		if (rt->ctx->stcf->is_spam) {
@@ -1591,6 +2586,41 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 		}
 	}
 
+	if (rt->ctx->tokens_cache) {
+		rt->query_tokens = rspamd_redis_cache_filter (task, rt, tokens);
+
+		if (rt->query_tokens->len == 0) {
+			rt->cached_only = TRUE;
+
+			if (rt->stcf->is_spam) {
+				task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+			}
+			else {
+				task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+			}
+
+			/*
+			 * Learns are requested to check cached values unless they have
+			 * been received recently for the same generation
+			 */
+			if (rspamd_redis_cache_get_learns (rt->ctx->tokens_cache,
+					rt->cache_obj, rt->cache_gen, &rt->learned)) {
+				msg_debug_stat_redis ("all tokens and learns for %s are cached",
+						rt->redis_object_expanded);
+
+				return TRUE;
+			}
+		}
+	}
+
+	if (rt->ctx->batch_window > 0) {
+		rspamd_session_add_event (task->s, rspamd_redis_fin, rt,
+				rspamd_redis_stat_quark ());
+		rt->has_event = TRUE;
+
+		return rspamd_redis_batch_add (task, rt);
+	}
+
 	if (redisAsyncCommand (rt->redis, rspamd_redis_connected, rt, "HGET %s %s",
 			rt->redis_object_expanded, learned_key) == REDIS_OK) {
 
@@ -1606,7 +2636,11 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 		double_to_tv (rt->ctx->timeout, &tv);
 		event_add (&rt->timeout_event, &tv);
 
-		query = rspamd_redis_tokens_to_query (task, rt, tokens,
+		if (rt->cached_only) {
+			return TRUE;
+		}
+
+		query = rspamd_redis_tokens_to_query (task, rt, rt->query_tokens,
 				rt->ctx->new_schema ? "HGET" : "HMGET",
 				rt->redis_object_expanded, FALSE, -1,
 				rt->stcf->clcf->flags & RSPAMD_FLAG_CLASSIFIER_INTEGER);
@@ -1663,7 +2697,9 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	rspamd_fstring_t *query;
 	const gchar *redis_cmd;
 	rspamd_token_t *tok;
-	gint ret;
+	gint64 *plearns, learns;
+	gchar nbuf[32];
+	gint ret, nlen;
 	goffset off;
 	const gchar *learned_key = "learns";
 
@@ -1736,43 +2772,35 @@ rspamd_redis_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 	/*
 	 * XXX:
 	 * Dirty hack: we get a token and check if it's value is -1 or 1, so
-	 * we could understand that we are learning or unlearning
+	 * we could understand that we are learning or unlearning, unless
+	 * learns of several messages are written at once
 	 */
+	plearns = rspamd_mempool_get_variable (task->task_pool, "stat_learns");
 
-	tok = g_ptr_array_index (task->tokens, 0);
-
-	if (tok->values[id] > 0) {
-		rspamd_printf_fstring (&query, ""
-				"*4\r\n"
-				"$7\r\n"
-				"HINCRBY\r\n"
-				"$%d\r\n"
-				"%s\r\n"
-				"$%d\r\n"
-				"%s\r\n" /* Learned key */
-				"$1\r\n"
-				"1\r\n",
-				(gint)strlen (rt->redis_object_expanded),
-				rt->redis_object_expanded,
-				(gint)strlen (learned_key),
-				learned_key);
+	if (plearns) {
+		learns = *plearns;
 	}
 	else {
-		rspamd_printf_fstring (&query, ""
-				"*4\r\n"
-				"$7\r\n"
-				"HINCRBY\r\n"
-				"$%d\r\n"
-				"%s\r\n"
-				"$%d\r\n"
-				"%s\r\n" /* Learned key */
-				"$2\r\n"
-				"-1\r\n",
-				(gint)strlen (rt->redis_object_expanded),
-				rt->redis_object_expanded,
-				(gint)strlen (learned_key),
-				learned_key);
-	}
+		tok = g_ptr_array_index (task->tokens, 0);
+		learns = tok->values[id] > 0 ? 1 : -1;
+	}
+
+	nlen = rspamd_snprintf (nbuf, sizeof (nbuf), "%L", learns);
+	rspamd_printf_fstring (&query, ""
+			"*4\r\n"
+			"$7\r\n"
+			"HINCRBY\r\n"
+			"$%d\r\n"
+			"%s\r\n"
+			"$%d\r\n"
+			"%s\r\n" /* Learned key */
+			"$%d\r\n"
+			"%s\r\n",
+			(gint)strlen (rt->redis_object_expanded),
+			rt->redis_object_expanded,
+			(gint)strlen (learned_key),
+			learned_key,
+			nlen, nbuf);
 
 	ret = redisAsyncFormattedCommand (rt->redis, NULL, NULL,
 			query->str, query->len);
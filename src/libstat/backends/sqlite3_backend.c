@@ -21,10 +21,15 @@
 #include "libmime/message.h"
 #include "lua/lua_common.h"
 #include "unix-std.h"
+#include "khash.h"
 
 #define SQLITE3_BACKEND_TYPE "sqlite3"
 #define SQLITE3_SCHEMA_VERSION "1"
 #define SQLITE3_DEFAULT "default"
+/* Rows inserted into the task tokens table by a single statement */
+#define SQLITE3_TOKENS_CHUNK 128
+/* Maximum number of cached users and languages ids */
+#define SQLITE3_MAX_CACHED_IDS 8192
 
 struct rspamd_stat_sqlite3_db {
 	sqlite3 *sqlite;
@@ -37,6 +42,10 @@ struct rspamd_stat_sqlite3_db {
 	gboolean enable_languages;
 	gint cbref_user;
 	gint cbref_language;
+	sqlite3_stmt *insert_tokens_stmt;
+	sqlite3_stmt *get_tokens_stmt;
+	GHashTable *users_cache;
+	GHashTable *languages_cache;
 };
 
 struct rspamd_stat_sqlite3_rt {
@@ -47,6 +56,8 @@ struct rspamd_stat_sqlite3_rt {
 	gint64 lang_id;
 };
 
+KHASH_MAP_INIT_INT64 (rspamd_sqlite3_tokens, gint64);
+
 static const char *create_tables_sql =
 		"BEGIN IMMEDIATE;"
 		"CREATE TABLE tokenizer(data BLOB);"
@@ -76,6 +87,23 @@ static const char *create_tables_sql =
 		"INSERT INTO languages(id, name, learns) VALUES(0, '" SQLITE3_DEFAULT "',0);"
 		"COMMIT;";
 
+/*
+ * Tokens of the current task, lookups and learns are done by joining it
+ * with the tokens table. Temporary tables are private for a connection.
+ */
+static const char *create_temp_tables_sql =
+		"CREATE TEMP TABLE IF NOT EXISTS task_tokens("
+		"token INTEGER PRIMARY KEY,"
+		"value INTEGER"
+		");";
+
+/* CROSS JOIN forces lookups in tokens table instead of its full scan */
+static const char *get_tokens_sql =
+		"SELECT task_tokens.token, tokens.value FROM task_tokens "
+		"CROSS JOIN tokens ON tokens.token=task_tokens.token "
+		"WHERE tokens.user=?1 AND (tokens.language=?2 OR tokens.language=0) "
+		"ORDER BY tokens.language;";
+
 enum rspamd_stat_sqlite3_stmt_idx {
 	RSPAMD_STAT_BACKEND_TRANSACTION_START_IM = 0,
 	RSPAMD_STAT_BACKEND_TRANSACTION_START_DEF,
@@ -96,6 +124,9 @@ enum rspamd_stat_sqlite3_stmt_idx {
 	RSPAMD_STAT_BACKEND_NTOKENS,
 	RSPAMD_STAT_BACKEND_NLANGUAGES,
 	RSPAMD_STAT_BACKEND_NUSERS,
+	RSPAMD_STAT_BACKEND_CLEAR_TASK_TOKENS,
+	RSPAMD_STAT_BACKEND_INSERT_TASK_TOKEN,
+	RSPAMD_STAT_BACKEND_SET_TASK_TOKENS,
 	RSPAMD_STAT_BACKEND_MAX
 };
 
@@ -278,6 +309,36 @@ static struct rspamd_sqlite3_prstmt prepared_stmts[RSPAMD_STAT_BACKEND_MAX] =
 		.result = SQLITE_ROW,
 		.flags = 0,
 		.ret = "I"
+	},
+	[RSPAMD_STAT_BACKEND_CLEAR_TASK_TOKENS] = {
+		.idx = RSPAMD_STAT_BACKEND_CLEAR_TASK_TOKENS,
+		.sql = "DELETE FROM task_tokens;",
+		.stmt = NULL,
+		.args = "",
+		.result = SQLITE_DONE,
+		.flags = 0,
+		.ret = ""
+	},
+	[RSPAMD_STAT_BACKEND_INSERT_TASK_TOKEN] = {
+		.idx = RSPAMD_STAT_BACKEND_INSERT_TASK_TOKEN,
+		.sql = "INSERT OR REPLACE INTO task_tokens (token, value) "
+				"VALUES (?1, ?2);",
+		.stmt = NULL,
+		.args = "II",
+		.result = SQLITE_DONE,
+		.flags = 0,
+		.ret = ""
+	},
+	[RSPAMD_STAT_BACKEND_SET_TASK_TOKENS] = {
+		.idx = RSPAMD_STAT_BACKEND_SET_TASK_TOKENS,
+		.sql = "INSERT OR REPLACE INTO tokens (token, user, language, value, modified) "
+				"SELECT token, ?1, ?2, value, strftime('%s','now') "
+				"FROM task_tokens;",
+		.stmt = NULL,
+		.args = "II",
+		.result = SQLITE_DONE,
+		.flags = 0,
+		.ret = ""
 	}
 };
 
@@ -287,21 +348,73 @@ rspamd_sqlite3_backend_quark (void)
 	return g_quark_from_static_string ("sqlite3-stat-backend");
 }
 
+static gboolean
+rspamd_sqlite3_get_cached_id (GHashTable *cache, const gchar *name, gint64 *id)
+{
+	gint64 *pid;
+
+	pid = g_hash_table_lookup (cache, name);
+
+	if (pid != NULL) {
+		*id = *pid;
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+rspamd_sqlite3_cache_id (GHashTable *cache, const gchar *name, gint64 id)
+{
+	gint64 *pid;
+
+	if (g_hash_table_size (cache) >= SQLITE3_MAX_CACHED_IDS) {
+		g_hash_table_remove_all (cache);
+	}
+
+	pid = g_malloc (sizeof (*pid));
+	*pid = id;
+	g_hash_table_insert (cache, g_strdup (name), pid);
+}
+
+/* Extracted names are the same for all statfiles of a classifier */
+static const gchar *
+rspamd_sqlite3_cache_key (struct rspamd_stat_sqlite3_rt *rt, const gchar *what)
+{
+	const gchar *clname;
+	gchar *key;
+	gsize len;
+
+	clname = rt->cf->clcf->name ? rt->cf->clcf->name : "";
+	len = strlen (what) + strlen (clname) + sizeof ("sqlite3__");
+	key = rspamd_mempool_alloc (rt->task->task_pool, len);
+	rspamd_snprintf (key, len, "sqlite3_%s_%s", what, clname);
+
+	return key;
+}
+
 static gint64
-rspamd_sqlite3_get_user (struct rspamd_stat_sqlite3_db *db,
-		struct rspamd_task *task, gboolean learn)
+rspamd_sqlite3_get_user (struct rspamd_stat_sqlite3_rt *rt, gboolean learn)
 {
 	gint64 id = 0; /* Default user is 0 */
 	gint rc, err_idx;
 	const gchar *user = NULL;
+	const gchar *cache_key;
 	struct rspamd_task **ptask;
+	struct rspamd_stat_sqlite3_db *db = rt->db;
+	struct rspamd_task *task = rt->task;
 	lua_State *L = db->L;
 	GString *tb;
 
-	if (db->cbref_user == -1) {
+	cache_key = rspamd_sqlite3_cache_key (rt, "user");
+
+	user = rspamd_mempool_get_variable (task->task_pool, cache_key);
+
+	if (user == NULL && db->cbref_user == -1) {
 		user = rspamd_task_get_principal_recipient (task);
 	}
-	else {
+	else if (user == NULL) {
 		/* Execute lua function to get userdata */
 		lua_pushcfunction (L, &rspamd_lua_traceback);
 		err_idx = lua_gettop (L);
@@ -328,11 +441,21 @@ rspamd_sqlite3_get_user (struct rspamd_stat_sqlite3_db *db,
 	if (user != NULL) {
 		rspamd_mempool_set_variable (task->task_pool, "stat_user",
 				(gpointer)user, NULL);
+		rspamd_mempool_set_variable (task->task_pool, cache_key,
+				(gpointer)user, NULL);
+
+		if (rspamd_sqlite3_get_cached_id (db->users_cache, user, &id)) {
+			return id;
+		}
 
 		rc = rspamd_sqlite3_run_prstmt (task->task_pool, db->sqlite, db->prstmt,
 				RSPAMD_STAT_BACKEND_GET_USER, user, &id);
 
-		if (rc != SQLITE_OK && learn) {
+		if (rc == SQLITE_OK) {
+			/* Newly inserted users are not cached as transaction might fail */
+			rspamd_sqlite3_cache_id (db->users_cache, user, id);
+		}
+		else if (learn) {
 			/* We need to insert a new user */
 			if (!db->in_transaction) {
 				rspamd_sqlite3_run_prstmt (task->task_pool, db->sqlite, db->prstmt,
@@ -349,19 +472,28 @@ rspamd_sqlite3_get_user (struct rspamd_stat_sqlite3_db *db,
 }
 
 static gint64
-rspamd_sqlite3_get_language (struct rspamd_stat_sqlite3_db *db,
-		struct rspamd_task *task, gboolean learn)
+rspamd_sqlite3_get_language (struct rspamd_stat_sqlite3_rt *rt, gboolean learn)
 {
 	gint64 id = 0; /* Default language is 0 */
 	gint rc, err_idx;
 	guint i;
 	const gchar *language = NULL;
+	const gchar *cache_key;
 	struct rspamd_mime_text_part *tp;
 	struct rspamd_task **ptask;
+	struct rspamd_stat_sqlite3_db *db = rt->db;
+	struct rspamd_task *task = rt->task;
 	lua_State *L = db->L;
 	GString *tb;
 
-	if (db->cbref_language == -1) {
+	cache_key = rspamd_sqlite3_cache_key (rt, "language");
+
+	language = rspamd_mempool_get_variable (task->task_pool, cache_key);
+
+	if (language == NULL && db->cbref_language == -1) {
+		rspamd_message_process_text_parts (task,
+				RSPAMD_MIME_TEXT_PART_STAGE_LANGUAGE);
+
 		for (i = 0; i < task->text_parts->len; i++) {
 			tp = g_ptr_array_index (task->text_parts, i);
 
@@ -372,7 +504,7 @@ rspamd_sqlite3_get_language (struct rspamd_stat_sqlite3_db *db,
 			}
 		}
 	}
-	else {
+	else if (language == NULL) {
 		/* Execute lua function to get userdata */
 		lua_pushcfunction (L, &rspamd_lua_traceback);
 		err_idx = lua_gettop (L);
@@ -399,10 +531,20 @@ rspamd_sqlite3_get_language (struct rspamd_stat_sqlite3_db *db,
 
 	/* XXX: We ignore multiple languages but default + extra */
 	if (language != NULL) {
+		rspamd_mempool_set_variable (task->task_pool, cache_key,
+				(gpointer)language, NULL);
+
+		if (rspamd_sqlite3_get_cached_id (db->languages_cache, language, &id)) {
+			return id;
+		}
+
 		rc = rspamd_sqlite3_run_prstmt (task->task_pool, db->sqlite, db->prstmt,
 				RSPAMD_STAT_BACKEND_GET_LANGUAGE, language, &id);
 
-		if (rc != SQLITE_OK && learn) {
+		if (rc == SQLITE_OK) {
+			rspamd_sqlite3_cache_id (db->languages_cache, language, id);
+		}
+		else if (learn) {
 			/* We need to insert a new language */
 			if (!db->in_transaction) {
 				rspamd_sqlite3_run_prstmt (task->task_pool, db->sqlite, db->prstmt,
@@ -418,6 +560,118 @@ rspamd_sqlite3_get_language (struct rspamd_stat_sqlite3_db *db,
 	return id;
 }
 
+static gboolean
+rspamd_sqlite3_prepare_task_tokens (struct rspamd_stat_sqlite3_db *bk,
+		GError **err)
+{
+	GString *sql;
+	guint i;
+	gint rc;
+
+	sql = g_string_new ("INSERT OR REPLACE INTO task_tokens (token, value) "
+			"VALUES ");
+
+	for (i = 0; i < SQLITE3_TOKENS_CHUNK; i ++) {
+		g_string_append (sql, i == 0 ? "(?,?)" : ",(?,?)");
+	}
+
+	rc = sqlite3_prepare_v2 (bk->sqlite, sql->str, -1, &bk->insert_tokens_stmt,
+			NULL);
+	g_string_free (sql, TRUE);
+
+	if (rc != SQLITE_OK) {
+		g_set_error (err, rspamd_sqlite3_backend_quark (), rc,
+				"cannot prepare task tokens insertion: %s",
+				sqlite3_errmsg (bk->sqlite));
+
+		return FALSE;
+	}
+
+	rc = sqlite3_prepare_v2 (bk->sqlite, get_tokens_sql, -1,
+			&bk->get_tokens_stmt, NULL);
+
+	if (rc != SQLITE_OK) {
+		g_set_error (err, rspamd_sqlite3_backend_quark (), rc,
+				"cannot prepare task tokens lookup: %s",
+				sqlite3_errmsg (bk->sqlite));
+		sqlite3_finalize (bk->insert_tokens_stmt);
+		bk->insert_tokens_stmt = NULL;
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_sqlite3_free_task_tokens (struct rspamd_stat_sqlite3_db *bk)
+{
+	if (bk->insert_tokens_stmt) {
+		sqlite3_finalize (bk->insert_tokens_stmt);
+		bk->insert_tokens_stmt = NULL;
+	}
+
+	if (bk->get_tokens_stmt) {
+		sqlite3_finalize (bk->get_tokens_stmt);
+		bk->get_tokens_stmt = NULL;
+	}
+}
+
+/*
+ * Replaces content of task_tokens table with the specified tokens,
+ * inserting them by chunks of SQLITE3_TOKENS_CHUNK rows
+ */
+static gboolean
+rspamd_sqlite3_load_task_tokens (struct rspamd_task *task,
+		struct rspamd_stat_sqlite3_db *bk,
+		GPtrArray *tokens, gint id, gboolean with_values)
+{
+	sqlite3_stmt *stmt = bk->insert_tokens_stmt;
+	rspamd_token_t *tok;
+	gint64 value;
+	guint i, j;
+
+	if (rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
+			RSPAMD_STAT_BACKEND_CLEAR_TASK_TOKENS) != SQLITE_OK) {
+		return FALSE;
+	}
+
+	for (i = 0; i + SQLITE3_TOKENS_CHUNK <= tokens->len;
+			i += SQLITE3_TOKENS_CHUNK) {
+		sqlite3_reset (stmt);
+
+		for (j = 0; j < SQLITE3_TOKENS_CHUNK; j ++) {
+			tok = g_ptr_array_index (tokens, i + j);
+			value = with_values ? tok->values[id] : 0;
+			sqlite3_bind_int64 (stmt, j * 2 + 1, tok->data);
+			sqlite3_bind_int64 (stmt, j * 2 + 2, value);
+		}
+
+		if (sqlite3_step (stmt) != SQLITE_DONE) {
+			msg_err_task ("cannot insert task tokens to %s: %s", bk->fname,
+					sqlite3_errmsg (bk->sqlite));
+			sqlite3_reset (stmt);
+
+			return FALSE;
+		}
+	}
+
+	sqlite3_reset (stmt);
+
+	for (; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+		value = with_values ? tok->values[id] : 0;
+
+		if (rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_INSERT_TASK_TOKEN,
+				tok->data, value) != SQLITE_OK) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 static struct rspamd_stat_sqlite3_db *
 rspamd_sqlite3_opendb (rspamd_mempool_t *pool,
 		struct rspamd_statfile_config *stcf,
@@ -450,11 +704,33 @@ rspamd_sqlite3_opendb (rspamd_mempool_t *pool,
 
 	bk->fname = g_strdup (path);
 
+	if (sqlite3_exec (bk->sqlite, create_temp_tables_sql, NULL, NULL,
+			NULL) != SQLITE_OK) {
+		g_set_error (err, rspamd_sqlite3_backend_quark (), errno,
+				"cannot create temporary tables: %s",
+				sqlite3_errmsg (bk->sqlite));
+		sqlite3_close (bk->sqlite);
+		g_free (bk->fname);
+		g_free (bk);
+
+		return NULL;
+	}
+
 	bk->prstmt = rspamd_sqlite3_init_prstmt (bk->sqlite, prepared_stmts,
 			RSPAMD_STAT_BACKEND_MAX, err);
 
 	if (bk->prstmt == NULL) {
 		sqlite3_close (bk->sqlite);
+		g_free (bk->fname);
+		g_free (bk);
+
+		return NULL;
+	}
+
+	if (!rspamd_sqlite3_prepare_task_tokens (bk, err)) {
+		rspamd_sqlite3_close_prstmt (bk->sqlite, bk->prstmt);
+		sqlite3_close (bk->sqlite);
+		g_free (bk->fname);
 		g_free (bk);
 
 		return NULL;
@@ -471,6 +747,7 @@ rspamd_sqlite3_opendb (rspamd_mempool_t *pool,
 	if (ret != SQLITE_OK) {
 		msg_err_pool ("failed to stard transaction: %d, %s", ret,
 				sqlite3_errmsg (bk->sqlite));
+		rspamd_sqlite3_free_task_tokens (bk);
 		sqlite3_close (bk->sqlite);
 		g_free (bk);
 
@@ -495,6 +772,7 @@ rspamd_sqlite3_opendb (rspamd_mempool_t *pool,
 				RSPAMD_STAT_BACKEND_SAVE_TOKENIZER,
 				(gint64)strlen (tok_conf_encoded),
 				tok_conf_encoded) != SQLITE_OK) {
+			rspamd_sqlite3_free_task_tokens (bk);
 			sqlite3_close (bk->sqlite);
 			g_free (bk);
 			g_free (tok_conf_encoded);
@@ -509,6 +787,10 @@ rspamd_sqlite3_opendb (rspamd_mempool_t *pool,
 
 	rspamd_sqlite3_run_prstmt (pool, bk->sqlite, bk->prstmt,
 				RSPAMD_STAT_BACKEND_TRANSACTION_COMMIT);
+	bk->users_cache = g_hash_table_new_full (rspamd_str_hash, rspamd_str_equal,
+			g_free, g_free);
+	bk->languages_cache = g_hash_table_new_full (rspamd_str_hash,
+			rspamd_str_equal, g_free, g_free);
 
 	return bk;
 }
@@ -639,8 +921,11 @@ rspamd_sqlite3_close (gpointer p)
 					RSPAMD_STAT_BACKEND_TRANSACTION_COMMIT);
 		}
 
+		rspamd_sqlite3_free_task_tokens (bk);
 		rspamd_sqlite3_close_prstmt (bk->sqlite, bk->prstmt);
 		sqlite3_close (bk->sqlite);
+		g_hash_table_unref (bk->users_cache);
+		g_hash_table_unref (bk->languages_cache);
 		g_free (bk->fname);
 		g_free (bk);
 	}
@@ -672,8 +957,11 @@ rspamd_sqlite3_process_tokens (struct rspamd_task *task,
 {
 	struct rspamd_stat_sqlite3_db *bk;
 	struct rspamd_stat_sqlite3_rt *rt = p;
-	gint64 iv = 0;
+	sqlite3_stmt *stmt;
+	khash_t(rspamd_sqlite3_tokens) *values;
+	khiter_t k;
 	guint i;
+	gint rc, r;
 	rspamd_token_t *tok;
 
 	g_assert (p != NULL);
@@ -683,54 +971,81 @@ rspamd_sqlite3_process_tokens (struct rspamd_task *task,
 
 	for (i = 0; i < tokens->len; i ++) {
 		tok = g_ptr_array_index (tokens, i);
+		tok->values[id] = 0.0;
+	}
 
-		if (bk == NULL) {
-			/* Statfile is does not exist, so all values are zero */
-			tok->values[id] = 0.0;
-			continue;
-		}
+	if (bk == NULL || tokens->len == 0) {
+		/* Statfile is does not exist, so all values are zero */
+		return TRUE;
+	}
 
-		if (!bk->in_transaction) {
-			rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
-					RSPAMD_STAT_BACKEND_TRANSACTION_START_DEF);
-			bk->in_transaction = TRUE;
-		}
+	if (!bk->in_transaction) {
+		rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_TRANSACTION_START_DEF);
+		bk->in_transaction = TRUE;
+	}
 
-		if (rt->user_id == -1) {
-			if (bk->enable_users) {
-				rt->user_id = rspamd_sqlite3_get_user (bk, task, FALSE);
-			}
-			else {
-				rt->user_id = 0;
-			}
+	if (rt->user_id == -1) {
+		if (bk->enable_users) {
+			rt->user_id = rspamd_sqlite3_get_user (rt, FALSE);
 		}
-
-		if (rt->lang_id == -1) {
-			if (bk->enable_languages) {
-				rt->lang_id = rspamd_sqlite3_get_language (bk, task, FALSE);
-			}
-			else {
-				rt->lang_id = 0;
-			}
+		else {
+			rt->user_id = 0;
 		}
+	}
 
-		if (rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
-				RSPAMD_STAT_BACKEND_GET_TOKEN,
-				tok->data, rt->user_id, rt->lang_id, &iv) == SQLITE_OK) {
-			tok->values[id] = iv;
+	if (rt->lang_id == -1) {
+		if (bk->enable_languages) {
+			rt->lang_id = rspamd_sqlite3_get_language (rt, FALSE);
 		}
 		else {
-			tok->values[id] = 0.0;
+			rt->lang_id = 0;
 		}
+	}
 
-		if (rt->cf->is_spam) {
-			task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
-		}
-		else {
-			task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+	if (rt->cf->is_spam) {
+		task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+	}
+	else {
+		task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+	}
+
+	if (!rspamd_sqlite3_load_task_tokens (task, bk, tokens, id, FALSE)) {
+		return TRUE;
+	}
+
+	/* Fetch values of all tokens by a single join */
+	stmt = bk->get_tokens_stmt;
+	values = kh_init (rspamd_sqlite3_tokens);
+	kh_resize (rspamd_sqlite3_tokens, values, tokens->len);
+	sqlite3_reset (stmt);
+	sqlite3_bind_int64 (stmt, 1, rt->user_id);
+	sqlite3_bind_int64 (stmt, 2, rt->lang_id);
+
+	while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+		/* Rows are ordered by language, so the specific language wins */
+		k = kh_put (rspamd_sqlite3_tokens, values,
+				sqlite3_column_int64 (stmt, 0), &r);
+		kh_value (values, k) = sqlite3_column_int64 (stmt, 1);
+	}
+
+	if (rc != SQLITE_DONE) {
+		msg_warn_task ("cannot get tokens from %s: %s", bk->fname,
+				sqlite3_errmsg (bk->sqlite));
+	}
+
+	sqlite3_reset (stmt);
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+		k = kh_get (rspamd_sqlite3_tokens, values, tok->data);
+
+		if (k != kh_end (values)) {
+			tok->values[id] = kh_value (values, k);
 		}
 	}
 
+	kh_destroy (rspamd_sqlite3_tokens, values);
 
 	return TRUE;
 }
@@ -763,57 +1078,55 @@ rspamd_sqlite3_learn_tokens (struct rspamd_task *task, GPtrArray *tokens,
 {
 	struct rspamd_stat_sqlite3_db *bk;
 	struct rspamd_stat_sqlite3_rt *rt = p;
-	gint64 iv = 0;
-	guint i;
-	rspamd_token_t *tok;
 
 	g_assert (tokens != NULL);
 	g_assert (p != NULL);
 
 	bk = rt->db;
 
-	for (i = 0; i < tokens->len; i++) {
-		tok = g_ptr_array_index (tokens, i);
-		if (bk == NULL) {
-			/* Statfile is does not exist, so all values are zero */
-			return FALSE;
-		}
+	if (tokens->len == 0) {
+		return TRUE;
+	}
 
-		if (!bk->in_transaction) {
-			rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
-					RSPAMD_STAT_BACKEND_TRANSACTION_START_IM);
-			bk->in_transaction = TRUE;
-		}
+	if (bk == NULL) {
+		/* Statfile is does not exist, so all values are zero */
+		return FALSE;
+	}
 
-		if (rt->user_id == -1) {
-			if (bk->enable_users) {
-				rt->user_id = rspamd_sqlite3_get_user (bk, task, TRUE);
-			}
-			else {
-				rt->user_id = 0;
-			}
-		}
+	if (!bk->in_transaction) {
+		rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_TRANSACTION_START_IM);
+		bk->in_transaction = TRUE;
+	}
 
-		if (rt->lang_id == -1) {
-			if (bk->enable_languages) {
-				rt->lang_id = rspamd_sqlite3_get_language (bk, task, TRUE);
-			}
-			else {
-				rt->lang_id = 0;
-			}
+	if (rt->user_id == -1) {
+		if (bk->enable_users) {
+			rt->user_id = rspamd_sqlite3_get_user (rt, TRUE);
+		}
+		else {
+			rt->user_id = 0;
 		}
+	}
 
-		iv = tok->values[id];
+	if (rt->lang_id == -1) {
+		if (bk->enable_languages) {
+			rt->lang_id = rspamd_sqlite3_get_language (rt, TRUE);
+		}
+		else {
+			rt->lang_id = 0;
+		}
+	}
 
-		if (rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
-				RSPAMD_STAT_BACKEND_SET_TOKEN,
-				tok->data, rt->user_id, rt->lang_id, iv) != SQLITE_OK) {
+	/* Store all tokens by a single statement */
+	if (!rspamd_sqlite3_load_task_tokens (task, bk, tokens, id, TRUE) ||
 			rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
-					RSPAMD_STAT_BACKEND_TRANSACTION_ROLLBACK);
-			bk->in_transaction = FALSE;
+					RSPAMD_STAT_BACKEND_SET_TASK_TOKENS,
+					rt->user_id, rt->lang_id) != SQLITE_OK) {
+		rspamd_sqlite3_run_prstmt (task->task_pool, bk->sqlite, bk->prstmt,
+				RSPAMD_STAT_BACKEND_TRANSACTION_ROLLBACK);
+		bk->in_transaction = FALSE;
 
-			return FALSE;
-		}
+		return FALSE;
 	}
 
 	return TRUE;
@@ -19,6 +19,7 @@
 #include "classifiers.h"
 #include "rspamd.h"
 #include "stat_internal.h"
+#include "bayes_kernel.h"
 #include "math.h"
 
 #define msg_err_bayes(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
@@ -102,6 +103,7 @@ struct bayes_task_closure {
 	guint64 processed_tokens;
 	guint64 total_hits;
 	guint64 text_tokens;
+	struct rspamd_bayes_columns cols;
 	struct rspamd_task *task;
 };
 
@@ -111,9 +113,9 @@ struct bayes_task_closure {
  */
 static const double feature_weight[] = { 0, 1, 4, 27, 256, 3125, 46656, 823543 };
 
-#define PROB_COMBINE(prob, cnt, weight, assumed) (((weight) * (assumed) + (cnt) * (prob)) / ((weight) + (cnt)))
 /*
- * In this callback we calculate local probabilities for tokens
+ * In this callback we collect counts of tokens to the columns processed
+ * by the bayes kernel
  */
 static void
 bayes_classify_token (struct rspamd_classifier *ctx,
@@ -125,8 +127,7 @@ bayes_classify_token (struct rspamd_classifier *ctx,
 	struct rspamd_statfile *st;
 	struct rspamd_task *task;
 	const gchar *token_type = "txt";
-	double spam_prob, spam_freq, ham_freq, bayes_spam_prob, bayes_ham_prob,
-		ham_prob, fw, w, norm_sum, norm_sub, val;
+	double fw, val;
 
 	task = cl->task;
 
@@ -172,13 +173,7 @@ bayes_classify_token (struct rspamd_classifier *ctx,
 		}
 	}
 
-	/* Probability for this token */
 	if (total_count > 0) {
-		spam_freq = ((double)spam_count / MAX (1., (double) ctx->spam_learns));
-		ham_freq = ((double)ham_count / MAX (1., (double)ctx->ham_learns));
-		spam_prob = spam_freq / (spam_freq + ham_freq);
-		ham_prob = ham_freq / (spam_freq + ham_freq);
-
 		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
 			fw = 1.0;
 		}
@@ -187,19 +182,10 @@ bayes_classify_token (struct rspamd_classifier *ctx,
 					G_N_ELEMENTS (feature_weight)];
 		}
 
-		norm_sum = (spam_freq + ham_freq) * (spam_freq + ham_freq);
-		norm_sub = (spam_freq - ham_freq) * (spam_freq - ham_freq);
-
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_spam_prob = PROB_COMBINE (spam_prob, total_count, w, 0.5);
-		norm_sub = (ham_freq - spam_freq) * (ham_freq - spam_freq);
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_ham_prob = PROB_COMBINE (ham_prob, total_count, w, 0.5);
-
-		cl->spam_prob += log2 (bayes_spam_prob);
-		cl->ham_prob += log2 (bayes_ham_prob);
+		cl->cols.spam[cl->cols.len] = spam_count;
+		cl->cols.ham[cl->cols.len] = ham_count;
+		cl->cols.weight[cl->cols.len] = fw;
+		cl->cols.len ++;
 		cl->processed_tokens ++;
 
 		if (!(tok->flags & RSPAMD_STAT_TOKEN_FLAG_META)) {
@@ -211,31 +197,19 @@ bayes_classify_token (struct rspamd_classifier *ctx,
 
 		if (tok->t1 && tok->t2) {
 			msg_debug_bayes ("token(%s) %uL <%*s:%*s>: weight: %f, total_count: %L, "
-					"spam_count: %L, ham_count: %L,"
-					"spam_prob: %.3f, ham_prob: %.3f, "
-					"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-					"current spam prob: %.3f, current ham prob: %.3f",
+					"spam_count: %L, ham_count: %L",
 					token_type,
 					tok->data,
 					(int) tok->t1->len, tok->t1->begin,
 					(int) tok->t2->len, tok->t2->begin,
-					fw, total_count, spam_count, ham_count,
-					spam_prob, ham_prob,
-					bayes_spam_prob, bayes_ham_prob,
-					cl->spam_prob, cl->ham_prob);
+					fw, total_count, spam_count, ham_count);
 		}
 		else {
 			msg_debug_bayes ("token(%s) %uL <?:?>: weight: %f, total_count: %L, "
-					"spam_count: %L, ham_count: %L,"
-					"spam_prob: %.3f, ham_prob: %.3f, "
-					"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-					"current spam prob: %.3f, current ham prob: %.3f",
+					"spam_count: %L, ham_count: %L",
 					token_type,
 					tok->data,
-					fw, total_count, spam_count, ham_count,
-					spam_prob, ham_prob,
-					bayes_spam_prob, bayes_ham_prob,
-					cl->spam_prob, cl->ham_prob);
+					fw, total_count, spam_count, ham_count);
 		}
 	}
 }
@@ -246,6 +220,7 @@ gboolean
 bayes_init (rspamd_mempool_t *pool, struct rspamd_classifier *cl)
 {
 	cl->cfg->flags |= RSPAMD_FLAG_CLASSIFIER_INTEGER;
+	msg_debug_pool ("use %s bayes kernel", bayes_kernel_load ());
 
 	return TRUE;
 }
@@ -312,12 +287,25 @@ bayes_classify (struct rspamd_classifier * ctx,
 		cl.meta_skip_prob = 1.0 - text_tokens / tokens->len;
 	}
 
+	/* Columns are filled with tokens that have any hits */
+	cl.cols.spam = rspamd_mempool_alloc (task->task_pool,
+			sizeof (gdouble) * tokens->len);
+	cl.cols.ham = rspamd_mempool_alloc (task->task_pool,
+			sizeof (gdouble) * tokens->len);
+	cl.cols.weight = rspamd_mempool_alloc (task->task_pool,
+			sizeof (gdouble) * tokens->len);
+
 	for (i = 0; i < tokens->len; i ++) {
 		tok = g_ptr_array_index (tokens, i);
 
 		bayes_classify_token (ctx, tok, &cl);
 	}
 
+	bayes_kernel_process (&cl.cols,
+			MAX (1., (gdouble)ctx->spam_learns),
+			MAX (1., (gdouble)ctx->ham_learns),
+			&cl.spam_prob, &cl.ham_prob);
+
 	h = 1 - inv_chi_square (task, cl.spam_prob, cl.processed_tokens);
 	s = 1 - inv_chi_square (task, cl.ham_prob, cl.processed_tokens);
 
@@ -0,0 +1,125 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Batch kernels of bayes classifier: generic one and SIMD versions selected
+ * at runtime depending on CPU features
+ */
+#include "config.h"
+#include "cryptobox.h"
+#include "platform_config.h"
+#include "bayes_kernel.h"
+
+extern unsigned long cpu_config;
+
+typedef struct bayes_kernel_impl {
+	unsigned long cpu_flags;
+	const char *desc;
+
+	void (*process) (const struct rspamd_bayes_columns *cols,
+			gdouble spam_learns, gdouble ham_learns,
+			gdouble *spam_prob, gdouble *ham_prob);
+} bayes_kernel_impl_t;
+
+#define BAYES_KERNEL_DECLARE(ext) \
+    void bayes_kernel_process_##ext(const struct rspamd_bayes_columns *cols, \
+        gdouble spam_learns, gdouble ham_learns, \
+        gdouble *spam_prob, gdouble *ham_prob);
+#define BAYES_KERNEL_IMPL(cpuflags, desc, ext) \
+    {(cpuflags), desc, bayes_kernel_process_##ext}
+
+BAYES_KERNEL_DECLARE(ref);
+#define BAYES_KERNEL_REF BAYES_KERNEL_IMPL(0, "ref", ref)
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+# if defined(HAVE_SSE2)
+void bayes_kernel_process_sse2 (const struct rspamd_bayes_columns *cols,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_prob, gdouble *ham_prob)
+		__attribute__((__target__("sse2")));
+
+BAYES_KERNEL_DECLARE(sse2);
+#  define BAYES_KERNEL_SSE2 BAYES_KERNEL_IMPL(CPUID_SSE2, "sse2", sse2)
+# endif
+#endif
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+# if defined(HAVE_AVX2)
+void bayes_kernel_process_avx2 (const struct rspamd_bayes_columns *cols,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_prob, gdouble *ham_prob)
+		__attribute__((__target__("avx2")));
+
+BAYES_KERNEL_DECLARE(avx2);
+#  define BAYES_KERNEL_AVX2 BAYES_KERNEL_IMPL(CPUID_AVX2, "avx2", avx2)
+# endif
+#endif
+
+static const bayes_kernel_impl_t bayes_kernel_list[] = {
+		BAYES_KERNEL_REF,
+#ifdef BAYES_KERNEL_AVX2
+		BAYES_KERNEL_AVX2,
+#endif
+#ifdef BAYES_KERNEL_SSE2
+		BAYES_KERNEL_SSE2,
+#endif
+};
+
+static const bayes_kernel_impl_t *bayes_kernel_opt = &bayes_kernel_list[0];
+
+const char *
+bayes_kernel_load (void)
+{
+	guint i;
+
+	if (cpu_config != 0) {
+		for (i = 0; i < G_N_ELEMENTS (bayes_kernel_list); i++) {
+			if (bayes_kernel_list[i].cpu_flags & cpu_config) {
+				bayes_kernel_opt = &bayes_kernel_list[i];
+				break;
+			}
+		}
+	}
+
+	return bayes_kernel_opt->desc;
+}
+
+void
+bayes_kernel_process (const struct rspamd_bayes_columns *cols,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_prob, gdouble *ham_prob)
+{
+	bayes_kernel_opt->process (cols, spam_learns, ham_learns,
+			spam_prob, ham_prob);
+}
+
+void
+bayes_kernel_process_ref (const struct rspamd_bayes_columns *cols,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_prob, gdouble *ham_prob)
+{
+	gdouble sp, hp, spam_sum = 0, ham_sum = 0;
+	guint i;
+
+	for (i = 0; i < cols->len; i ++) {
+		bayes_kernel_token_probs (cols->spam[i], cols->ham[i], cols->weight[i],
+				spam_learns, ham_learns, &sp, &hp);
+		spam_sum += log2 (sp);
+		ham_sum += log2 (hp);
+	}
+
+	*spam_prob += spam_sum;
+	*ham_prob += ham_sum;
+}
@@ -0,0 +1,83 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSTAT_CLASSIFIERS_BAYES_KERNEL_H_
+#define SRC_LIBSTAT_CLASSIFIERS_BAYES_KERNEL_H_
+
+#include "config.h"
+#include <math.h>
+#include <float.h>
+
+/*
+ * Tokens of a task that have some hits, stored as columns: spam and ham
+ * counts summed over statfiles and the feature weight of each token
+ */
+struct rspamd_bayes_columns {
+	gdouble *spam;
+	gdouble *ham;
+	gdouble *weight;
+	guint len;
+};
+
+/*
+ * Probabilities of a single token, zero probabilities are clamped to the
+ * smallest normal value to keep log sums finite
+ */
+static inline void
+bayes_kernel_token_probs (gdouble spam_cnt, gdouble ham_cnt, gdouble fw,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_prob, gdouble *ham_prob)
+{
+	gdouble total, spam_freq, ham_freq, freq_sum, diff, w;
+
+	total = spam_cnt + ham_cnt;
+	spam_freq = spam_cnt / spam_learns;
+	ham_freq = ham_cnt / ham_learns;
+	freq_sum = spam_freq + ham_freq;
+	diff = spam_freq - ham_freq;
+	/* Weight is the same for both classes as the difference is squared */
+	w = (diff * diff) / (freq_sum * freq_sum) *
+			(fw * total) / (4.0 * (1.0 + fw * total));
+	*spam_prob = (w * 0.5 + total * (spam_freq / freq_sum)) / (w + total);
+	*ham_prob = (w * 0.5 + total * (ham_freq / freq_sum)) / (w + total);
+
+	if (*spam_prob < DBL_MIN) {
+		*spam_prob = DBL_MIN;
+	}
+	if (*ham_prob < DBL_MIN) {
+		*ham_prob = DBL_MIN;
+	}
+}
+
+/**
+ * Selects the best kernel for the current CPU, must be called after
+ * cryptobox initialisation
+ * @return name of the kernel
+ */
+const char* bayes_kernel_load (void);
+
+/**
+ * Accumulates log2 of spam and ham probabilities for all tokens in columns
+ * @param cols token columns
+ * @param spam_learns number of spam learns (at least 1)
+ * @param ham_learns number of ham learns (at least 1)
+ * @param spam_prob output sum for spam
+ * @param ham_prob output sum for ham
+ */
+void bayes_kernel_process (const struct rspamd_bayes_columns *cols,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_prob, gdouble *ham_prob);
+
+#endif /* SRC_LIBSTAT_CLASSIFIERS_BAYES_KERNEL_H_ */
@@ -0,0 +1,131 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "bayes_kernel.h"
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#ifndef __AVX__
+#define __AVX__
+#endif
+#ifndef __AVX2__
+#define __AVX2__
+#endif
+
+#include <immintrin.h>
+
+/* The same algorithm as in the SSE2 kernel over 4 lanes */
+#define MANTISSA_MASK 0x000fffffffffffffULL
+#define EXPONENT_ONE 0x3ff0000000000000ULL
+#define EXPONENT_BIAS 1023
+
+void
+bayes_kernel_process_avx2 (const struct rspamd_bayes_columns *cols,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_prob, gdouble *ham_prob)
+		__attribute__((__target__("avx2")));
+void
+bayes_kernel_process_avx2 (const struct rspamd_bayes_columns *cols,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_prob, gdouble *ham_prob)
+{
+	const __m256d sl = _mm256_set1_pd (spam_learns),
+			hl = _mm256_set1_pd (ham_learns),
+			half = _mm256_set1_pd (0.5), one = _mm256_set1_pd (1.0),
+			four = _mm256_set1_pd (4.0), minval = _mm256_set1_pd (DBL_MIN);
+	const __m256i mant_mask = _mm256_set1_epi64x (MANTISSA_MASK),
+			exp_one = _mm256_set1_epi64x (EXPONENT_ONE);
+	__m256d s, h, fw, total, sf, hf, fs, d, ft, w, sp, hp,
+			spam_mant = one, ham_mant = one;
+	__m256i bits, spam_exp = _mm256_setzero_si256 (),
+			ham_exp = _mm256_setzero_si256 ();
+	gdouble mant[4], spam_sum = 0, ham_sum = 0;
+	gint64 exps[4];
+	guint i, j, steps = 0;
+
+	for (i = 0; i + 4 <= cols->len; i += 4) {
+		s = _mm256_loadu_pd (&cols->spam[i]);
+		h = _mm256_loadu_pd (&cols->ham[i]);
+		fw = _mm256_loadu_pd (&cols->weight[i]);
+
+		total = _mm256_add_pd (s, h);
+		sf = _mm256_div_pd (s, sl);
+		hf = _mm256_div_pd (h, hl);
+		fs = _mm256_add_pd (sf, hf);
+		d = _mm256_sub_pd (sf, hf);
+		ft = _mm256_mul_pd (fw, total);
+		w = _mm256_mul_pd (_mm256_div_pd (_mm256_mul_pd (d, d),
+				_mm256_mul_pd (fs, fs)), ft);
+		w = _mm256_div_pd (w, _mm256_mul_pd (four, _mm256_add_pd (one, ft)));
+
+		sp = _mm256_add_pd (_mm256_mul_pd (w, half),
+				_mm256_mul_pd (total, _mm256_div_pd (sf, fs)));
+		sp = _mm256_max_pd (_mm256_div_pd (sp, _mm256_add_pd (w, total)),
+				minval);
+		hp = _mm256_add_pd (_mm256_mul_pd (w, half),
+				_mm256_mul_pd (total, _mm256_div_pd (hf, fs)));
+		hp = _mm256_max_pd (_mm256_div_pd (hp, _mm256_add_pd (w, total)),
+				minval);
+
+		bits = _mm256_castpd_si256 (_mm256_mul_pd (spam_mant, sp));
+		spam_exp = _mm256_add_epi64 (spam_exp, _mm256_srli_epi64 (bits, 52));
+		spam_mant = _mm256_castsi256_pd (_mm256_or_si256 (
+				_mm256_and_si256 (bits, mant_mask), exp_one));
+		bits = _mm256_castpd_si256 (_mm256_mul_pd (ham_mant, hp));
+		ham_exp = _mm256_add_epi64 (ham_exp, _mm256_srli_epi64 (bits, 52));
+		ham_mant = _mm256_castsi256_pd (_mm256_or_si256 (
+				_mm256_and_si256 (bits, mant_mask), exp_one));
+		steps ++;
+	}
+
+	_mm256_storeu_pd (mant, spam_mant);
+	_mm256_storeu_si256 ((__m256i *)exps, spam_exp);
+
+	for (j = 0; j < G_N_ELEMENTS (mant); j ++) {
+		spam_sum += (exps[j] - (gint64)steps * EXPONENT_BIAS) + log2 (mant[j]);
+	}
+
+	_mm256_storeu_pd (mant, ham_mant);
+	_mm256_storeu_si256 ((__m256i *)exps, ham_exp);
+
+	for (j = 0; j < G_N_ELEMENTS (mant); j ++) {
+		ham_sum += (exps[j] - (gint64)steps * EXPONENT_BIAS) + log2 (mant[j]);
+	}
+
+	for (; i < cols->len; i ++) {
+		gdouble tsp, thp;
+
+		bayes_kernel_token_probs (cols->spam[i], cols->ham[i], cols->weight[i],
+				spam_learns, ham_learns, &tsp, &thp);
+		spam_sum += log2 (tsp);
+		ham_sum += log2 (thp);
+	}
+
+	*spam_prob += spam_sum;
+	*ham_prob += ham_sum;
+}
+
+#pragma GCC pop_options
+#endif
@@ -0,0 +1,124 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "bayes_kernel.h"
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+
+#include <emmintrin.h>
+
+/*
+ * Instead of calling log2 for each token we multiply probabilities in each
+ * lane and move the binary exponent of the product to an integer
+ * accumulator after each step, so the product always stays in [1, 2)
+ */
+#define MANTISSA_MASK 0x000fffffffffffffULL
+#define EXPONENT_ONE 0x3ff0000000000000ULL
+#define EXPONENT_BIAS 1023
+
+void
+bayes_kernel_process_sse2 (const struct rspamd_bayes_columns *cols,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_prob, gdouble *ham_prob)
+		__attribute__((__target__("sse2")));
+void
+bayes_kernel_process_sse2 (const struct rspamd_bayes_columns *cols,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_prob, gdouble *ham_prob)
+{
+	const __m128d sl = _mm_set1_pd (spam_learns), hl = _mm_set1_pd (ham_learns),
+			half = _mm_set1_pd (0.5), one = _mm_set1_pd (1.0),
+			four = _mm_set1_pd (4.0), minval = _mm_set1_pd (DBL_MIN);
+	const __m128i mant_mask = _mm_set1_epi64x (MANTISSA_MASK),
+			exp_one = _mm_set1_epi64x (EXPONENT_ONE);
+	__m128d s, h, fw, total, sf, hf, fs, d, ft, w, sp, hp,
+			spam_mant = one, ham_mant = one;
+	__m128i bits, spam_exp = _mm_setzero_si128 (), ham_exp = _mm_setzero_si128 ();
+	gdouble mant[2], spam_sum = 0, ham_sum = 0;
+	gint64 exps[2];
+	guint i, j, steps = 0;
+
+	for (i = 0; i + 2 <= cols->len; i += 2) {
+		s = _mm_loadu_pd (&cols->spam[i]);
+		h = _mm_loadu_pd (&cols->ham[i]);
+		fw = _mm_loadu_pd (&cols->weight[i]);
+
+		total = _mm_add_pd (s, h);
+		sf = _mm_div_pd (s, sl);
+		hf = _mm_div_pd (h, hl);
+		fs = _mm_add_pd (sf, hf);
+		d = _mm_sub_pd (sf, hf);
+		ft = _mm_mul_pd (fw, total);
+		w = _mm_mul_pd (_mm_div_pd (_mm_mul_pd (d, d), _mm_mul_pd (fs, fs)), ft);
+		w = _mm_div_pd (w, _mm_mul_pd (four, _mm_add_pd (one, ft)));
+
+		sp = _mm_add_pd (_mm_mul_pd (w, half),
+				_mm_mul_pd (total, _mm_div_pd (sf, fs)));
+		sp = _mm_max_pd (_mm_div_pd (sp, _mm_add_pd (w, total)), minval);
+		hp = _mm_add_pd (_mm_mul_pd (w, half),
+				_mm_mul_pd (total, _mm_div_pd (hf, fs)));
+		hp = _mm_max_pd (_mm_div_pd (hp, _mm_add_pd (w, total)), minval);
+
+		bits = _mm_castpd_si128 (_mm_mul_pd (spam_mant, sp));
+		spam_exp = _mm_add_epi64 (spam_exp, _mm_srli_epi64 (bits, 52));
+		spam_mant = _mm_castsi128_pd (_mm_or_si128 (
+				_mm_and_si128 (bits, mant_mask), exp_one));
+		bits = _mm_castpd_si128 (_mm_mul_pd (ham_mant, hp));
+		ham_exp = _mm_add_epi64 (ham_exp, _mm_srli_epi64 (bits, 52));
+		ham_mant = _mm_castsi128_pd (_mm_or_si128 (
+				_mm_and_si128 (bits, mant_mask), exp_one));
+		steps ++;
+	}
+
+	_mm_storeu_pd (mant, spam_mant);
+	_mm_storeu_si128 ((__m128i *)exps, spam_exp);
+
+	for (j = 0; j < G_N_ELEMENTS (mant); j ++) {
+		spam_sum += (exps[j] - (gint64)steps * EXPONENT_BIAS) + log2 (mant[j]);
+	}
+
+	_mm_storeu_pd (mant, ham_mant);
+	_mm_storeu_si128 ((__m128i *)exps, ham_exp);
+
+	for (j = 0; j < G_N_ELEMENTS (mant); j ++) {
+		ham_sum += (exps[j] - (gint64)steps * EXPONENT_BIAS) + log2 (mant[j]);
+	}
+
+	for (; i < cols->len; i ++) {
+		gdouble tsp, thp;
+
+		bayes_kernel_token_probs (cols->spam[i], cols->ham[i], cols->weight[i],
+				spam_learns, ham_learns, &tsp, &thp);
+		spam_sum += log2 (tsp);
+		ham_sum += log2 (thp);
+	}
+
+	*spam_prob += spam_sum;
+	*ham_prob += ham_sum;
+}
+
+#pragma GCC pop_options
+#endif
@@ -25,6 +25,8 @@ struct rspamd_task;
 struct rspamd_stat_ctx;
 struct rspamd_config;
 struct rspamd_statfile;
+struct rspamd_classifier_config;
+struct rspamd_stat_cache_filter;
 
 struct rspamd_stat_cache {
 	const char *name;
@@ -59,6 +61,63 @@ struct rspamd_stat_cache {
 				gpointer runtime); \
 		void rspamd_stat_cache_##name##_close (gpointer ctx)
 
+/*
+ * Filter of learned messages digests shared by all workers of a node: it is
+ * loaded from the cache by one of the workers and updated on each learn, so
+ * messages that have never been learned do not require cache lookups.
+ * Digests learned by other nodes appear in the filter after the next resync,
+ * so the filter is not used if it has not been loaded for the resync interval.
+ * Digests must be added after they are stored in the cache.
+ */
+
+/**
+ * Allocate shared filter for a classifier, must be called in the main process
+ * @param cfg
+ * @param clcf
+ */
+void rspamd_stat_cache_filter_init_shared (struct rspamd_config *cfg,
+		struct rspamd_classifier_config *clcf);
+
+/**
+ * Check whether a digest might be in the cache, also updates statistics
+ * @return FALSE if the digest is definitely not in the cache
+ */
+gboolean rspamd_stat_cache_filter_check (struct rspamd_stat_cache_filter *filter,
+		struct rspamd_task *task, const guchar *digest);
+
+/**
+ * Account cache lookup that has been passed by filter but found nothing
+ */
+void rspamd_stat_cache_filter_miss (struct rspamd_stat_cache_filter *filter,
+		struct rspamd_task *task);
+
+/**
+ * Add digest of a learned message once it is stored in the cache
+ */
+void rspamd_stat_cache_filter_add (struct rspamd_stat_cache_filter *filter,
+		const guchar *digest);
+
+/**
+ * Start loading of the filter from the cache
+ * @return TRUE if the caller should load all digests and call
+ * `rspamd_stat_cache_filter_sync_end`
+ */
+gboolean rspamd_stat_cache_filter_sync_start (
+		struct rspamd_stat_cache_filter *filter);
+
+/**
+ * Finish loading of the filter
+ * @param filter
+ * @param success if FALSE, loading is retried later
+ */
+void rspamd_stat_cache_filter_sync_end (struct rspamd_stat_cache_filter *filter,
+		gboolean success);
+
+/**
+ * Returns interval between attempts to load the filter
+ */
+gdouble rspamd_stat_cache_filter_resync (struct rspamd_stat_cache_filter *filter);
+
 RSPAMD_STAT_CACHE_DEF(sqlite3);
 #ifdef WITH_HIREDIS
 RSPAMD_STAT_CACHE_DEF(redis);
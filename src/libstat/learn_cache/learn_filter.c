@@ -0,0 +1,232 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "learn_cache.h"
+#include "rspamd.h"
+#include "stat_internal.h"
+#include "bloom.h"
+
+#define DEFAULT_FILTER_SIZE 1000000
+#define DEFAULT_FILTER_RESYNC 600.0
+/* Loading is taken over if a process has not finished it in this time */
+#define FILTER_SYNC_TIMEOUT 300.0
+
+struct rspamd_stat_cache_filter {
+	rspamd_blocked_bloom_t *bloom;
+	gdouble resync;
+	gdouble last_sync;
+	gdouble sync_started;
+	gint ready;
+	gint syncing;
+};
+
+void
+rspamd_stat_cache_filter_init_shared (struct rspamd_config *cfg,
+		struct rspamd_classifier_config *clcf)
+{
+	struct rspamd_stat_cache_filter *filter;
+	const ucl_object_t *cache_obj = NULL, *elt;
+	gint64 nelts = DEFAULT_FILTER_SIZE;
+	gdouble resync = DEFAULT_FILTER_RESYNC;
+
+	if (clcf->flags & RSPAMD_FLAG_CLASSIFIER_NO_BACKEND) {
+		return;
+	}
+
+	if (clcf->opts) {
+		cache_obj = ucl_object_lookup (clcf->opts, "cache");
+	}
+
+	if (cache_obj) {
+		if (ucl_object_type (cache_obj) == UCL_NULL) {
+			/* Learn cache is disabled */
+			return;
+		}
+
+		elt = ucl_object_lookup (cache_obj, "filter_size");
+
+		if (elt) {
+			nelts = ucl_object_toint (elt);
+		}
+
+		elt = ucl_object_lookup (cache_obj, "filter_resync");
+
+		if (elt) {
+			resync = ucl_object_todouble (elt);
+		}
+	}
+
+	if (nelts <= 0) {
+		return;
+	}
+
+	filter = rspamd_mempool_alloc0_shared (cfg->cfg_pool, sizeof (*filter));
+	filter->bloom = rspamd_blocked_bloom_create (nelts, cfg->cfg_pool);
+	filter->resync = MAX (resync, 1.0);
+	clcf->cache_filter = filter;
+
+	msg_info_config ("use shared learn cache filter of %L digests for %s "
+			"classifier", nelts, clcf->name);
+}
+
+static inline guint64
+rspamd_stat_cache_filter_hash (const guchar *digest)
+{
+	guint64 h;
+
+	/* Digests are cryptographic hashes, so any part of them is good */
+	memcpy (&h, digest, sizeof (h));
+
+	return h;
+}
+
+static struct rspamd_stat *
+rspamd_stat_cache_filter_stat (struct rspamd_task *task)
+{
+	if (task->worker && task->worker->srv) {
+		return task->worker->srv->stat;
+	}
+
+	return NULL;
+}
+
+gboolean
+rspamd_stat_cache_filter_check (struct rspamd_stat_cache_filter *filter,
+		struct rspamd_task *task, const guchar *digest)
+{
+	struct rspamd_stat *stat;
+	gboolean ret;
+
+	if (filter == NULL || !g_atomic_int_get (&filter->ready)) {
+		return TRUE;
+	}
+
+	if (rspamd_get_calendar_ticks () - filter->last_sync > filter->resync) {
+		/*
+		 * Digests written by other nodes or by rspamadm since the last load
+		 * are not in the filter, so its misses are no longer reliable
+		 */
+		ret = TRUE;
+	}
+	else {
+		ret = rspamd_blocked_bloom_check (filter->bloom,
+				rspamd_stat_cache_filter_hash (digest));
+	}
+
+	stat = rspamd_stat_cache_filter_stat (task);
+
+	if (stat) {
+		if (ret) {
+			g_atomic_int_inc (&stat->learn_cache_lookups);
+		}
+		else {
+			g_atomic_int_inc (&stat->learn_cache_skipped);
+		}
+	}
+
+	return ret;
+}
+
+void
+rspamd_stat_cache_filter_miss (struct rspamd_stat_cache_filter *filter,
+		struct rspamd_task *task)
+{
+	struct rspamd_stat *stat;
+
+	if (filter == NULL || !g_atomic_int_get (&filter->ready)) {
+		return;
+	}
+
+	stat = rspamd_stat_cache_filter_stat (task);
+
+	if (stat) {
+		g_atomic_int_inc (&stat->learn_cache_false_positives);
+	}
+}
+
+void
+rspamd_stat_cache_filter_add (struct rspamd_stat_cache_filter *filter,
+		const guchar *digest)
+{
+	if (filter != NULL) {
+		rspamd_blocked_bloom_add (filter->bloom,
+				rspamd_stat_cache_filter_hash (digest));
+	}
+}
+
+gboolean
+rspamd_stat_cache_filter_sync_start (struct rspamd_stat_cache_filter *filter)
+{
+	gdouble now = rspamd_get_calendar_ticks ();
+
+	if (filter == NULL) {
+		return FALSE;
+	}
+
+	/* Timers are jittered, so do not resync too early */
+	if (g_atomic_int_get (&filter->ready) &&
+			now - filter->last_sync < filter->resync / 2.0) {
+		return FALSE;
+	}
+
+	if (!g_atomic_int_compare_and_exchange (&filter->syncing, 0, 1)) {
+		if (now - filter->sync_started < FILTER_SYNC_TIMEOUT) {
+			return FALSE;
+		}
+
+		/* Process that has been loading filter is likely dead */
+		msg_warn ("learn cache filter has not been loaded in %.0f seconds, "
+				"retry", now - filter->sync_started);
+	}
+
+	filter->sync_started = now;
+
+	if (rspamd_blocked_bloom_is_full (filter->bloom)) {
+		/*
+		 * Forget digests that have been removed from the cache, all lookups
+		 * are passed to the cache until the filter is loaded. Digests are
+		 * added after they are stored in the cache, so the ones added during
+		 * clearing are loaded back from the cache.
+		 */
+		g_atomic_int_set (&filter->ready, 0);
+		rspamd_blocked_bloom_clear (filter->bloom);
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_stat_cache_filter_sync_end (struct rspamd_stat_cache_filter *filter,
+		gboolean success)
+{
+	if (success) {
+		/* Filter has all digests stored before loading has been started */
+		filter->last_sync = filter->sync_started;
+		g_atomic_int_set (&filter->ready, 1);
+	}
+
+	g_atomic_int_set (&filter->syncing, 0);
+}
+
+gdouble
+rspamd_stat_cache_filter_resync (struct rspamd_stat_cache_filter *filter)
+{
+	/*
+	 * Timers are jittered up to twice of the interval, so the filter is
+	 * reloaded before it becomes stale
+	 */
+	return filter->resync / 2.0;
+}
@@ -27,6 +27,7 @@
 #define REDIS_STAT_TIMEOUT 30
 #define REDIS_DEFAULT_PORT 6379
 #define DEFAULT_REDIS_KEY "learned_ids"
+#define REDIS_SCAN_COUNT 1000
 
 struct rspamd_redis_cache_ctx {
 	struct rspamd_statfile_config *stcf;
@@ -36,6 +37,16 @@ struct rspamd_redis_cache_ctx {
 	const gchar *dbname;
 	const gchar *redis_object;
 	gdouble timeout;
+	struct rspamd_stat_cache_filter *filter;
+	struct event_base *ev_base;
+};
+
+/* Loading of learned digests to the shared filter */
+struct rspamd_redis_cache_sync {
+	struct rspamd_redis_cache_ctx *ctx;
+	struct upstream *selected;
+	redisAsyncContext *redis;
+	guint64 loaded;
 };
 
 struct rspamd_redis_cache_runtime {
@@ -143,6 +154,10 @@ rspamd_stat_cache_redis_get (redisAsyncContext *c, gpointer r, gpointer priv)
 			/* Unlearn flag */
 			task->flags |= RSPAMD_TASK_FLAG_UNLEARN;
 		}
+		else {
+			/* Filter has not excluded a message that has not been learned */
+			rspamd_stat_cache_filter_miss (rt->ctx->filter, task);
+		}
 
 		rspamd_upstream_ok (rt->selected);
 	}
@@ -156,17 +171,37 @@ rspamd_stat_cache_redis_get (redisAsyncContext *c, gpointer r, gpointer priv)
 }
 
 /* Called when we have learned the specified message id */
+static gboolean
+rspamd_stat_cache_redis_decode_id (const gchar *id, gsize len, guchar *out)
+{
+	return rspamd_decode_base32_buf (id, len, out,
+			rspamd_cryptobox_HASHBYTES + 8) >= rspamd_cryptobox_HASHBYTES;
+}
+
 static void
 rspamd_stat_cache_redis_set (redisAsyncContext *c, gpointer r, gpointer priv)
 {
 	struct rspamd_redis_cache_runtime *rt = priv;
 	struct rspamd_task *task;
+	guchar digest[rspamd_cryptobox_HASHBYTES + 8];
+	gchar *h;
 
 	task = rt->task;
 
 	if (c->err == 0) {
 		/* XXX: we ignore results here */
 		rspamd_upstream_ok (rt->selected);
+
+		/*
+		 * Digest is added once it is stored, so a filter load that clears
+		 * the filter concurrently finds it in the cache
+		 */
+		h = rspamd_mempool_get_variable (task->task_pool, "words_hash");
+
+		if (rt->ctx->filter && h &&
+				rspamd_stat_cache_redis_decode_id (h, strlen (h), digest)) {
+			rspamd_stat_cache_filter_add (rt->ctx->filter, digest);
+		}
 	}
 	else {
 		rspamd_upstream_fail (rt->selected, FALSE);
@@ -177,8 +212,10 @@ rspamd_stat_cache_redis_set (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 }
 
-static void
-rspamd_stat_cache_redis_generate_id (struct rspamd_task *task)
+/* Returns FALSE if the message has definitely not been learned */
+static gboolean
+rspamd_stat_cache_redis_generate_id (struct rspamd_task *task,
+		struct rspamd_redis_cache_ctx *ctx)
 {
 	rspamd_cryptobox_hash_state_t st;
 	rspamd_token_t *tok;
@@ -206,6 +243,129 @@ rspamd_stat_cache_redis_generate_id (struct rspamd_task *task)
 	b32out = rspamd_encode_base32 (out, sizeof (out));
 	g_assert (b32out != NULL);
 	rspamd_mempool_set_variable (task->task_pool, "words_hash", b32out, g_free);
+
+	return rspamd_stat_cache_filter_check (ctx->filter, task, out);
+}
+
+static void
+rspamd_stat_cache_redis_sync_fin (struct rspamd_redis_cache_sync *sync,
+		gboolean success)
+{
+	redisAsyncContext *redis;
+
+	if (success) {
+		msg_info ("loaded %L learned digests to the learn cache filter",
+				(gint64)sync->loaded);
+		rspamd_upstream_ok (sync->selected);
+	}
+	else {
+		rspamd_upstream_fail (sync->selected, FALSE);
+	}
+
+	rspamd_stat_cache_filter_sync_end (sync->ctx->filter, success);
+
+	if (sync->redis) {
+		redis = sync->redis;
+		sync->redis = NULL;
+		redisAsyncFree (redis);
+	}
+
+	g_free (sync);
+}
+
+/* Called on each part of HSCAN results */
+static void
+rspamd_stat_cache_redis_scan (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct rspamd_redis_cache_sync *sync = priv;
+	redisReply *reply = r, *cursor, *elts, *elt;
+	guchar digest[rspamd_cryptobox_HASHBYTES + 8];
+	guint i;
+
+	if (c->err != 0 || reply == NULL || reply->type != REDIS_REPLY_ARRAY ||
+			reply->elements != 2) {
+		msg_err ("cannot load learned digests from %s: %s",
+				rspamd_upstream_name (sync->selected),
+				c->err ? c->errstr : "bad reply");
+		rspamd_stat_cache_redis_sync_fin (sync, FALSE);
+
+		return;
+	}
+
+	cursor = reply->element[0];
+	elts = reply->element[1];
+
+	if (elts->type == REDIS_REPLY_ARRAY) {
+		/* Field and value pairs */
+		for (i = 0; i + 1 < elts->elements; i += 2) {
+			elt = elts->element[i];
+
+			if (elt->type == REDIS_REPLY_STRING &&
+					rspamd_stat_cache_redis_decode_id (elt->str, elt->len,
+							digest)) {
+				rspamd_stat_cache_filter_add (sync->ctx->filter, digest);
+				sync->loaded ++;
+			}
+		}
+	}
+
+	if (cursor->type != REDIS_REPLY_STRING ||
+			(cursor->len == 1 && cursor->str[0] == '0')) {
+		rspamd_stat_cache_redis_sync_fin (sync, cursor->type == REDIS_REPLY_STRING);
+	}
+	else if (redisAsyncCommand (c, rspamd_stat_cache_redis_scan, sync,
+			"HSCAN %s %b COUNT %d", sync->ctx->redis_object,
+			cursor->str, (size_t)cursor->len, REDIS_SCAN_COUNT) != REDIS_OK) {
+		rspamd_stat_cache_redis_sync_fin (sync, FALSE);
+	}
+}
+
+/* Loads digests of all learned messages to the shared filter */
+static void
+rspamd_stat_cache_redis_sync (struct rspamd_stat_async_elt *elt, gpointer d)
+{
+	struct rspamd_redis_cache_ctx *ctx = d;
+	struct rspamd_redis_cache_sync *sync;
+	struct upstream *up;
+	rspamd_inet_addr_t *addr;
+
+	up = rspamd_upstream_get (ctx->read_servers,
+			RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL,
+			0);
+
+	if (up == NULL || !rspamd_stat_cache_filter_sync_start (ctx->filter)) {
+		return;
+	}
+
+	sync = g_malloc0 (sizeof (*sync));
+	sync->ctx = ctx;
+	sync->selected = up;
+	addr = rspamd_upstream_addr (up);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		sync->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		sync->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	if (sync->redis == NULL) {
+		rspamd_stat_cache_redis_sync_fin (sync, FALSE);
+
+		return;
+	}
+
+	redisLibeventAttach (sync->redis, ctx->ev_base);
+	rspamd_redis_cache_maybe_auth (ctx, sync->redis);
+
+	if (redisAsyncCommand (sync->redis, rspamd_stat_cache_redis_scan, sync,
+			"HSCAN %s 0 COUNT %d", ctx->redis_object,
+			REDIS_SCAN_COUNT) != REDIS_OK) {
+		rspamd_stat_cache_redis_sync_fin (sync, FALSE);
+	}
 }
 
 static gboolean
@@ -355,6 +515,14 @@ rspamd_stat_cache_redis_init (struct rspamd_stat_ctx *ctx,
 
 	cache_ctx->stcf = stf;
 
+	if (st->classifier->cfg->cache_filter && ctx->ev_base) {
+		cache_ctx->filter = st->classifier->cfg->cache_filter;
+		cache_ctx->ev_base = ctx->ev_base;
+		rspamd_stat_ctx_register_async (rspamd_stat_cache_redis_sync,
+				NULL, cache_ctx,
+				rspamd_stat_cache_filter_resync (cache_ctx->filter));
+	}
+
 	return (gpointer)cache_ctx;
 }
 
@@ -402,6 +570,11 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	rt->task = task;
 	rt->ctx = ctx;
 
+	if (!learn && !rspamd_stat_cache_redis_generate_id (task, ctx)) {
+		/* No need to ask redis about a message that has not been learned */
+		return rt;
+	}
+
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
 
@@ -422,10 +595,6 @@ rspamd_stat_cache_redis_runtime (struct rspamd_task *task,
 	event_base_set (task->ev_base, &rt->timeout_event);
 	rspamd_redis_cache_maybe_auth (ctx, rt->redis);
 
-	if (!learn) {
-		rspamd_stat_cache_redis_generate_id (task);
-	}
-
 	return rt;
 }
 
@@ -448,6 +617,11 @@ rspamd_stat_cache_redis_check (struct rspamd_task *task,
 		return RSPAMD_LEARN_INGORE;
 	}
 
+	if (rt->redis == NULL) {
+		/* Skipped by the learned messages filter */
+		return RSPAMD_LEARN_OK;
+	}
+
 	double_to_tv (rt->ctx->timeout, &tv);
 
 	if (redisAsyncCommand (rt->redis, rspamd_stat_cache_redis_get, rt,
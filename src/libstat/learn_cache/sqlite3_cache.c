@@ -106,11 +106,107 @@ static struct rspamd_sqlite3_prstmt prepared_stmts[RSPAMD_STAT_CACHE_MAX] =
 	}
 };
 
+/* Number of learned digests loaded to the filter per event loop iteration */
+#define SQLITE_SYNC_CHUNK 1000
+
 struct rspamd_stat_sqlite3_ctx {
 	sqlite3 *db;
 	GArray *prstmt;
+	struct rspamd_stat_cache_filter *filter;
+	/* Loading of the filter */
+	struct event_base *ev_base;
+	struct event sync_ev;
+	sqlite3_stmt *sync_stmt;
+	gint64 sync_last_id;
+	guint64 sync_loaded;
 };
 
+static void
+rspamd_stat_cache_sqlite3_sync_fin (struct rspamd_stat_sqlite3_ctx *ctx,
+		gboolean success)
+{
+	if (success) {
+		msg_info ("loaded %L learned digests to the learn cache filter",
+				(gint64)ctx->sync_loaded);
+	}
+	else {
+		msg_err ("cannot load learned digests: %s", sqlite3_errmsg (ctx->db));
+	}
+
+	sqlite3_finalize (ctx->sync_stmt);
+	ctx->sync_stmt = NULL;
+	rspamd_stat_cache_filter_sync_end (ctx->filter, success);
+}
+
+/*
+ * Loads the next chunk of learned digests, the table might be large, so
+ * it is not read at once to avoid blocking of the event loop
+ */
+static void
+rspamd_stat_cache_sqlite3_sync_chunk (gint fd, short what, gpointer d)
+{
+	struct rspamd_stat_sqlite3_ctx *ctx = d;
+	struct timeval tv;
+	guint nrows = 0;
+	gint rc;
+
+	sqlite3_reset (ctx->sync_stmt);
+	sqlite3_bind_int64 (ctx->sync_stmt, 1, ctx->sync_last_id);
+
+	while ((rc = sqlite3_step (ctx->sync_stmt)) == SQLITE_ROW) {
+		ctx->sync_last_id = sqlite3_column_int64 (ctx->sync_stmt, 0);
+		nrows ++;
+
+		if (sqlite3_column_bytes (ctx->sync_stmt, 1) >= (gint)sizeof (guint64)) {
+			rspamd_stat_cache_filter_add (ctx->filter,
+					sqlite3_column_blob (ctx->sync_stmt, 1));
+			ctx->sync_loaded ++;
+		}
+	}
+
+	if (rc != SQLITE_DONE) {
+		rspamd_stat_cache_sqlite3_sync_fin (ctx, FALSE);
+	}
+	else if (nrows < SQLITE_SYNC_CHUNK) {
+		/* Rows inserted while loading have larger ids, so they are read too */
+		rspamd_stat_cache_sqlite3_sync_fin (ctx, TRUE);
+	}
+	else {
+		tv.tv_sec = 0;
+		tv.tv_usec = 0;
+		event_add (&ctx->sync_ev, &tv);
+	}
+}
+
+/* Loads digests of all learned messages to the shared filter */
+static void
+rspamd_stat_cache_sqlite3_sync (struct rspamd_stat_async_elt *elt, gpointer d)
+{
+	struct rspamd_stat_sqlite3_ctx *ctx = d;
+
+	if (ctx->sync_stmt != NULL ||
+			!rspamd_stat_cache_filter_sync_start (ctx->filter)) {
+		return;
+	}
+
+	if (sqlite3_prepare_v2 (ctx->db, "SELECT id, digest FROM learns "
+			"WHERE id>?1 ORDER BY id LIMIT " G_STRINGIFY (SQLITE_SYNC_CHUNK) ";",
+			-1, &ctx->sync_stmt, NULL) != SQLITE_OK) {
+		msg_err ("cannot load learned digests: %s", sqlite3_errmsg (ctx->db));
+		ctx->sync_stmt = NULL;
+		rspamd_stat_cache_filter_sync_end (ctx->filter, FALSE);
+
+		return;
+	}
+
+	ctx->sync_last_id = 0;
+	ctx->sync_loaded = 0;
+	event_set (&ctx->sync_ev, -1, EV_TIMEOUT,
+			rspamd_stat_cache_sqlite3_sync_chunk, ctx);
+	event_base_set (ctx->ev_base, &ctx->sync_ev);
+	rspamd_stat_cache_sqlite3_sync_chunk (-1, EV_TIMEOUT, ctx);
+}
+
 gpointer
 rspamd_stat_cache_sqlite3_init (struct rspamd_stat_ctx *ctx,
 		struct rspamd_config *cfg,
@@ -156,6 +252,13 @@ rspamd_stat_cache_sqlite3_init (struct rspamd_stat_ctx *ctx,
 			g_free (new);
 			new = NULL;
 		}
+		else if (st->classifier->cfg->cache_filter && ctx->ev_base) {
+			new->filter = st->classifier->cfg->cache_filter;
+			new->ev_base = ctx->ev_base;
+			rspamd_stat_ctx_register_async (rspamd_stat_cache_sqlite3_sync,
+					NULL, new,
+					rspamd_stat_cache_filter_resync (new->filter));
+		}
 	}
 
 	return new;
@@ -206,6 +309,14 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 
 		rspamd_cryptobox_hash_final (&st, out);
 
+		/* Save hash into variables */
+		rspamd_mempool_set_variable (task->task_pool, "words_hash", out, NULL);
+
+		if (!rspamd_stat_cache_filter_check (ctx->filter, task, out)) {
+			/* Has never been learned */
+			return RSPAMD_LEARN_OK;
+		}
+
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_START_DEF);
 		rc = rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
@@ -214,9 +325,6 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 		rspamd_sqlite3_run_prstmt (task->task_pool, ctx->db, ctx->prstmt,
 				RSPAMD_STAT_CACHE_TRANSACTION_COMMIT);
 
-		/* Save hash into variables */
-		rspamd_mempool_set_variable (task->task_pool, "words_hash", out, NULL);
-
 		if (rc == SQLITE_OK) {
 			/* We have some existing record in the table */
 			if (!!flag == !!is_spam) {
@@ -228,6 +336,8 @@ rspamd_stat_cache_sqlite3_check (struct rspamd_task *task,
 				return RSPAMD_LEARN_UNLEARN;
 			}
 		}
+
+		rspamd_stat_cache_filter_miss (ctx->filter, task);
 	}
 
 	return RSPAMD_LEARN_OK;
@@ -272,6 +382,7 @@ rspamd_stat_cache_sqlite3_learn (struct rspamd_task *task,
 				RSPAMD_STAT_CACHE_TRANSACTION_COMMIT);
 	}
 
+	rspamd_stat_cache_filter_add (ctx->filter, h);
 	rspamd_sqlite3_sync (ctx->db, NULL, NULL);
 
 	return RSPAMD_LEARN_OK;
@@ -283,6 +394,12 @@ rspamd_stat_cache_sqlite3_close (gpointer c)
 	struct rspamd_stat_sqlite3_ctx *ctx = (struct rspamd_stat_sqlite3_ctx *)c;
 
 	if (ctx != NULL) {
+		if (ctx->sync_stmt) {
+			event_del (&ctx->sync_ev);
+			sqlite3_finalize (ctx->sync_stmt);
+			rspamd_stat_cache_filter_sync_end (ctx->filter, FALSE);
+		}
+
 		rspamd_sqlite3_close_prstmt (ctx->db, ctx->prstmt);
 		sqlite3_close (ctx->db);
 		g_free (ctx);
@@ -68,6 +68,13 @@ typedef enum rspamd_stat_result_e {
  */
 void rspamd_stat_init (struct rspamd_config *cfg, struct event_base *ev_base);
 
+/**
+ * Allocate statistics structures that are shared between workers, must be
+ * called in the main process before workers are spawned
+ * @param cfg
+ */
+void rspamd_stat_init_shared (struct rspamd_config *cfg);
+
 /**
  * Finalize statistics
  */
@@ -92,6 +92,25 @@ static struct rspamd_stat_cache stat_caches[] = {
 #endif
 };
 
+void
+rspamd_stat_init_shared (struct rspamd_config *cfg)
+{
+	GList *cur;
+	struct rspamd_classifier_config *clf;
+
+	for (cur = cfg->classifiers; cur != NULL; cur = g_list_next (cur)) {
+		clf = cur->data;
+
+#ifdef WITH_HIREDIS
+		if (clf->backend && strcmp (clf->backend, "redis") == 0) {
+			rspamd_redis_init_shared (cfg, clf);
+		}
+#endif
+
+		rspamd_stat_cache_filter_init_shared (cfg, clf);
+	}
+}
+
 void
 rspamd_stat_init (struct rspamd_config *cfg, struct event_base *ev_base)
 {
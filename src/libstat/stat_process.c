@@ -327,6 +327,8 @@ rspamd_stat_process_tokenize (struct rspamd_stat_ctx *st_ctx,
 	}
 
 	g_assert (st_ctx != NULL);
+	rspamd_message_process_text_parts (task,
+			RSPAMD_MIME_TEXT_PART_STAGE_NORMALIZED);
 
 	for (i = 0; i < task->text_parts->len; i++) {
 		part = g_ptr_array_index (task->text_parts, i);
@@ -252,11 +252,97 @@ rspamd_tokenizer_osb_is_compat (struct rspamd_tokenizer_runtime *rt)
 }
 #endif
 
-struct token_pipe_entry {
-	guint64 h;
-	rspamd_stat_token_t *t;
-};
+/*
+ * Hashes all words in a single pass
+ */
+static void
+rspamd_tokenizer_osb_hash_words (struct rspamd_osb_tokenizer_config *osb_cf,
+		GArray *words, gboolean is_utf, const gchar *prefix, guint64 seed,
+		guint64 *hashes)
+{
+	rspamd_stat_token_t *token;
+	rspamd_ftok_t ftok;
+	guint w;
+
+	switch (osb_cf->ht) {
+	case RSPAMD_OSB_HASH_COMPAT:
+		for (w = 0; w < words->len; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
+			ftok.begin = token->begin;
+			ftok.len = token->len;
+			hashes[w] = rspamd_fstrhash_lc (&ftok, is_utf);
+		}
+		break;
+	case RSPAMD_OSB_HASH_XXHASH:
+		/* We know that the words are normalized */
+		for (w = 0; w < words->len; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
+			hashes[w] = rspamd_cryptobox_fast_hash_specific (
+					RSPAMD_CRYPTOBOX_XXHASH64,
+					token->begin, token->len, osb_cf->seed);
+		}
+		break;
+	default:
+		for (w = 0; w < words->len; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
+			rspamd_cryptobox_siphash ((guchar *)&hashes[w], token->begin,
+					token->len, osb_cf->sk);
+
+			if (prefix) {
+				hashes[w] ^= seed;
+			}
+		}
+		break;
+	}
+}
+
+/*
+ * Combines the last word of the sequence with the previous ones
+ */
+static inline guint
+rspamd_tokenizer_osb_add_pairs (struct rspamd_osb_tokenizer_config *osb_cf,
+		const guint64 *seq_hashes, rspamd_stat_token_t **seq_words,
+		guint last, guint npairs, guint flags,
+		guchar *slab, gsize token_size, gpointer *out)
+{
+	rspamd_token_t *new_tok;
+	guint32 h1, h2;
+	guint i;
+
+	for (i = 1; i <= npairs; i ++) {
+		new_tok = (rspamd_token_t *)(slab + token_size * (i - 1));
+		new_tok->flags = flags;
+		new_tok->t1 = seq_words[last];
+		new_tok->t2 = seq_words[last - i];
+
+		if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
+			h1 = ((guint32)seq_hashes[last]) * primes[0] +
+					((guint32)seq_hashes[last - i]) * primes[i << 1];
+			h2 = ((guint32)seq_hashes[last]) * primes[1] +
+					((guint32)seq_hashes[last - i]) * primes[(i << 1) - 1];
+			memcpy ((guchar *)&new_tok->data, &h1, sizeof (h1));
+			memcpy (((guchar *)&new_tok->data) + sizeof (h1), &h2, sizeof (h2));
+		}
+		else {
+			new_tok->data = seq_hashes[last] * primes[0] +
+					seq_hashes[last - i] * primes[i << 1];
+		}
+
+		new_tok->window_idx = i + 1;
+		out[i - 1] = new_tok;
+	}
+
+	return npairs;
+}
 
+/*
+ * Words are hashed first and then all tokens are produced into a single
+ * preallocated array. The order and the content of tokens are the same as
+ * with the sliding window: each word of the sequence (unigrams are excluded)
+ * starting from window_size one is combined with window_size - 1 previous
+ * words; short sequences combine the last but one word with the previous
+ * ones.
+ */
 gint
 rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		rspamd_mempool_t *pool,
@@ -266,13 +352,13 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		GPtrArray *result)
 {
 	rspamd_token_t *new_tok = NULL;
-	rspamd_stat_token_t *token;
+	rspamd_stat_token_t *token, **seq_words;
 	struct rspamd_osb_tokenizer_config *osb_cf;
-	guint64 cur, seed;
-	struct token_pipe_entry *hashpipe;
-	guint32 h1, h2;
-	gsize token_size;
-	guint processed = 0, i, w, window_size, token_flags = 0;
+	guint64 seed, *hashes, *seq_hashes;
+	gsize token_size, max_tokens, ntokens = 0;
+	guchar *tokens_slab;
+	gpointer *out;
+	guint nseq = 0, w, window_size, start, token_flags = 0;
 
 	if (words == NULL) {
 		return FALSE;
@@ -281,6 +367,10 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 	osb_cf = ctx->tkcf;
 	window_size = osb_cf->window_size;
 
+	if (words->len == 0) {
+		return TRUE;
+	}
+
 	if (prefix) {
 		seed = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
 				prefix, strlen (prefix), osb_cf->seed);
@@ -289,108 +379,66 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		seed = osb_cf->seed;
 	}
 
-	hashpipe = g_alloca (window_size * sizeof (hashpipe[0]));
-	for (i = 0; i < window_size; i++) {
-		hashpipe[i].h = 0xfe;
-		hashpipe[i].t = NULL;
-	}
-
 	token_size = sizeof (rspamd_token_t) +
 			sizeof (gdouble) * ctx->statfiles->len;
 	g_assert (token_size > 0);
+	/*
+	 * All tokens are allocated as a single block: each word produces at most
+	 * window_size - 1 tokens, so classifiers walk them sequentially in memory
+	 */
+	max_tokens = words->len * (window_size > 1 ? window_size - 1 : 1);
+	tokens_slab = rspamd_mempool_alloc0 (pool, token_size * max_tokens);
+	start = result->len;
+	g_ptr_array_set_size (result, start + max_tokens);
+	out = &result->pdata[start];
+
+	hashes = g_malloc (sizeof (*hashes) * words->len * 2);
+	seq_hashes = hashes + words->len;
+	seq_words = g_malloc (sizeof (*seq_words) * words->len);
+	rspamd_tokenizer_osb_hash_words (osb_cf, words, is_utf, prefix, seed,
+			hashes);
 
 	for (w = 0; w < words->len; w ++) {
 		token = &g_array_index (words, rspamd_stat_token_t, w);
 		token_flags = token->flags;
 
-		if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
-			rspamd_ftok_t ftok;
-
-			ftok.begin = token->begin;
-			ftok.len = token->len;
-			cur = rspamd_fstrhash_lc (&ftok, is_utf);
-		}
-		else {
-			/* We know that the words are normalized */
-			if (osb_cf->ht == RSPAMD_OSB_HASH_XXHASH) {
-				cur = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
-						token->begin, token->len, osb_cf->seed);
-			}
-			else {
-				rspamd_cryptobox_siphash ((guchar *)&cur, token->begin,
-						token->len, osb_cf->sk);
-
-				if (prefix) {
-					cur ^= seed;
-				}
-			}
-		}
-
 		if (token_flags & RSPAMD_STAT_TOKEN_FLAG_UNIGRAM) {
-			new_tok = rspamd_mempool_alloc0 (pool, token_size);
+			new_tok = (rspamd_token_t *)(tokens_slab + token_size * ntokens);
 			new_tok->flags = token_flags;
 			new_tok->t1 = token;
 			new_tok->t2 = token;
-			new_tok->data = cur;
+			new_tok->data = hashes[w];
 			new_tok->window_idx = 0;
-			g_ptr_array_add (result, new_tok);
+			out[ntokens ++] = new_tok;
 
 			continue;
 		}
 
-#define ADD_TOKEN do {\
-    new_tok = rspamd_mempool_alloc0 (pool, token_size); \
-    new_tok->flags = token_flags; \
-    new_tok->t1 = hashpipe[0].t; \
-    new_tok->t2 = hashpipe[i].t; \
-    if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) { \
-        h1 = ((guint32)hashpipe[0].h) * primes[0] + \
-            ((guint32)hashpipe[i].h) * primes[i << 1]; \
-        h2 = ((guint32)hashpipe[0].h) * primes[1] + \
-            ((guint32)hashpipe[i].h) * primes[(i << 1) - 1]; \
-        memcpy((guchar *)&new_tok->data, &h1, sizeof (h1)); \
-        memcpy(((guchar *)&new_tok->data) + sizeof (h1), &h2, sizeof (h2)); \
-    } \
-    else { \
-        new_tok->data = hashpipe[0].h * primes[0] + hashpipe[i].h * primes[i << 1]; \
-    } \
-    new_tok->window_idx = i + 1; \
-    g_ptr_array_add (result, new_tok); \
-  } while(0)
-
-		if (processed < window_size) {
-			/* Just fill a hashpipe */
-			++processed;
-			hashpipe[window_size - processed].h = cur;
-			hashpipe[window_size - processed].t = token;
-		}
-		else {
-			/* Shift hashpipe */
-			for (i = window_size - 1; i > 0; i--) {
-				hashpipe[i] = hashpipe[i - 1];
-			}
-			hashpipe[0].h = cur;
-			hashpipe[0].t = token;
-
-			processed++;
+		seq_hashes[nseq] = hashes[w];
+		seq_words[nseq] = token;
 
-			for (i = 1; i < window_size; i++) {
-				ADD_TOKEN;
-			}
+		if (nseq >= window_size) {
+			g_assert (ntokens + window_size - 1 <= max_tokens);
+			ntokens += rspamd_tokenizer_osb_add_pairs (osb_cf, seq_hashes,
+					seq_words, nseq, window_size - 1, token_flags,
+					tokens_slab + token_size * ntokens, token_size,
+					&out[ntokens]);
 		}
-	}
 
-	if (processed > 1 && processed <= window_size) {
-		processed --;
-		memmove (hashpipe, &hashpipe[window_size - processed],
-				processed * sizeof (hashpipe[0]));
+		nseq ++;
+	}
 
-		for (i = 1; i < processed; i++) {
-			ADD_TOKEN;
-		}
+	if (nseq > 1 && nseq <= window_size) {
+		g_assert (ntokens + nseq - 2 <= max_tokens);
+		ntokens += rspamd_tokenizer_osb_add_pairs (osb_cf, seq_hashes,
+				seq_words, nseq - 2, nseq - 2, token_flags,
+				tokens_slab + token_size * ntokens, token_size,
+				&out[ntokens]);
 	}
 
-#undef ADD_TOKEN
+	g_ptr_array_set_size (result, start + ntokens);
+	g_free (hashes);
+	g_free (seq_words);
 
 	return TRUE;
 }
@@ -24,6 +24,10 @@
 #include "unicode/utf8.h"
 #include "unicode/uchar.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 typedef gboolean (*token_get_function) (rspamd_stat_token_t * buf, gchar const **pos,
 		rspamd_stat_token_t * token,
 		GList **exceptions, gsize *rl, gboolean check_signature);
@@ -148,13 +152,107 @@ rspamd_tokenizer_get_word_compat (rspamd_stat_token_t * buf,
 	return TRUE;
 }
 
-static gboolean
-rspamd_tokenizer_get_word (rspamd_stat_token_t * buf,
+/*
+ * Returns the length of the leading run of ASCII alphanumeric characters
+ */
+static inline gint32
+rspamd_tokenizer_ascii_alnum_run (const gchar *p, gint32 len)
+{
+	gint32 i = 0;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_set1_epi8 ('0' - 1), nine = _mm_set1_epi8 ('9' + 1),
+			a = _mm_set1_epi8 ('a' - 1), z = _mm_set1_epi8 ('z' + 1),
+			lc = _mm_set1_epi8 (0x20);
+	__m128i v, lv, digit, alpha;
+	guint mask;
+
+	/* Bytes >= 0x80 are negative in signed comparisons and never match */
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128 ((const __m128i *)(p + i));
+		lv = _mm_or_si128 (v, lc);
+		digit = _mm_and_si128 (_mm_cmpgt_epi8 (v, zero),
+				_mm_cmpgt_epi8 (nine, v));
+		alpha = _mm_and_si128 (_mm_cmpgt_epi8 (lv, a),
+				_mm_cmpgt_epi8 (z, lv));
+		mask = ~_mm_movemask_epi8 (_mm_or_si128 (digit, alpha)) & 0xffff;
+
+		if (mask != 0) {
+			return i + __builtin_ctz (mask);
+		}
+	}
+#endif
+
+	for (; i < len; i ++) {
+		if (!g_ascii_isalnum (p[i])) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Returns the length of the leading run of ASCII characters that are neither
+ * alphanumeric nor, if sig is TRUE, signature delimiters
+ */
+static inline gint32
+rspamd_tokenizer_ascii_delim_run (const gchar *p, gint32 len, gboolean sig)
+{
+	gint32 i = 0;
+
+#ifdef __SSE2__
+	const __m128i zero = _mm_set1_epi8 ('0' - 1), nine = _mm_set1_epi8 ('9' + 1),
+			a = _mm_set1_epi8 ('a' - 1), z = _mm_set1_epi8 ('z' + 1),
+			lc = _mm_set1_epi8 (0x20), us = _mm_set1_epi8 ('_'),
+			dash = _mm_set1_epi8 ('-');
+	__m128i v, lv, stop;
+	guint mask;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128 ((const __m128i *)(p + i));
+		lv = _mm_or_si128 (v, lc);
+		/* Non ASCII */
+		stop = _mm_cmpgt_epi8 (_mm_setzero_si128 (), v);
+		stop = _mm_or_si128 (stop, _mm_and_si128 (_mm_cmpgt_epi8 (v, zero),
+				_mm_cmpgt_epi8 (nine, v)));
+		stop = _mm_or_si128 (stop, _mm_and_si128 (_mm_cmpgt_epi8 (lv, a),
+				_mm_cmpgt_epi8 (z, lv)));
+
+		if (sig) {
+			stop = _mm_or_si128 (stop, _mm_or_si128 (_mm_cmpeq_epi8 (v, us),
+					_mm_cmpeq_epi8 (v, dash)));
+		}
+
+		mask = _mm_movemask_epi8 (stop);
+
+		if (mask != 0) {
+			return i + __builtin_ctz (mask);
+		}
+	}
+#endif
+
+	for (; i < len; i ++) {
+		if ((guchar)p[i] >= 0x80 || g_ascii_isalnum (p[i]) ||
+				(sig && (p[i] == '_' || p[i] == '-'))) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+/*
+ * If ascii_fast is TRUE, then runs of ASCII characters are classified
+ * without decoding them and calling ICU, the result must be the same
+ */
+static inline gboolean
+rspamd_tokenizer_get_word_common (rspamd_stat_token_t * buf,
 		gchar const **cur, rspamd_stat_token_t * token,
 		GList **exceptions, gsize *rl,
-		gboolean check_signature)
+		gboolean check_signature, gboolean ascii_fast)
 {
-	gint32 i, siglen = 0, remain;
+	gint32 i, siglen = 0, remain, run, lim;
 	goffset pos;
 	const gchar *p, *s, *sig = NULL;
 	UChar32 uc;
@@ -192,16 +290,49 @@ rspamd_tokenizer_get_word (rspamd_stat_token_t * buf,
 	p = s;
 	token->begin = s;
 
+#define TOK_ISGRAPH(c) ((ascii_fast && (c) < 0x80) ? g_ascii_isgraph (c) : u_isgraph (c))
+#define TOK_ISALNUM(c) ((ascii_fast && (c) < 0x80) ? g_ascii_isalnum (c) : u_isalnum (c))
+
 	for (i = 0; i < remain; ) {
 		p = &s[i];
-		U8_NEXT (s, i, remain, uc); /* This also advances i */
 
-		if (uc < 0) {
-			if (i < remain) {
-				uc = 0xFFFD;
+		if (ascii_fast && state != process_signature) {
+			/* Runs must stop before the next exception */
+			lim = remain - i;
+
+			if (ex != NULL && ex->pos >= p - buf->begin) {
+				lim = MIN (lim, ex->pos - (p - buf->begin));
+			}
+
+			if (state == feed_token) {
+				run = rspamd_tokenizer_ascii_alnum_run (p, lim);
+				processed += run;
 			}
 			else {
-				return FALSE;
+				run = rspamd_tokenizer_ascii_delim_run (p, lim,
+						check_signature && pos != 0);
+			}
+
+			if (run > 0) {
+				i += run;
+				continue;
+			}
+		}
+
+		if (ascii_fast && (guchar)*p < 0x80) {
+			uc = (guchar)*p;
+			i ++;
+		}
+		else {
+			U8_NEXT (s, i, remain, uc); /* This also advances i */
+
+			if (uc < 0) {
+				if (i < remain) {
+					uc = 0xFFFD;
+				}
+				else {
+					return FALSE;
+				}
 			}
 		}
 
@@ -210,8 +341,8 @@ rspamd_tokenizer_get_word (rspamd_stat_token_t * buf,
 			if (ex != NULL && p - buf->begin == ex->pos) {
 				goto process_exception;
 			}
-			else if (u_isgraph (uc)) {
-				if (u_isalnum (uc)) {
+			else if (TOK_ISGRAPH (uc)) {
+				if (TOK_ISALNUM (uc)) {
 					state = feed_token;
 					token->begin = p;
 					continue;
@@ -229,7 +360,7 @@ rspamd_tokenizer_get_word (rspamd_stat_token_t * buf,
 				token->flags = RSPAMD_STAT_TOKEN_FLAG_TEXT;
 				goto process_exception;
 			}
-			else if (!u_isalnum (uc)) {
+			else if (!TOK_ISALNUM (uc)) {
 				token->flags = RSPAMD_STAT_TOKEN_FLAG_TEXT;
 				goto set_token;
 			}
@@ -248,6 +379,9 @@ rspamd_tokenizer_get_word (rspamd_stat_token_t * buf,
 		}
 	}
 
+#undef TOK_ISGRAPH
+#undef TOK_ISALNUM
+
 	/* Last character */
 	if (state == feed_token) {
 		p = &s[i];
@@ -325,6 +459,26 @@ process_exception:
 	return TRUE;
 }
 
+static gboolean
+rspamd_tokenizer_get_word (rspamd_stat_token_t * buf,
+		gchar const **cur, rspamd_stat_token_t * token,
+		GList **exceptions, gsize *rl,
+		gboolean check_signature)
+{
+	return rspamd_tokenizer_get_word_common (buf, cur, token, exceptions, rl,
+			check_signature, TRUE);
+}
+
+static gboolean
+rspamd_tokenizer_get_word_generic (rspamd_stat_token_t * buf,
+		gchar const **cur, rspamd_stat_token_t * token,
+		GList **exceptions, gsize *rl,
+		gboolean check_signature)
+{
+	return rspamd_tokenizer_get_word_common (buf, cur, token, exceptions, rl,
+			check_signature, FALSE);
+}
+
 GArray *
 rspamd_tokenize_text (const gchar *text, gsize len,
 					  enum rspamd_tokenize_type how,
@@ -360,6 +514,9 @@ rspamd_tokenize_text (const gchar *text, gsize len,
 	case RSPAMD_TOKENIZE_UTF:
 		func = rspamd_tokenizer_get_word;
 		break;
+	case RSPAMD_TOKENIZE_UTF_GENERIC:
+		func = rspamd_tokenizer_get_word_generic;
+		break;
 	default:
 		g_assert_not_reached ();
 		break;
@@ -28,7 +28,9 @@ struct rspamd_stat_tokenizer {
 enum rspamd_tokenize_type {
 	RSPAMD_TOKENIZE_UTF = 0,
 	RSPAMD_TOKENIZE_RAW,
-	RSPAMD_TOKENIZE_UCS
+	RSPAMD_TOKENIZE_UCS,
+	/* UTF tokenization without ASCII fast path, used to verify it */
+	RSPAMD_TOKENIZE_UTF_GENERIC
 };
 
 /* Compare two token nodes */
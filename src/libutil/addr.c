@@ -1146,6 +1146,21 @@ rspamd_inet_address_sendto (gint fd, const void *buf, gsize len, gint fl,
 	return r;
 }
 
+const struct sockaddr*
+rspamd_inet_address_get_sa (const rspamd_inet_addr_t *addr,
+		socklen_t *sz)
+{
+	g_assert (addr != NULL);
+
+	*sz = addr->slen;
+
+	if (addr->af == AF_UNIX) {
+		return (const struct sockaddr *)&addr->u.un->addr;
+	}
+
+	return &addr->u.in.addr.sa;
+}
+
 static gboolean
 rspamd_check_port_priority (const char *line, guint default_port,
 		guint *priority, gchar *out,
@@ -156,3 +156,131 @@ rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s)
 
 	return TRUE;
 }
+
+/* 512 bits blocks */
+#define BLOCKED_BLOOM_WORDS 16
+#define BLOCKED_BLOOM_BITS_PER_ELT 10
+#define BLOCKED_BLOOM_FUNCS 6
+
+struct rspamd_blocked_bloom_s {
+	gsize nblocks;
+	gsize nelts;
+	gint count;
+	gboolean shared;
+	guint32 *blocks;
+};
+
+rspamd_blocked_bloom_t *
+rspamd_blocked_bloom_create (gsize nelts, rspamd_mempool_t *pool)
+{
+	rspamd_blocked_bloom_t *bloom;
+	gsize nblocks, size;
+
+	nelts = MAX (nelts, 1);
+	nblocks = (nelts * BLOCKED_BLOOM_BITS_PER_ELT +
+			BLOCKED_BLOOM_WORDS * 32 - 1) / (BLOCKED_BLOOM_WORDS * 32);
+	size = nblocks * BLOCKED_BLOOM_WORDS * sizeof (guint32);
+
+	if (pool) {
+		bloom = rspamd_mempool_alloc0_shared (pool, sizeof (*bloom));
+		bloom->blocks = rspamd_mempool_alloc0_shared (pool, size);
+		bloom->shared = TRUE;
+	}
+	else {
+		bloom = g_malloc0 (sizeof (*bloom));
+		bloom->blocks = g_malloc0 (size);
+	}
+
+	bloom->nblocks = nblocks;
+	bloom->nelts = nelts;
+
+	return bloom;
+}
+
+void
+rspamd_blocked_bloom_destroy (rspamd_blocked_bloom_t *bloom)
+{
+	if (bloom && !bloom->shared) {
+		g_free (bloom->blocks);
+		g_free (bloom);
+	}
+}
+
+/*
+ * The upper half of hash selects a block, bits in the block are taken from
+ * the lower half mixed once more, 9 bits per function
+ */
+static inline guint32 *
+rspamd_blocked_bloom_block (rspamd_blocked_bloom_t *bloom, guint64 h,
+		guint64 *bits)
+{
+	*bits = (h ^ (h >> 29)) * G_GUINT64_CONSTANT (0xbf58476d1ce4e5b9);
+
+	return &bloom->blocks[((h >> 32) % bloom->nblocks) * BLOCKED_BLOOM_WORDS];
+}
+
+gboolean
+rspamd_blocked_bloom_add (rspamd_blocked_bloom_t *bloom, guint64 h)
+{
+	guint32 *block, mask, old;
+	guint64 bits;
+	guint i, bit;
+	gboolean added = FALSE;
+
+	block = rspamd_blocked_bloom_block (bloom, h, &bits);
+
+	for (i = 0; i < BLOCKED_BLOOM_FUNCS; i ++) {
+		bit = bits & 0x1ff;
+		bits >>= 9;
+		mask = 1U << (bit & 31);
+
+		if (!(block[bit >> 5] & mask)) {
+			old = g_atomic_int_or (&block[bit >> 5], mask);
+
+			if (!(old & mask)) {
+				added = TRUE;
+			}
+		}
+	}
+
+	if (added) {
+		g_atomic_int_inc (&bloom->count);
+	}
+
+	return added;
+}
+
+gboolean
+rspamd_blocked_bloom_check (rspamd_blocked_bloom_t *bloom, guint64 h)
+{
+	guint32 *block;
+	guint64 bits;
+	guint i, bit;
+
+	block = rspamd_blocked_bloom_block (bloom, h, &bits);
+
+	for (i = 0; i < BLOCKED_BLOOM_FUNCS; i ++) {
+		bit = bits & 0x1ff;
+		bits >>= 9;
+
+		if (!(block[bit >> 5] & (1U << (bit & 31)))) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+void
+rspamd_blocked_bloom_clear (rspamd_blocked_bloom_t *bloom)
+{
+	memset (bloom->blocks, 0,
+			bloom->nblocks * BLOCKED_BLOOM_WORDS * sizeof (guint32));
+	g_atomic_int_set (&bloom->count, 0);
+}
+
+gboolean
+rspamd_blocked_bloom_is_full (rspamd_blocked_bloom_t *bloom)
+{
+	return (gsize)g_atomic_int_get (&bloom->count) > bloom->nelts;
+}
@@ -2,6 +2,7 @@
 #define __RSPAMD_BLOOM_H__
 
 #include "config.h"
+#include "mem_pool.h"
 
 typedef struct rspamd_bloom_filter_s {
 	size_t asize;
@@ -45,4 +46,44 @@ gboolean rspamd_bloom_del (rspamd_bloom_filter_t * bloom, const gchar *s);
  */
 gboolean rspamd_bloom_check (rspamd_bloom_filter_t * bloom, const gchar *s);
 
+/*
+ * Blocked bloom filter of 64 bit hashes: all bits of an element are set in a
+ * single cache line, so a check costs one memory access. Bits are set
+ * atomically, so a filter allocated in shared memory could be updated by
+ * several processes. Elements cannot be deleted.
+ */
+typedef struct rspamd_blocked_bloom_s rspamd_blocked_bloom_t;
+
+/*
+ * Create blocked bloom filter for about `nelts` elements with 1% of false
+ * positives, filter is allocated in shared memory of `pool` if it is not NULL
+ */
+rspamd_blocked_bloom_t * rspamd_blocked_bloom_create (gsize nelts,
+		rspamd_mempool_t *pool);
+
+/*
+ * Destroy blocked bloom filter allocated without pool
+ */
+void rspamd_blocked_bloom_destroy (rspamd_blocked_bloom_t *bloom);
+
+/*
+ * Add hash to the filter, returns TRUE if it has not been there
+ */
+gboolean rspamd_blocked_bloom_add (rspamd_blocked_bloom_t *bloom, guint64 h);
+
+/*
+ * Check whether hash is in the filter (FALSE-POSITIVES are possible)
+ */
+gboolean rspamd_blocked_bloom_check (rspamd_blocked_bloom_t *bloom, guint64 h);
+
+/*
+ * Remove all elements from the filter
+ */
+void rspamd_blocked_bloom_clear (rspamd_blocked_bloom_t *bloom);
+
+/*
+ * Returns TRUE if more elements than the filter was created for are added
+ */
+gboolean rspamd_blocked_bloom_is_full (rspamd_blocked_bloom_t *bloom);
+
 #endif
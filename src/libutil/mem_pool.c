@@ -97,6 +97,30 @@ static rspamd_mempool_stat_t *mem_pool_stat = NULL;
 static gboolean env_checked = FALSE;
 static gboolean always_malloc = FALSE;
 
+/*
+ * Freed normal chains are not returned to libc but kept in power of two
+ * size classes to be reused by the subsequent pools. Chains that are larger
+ * than the last class are always allocated and freed directly.
+ */
+#define CHAIN_CACHE_MIN_SHIFT 12
+#define CHAIN_CACHE_MAX_SHIFT 24
+#define CHAIN_CACHE_CLASSES (CHAIN_CACHE_MAX_SHIFT - CHAIN_CACHE_MIN_SHIFT + 1)
+
+struct rspamd_mempool_chain_class {
+	GPtrArray *chains;                  /**< stack of free chains					*/
+	guint low;                          /**< minimum depth since the last trim		*/
+	guint trimmed;                      /**< number of bottom chains trimmed		*/
+};
+
+/*
+ * Cache is shared by all threads of a process: workers are single threaded,
+ * but pools may still be created by helper threads (e.g. fann training)
+ */
+G_LOCK_DEFINE_STATIC (chain_cache);
+static struct rspamd_mempool_chain_class chain_classes[CHAIN_CACHE_CLASSES];
+static gsize chain_cache_bytes = 0;
+static gsize chain_cache_limit = RSPAMD_MEMPOOL_CHAIN_CACHE_LIMIT;
+
 /**
  * Function that return free space in pool page
  * @param x pool page struct
@@ -163,6 +187,180 @@ rspamd_mempool_get_entry (const gchar *loc)
 	return rspamd_mempool_entry_new (loc);
 }
 
+/*
+ * Returns size class for a chain of the specified total size or -1 if
+ * a chain should not be cached
+ */
+static inline gint
+rspamd_mempool_chain_class (gsize total_size)
+{
+	gint shift = CHAIN_CACHE_MIN_SHIFT;
+
+	while (((gsize)1 << shift) < total_size) {
+		shift ++;
+
+		if (shift > CHAIN_CACHE_MAX_SHIFT) {
+			return -1;
+		}
+	}
+
+	return shift - CHAIN_CACHE_MIN_SHIFT;
+}
+
+static struct _pool_chain *
+rspamd_mempool_chain_cache_pop (gint cls)
+{
+	struct rspamd_mempool_chain_class *c = &chain_classes[cls];
+	struct _pool_chain *chain;
+	guint len;
+
+	G_LOCK (chain_cache);
+
+	if (c->chains == NULL || c->chains->len == 0) {
+		G_UNLOCK (chain_cache);
+		g_atomic_int_inc (&mem_pool_stat->chain_cache_misses);
+
+		return NULL;
+	}
+
+	len = c->chains->len - 1;
+	chain = g_ptr_array_index (c->chains, len);
+	g_ptr_array_set_size (c->chains, len);
+
+	c->low = MIN (c->low, len);
+	c->trimmed = MIN (c->trimmed, len);
+	chain_cache_bytes -= (gsize)1 << (cls + CHAIN_CACHE_MIN_SHIFT);
+	G_UNLOCK (chain_cache);
+
+	g_atomic_int_inc (&mem_pool_stat->chain_cache_hits);
+	g_atomic_int_add (&mem_pool_stat->chain_cache_bytes,
+			-((gint)1 << (cls + CHAIN_CACHE_MIN_SHIFT)));
+
+	return chain;
+}
+
+/*
+ * Returns normal or tmp chain to the cache or to the system allocator if
+ * it cannot be cached
+ */
+static void
+rspamd_mempool_chain_free (struct _pool_chain *chain)
+{
+	gsize total_size = chain->len + sizeof (struct _pool_chain);
+	struct rspamd_mempool_chain_class *c;
+	gint cls;
+
+	cls = rspamd_mempool_chain_class (total_size);
+	G_LOCK (chain_cache);
+
+	if (cls == -1 || ((gsize)1 << (cls + CHAIN_CACHE_MIN_SHIFT)) != total_size ||
+			chain_cache_bytes + total_size > chain_cache_limit) {
+		G_UNLOCK (chain_cache);
+		free (chain); /* Not g_free as we use system allocator */
+
+		return;
+	}
+
+	c = &chain_classes[cls];
+
+	if (c->chains == NULL) {
+		c->chains = g_ptr_array_new ();
+	}
+
+	g_ptr_array_add (c->chains, chain);
+	chain_cache_bytes += total_size;
+	G_UNLOCK (chain_cache);
+	g_atomic_int_add (&mem_pool_stat->chain_cache_bytes, total_size);
+}
+
+void
+rspamd_mempool_chain_cache_trim (void)
+{
+	struct rspamd_mempool_chain_class *c;
+	struct _pool_chain *chain;
+	guint8 *start, *end;
+	gsize page_size, total_size;
+	guint i, j;
+
+#ifdef HAVE_GETPAGESIZE
+	page_size = getpagesize ();
+#else
+	page_size = sysconf (_SC_PAGESIZE);
+#endif
+
+	G_LOCK (chain_cache);
+
+	for (i = 0; i < G_N_ELEMENTS (chain_classes); i ++) {
+		c = &chain_classes[i];
+
+		if (c->chains == NULL) {
+			continue;
+		}
+
+		/*
+		 * Chains below the low water mark have not been touched since the
+		 * previous trim, so we release their pages but keep the mappings
+		 */
+		total_size = (gsize)1 << (i + CHAIN_CACHE_MIN_SHIFT);
+
+		for (j = c->trimmed; j < c->low; j ++) {
+			chain = g_ptr_array_index (c->chains, j);
+			start = align_ptr (((guint8 *)chain) + sizeof (*chain), page_size);
+			end = (guint8 *)(((guintptr)chain + total_size) & ~(page_size - 1));
+
+			if (end > start) {
+#ifdef MADV_DONTNEED
+				(void)madvise (start, end - start, MADV_DONTNEED);
+#endif
+				g_atomic_int_add (&mem_pool_stat->chain_cache_trimmed,
+						end - start);
+			}
+		}
+
+		c->trimmed = MAX (c->trimmed, c->low);
+		c->low = c->chains->len;
+	}
+
+	G_UNLOCK (chain_cache);
+}
+
+void
+rspamd_mempool_chain_cache_limit (gsize limit)
+{
+	struct rspamd_mempool_chain_class *c;
+	struct _pool_chain *chain;
+	gsize total_size;
+	gint i;
+
+	G_LOCK (chain_cache);
+	chain_cache_limit = limit;
+
+	/* Drop the largest chains first */
+	for (i = G_N_ELEMENTS (chain_classes) - 1;
+			i >= 0 && chain_cache_bytes > chain_cache_limit; i --) {
+		c = &chain_classes[i];
+		total_size = (gsize)1 << (i + CHAIN_CACHE_MIN_SHIFT);
+
+		while (c->chains && c->chains->len > 0 &&
+				chain_cache_bytes > chain_cache_limit) {
+			chain = g_ptr_array_index (c->chains, c->chains->len - 1);
+			g_ptr_array_set_size (c->chains, c->chains->len - 1);
+			c->low = MIN (c->low, c->chains->len);
+			c->trimmed = MIN (c->trimmed, c->chains->len);
+			chain_cache_bytes -= total_size;
+
+			if (mem_pool_stat) {
+				g_atomic_int_add (&mem_pool_stat->chain_cache_bytes,
+						-((gint)total_size));
+			}
+
+			free (chain);
+		}
+	}
+
+	G_UNLOCK (chain_cache);
+}
+
 static struct _pool_chain *
 rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 {
@@ -170,6 +368,7 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 	gsize total_size = size + sizeof (struct _pool_chain) + MEM_ALIGNMENT,
 			optimal_size = 0;
 	gpointer map;
+	gint cls;
 
 	g_return_val_if_fail (size > 0, NULL);
 
@@ -215,11 +414,23 @@ rspamd_mempool_chain_new (gsize size, enum rspamd_mempool_chain_type pool_type)
 		g_atomic_int_add (&mem_pool_stat->bytes_allocated, total_size);
 	}
 	else {
+		cls = chain_cache_limit > 0 ? rspamd_mempool_chain_class (total_size) : -1;
+
+		if (cls != -1) {
+			total_size = (gsize)1 << (cls + CHAIN_CACHE_MIN_SHIFT);
+			map = rspamd_mempool_chain_cache_pop (cls);
+		}
+		else {
 #ifdef HAVE_MALLOC_SIZE
-		optimal_size = sys_alloc_size (total_size);
+			optimal_size = sys_alloc_size (total_size);
 #endif
-		total_size = MAX (total_size, optimal_size);
-		map = malloc (total_size);
+			total_size = MAX (total_size, optimal_size);
+			map = NULL;
+		}
+
+		if (map == NULL) {
+			map = malloc (total_size);
+		}
 
 		if (map == NULL) {
 			g_error ("%s: failed to allocate %"G_GSIZE_FORMAT" bytes",
@@ -713,7 +924,7 @@ rspamd_mempool_delete (rspamd_mempool_t * pool)
 					munmap ((void *)cur, len);
 				}
 				else {
-					free (cur); /* Not g_free as we use system allocator */
+					rspamd_mempool_chain_free (cur);
 				}
 			}
 
@@ -754,7 +965,7 @@ rspamd_mempool_cleanup_tmp (rspamd_mempool_t * pool)
 					-((gint)cur->len));
 			g_atomic_int_add (&mem_pool_stat->chunks_allocated, -1);
 
-			free (cur);
+			rspamd_mempool_chain_free (cur);
 		}
 
 		g_ptr_array_free (pool->pools[RSPAMD_MEMPOOL_TMP], TRUE);
@@ -777,14 +988,23 @@ rspamd_mempool_stat (rspamd_mempool_stat_t * st)
 		st->shared_chunks_allocated = mem_pool_stat->shared_chunks_allocated;
 		st->chunks_freed = mem_pool_stat->chunks_freed;
 		st->oversized_chunks = mem_pool_stat->oversized_chunks;
+		st->chain_cache_hits = mem_pool_stat->chain_cache_hits;
+		st->chain_cache_misses = mem_pool_stat->chain_cache_misses;
+		st->chain_cache_bytes = mem_pool_stat->chain_cache_bytes;
+		st->chain_cache_trimmed = mem_pool_stat->chain_cache_trimmed;
 	}
 }
 
 void
 rspamd_mempool_stat_reset (void)
 {
+	guint cached;
+
 	if (mem_pool_stat != NULL) {
+		/* Cache size is not a counter, so it is preserved */
+		cached = mem_pool_stat->chain_cache_bytes;
 		memset (mem_pool_stat, 0, sizeof (rspamd_mempool_stat_t));
+		mem_pool_stat->chain_cache_bytes = cached;
 	}
 }
 
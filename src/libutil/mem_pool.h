@@ -113,8 +113,17 @@ typedef struct memory_pool_stat_s {
 	guint chunks_freed;                 /**< chunks freed										*/
 	guint oversized_chunks;             /**< oversized chunks									*/
 	guint fragmented_size;                /**< fragmentation size								*/
+	guint chain_cache_hits;             /**< chains reused from the chains cache				*/
+	guint chain_cache_misses;           /**< chains allocated as the cache was empty			*/
+	guint chain_cache_bytes;            /**< bytes kept in the chains cache						*/
+	guint chain_cache_trimmed;          /**< bytes released from the idle cached chains			*/
 } rspamd_mempool_stat_t;
 
+/**
+ * Default high water mark for the free chains cache
+ */
+#define RSPAMD_MEMPOOL_CHAIN_CACHE_LIMIT (32 * 1024 * 1024)
+
 
 
 /**
@@ -290,6 +299,19 @@ void rspamd_mempool_stat (rspamd_mempool_stat_t *st);
  */
 void rspamd_mempool_stat_reset (void);
 
+/**
+ * Set the maximum amount of memory kept in the free chains cache of this
+ * process, zero disables caching
+ * @param limit limit in bytes
+ */
+void rspamd_mempool_chain_cache_limit (gsize limit);
+
+/**
+ * Release pages of the cached chains that have not been reused since the
+ * previous call, should be called periodically
+ */
+void rspamd_mempool_chain_cache_trim (void);
+
 /**
  * Get optimal pool size based on page size for this system
  * @return size of memory page in system
@@ -41,6 +41,7 @@ static enum rspamd_hs_check_state hs_suitable_cpu = RSPAMD_HS_UNCHECKED;
 struct rspamd_multipattern {
 #ifdef WITH_HYPERSCAN
 	hs_database_t *db;
+	hs_database_t *vdb;
 	hs_scratch_t *scratch[MAX_SCRATCH];
 	GArray *hs_pats;
 	GArray *hs_ids;
@@ -345,7 +346,7 @@ rspamd_multipattern_create_full (const gchar **patterns,
 
 #ifdef WITH_HYPERSCAN
 static gboolean
-rspamd_multipattern_try_load_hs (struct rspamd_multipattern *mp,
+rspamd_multipattern_try_load_hs (hs_database_t **db, const gchar *ext,
 		const guchar *hash)
 {
 	gchar fp[PATH_MAX];
@@ -356,11 +357,11 @@ rspamd_multipattern_try_load_hs (struct rspamd_multipattern *mp,
 		return FALSE;
 	}
 
-	rspamd_snprintf (fp, sizeof (fp), "%s/%*xs.hsmp", hs_cache_dir,
-			(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+	rspamd_snprintf (fp, sizeof (fp), "%s/%*xs.%s", hs_cache_dir,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, hash, ext);
 
 	if ((map = rspamd_file_xmap (fp, PROT_READ, &len, TRUE)) != NULL) {
-		if (hs_deserialize_database (map, len, &mp->db) == HS_SUCCESS) {
+		if (hs_deserialize_database (map, len, db) == HS_SUCCESS) {
 			munmap (map, len);
 			return TRUE;
 		}
@@ -374,7 +375,7 @@ rspamd_multipattern_try_load_hs (struct rspamd_multipattern *mp,
 }
 
 static void
-rspamd_multipattern_try_save_hs (struct rspamd_multipattern *mp,
+rspamd_multipattern_try_save_hs (hs_database_t *db, const gchar *ext,
 		const guchar *hash)
 {
 	gchar fp[PATH_MAX], np[PATH_MAX];
@@ -386,11 +387,11 @@ rspamd_multipattern_try_save_hs (struct rspamd_multipattern *mp,
 		return;
 	}
 
-	rspamd_snprintf (fp, sizeof (fp), "%s/%*xs.hsmp.tmp", hs_cache_dir,
-			(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+	rspamd_snprintf (fp, sizeof (fp), "%s/%*xs.%s.tmp", hs_cache_dir,
+			(gint)rspamd_cryptobox_HASHBYTES / 2, hash, ext);
 
 	if ((fd = rspamd_file_xopen (fp, O_WRONLY | O_CREAT | O_EXCL, 00644, 0)) != -1) {
-		if (hs_serialize_database (mp->db, &bytes, &len) == HS_SUCCESS) {
+		if (hs_serialize_database (db, &bytes, &len) == HS_SUCCESS) {
 			if (write (fd, bytes, len) == -1) {
 				msg_warn ("cannot write hyperscan cache to %s: %s",
 						fp, strerror (errno));
@@ -401,8 +402,8 @@ rspamd_multipattern_try_save_hs (struct rspamd_multipattern *mp,
 				free (bytes);
 				fsync (fd);
 
-				rspamd_snprintf (np, sizeof (np), "%s/%*xs.hsmp", hs_cache_dir,
-						(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+				rspamd_snprintf (np, sizeof (np), "%s/%*xs.%s", hs_cache_dir,
+						(gint)rspamd_cryptobox_HASHBYTES / 2, hash, ext);
 
 				if (rename (fp, np) == -1) {
 					msg_warn ("cannot rename hyperscan cache from %s to %s: %s",
@@ -423,6 +424,36 @@ rspamd_multipattern_try_save_hs (struct rspamd_multipattern *mp,
 }
 #endif
 
+#ifdef WITH_HYPERSCAN
+static gboolean
+rspamd_multipattern_compile_hs (struct rspamd_multipattern *mp,
+		guint mode, hs_platform_info_t *plt, hs_database_t **db,
+		GError **err)
+{
+	hs_compile_error_t *hs_errors;
+
+	if (hs_compile_multi ((const char *const *)mp->hs_pats->data,
+			(const unsigned int *)mp->hs_flags->data,
+			(const unsigned int *)mp->hs_ids->data,
+			mp->cnt,
+			mode,
+			plt,
+			db,
+			&hs_errors) != HS_SUCCESS) {
+
+		g_set_error (err, rspamd_multipattern_quark (), EINVAL,
+				"cannot create tree of regexp when processing '%s': %s",
+				g_array_index (mp->hs_pats, char *, hs_errors->expression),
+				hs_errors->message);
+		hs_free_compile_error (hs_errors);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+#endif
+
 gboolean
 rspamd_multipattern_compile (struct rspamd_multipattern *mp, GError **err)
 {
@@ -433,7 +464,6 @@ rspamd_multipattern_compile (struct rspamd_multipattern *mp, GError **err)
 	if (rspamd_hs_check ()) {
 		guint i;
 		hs_platform_info_t plt;
-		hs_compile_error_t *hs_errors;
 		guchar hash[rspamd_cryptobox_HASHBYTES];
 
 		if (mp->cnt > 0) {
@@ -441,30 +471,38 @@ rspamd_multipattern_compile (struct rspamd_multipattern *mp, GError **err)
 			rspamd_cryptobox_hash_update (&mp->hash_state, (void *)&plt, sizeof (plt));
 			rspamd_cryptobox_hash_final (&mp->hash_state, hash);
 
-			if (!rspamd_multipattern_try_load_hs (mp, hash)) {
-				if (hs_compile_multi ((const char *const *)mp->hs_pats->data,
-						(const unsigned int *)mp->hs_flags->data,
-						(const unsigned int *)mp->hs_ids->data,
-						mp->cnt,
-						HS_MODE_BLOCK,
-						&plt,
-						&mp->db,
-						&hs_errors) != HS_SUCCESS) {
-
-					g_set_error (err, rspamd_multipattern_quark (), EINVAL,
-							"cannot create tree of regexp when processing '%s': %s",
-							g_array_index (mp->hs_pats, char *, hs_errors->expression),
-							hs_errors->message);
-					hs_free_compile_error (hs_errors);
-
+			if (!rspamd_multipattern_try_load_hs (&mp->db, "hsmp", hash)) {
+				if (!rspamd_multipattern_compile_hs (mp, HS_MODE_BLOCK, &plt,
+						&mp->db, err)) {
 					return FALSE;
 				}
 			}
 
-			rspamd_multipattern_try_save_hs (mp, hash);
+			rspamd_multipattern_try_save_hs (mp->db, "hsmp", hash);
+
+			if (mp->flags & RSPAMD_MULTIPATTERN_VECTORED) {
+				/* Vectored database uses its own cache entry */
+				if (!rspamd_multipattern_try_load_hs (&mp->vdb, "hsmv", hash)) {
+					if (!rspamd_multipattern_compile_hs (mp, HS_MODE_VECTORED,
+							&plt, &mp->vdb, err)) {
+						hs_free_database (mp->db);
+						mp->db = NULL;
+
+						return FALSE;
+					}
+				}
+
+				rspamd_multipattern_try_save_hs (mp->vdb, "hsmv", hash);
+			}
 
 			for (i = 0; i < MAX_SCRATCH; i ++) {
 				g_assert (hs_alloc_scratch (mp->db, &mp->scratch[i]) == HS_SUCCESS);
+
+				if (mp->vdb) {
+					/* The same scratch is grown to fit both databases */
+					g_assert (hs_alloc_scratch (mp->vdb,
+							&mp->scratch[i]) == HS_SUCCESS);
+				}
 			}
 		}
 
@@ -606,6 +644,187 @@ rspamd_multipattern_lookup (struct rspamd_multipattern *mp,
 	return ret;
 }
 
+struct rspamd_multipattern_vec_cbdata {
+	struct rspamd_multipattern *mp;
+	const gchar **in;
+	const gsize *lens;
+	/* Offset of each buffer in the virtual concatenation of all buffers */
+	gsize *offsets;
+	guint cnt;
+	guint cur;
+	rspamd_multipattern_vec_cb_t cb;
+	gpointer ud;
+	guint nfound;
+	gint ret;
+};
+
+static gint
+rspamd_multipattern_vec_match (struct rspamd_multipattern_vec_cbdata *cbd,
+		guint strnum, gsize from, gsize to)
+{
+	guint idx = cbd->cur;
+	gint ret;
+
+	/* Matches usually come in order of their end offset, so start from the last buffer */
+	while (idx > 0 && to <= cbd->offsets[idx]) {
+		idx --;
+	}
+
+	while (idx + 1 < cbd->cnt && to > cbd->offsets[idx + 1]) {
+		idx ++;
+	}
+
+	cbd->cur = idx;
+
+	if (from < cbd->offsets[idx]) {
+		/* Match spans several buffers, so it is not a match in any of them */
+		return 0;
+	}
+
+	ret = cbd->cb (cbd->mp, idx, strnum, from - cbd->offsets[idx],
+			to - cbd->offsets[idx], cbd->in[idx], cbd->lens[idx], cbd->ud);
+
+	cbd->nfound ++;
+	cbd->ret = ret;
+
+	return ret;
+}
+
+#ifdef WITH_HYPERSCAN
+static gint
+rspamd_multipattern_hs_vec_cb (unsigned int id,
+		unsigned long long from,
+		unsigned long long to,
+		unsigned int flags,
+		void *ud)
+{
+	struct rspamd_multipattern_vec_cbdata *cbd = ud;
+
+	if (to > 0) {
+		if (from == HS_OFFSET_PAST_HORIZON) {
+			from = 0;
+		}
+
+		return rspamd_multipattern_vec_match (cbd, id, from, to);
+	}
+
+	return 0;
+}
+#endif
+
+static gint
+rspamd_multipattern_acism_vec_cb (int strnum, int textpos, void *context)
+{
+	struct rspamd_multipattern_vec_cbdata *cbd = context;
+	ac_trie_pat_t pat;
+	gsize to;
+
+	pat = g_array_index (cbd->mp->pats, ac_trie_pat_t, strnum);
+	to = cbd->offsets[cbd->cur] + textpos;
+
+	return rspamd_multipattern_vec_match (cbd, strnum, to - pat.len, to);
+}
+
+gint
+rspamd_multipattern_lookup_vectored (struct rspamd_multipattern *mp,
+		const gchar **in, const gsize *lens, guint cnt,
+		rspamd_multipattern_vec_cb_t cb,
+		gpointer ud, guint *pnfound)
+{
+	struct rspamd_multipattern_vec_cbdata cbd;
+	gsize *offsets;
+	gint ret = 0;
+	guint i;
+
+	g_assert (mp != NULL);
+
+	if (mp->cnt == 0 || !mp->compiled || cnt == 0) {
+		return 0;
+	}
+
+	offsets = g_new (gsize, cnt);
+	offsets[0] = 0;
+
+	for (i = 1; i < cnt; i ++) {
+		offsets[i] = offsets[i - 1] + lens[i - 1];
+	}
+
+	cbd.mp = mp;
+	cbd.in = in;
+	cbd.lens = lens;
+	cbd.offsets = offsets;
+	cbd.cnt = cnt;
+	cbd.cur = 0;
+	cbd.cb = cb;
+	cbd.ud = ud;
+	cbd.nfound = 0;
+	cbd.ret = 0;
+
+#ifdef WITH_HYPERSCAN
+	if (rspamd_hs_check ()) {
+		hs_scratch_t *scr = NULL;
+		unsigned int *hs_lens;
+		guint j;
+
+		g_assert (mp->vdb != NULL);
+
+		for (i = 0; i < MAX_SCRATCH; i ++) {
+			if (!(mp->scratch_used & (1 << i))) {
+				mp->scratch_used |= (1 << i);
+				scr = mp->scratch[i];
+				break;
+			}
+		}
+
+		g_assert (scr != NULL);
+
+		hs_lens = g_new (unsigned int, cnt);
+
+		for (j = 0; j < cnt; j ++) {
+			hs_lens[j] = lens[j];
+		}
+
+		ret = hs_scan_vector (mp->vdb, (const char * const *)in, hs_lens, cnt,
+				0, scr, rspamd_multipattern_hs_vec_cb, &cbd);
+
+		mp->scratch_used &= ~(1 << i);
+		g_free (hs_lens);
+		g_free (offsets);
+
+		if (ret == HS_SUCCESS) {
+			ret = 0;
+		}
+		else if (ret == HS_SCAN_TERMINATED) {
+			ret = cbd.ret;
+		}
+
+		if (pnfound) {
+			*pnfound = cbd.nfound;
+		}
+
+		return ret;
+	}
+#endif
+
+	/* Aho-Corasick has no notion of vectors, so scan buffers one by one */
+	for (i = 0; i < cnt && ret == 0; i ++) {
+		gint state = 0;
+
+		cbd.cur = i;
+		ret = acism_lookup (mp->t, in[i], lens[i],
+				rspamd_multipattern_acism_vec_cb, &cbd,
+				&state, mp->flags & RSPAMD_MULTIPATTERN_ICASE);
+	}
+
+	g_free (offsets);
+
+	if (pnfound) {
+		*pnfound = cbd.nfound;
+	}
+
+	return ret;
+}
+
 
 void
 rspamd_multipattern_destroy (struct rspamd_multipattern *mp)
@@ -623,6 +842,10 @@ rspamd_multipattern_destroy (struct rspamd_multipattern *mp)
 				}
 
 				hs_free_database (mp->db);
+
+				if (mp->vdb) {
+					hs_free_database (mp->vdb);
+				}
 			}
 
 			for (i = 0; i < mp->cnt; i ++) {
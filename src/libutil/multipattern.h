@@ -34,6 +34,8 @@ enum rspamd_multipattern_flags {
 	/* Not supported by acism */
 	RSPAMD_MULTIPATTERN_GLOB = (1 << 3),
 	RSPAMD_MULTIPATTERN_RE = (1 << 4),
+	/* Also build a database for rspamd_multipattern_lookup_vectored */
+	RSPAMD_MULTIPATTERN_VECTORED = (1 << 5),
 };
 
 struct rspamd_multipattern;
@@ -57,6 +59,27 @@ typedef gint (*rspamd_multipattern_cb_t) (struct rspamd_multipattern *mp,
 		gsize len,
 		void *context);
 
+/**
+ * Called on pattern match in a vectored lookup
+ * @param mp multipattern structure
+ * @param idx index of the buffer where pattern has been matched
+ * @param strnum number of pattern matched
+ * @param match_start start of the match relative to the buffer
+ * @param match_pos end of the match relative to the buffer
+ * @param text buffer where pattern has been matched
+ * @param len length of that buffer
+ * @param context userdata
+ * @return if 0 then search for another pattern, otherwise return this value to caller
+ */
+typedef gint (*rspamd_multipattern_vec_cb_t) (struct rspamd_multipattern *mp,
+		guint idx,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context);
+
 /**
  * Init multipart library and set the appropriate cache dir
  * @param cache_dir
@@ -130,6 +153,23 @@ gboolean rspamd_multipattern_compile (struct rspamd_multipattern *mp,
 gint rspamd_multipattern_lookup (struct rspamd_multipattern *mp,
 		const gchar *in, gsize len, rspamd_multipattern_cb_t cb,
 		gpointer ud, guint *pnfound);
+
+/**
+ * Lookups for patterns in several buffers at once. Matches never cross buffer
+ * boundaries and their offsets are relative to the buffer where they are found.
+ * Multipattern must be created with RSPAMD_MULTIPATTERN_VECTORED flag
+ * @param mp
+ * @param in vector of buffers
+ * @param lens lengths of buffers
+ * @param cnt number of buffers
+ * @param cb if callback returns non-zero, then search is terminated and that value is returned
+ * @param ud callback data
+ * @return
+ */
+gint rspamd_multipattern_lookup_vectored (struct rspamd_multipattern *mp,
+		const gchar **in, const gsize *lens, guint cnt,
+		rspamd_multipattern_vec_cb_t cb,
+		gpointer ud, guint *pnfound);
 /**
  * Get pattern string from multipattern identified by index
  * @param mp
@@ -2157,6 +2157,8 @@ rspamd_config_libs (struct rspamd_external_libs_ctx *ctx,
 
 	g_assert (cfg != NULL);
 
+	rspamd_mempool_chain_cache_limit (cfg->mempool_cache_size);
+
 	if (ctx != NULL) {
 		if (cfg->local_addrs) {
 			rspamd_config_radix_from_ucl (cfg, cfg->local_addrs,
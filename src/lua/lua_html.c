@@ -416,10 +416,9 @@ struct lua_html_traverse_ud {
 };
 
 static gboolean
-lua_html_node_foreach_cb (GNode *n, gpointer d)
+lua_html_node_foreach_cb (struct html_tag *tag, struct lua_html_traverse_ud *ud)
 {
-	struct lua_html_traverse_ud *ud = d;
-	struct html_tag *tag = n->data, **ptag;
+	struct html_tag **ptag;
 
 	if (tag && (ud->any || g_hash_table_lookup (ud->tags,
 			GSIZE_TO_POINTER (mum_hash64 (tag->id, 0))))) {
@@ -456,6 +455,7 @@ lua_html_foreach_tag (lua_State *L)
 	struct lua_html_traverse_ud ud;
 	const gchar *tagname;
 	gint id;
+	guint i;
 
 	ud.tags = g_hash_table_new (g_direct_hash, g_direct_equal);
 	ud.any = FALSE;
@@ -506,8 +506,12 @@ lua_html_foreach_tag (lua_State *L)
 			ud.cbref = luaL_ref (L, LUA_REGISTRYINDEX);
 			ud.L = L;
 
-			g_node_traverse (hc->html_tags, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
-					lua_html_node_foreach_cb, &ud);
+			for (i = 0; i < hc->html_tags->len; i ++) {
+				if (lua_html_node_foreach_cb (
+						g_ptr_array_index (hc->html_tags, i), &ud)) {
+					break;
+				}
+			}
 
 			luaL_unref (L, LUA_REGISTRYINDEX, ud.cbref);
 		}
@@ -551,14 +555,11 @@ lua_html_tag_get_parent (lua_State *L)
 {
 	LUA_TRACE_POINT;
 	struct html_tag *tag = lua_check_html_tag (L, 1), **ptag;
-	GNode *node;
 
 	if (tag != NULL) {
-		node = tag->parent;
-
-		if (node && node->data) {
+		if (tag->parent) {
 			ptag = lua_newuserdata (L, sizeof (gpointer));
-			*ptag = node->data;
+			*ptag = tag->parent;
 			rspamd_lua_setclass (L, "rspamd{html_tag}", -1);
 		}
 	}
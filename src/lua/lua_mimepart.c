@@ -458,6 +458,19 @@ lua_check_textpart (lua_State * L)
 	return ud ? *((struct rspamd_mime_text_part **)ud) : NULL;
 }
 
+/* Text parts are processed on demand if `lazy_text_parts` is set */
+static struct rspamd_mime_text_part *
+lua_check_textpart_stage (lua_State * L, enum rspamd_mime_text_part_stage stage)
+{
+	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+
+	if (part != NULL) {
+		rspamd_mime_text_part_process (part->task, part, stage);
+	}
+
+	return part;
+}
+
 static struct rspamd_mime_part *
 lua_check_mimepart (lua_State * L)
 {
@@ -471,7 +484,8 @@ static gint
 lua_textpart_is_utf (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 
 	if (part == NULL || IS_PART_EMPTY (part)) {
 		lua_pushboolean (L, FALSE);
@@ -488,7 +502,8 @@ static gint
 lua_textpart_has_8bit_raw (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 
 	if (part) {
 		if (part->flags & RSPAMD_MIME_TEXT_PART_FLAG_8BIT) {
@@ -509,7 +524,8 @@ static gint
 lua_textpart_has_8bit (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 
 	if (part) {
 		if (part->flags & RSPAMD_MIME_TEXT_PART_FLAG_8BIT_ENCODED) {
@@ -531,7 +547,8 @@ static gint
 lua_textpart_get_content (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 	struct rspamd_lua_text *t;
 	gsize len;
 	const gchar *start, *type = NULL;
@@ -587,7 +604,8 @@ static gint
 lua_textpart_get_raw_content (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 	struct rspamd_lua_text *t;
 
 	if (part == NULL || IS_PART_EMPTY (part)) {
@@ -608,7 +626,8 @@ static gint
 lua_textpart_get_content_oneline (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 	struct rspamd_lua_text *t;
 
 	if (part == NULL || IS_PART_EMPTY (part)) {
@@ -629,7 +648,8 @@ static gint
 lua_textpart_get_length (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 
 	if (part == NULL) {
 		lua_pushnil (L);
@@ -666,7 +686,8 @@ static gint
 lua_textpart_get_urls_length (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 	GList *cur;
 	guint total = 0;
 	struct rspamd_process_exception *ex;
@@ -693,7 +714,8 @@ static gint
 lua_textpart_get_lines_count (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 
 	if (part == NULL) {
 		lua_pushnil (L);
@@ -714,7 +736,8 @@ static gint
 lua_textpart_get_words_count (lua_State *L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_NORMALIZED);
 
 	if (part == NULL) {
 		lua_pushnil (L);
@@ -735,7 +758,8 @@ static gint
 lua_textpart_get_words (lua_State *L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_NORMALIZED);
 	rspamd_stat_token_t *w;
 	guint i;
 
@@ -764,7 +788,8 @@ static gint
 lua_textpart_is_empty (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 
 	if (part == NULL) {
 		lua_pushnil (L);
@@ -796,7 +821,8 @@ static gint
 lua_textpart_get_html (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 	struct html_content **phc;
 
 	if (part == NULL || part->html == NULL) {
@@ -815,7 +841,8 @@ static gint
 lua_textpart_get_language (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_LANGUAGE);
 
 	if (part != NULL) {
 		if (part->language != NULL && part->language[0] != '\0') {
@@ -837,7 +864,8 @@ static gint
 lua_textpart_get_languages (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_LANGUAGE);
 	guint i;
 	struct rspamd_lang_detector_res *cur;
 
@@ -917,7 +945,8 @@ static gint
 lua_textpart_get_fuzzy_hashes (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_NORMALIZED);
 	rspamd_mempool_t *pool = rspamd_lua_check_mempool (L, 2);
 	guchar key[rspamd_cryptobox_HASHBYTES], digest[rspamd_cryptobox_HASHBYTES],
 			hexdigest[rspamd_cryptobox_HASHBYTES * 2 + 1], numbuf[64];
@@ -1022,7 +1051,8 @@ static gint
 lua_textpart_get_stats (lua_State * L)
 {
 	LUA_TRACE_POINT;
-	struct rspamd_mime_text_part *part = lua_check_textpart (L);
+	struct rspamd_mime_text_part *part = lua_check_textpart_stage (L,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 
 	if (part != NULL) {
 		lua_createtable (L, 0, 9);
@@ -229,6 +229,12 @@ LUA_FUNCTION_DEF (task, get_emails);
  * @return {table rspamd_text_part} list of text parts
  */
 LUA_FUNCTION_DEF (task, get_text_parts);
+/***
+ * @method task:process_text_parts()
+ * Performs all processing of text parts (decoding, tokenization, language
+ * detection and words statistics) delayed by `lazy_text_parts` option
+ */
+LUA_FUNCTION_DEF (task, process_text_parts);
 /***
  * @method task:get_parts()
  * Get all mime parts found in a message
@@ -940,6 +946,7 @@ static const struct luaL_reg tasklib_m[] = {
 	LUA_INTERFACE_DEF (task, get_rawbody),
 	LUA_INTERFACE_DEF (task, get_emails),
 	LUA_INTERFACE_DEF (task, get_text_parts),
+	LUA_INTERFACE_DEF (task, process_text_parts),
 	LUA_INTERFACE_DEF (task, get_parts),
 	LUA_INTERFACE_DEF (task, get_request_header),
 	LUA_INTERFACE_DEF (task, set_request_header),
@@ -1694,6 +1701,10 @@ lua_task_get_urls (lua_State * L)
 	gsize sz;
 
 	if (task) {
+		/* Urls are extracted when text parts are processed */
+		rspamd_message_process_text_parts (task,
+				RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
+
 		if (lua_gettop (L) >= 2) {
 			need_emails = lua_toboolean (L, 2);
 		}
@@ -1740,6 +1751,9 @@ lua_task_has_urls (lua_State * L)
 	gboolean need_emails = FALSE, ret = FALSE;
 
 	if (task) {
+		rspamd_message_process_text_parts (task,
+				RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
+
 		if (lua_gettop (L) >= 2) {
 			need_emails = lua_toboolean (L, 2);
 		}
@@ -1841,6 +1855,9 @@ lua_task_get_emails (lua_State * L)
 	struct lua_tree_cb_data cb;
 
 	if (task) {
+		rspamd_message_process_text_parts (task,
+				RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
+
 		lua_createtable (L, g_hash_table_size (task->emails), 0);
 		cb.i = 1;
 		cb.L = L;
@@ -1853,6 +1870,23 @@ lua_task_get_emails (lua_State * L)
 	return 1;
 }
 
+static gint
+lua_task_process_text_parts (lua_State * L)
+{
+	LUA_TRACE_POINT;
+	struct rspamd_task *task = lua_check_task (L, 1);
+
+	if (task != NULL) {
+		rspamd_message_process_text_parts (task,
+				RSPAMD_MIME_TEXT_PART_STAGE_NORMALIZED);
+	}
+	else {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	return 0;
+}
+
 static gint
 lua_task_get_text_parts (lua_State * L)
 {
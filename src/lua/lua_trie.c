@@ -261,6 +261,8 @@ lua_trie_search_mime (lua_State *L)
 	if (trie && task) {
 		for (i = 0; i < task->text_parts->len; i ++) {
 			part = g_ptr_array_index (task->text_parts, i);
+			rspamd_mime_text_part_process (task, part,
+					RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 
 			if (!IS_PART_EMPTY (part) && part->content != NULL) {
 				text = part->content->data;
@@ -608,6 +608,9 @@ chartable_symbol_callback (struct rspamd_task *task, void *unused)
 	struct rspamd_mime_text_part *part;
 	struct chartable_ctx *chartable_module_ctx = chartable_get_context (task->cfg);
 
+	rspamd_message_process_text_parts (task,
+			RSPAMD_MIME_TEXT_PART_STAGE_NORMALIZED);
+
 	for (i = 0; i < task->text_parts->len; i ++) {
 		part = g_ptr_array_index (task->text_parts, i);
 		rspamd_chartable_process_part (task, part, chartable_module_ctx);
@@ -661,6 +664,8 @@ chartable_url_symbol_callback (struct rspamd_task *task, void *unused)
 	gdouble cur_score = 0.0;
 	struct chartable_ctx *chartable_module_ctx = chartable_get_context (task->cfg);
 
+	rspamd_message_process_text_parts (task,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 	g_hash_table_iter_init (&it, task->urls);
 
 	while (g_hash_table_iter_next (&it, &k, &v)) {
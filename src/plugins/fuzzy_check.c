@@ -35,6 +35,7 @@
 #include "libutil/map.h"
 #include "libutil/map_helpers.h"
 #include "libmime/images.h"
+#include "libmime/part_cache.h"
 #include "libserver/worker_util.h"
 #include "libserver/mempool_vars_internal.h"
 #include "fuzzy_wire.h"
@@ -82,6 +83,7 @@ struct fuzzy_rule {
 	GPtrArray *fuzzy_headers;
 	GString *hash_key;
 	GString *shingles_key;
+	guint64 parts_cache_key;
 	struct rspamd_cryptobox_keypair *local_key;
 	struct rspamd_cryptobox_pubkey *peer_key;
 	double max_score;
@@ -674,6 +676,11 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj,
 	rspamd_cryptobox_hash (rule->shingles_key->str, shingles_key_str,
 			strlen (shingles_key_str), NULL, 0);
 	rule->shingles_key->len = 16;
+	/* Distinguishes results of rules with different keys in parts cache */
+	rule->parts_cache_key = rspamd_cryptobox_fast_hash (
+			rule->hash_key->str, rule->hash_key->len,
+			rspamd_cryptobox_fast_hash (rule->shingles_key->str,
+					rule->shingles_key->len, rule->alg));
 
 	if (rspamd_upstreams_count (rule->servers) == 0) {
 		msg_err_config ("no servers defined for fuzzy rule with name: %s",
@@ -1364,6 +1371,92 @@ fuzzy_cmd_set_cached (struct fuzzy_rule *rule,
 	rspamd_mempool_set_variable (pool, key, data, NULL);
 }
 
+/*
+ * Shingles of the same text are shared between tasks by parts cache, short
+ * texts hashes are not stored as they include subject of a message
+ */
+static guint64
+fuzzy_cmd_shared_key (struct fuzzy_rule *rule,
+		struct rspamd_mime_text_part *part)
+{
+	guint64 key = rule->parts_cache_key;
+	guint flags;
+
+	/*
+	 * Part digest covers the decoded content only, but words and thus
+	 * shingles also depend on the charset the content is converted from,
+	 * on HTML processing and on the language used for stemming, which might
+	 * be taken from another part of a message
+	 */
+	flags = part->flags & (RSPAMD_MIME_TEXT_PART_FLAG_UTF |
+			RSPAMD_MIME_TEXT_PART_FLAG_HTML);
+	key = rspamd_cryptobox_fast_hash (&flags, sizeof (flags), key);
+
+	if (part->real_charset) {
+		key = rspamd_cryptobox_fast_hash (part->real_charset,
+				strlen (part->real_charset), key);
+	}
+
+	if (part->language && part->language[0] != '\0' && IS_PART_UTF (part)) {
+		key = rspamd_cryptobox_fast_hash (part->language,
+				strlen (part->language), key);
+	}
+
+	return key;
+}
+
+static gboolean
+fuzzy_cmd_get_shared (struct rspamd_task *task,
+		struct fuzzy_rule *rule,
+		rspamd_mempool_t *pool,
+		struct rspamd_mime_text_part *part,
+		struct rspamd_cached_shingles *cached)
+{
+	guchar buf[RSPAMD_PART_CACHE_DATA_LEN];
+	gssize r;
+
+	r = rspamd_part_cache_lookup (task, part->mime_part,
+			RSPAMD_PART_CACHE_SHINGLES, fuzzy_cmd_shared_key (rule, part), buf);
+
+	if (r == sizeof (cached->digest)) {
+		memcpy (cached->digest, buf, sizeof (cached->digest));
+		cached->sh = NULL;
+
+		return TRUE;
+	}
+	else if (r == sizeof (cached->digest) + sizeof (struct rspamd_shingle)) {
+		memcpy (cached->digest, buf, sizeof (cached->digest));
+		cached->sh = rspamd_mempool_alloc (pool, sizeof (struct rspamd_shingle));
+		memcpy (cached->sh, buf + sizeof (cached->digest),
+				sizeof (struct rspamd_shingle));
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void
+fuzzy_cmd_set_shared (struct rspamd_task *task,
+		struct fuzzy_rule *rule,
+		struct rspamd_mime_text_part *part,
+		struct rspamd_cached_shingles *cached)
+{
+	guchar buf[sizeof (cached->digest) + sizeof (struct rspamd_shingle)];
+	gsize len = sizeof (cached->digest);
+
+	memcpy (buf, cached->digest, sizeof (cached->digest));
+
+	if (cached->sh) {
+		memcpy (buf + len, cached->sh, sizeof (struct rspamd_shingle));
+		len += sizeof (struct rspamd_shingle);
+	}
+
+	rspamd_part_cache_insert (task, part->mime_part,
+			RSPAMD_PART_CACHE_SHINGLES, fuzzy_cmd_shared_key (rule, part),
+			buf, len);
+}
+
 /*
  * Create fuzzy command from a text part
  */
@@ -1435,34 +1528,45 @@ fuzzy_cmd_from_text_part (struct rspamd_task *task,
 			encshcmd = rspamd_mempool_alloc0 (pool, sizeof (*encshcmd));
 			shcmd = &encshcmd->cmd;
 
-			/*
-			 * Generate hash from all words in the part
-			 */
-			rspamd_cryptobox_hash_init (&st, rule->hash_key->str, rule->hash_key->len);
-			words = fuzzy_preprocess_words (part, pool);
+			if (fuzzy_cmd_get_shared (task, rule, pool, part, cached)) {
+				memcpy (shcmd->basic.digest, cached->digest,
+						sizeof (cached->digest));
 
-			for (i = 0; i < words->len; i ++) {
-				word = &g_array_index (words, rspamd_stat_token_t, i);
-				rspamd_cryptobox_hash_update (&st, word->begin, word->len);
+				if (cached->sh != NULL) {
+					memcpy (&shcmd->sgl, cached->sh, sizeof (shcmd->sgl));
+					shcmd->basic.shingles_count = RSPAMD_SHINGLE_SIZE;
+				}
 			}
+			else {
+				/*
+				 * Generate hash from all words in the part
+				 */
+				rspamd_cryptobox_hash_init (&st, rule->hash_key->str, rule->hash_key->len);
+				words = fuzzy_preprocess_words (part, pool);
+
+				for (i = 0; i < words->len; i ++) {
+					word = &g_array_index (words, rspamd_stat_token_t, i);
+					rspamd_cryptobox_hash_update (&st, word->begin, word->len);
+				}
 
-			rspamd_cryptobox_hash_final (&st, shcmd->basic.digest);
-
+				rspamd_cryptobox_hash_final (&st, shcmd->basic.digest);
+
+				msg_debug_pool ("loading shingles of type %s with key %*xs",
+						rule->algorithm_str,
+						16, rule->shingles_key->str);
+				sh = rspamd_shingles_from_text (words,
+						rule->shingles_key->str, pool,
+						rspamd_shingles_default_filter, NULL,
+						rule->alg);
+				if (sh != NULL) {
+					memcpy (&shcmd->sgl, sh, sizeof (shcmd->sgl));
+					shcmd->basic.shingles_count = RSPAMD_SHINGLE_SIZE;
+				}
 
-			msg_debug_pool ("loading shingles of type %s with key %*xs",
-					rule->algorithm_str,
-					16, rule->shingles_key->str);
-			sh = rspamd_shingles_from_text (words,
-					rule->shingles_key->str, pool,
-					rspamd_shingles_default_filter, NULL,
-					rule->alg);
-			if (sh != NULL) {
-				memcpy (&shcmd->sgl, sh, sizeof (shcmd->sgl));
-				shcmd->basic.shingles_count = RSPAMD_SHINGLE_SIZE;
+				cached->sh = sh;
+				memcpy (cached->digest, shcmd->basic.digest, sizeof (cached->digest));
+				fuzzy_cmd_set_shared (task, rule, part, cached);
 			}
-
-			cached->sh = sh;
-			memcpy (cached->digest, shcmd->basic.digest, sizeof (cached->digest));
 		}
 
 		/*
@@ -2604,6 +2708,9 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 	}
 
 	if (G_LIKELY (!(flags & FUZZY_CHECK_FLAG_NOTEXT))) {
+		rspamd_message_process_text_parts (task,
+				RSPAMD_MIME_TEXT_PART_STAGE_NORMALIZED);
+
 		for (i = 0; i < task->text_parts->len; i ++) {
 			gdouble fac;
 			gboolean short_text = FALSE;
@@ -1872,6 +1872,8 @@ surbl_test_url (struct rspamd_task *task, void *user_data)
 	rspamd_mempool_add_destructor (task->task_pool,
 		(rspamd_mempool_destruct_t)g_hash_table_unref,
 		param->tree);
+	rspamd_message_process_text_parts (task,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 	g_hash_table_foreach (task->urls, surbl_tree_url_callback, param);
 
 	/* We also need to check and process img URLs */
@@ -1919,6 +1921,8 @@ surbl_test_redirector (struct rspamd_task *task, void *user_data)
 	param->suffix = NULL;
 	param->redirector_requests = 0;
 	param->ctx = surbl_module_ctx;
+	rspamd_message_process_text_parts (task,
+			RSPAMD_MIME_TEXT_PART_STAGE_CONTENT);
 	g_hash_table_foreach (task->urls, surbl_tree_redirector_callback, param);
 
 	/* We also need to check and process img URLs */
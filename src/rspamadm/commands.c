@@ -29,6 +29,8 @@ extern struct rspamadm_command fuzzyconvert_command;
 extern struct rspamadm_command signtool_command;
 extern struct rspamadm_command lua_command;
 extern struct rspamadm_command dkim_keygen_command;
+extern struct rspamadm_command lang_compile_command;
+extern struct rspamadm_command learn_command;
 
 const struct rspamadm_command *commands[] = {
 	&help_command,
@@ -43,6 +45,8 @@ const struct rspamadm_command *commands[] = {
 	&signtool_command,
 	&lua_command,
 	&dkim_keygen_command,
+	&lang_compile_command,
+	&learn_command,
 	NULL
 };
 
@@ -0,0 +1,165 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "cfg_file.h"
+#include "cfg_rcl.h"
+#include "rspamd.h"
+#include "libmime/lang_detection.h"
+
+static gchar *config = NULL;
+static gchar *output = NULL;
+extern struct rspamd_main *rspamd_main;
+
+static void rspamadm_lang_compile (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd);
+static const char *rspamadm_lang_compile_help (gboolean full_help,
+		const struct rspamadm_command *cmd);
+
+struct rspamadm_command lang_compile_command = {
+		.name = "langcompile",
+		.flags = 0,
+		.help = rspamadm_lang_compile_help,
+		.run = rspamadm_lang_compile,
+		.lua_subrs = NULL,
+};
+
+static GOptionEntry entries[] = {
+		{"config", 'c', 0, G_OPTION_ARG_STRING, &config,
+				"Config file to use", NULL},
+		{"output", 'o', 0, G_OPTION_ARG_FILENAME, &output,
+				"Output file (default: `compiled` option of lang_detection)", NULL},
+		{NULL,  0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const char *
+rspamadm_lang_compile_help (gboolean full_help,
+		const struct rspamadm_command *cmd)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Compile languages data for language detection\n\n"
+				"Usage: rspamadm langcompile [-c <config_name>] [-o <file>]\n"
+				"Where options are:\n\n"
+				"-c: config file to use\n"
+				"-o: output file, `compiled` option of lang_detection "
+				"section by default\n"
+				"--help: shows available options and commands\n\n"
+				"Compiled tables are loaded instead of languages data if "
+				"they are set in config:\n\n"
+				"lang_detection {\n"
+				"  compiled = \"${DBDIR}/languages.bin\";\n"
+				"}\n\n"
+				"Tables are ignored when languages data is changed, so they "
+				"should be compiled again after upgrade";
+	}
+	else {
+		help_str = "Compile languages data for language detection";
+	}
+
+	return help_str;
+}
+
+static void
+config_logger (rspamd_mempool_t *pool, gpointer ud)
+{
+	struct rspamd_main *rm = ud;
+
+	rm->cfg->log_type = RSPAMD_LOG_CONSOLE;
+	rm->cfg->log_level = G_LOG_LEVEL_WARNING;
+
+	rspamd_set_logger (rm->cfg, g_quark_from_static_string ("langcompile"),
+			&rm->logger, rm->server_pool);
+
+	if (rspamd_log_open_priv (rm->logger, rm->workers_uid, rm->workers_gid) ==
+			-1) {
+		fprintf (stderr, "Fatal error, cannot open logfile, exiting\n");
+		exit (EXIT_FAILURE);
+	}
+}
+
+static void
+rspamadm_lang_compile (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	const gchar *confdir;
+	const ucl_object_t *section, *elt;
+	struct rspamd_config *cfg = rspamd_main->cfg;
+
+	context = g_option_context_new (
+			"langcompile - compile languages data for language detection");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (config == NULL) {
+		if ((confdir = g_hash_table_lookup (ucl_vars, "CONFDIR")) == NULL) {
+			confdir = RSPAMD_CONFDIR;
+		}
+
+		config = g_strdup_printf ("%s%c%s", confdir, G_DIR_SEPARATOR,
+				"rspamd.conf");
+	}
+
+	cfg->cfg_name = config;
+
+	/* Language detector is created when config is read */
+	if (!rspamd_config_read (cfg, cfg->cfg_name, config_logger, rspamd_main,
+			ucl_vars)) {
+		rspamd_fprintf (stderr, "cannot load config %s\n", config);
+		exit (EXIT_FAILURE);
+	}
+
+	if (output == NULL) {
+		section = ucl_object_lookup (cfg->rcl_obj, "lang_detection");
+		elt = section ? ucl_object_lookup (section, "compiled") : NULL;
+
+		if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+			rspamd_fprintf (stderr, "no output file specified and no "
+					"lang_detection.compiled option in config\n");
+			exit (EXIT_FAILURE);
+		}
+
+		output = g_strdup (ucl_object_tostring (elt));
+	}
+
+	if (cfg->lang_det == NULL) {
+		rspamd_fprintf (stderr, "cannot load languages data\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (!rspamd_language_detector_save (cfg->lang_det, output, &error)) {
+		rspamd_fprintf (stderr, "cannot save compiled languages: %e\n", error);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_printf ("saved compiled languages to %s\n", output);
+
+	exit (EXIT_SUCCESS);
+}
@@ -0,0 +1,897 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "rspamadm.h"
+#include "cfg_file.h"
+#include "cfg_rcl.h"
+#include "rspamd.h"
+#include "task.h"
+#include "message.h"
+#include "lua/lua_common.h"
+#include "libstat/stat_internal.h"
+#include "unix-std.h"
+#include "khash.h"
+#include <sys/wait.h>
+#include <poll.h>
+
+/*
+ * Offline learning of statistics: messages are parsed and tokenized by
+ * several worker processes, tokens are sent to the main process, which
+ * checks learn cache, aggregates tokens counts and writes them to the
+ * backend once per batch of messages.
+ */
+
+static gchar *config = NULL;
+static gchar **spam_paths = NULL;
+static gchar **ham_paths = NULL;
+static gchar *classifier = NULL;
+static gint nworkers = 0;
+static gint batch = 1000;
+extern struct rspamd_main *rspamd_main;
+extern module_t *modules[];
+extern worker_t *workers[];
+
+static void rspamadm_learn (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd);
+static const char *rspamadm_learn_help (gboolean full_help,
+		const struct rspamadm_command *cmd);
+
+struct rspamadm_command learn_command = {
+		.name = "learn",
+		.flags = 0,
+		.help = rspamadm_learn_help,
+		.run = rspamadm_learn,
+		.lua_subrs = NULL,
+};
+
+static GOptionEntry entries[] = {
+		{"config", 'c', 0, G_OPTION_ARG_STRING, &config,
+				"Config file to use", NULL},
+		{"spam", 's', 0, G_OPTION_ARG_FILENAME_ARRAY, &spam_paths,
+				"Mbox file or maildir with spam (can be repeated)", NULL},
+		{"ham", 'h', 0, G_OPTION_ARG_FILENAME_ARRAY, &ham_paths,
+				"Mbox file or maildir with ham (can be repeated)", NULL},
+		{"classifier", 'C', 0, G_OPTION_ARG_STRING, &classifier,
+				"Classifier to learn (default: the first one)", NULL},
+		{"workers", 'n', 0, G_OPTION_ARG_INT, &nworkers,
+				"Number of processes to parse messages (default: number of CPUs)",
+				NULL},
+		{"batch", 'b', 0, G_OPTION_ARG_INT, &batch,
+				"Number of messages learned at once (default: 1000)", NULL},
+		{NULL,  0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+enum rspamadm_learn_record_type {
+	RSPAMADM_LEARN_HAM = 0,
+	RSPAMADM_LEARN_SPAM = 1,
+	RSPAMADM_LEARN_ERROR,
+};
+
+/* Sent by workers for each message, followed by tokens */
+struct rspamadm_learn_record {
+	guint32 type;
+	guint32 ntokens;
+};
+
+struct rspamadm_learn_source {
+	gchar *path;
+	gboolean is_spam;
+	gboolean is_mbox;
+};
+
+/* Increments for ham and spam statfiles */
+struct rspamadm_learn_counts {
+	gint32 v[2];
+};
+
+KHASH_INIT (rspamadm_learn_tokens, guint64, struct rspamadm_learn_counts, 1,
+		kh_int64_hash_func, kh_int64_hash_equal);
+/* Messages learned in this run: digest -> is_spam */
+KHASH_INIT (rspamadm_learn_digests, guint64, guint8, 1,
+		kh_int64_hash_func, kh_int64_hash_equal);
+
+struct rspamadm_learn_ctx {
+	struct rspamd_config *cfg;
+	struct rspamd_stat_ctx *st_ctx;
+	struct rspamd_classifier *cl;
+	struct event_base *ev_base;
+	GArray *sources;
+	khash_t(rspamadm_learn_tokens) *tokens;
+	khash_t(rspamadm_learn_digests) *digests;
+	/* Tasks waiting for learn cache update */
+	GPtrArray *pending;
+	GArray *buf;
+	gint64 learns[2];
+	guint64 learned;
+	guint64 relearned;
+	guint64 skipped;
+	guint64 failed;
+};
+
+static const char *
+rspamadm_learn_help (gboolean full_help,
+		const struct rspamadm_command *cmd)
+{
+	const char *help_str;
+
+	if (full_help) {
+		help_str = "Learn statistics from mailboxes\n\n"
+				"Usage: rspamadm learn [-c <config_name>] [-n <workers>] "
+				"[-s <spam>]... [-h <ham>]...\n"
+				"Where options are:\n\n"
+				"-c: config file to use\n"
+				"-s: mbox file or maildir with spam, can be repeated\n"
+				"-h: mbox file or maildir with ham, can be repeated\n"
+				"-C: classifier to learn, the first one by default\n"
+				"-n: number of processes to parse messages\n"
+				"-b: number of messages learned at once (1000 by default)\n"
+				"--help: shows available options and commands\n\n"
+				"Messages are learned like with `rspamc learn_spam` and "
+				"`rspamc learn_ham`, however, tokens counts are aggregated "
+				"and written to the backend once per batch. Learn cache "
+				"is used to skip messages that have been already learned. "
+				"Directories are read recursively, each file there is a "
+				"message";
+	}
+	else {
+		help_str = "Learn statistics from mailboxes";
+	}
+
+	return help_str;
+}
+
+static void
+config_logger (rspamd_mempool_t *pool, gpointer ud)
+{
+	struct rspamd_main *rm = ud;
+
+	rm->cfg->log_type = RSPAMD_LOG_CONSOLE;
+	rm->cfg->log_level = G_LOG_LEVEL_WARNING;
+
+	rspamd_set_logger (rm->cfg, g_quark_from_static_string ("learn"),
+			&rm->logger, rm->server_pool);
+
+	if (rspamd_log_open_priv (rm->logger, rm->workers_uid, rm->workers_gid) ==
+			-1) {
+		fprintf (stderr, "Fatal error, cannot open logfile, exiting\n");
+		exit (EXIT_FAILURE);
+	}
+}
+
+static void
+rspamadm_learn_add_path (struct rspamadm_learn_ctx *ctx, const gchar *path,
+		gboolean is_spam, gboolean toplevel)
+{
+	struct rspamadm_learn_source src;
+	struct stat st;
+	GDir *dir;
+	const gchar *name;
+	gchar *fpath, hdr[5];
+	gint fd;
+
+	if (stat (path, &st) == -1) {
+		rspamd_fprintf (stderr, "cannot stat %s: %s\n", path,
+				strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	if (S_ISDIR (st.st_mode)) {
+		dir = g_dir_open (path, 0, NULL);
+
+		if (dir == NULL) {
+			rspamd_fprintf (stderr, "cannot open directory %s\n", path);
+			exit (EXIT_FAILURE);
+		}
+
+		while ((name = g_dir_read_name (dir)) != NULL) {
+			if (name[0] == '.') {
+				continue;
+			}
+
+			fpath = g_build_filename (path, name, NULL);
+			rspamadm_learn_add_path (ctx, fpath, is_spam, FALSE);
+			g_free (fpath);
+		}
+
+		g_dir_close (dir);
+	}
+	else if (S_ISREG (st.st_mode)) {
+		src.path = g_strdup (path);
+		src.is_spam = is_spam;
+		src.is_mbox = FALSE;
+
+		/* Files inside directories are always single messages */
+		if (toplevel && (fd = open (path, O_RDONLY)) != -1) {
+			if (read (fd, hdr, sizeof (hdr)) == sizeof (hdr) &&
+					memcmp (hdr, "From ", sizeof (hdr)) == 0) {
+				src.is_mbox = TRUE;
+			}
+
+			close (fd);
+		}
+
+		g_array_append_val (ctx->sources, src);
+	}
+}
+
+static gboolean
+rspamadm_learn_write_full (gint fd, const void *buf, gsize len)
+{
+	const guchar *p = buf;
+	gssize r;
+
+	while (len > 0) {
+		r = write (fd, p, len);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return FALSE;
+		}
+
+		p += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamadm_learn_read_full (gint fd, void *buf, gsize len)
+{
+	guchar *p = buf;
+	gssize r;
+
+	while (len > 0) {
+		r = read (fd, p, len);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return FALSE;
+		}
+		else if (r == 0) {
+			return FALSE;
+		}
+
+		p += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+/* Parses and tokenizes a single message in a worker */
+static void
+rspamadm_learn_worker_message (struct rspamadm_learn_ctx *ctx, gint fd,
+		const gchar *begin, gsize len, gboolean is_spam)
+{
+	struct rspamd_task *task;
+	struct rspamadm_learn_record rec;
+	rspamd_token_t *tok;
+	guint i;
+
+	task = rspamd_task_new (NULL, ctx->cfg, NULL, ctx->cfg->lang_det);
+	task->msg.begin = begin;
+	task->msg.len = len;
+	g_array_set_size (ctx->buf, 0);
+
+	if (len > 0 && rspamd_message_parse (task)) {
+		rspamd_message_process (task);
+		rspamd_stat_process_tokenize (ctx->st_ctx, task);
+		rec.type = is_spam ? RSPAMADM_LEARN_SPAM : RSPAMADM_LEARN_HAM;
+
+		PTR_ARRAY_FOREACH (task->tokens, i, tok) {
+			g_array_append_val (ctx->buf, tok->data);
+		}
+	}
+	else {
+		rec.type = RSPAMADM_LEARN_ERROR;
+	}
+
+	rec.ntokens = ctx->buf->len;
+	rspamd_task_free (task);
+
+	if (!rspamadm_learn_write_full (fd, &rec, sizeof (rec)) ||
+			!rspamadm_learn_write_full (fd, ctx->buf->data,
+					ctx->buf->len * sizeof (guint64))) {
+		_exit (EXIT_FAILURE);
+	}
+}
+
+/*
+ * All workers walk the same list of sources, and each of them processes
+ * every nworkers-th message, so large mailboxes are split as well
+ */
+static void
+rspamadm_learn_worker (struct rspamadm_learn_ctx *ctx, gint fd, guint wid)
+{
+	struct rspamadm_learn_source *src;
+	struct rspamadm_learn_record rec;
+	gchar *map, *p, *end, *body;
+	goffset next;
+	gsize len;
+	guint64 idx = 0;
+	guint i;
+
+	for (i = 0; i < ctx->sources->len; i ++) {
+		src = &g_array_index (ctx->sources, struct rspamadm_learn_source, i);
+		map = rspamd_file_xmap (src->path, PROT_READ, &len, TRUE);
+
+		if (map == NULL) {
+			if (idx ++ % nworkers == wid) {
+				msg_err ("cannot map %s: %s", src->path, strerror (errno));
+				rec.type = RSPAMADM_LEARN_ERROR;
+				rec.ntokens = 0;
+
+				if (!rspamadm_learn_write_full (fd, &rec, sizeof (rec))) {
+					_exit (EXIT_FAILURE);
+				}
+			}
+
+			continue;
+		}
+
+		if (src->is_mbox) {
+			p = map;
+			end = map + len;
+
+			while (p < end) {
+				next = rspamd_substring_search (p, end - p, "\nFrom ", 6);
+				next = next == -1 ? end - p : next + 1;
+
+				if (idx ++ % nworkers == wid) {
+					/* Skip envelope line */
+					body = memchr (p, '\n', next);
+					body = body ? body + 1 : p + next;
+					rspamadm_learn_worker_message (ctx, fd, body,
+							p + next - body, src->is_spam);
+				}
+
+				p += next;
+			}
+		}
+		else if (idx ++ % nworkers == wid) {
+			rspamadm_learn_worker_message (ctx, fd, map, len, src->is_spam);
+		}
+
+		munmap (map, len);
+	}
+}
+
+static struct rspamd_task *
+rspamadm_learn_task_new (struct rspamadm_learn_ctx *ctx)
+{
+	struct rspamd_task *task;
+
+	task = rspamd_task_new (NULL, ctx->cfg, NULL, NULL);
+	task->ev_base = ctx->ev_base;
+	task->s = rspamd_session_create (task->task_pool, NULL, NULL, NULL, task);
+
+	return task;
+}
+
+/* Redis backends and caches are asynchronous */
+static void
+rspamadm_learn_wait (struct rspamd_task *task)
+{
+	while (rspamd_session_events_pending (task->s) > 0) {
+		event_base_loop (task->ev_base, EVLOOP_ONCE);
+	}
+}
+
+static GPtrArray *
+rspamadm_learn_tokens_array (struct rspamd_task *task, guint n)
+{
+	GPtrArray *tokens;
+
+	tokens = g_ptr_array_sized_new (n);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_ptr_array_free_hard, tokens);
+	task->tokens = tokens;
+
+	return tokens;
+}
+
+static gboolean
+rspamadm_learn_flush_statfile (struct rspamadm_learn_ctx *ctx,
+		struct rspamd_statfile *st, GError **err)
+{
+	struct rspamd_task *task;
+	struct rspamadm_learn_counts counts;
+	rspamd_token_t *tok;
+	gdouble *deltas;
+	guchar *slab;
+	gpointer rt;
+	gsize token_size;
+	guint64 data;
+	gint64 learns, i;
+	guint j, cls = st->stcf->is_spam ? 1 : 0;
+	gboolean ret = TRUE;
+
+	learns = ctx->learns[cls];
+	task = rspamadm_learn_task_new (ctx);
+	token_size = sizeof (rspamd_token_t) +
+			sizeof (gdouble) * ctx->st_ctx->statfiles->len;
+	slab = rspamd_mempool_alloc0 (task->task_pool,
+			token_size * MAX (kh_size (ctx->tokens), 1));
+	rspamadm_learn_tokens_array (task, kh_size (ctx->tokens));
+
+	kh_foreach (ctx->tokens, data, counts, {
+		if (counts.v[cls] != 0) {
+			tok = (rspamd_token_t *)(slab + token_size * task->tokens->len);
+			tok->data = data;
+			tok->values[st->id] = counts.v[cls];
+			g_ptr_array_add (task->tokens, tok);
+		}
+	});
+
+	if (task->tokens->len == 0 && learns == 0) {
+		rspamd_task_free (task);
+
+		return TRUE;
+	}
+
+	rt = st->backend->runtime (task, st->stcf, TRUE, st->bkcf);
+
+	if (rt == NULL) {
+		g_set_error (err, rspamd_stat_quark (), 500,
+				"cannot open backend for %s", st->stcf->symbol);
+		rspamd_task_free (task);
+
+		return FALSE;
+	}
+
+	if (!(ctx->cl->cfg->flags & RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND)) {
+		/* Backend stores absolute values, so add counts to the current ones */
+		deltas = g_malloc (sizeof (*deltas) * MAX (task->tokens->len, 1));
+
+		PTR_ARRAY_FOREACH (task->tokens, j, tok) {
+			deltas[j] = tok->values[st->id];
+			tok->values[st->id] = 0;
+		}
+
+		st->backend->process_tokens (task, task->tokens, st->id, rt);
+		rspamadm_learn_wait (task);
+
+		PTR_ARRAY_FOREACH (task->tokens, j, tok) {
+			tok->values[st->id] = MAX (tok->values[st->id] + deltas[j], 0);
+		}
+
+		g_free (deltas);
+	}
+
+	/* Incrementing backends add learns with tokens */
+	rspamd_mempool_set_variable (task->task_pool, "stat_learns", &learns, NULL);
+
+	if (!st->backend->learn_tokens (task, task->tokens, st->id, rt)) {
+		g_set_error (err, rspamd_stat_quark (), 500, "cannot push "
+				"learned results to the backend for %s", st->stcf->symbol);
+		ret = FALSE;
+	}
+	else {
+		rspamadm_learn_wait (task);
+
+		for (i = 0; i < learns; i ++) {
+			st->backend->inc_learns (task, rt, ctx->st_ctx);
+		}
+
+		for (i = 0; i > learns; i --) {
+			st->backend->dec_learns (task, rt, ctx->st_ctx);
+		}
+	}
+
+	if (!st->backend->finalize_learn (task, rt, ctx->st_ctx,
+			ret ? err : NULL)) {
+		ret = FALSE;
+	}
+
+	rspamd_task_free (task);
+
+	return ret;
+}
+
+static gboolean
+rspamadm_learn_flush (struct rspamadm_learn_ctx *ctx, GError **err)
+{
+	struct rspamd_classifier *cl = ctx->cl;
+	struct rspamd_statfile *st;
+	struct rspamd_task *task;
+	gpointer rt;
+	guint i;
+	gint id;
+
+	for (i = 0; i < cl->statfiles_ids->len; i ++) {
+		id = g_array_index (cl->statfiles_ids, gint, i);
+		st = g_ptr_array_index (ctx->st_ctx->statfiles, id);
+
+		if (!rspamadm_learn_flush_statfile (ctx, st, err)) {
+			return FALSE;
+		}
+	}
+
+	/* Messages are marked as learned only after their tokens are written */
+	PTR_ARRAY_FOREACH (ctx->pending, i, task) {
+		if (cl->cache && cl->cachecf) {
+			rt = cl->cache->runtime (task, cl->cachecf, TRUE);
+			cl->cache->learn (task,
+					task->flags & RSPAMD_TASK_FLAG_LEARN_SPAM, rt);
+			rspamadm_learn_wait (task);
+		}
+
+		rspamd_task_free (task);
+	}
+
+	g_ptr_array_set_size (ctx->pending, 0);
+	kh_clear (rspamadm_learn_tokens, ctx->tokens);
+	ctx->learns[0] = 0;
+	ctx->learns[1] = 0;
+
+	return TRUE;
+}
+
+static void
+rspamadm_learn_message (struct rspamadm_learn_ctx *ctx, gboolean is_spam,
+		const guint64 *data, guint ntokens)
+{
+	struct rspamd_classifier *cl = ctx->cl;
+	struct rspamd_task *task;
+	struct rspamadm_learn_counts *counts;
+	rspamd_token_t *tok;
+	GError *err = NULL;
+	guchar *slab;
+	gpointer rt;
+	gsize token_size;
+	guint64 h;
+	guint i;
+	gint r, res;
+	gboolean unlearn = FALSE;
+	khiter_t k;
+
+	if ((cl->cfg->min_tokens > 0 && ntokens < cl->cfg->min_tokens) ||
+			(cl->cfg->max_tokens > 0 && ntokens > cl->cfg->max_tokens)) {
+		ctx->skipped ++;
+
+		return;
+	}
+
+	h = rspamd_cryptobox_fast_hash (data, ntokens * sizeof (*data),
+			rspamd_hash_seed ());
+	k = kh_put (rspamadm_learn_digests, ctx->digests, h, &r);
+
+	if (r == 0) {
+		if (kh_value (ctx->digests, k) == is_spam) {
+			ctx->skipped ++;
+
+			return;
+		}
+
+		/* Learned in this run as another class */
+		unlearn = TRUE;
+	}
+
+	kh_value (ctx->digests, k) = is_spam;
+
+	task = rspamadm_learn_task_new (ctx);
+	task->flags |= is_spam ? RSPAMD_TASK_FLAG_LEARN_SPAM :
+			RSPAMD_TASK_FLAG_LEARN_HAM;
+	token_size = sizeof (rspamd_token_t) +
+			sizeof (gdouble) * ctx->st_ctx->statfiles->len;
+	slab = rspamd_mempool_alloc0 (task->task_pool,
+			token_size * MAX (ntokens, 1));
+	rspamadm_learn_tokens_array (task, ntokens);
+
+	for (i = 0; i < ntokens; i ++) {
+		tok = (rspamd_token_t *)(slab + token_size * i);
+		tok->data = data[i];
+		g_ptr_array_add (task->tokens, tok);
+	}
+
+	if (cl->cache && cl->cachecf) {
+		rt = cl->cache->runtime (task, cl->cachecf, FALSE);
+		res = cl->cache->check (task, is_spam, rt);
+		rspamadm_learn_wait (task);
+
+		if (!unlearn) {
+			if (res == RSPAMD_LEARN_INGORE ||
+					(task->flags & RSPAMD_TASK_FLAG_ALREADY_LEARNED)) {
+				ctx->skipped ++;
+				rspamd_task_free (task);
+
+				return;
+			}
+
+			if (res == RSPAMD_LEARN_UNLEARN ||
+					(task->flags & RSPAMD_TASK_FLAG_UNLEARN)) {
+				unlearn = TRUE;
+			}
+		}
+	}
+
+	for (i = 0; i < ntokens; i ++) {
+		k = kh_put (rspamadm_learn_tokens, ctx->tokens, data[i], &r);
+		counts = &kh_value (ctx->tokens, k);
+
+		if (r != 0) {
+			memset (counts, 0, sizeof (*counts));
+		}
+
+		counts->v[is_spam] ++;
+
+		if (unlearn) {
+			counts->v[!is_spam] --;
+		}
+	}
+
+	ctx->learns[is_spam] ++;
+
+	if (unlearn) {
+		ctx->learns[!is_spam] --;
+		ctx->relearned ++;
+	}
+	else {
+		ctx->learned ++;
+	}
+
+	g_ptr_array_add (ctx->pending, task);
+
+	if (ctx->pending->len >= (guint)batch) {
+		if (!rspamadm_learn_flush (ctx, &err)) {
+			rspamd_fprintf (stderr, "cannot learn: %e\n", err);
+			exit (EXIT_FAILURE);
+		}
+	}
+}
+
+/* Returns FALSE when worker has finished */
+static gboolean
+rspamadm_learn_read_record (struct rspamadm_learn_ctx *ctx, gint fd)
+{
+	struct rspamadm_learn_record rec;
+
+	if (!rspamadm_learn_read_full (fd, &rec, sizeof (rec))) {
+		return FALSE;
+	}
+
+	g_array_set_size (ctx->buf, rec.ntokens);
+
+	if (rec.ntokens > 0 && !rspamadm_learn_read_full (fd, ctx->buf->data,
+			rec.ntokens * sizeof (guint64))) {
+		return FALSE;
+	}
+
+	if (rec.type == RSPAMADM_LEARN_ERROR) {
+		ctx->failed ++;
+	}
+	else {
+		rspamadm_learn_message (ctx, rec.type == RSPAMADM_LEARN_SPAM,
+				(const guint64 *)ctx->buf->data, rec.ntokens);
+	}
+
+	return TRUE;
+}
+
+static struct rspamd_classifier *
+rspamadm_learn_find_classifier (struct rspamd_stat_ctx *st_ctx)
+{
+	struct rspamd_classifier *cl;
+	guint i;
+
+	PTR_ARRAY_FOREACH (st_ctx->classifiers, i, cl) {
+		if (classifier == NULL || (cl->cfg->name != NULL &&
+				g_ascii_strcasecmp (classifier, cl->cfg->name) == 0)) {
+			return cl;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamadm_learn (gint argc, gchar **argv,
+		const struct rspamadm_command *cmd)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	const gchar *confdir;
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	struct rspamadm_learn_ctx ctx;
+	struct pollfd *pfds;
+	gint sv[2], status;
+	guint i, j, nalive;
+	gdouble start, elapsed;
+	guint64 total;
+	pid_t *pids;
+
+	context = g_option_context_new (
+			"learn - learn statistics from mailboxes");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd administration utility version "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (spam_paths == NULL && ham_paths == NULL) {
+		rspamd_fprintf (stderr, "no spam or ham specified\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (nworkers <= 0) {
+		nworkers = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+	}
+
+	batch = MAX (batch, 1);
+
+	if (config == NULL) {
+		if ((confdir = g_hash_table_lookup (ucl_vars, "CONFDIR")) == NULL) {
+			confdir = RSPAMD_CONFDIR;
+		}
+
+		config = g_strdup_printf ("%s%c%s", confdir, G_DIR_SEPARATOR,
+				"rspamd.conf");
+	}
+
+	cfg->compiled_modules = modules;
+	cfg->compiled_workers = workers;
+	cfg->cfg_name = config;
+
+	if (!rspamd_config_read (cfg, cfg->cfg_name, config_logger, rspamd_main,
+			ucl_vars)) {
+		rspamd_fprintf (stderr, "cannot load config %s\n", config);
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_lua_post_load_config (cfg);
+
+	if (!rspamd_config_post_load (cfg, RSPAMD_CONFIG_INIT_URL|
+			RSPAMD_CONFIG_INIT_LIBS|RSPAMD_CONFIG_INIT_SYMCACHE)) {
+		rspamd_fprintf (stderr, "cannot init config %s\n", config);
+		exit (EXIT_FAILURE);
+	}
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.cfg = cfg;
+	ctx.ev_base = event_init ();
+	rspamd_stat_init (cfg, ctx.ev_base);
+	ctx.st_ctx = rspamd_stat_get_ctx ();
+	ctx.cl = rspamadm_learn_find_classifier (ctx.st_ctx);
+
+	if (ctx.cl == NULL) {
+		rspamd_fprintf (stderr, "cannot find classifier %s\n",
+				classifier ? classifier : "to learn");
+		exit (EXIT_FAILURE);
+	}
+
+	if (ctx.cl->cfg->flags & RSPAMD_FLAG_CLASSIFIER_NO_BACKEND) {
+		rspamd_fprintf (stderr, "classifier %s has no backend\n",
+				ctx.cl->cfg->name);
+		exit (EXIT_FAILURE);
+	}
+
+	ctx.sources = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamadm_learn_source));
+	ctx.buf = g_array_new (FALSE, FALSE, sizeof (guint64));
+
+	for (i = 0; spam_paths && spam_paths[i]; i ++) {
+		rspamadm_learn_add_path (&ctx, spam_paths[i], TRUE, TRUE);
+	}
+
+	for (i = 0; ham_paths && ham_paths[i]; i ++) {
+		rspamadm_learn_add_path (&ctx, ham_paths[i], FALSE, TRUE);
+	}
+
+	pfds = g_malloc0 (sizeof (*pfds) * nworkers);
+	pids = g_malloc0 (sizeof (*pids) * nworkers);
+	start = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < (guint)nworkers; i ++) {
+		if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+			rspamd_fprintf (stderr, "cannot create socketpair: %s\n",
+					strerror (errno));
+			exit (EXIT_FAILURE);
+		}
+
+		pids[i] = fork ();
+
+		if (pids[i] == 0) {
+			close (sv[0]);
+
+			for (j = 0; j < i; j ++) {
+				close (pfds[j].fd);
+			}
+
+			rspamadm_learn_worker (&ctx, sv[1], i);
+			/* Backends are owned by the main process */
+			_exit (EXIT_SUCCESS);
+		}
+		else if (pids[i] == -1) {
+			rspamd_fprintf (stderr, "cannot fork: %s\n", strerror (errno));
+			exit (EXIT_FAILURE);
+		}
+
+		close (sv[1]);
+		pfds[i].fd = sv[0];
+		pfds[i].events = POLLIN;
+	}
+
+	ctx.tokens = kh_init (rspamadm_learn_tokens);
+	ctx.digests = kh_init (rspamadm_learn_digests);
+	ctx.pending = g_ptr_array_new ();
+	nalive = nworkers;
+
+	while (nalive > 0) {
+		if (poll (pfds, nworkers, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			rspamd_fprintf (stderr, "poll failed: %s\n", strerror (errno));
+			exit (EXIT_FAILURE);
+		}
+
+		for (i = 0; i < (guint)nworkers; i ++) {
+			if (pfds[i].fd != -1 && pfds[i].revents != 0) {
+				if (!rspamadm_learn_read_record (&ctx, pfds[i].fd)) {
+					close (pfds[i].fd);
+					pfds[i].fd = -1;
+					nalive --;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < (guint)nworkers; i ++) {
+		if (waitpid (pids[i], &status, 0) != -1 &&
+				(!WIFEXITED (status) || WEXITSTATUS (status) != 0)) {
+			rspamd_fprintf (stderr, "worker %P has failed\n", pids[i]);
+		}
+	}
+
+	if (!rspamadm_learn_flush (&ctx, &error)) {
+		rspamd_fprintf (stderr, "cannot learn: %e\n", error);
+		g_error_free (error);
+		exit (EXIT_FAILURE);
+	}
+
+	elapsed = rspamd_get_ticks (FALSE) - start;
+	total = ctx.learned + ctx.relearned + ctx.skipped + ctx.failed;
+	rspamd_printf ("%L messages in %.2f seconds, %.1f messages per second: "
+			"%L learned, %L relearned, %L skipped, %L failed\n",
+			(gint64)total, elapsed, elapsed > 0 ? total / elapsed : 0.0,
+			(gint64)ctx.learned, (gint64)ctx.relearned,
+			(gint64)ctx.skipped, (gint64)ctx.failed);
+
+	kh_destroy (rspamadm_learn_tokens, ctx.tokens);
+	kh_destroy (rspamadm_learn_digests, ctx.digests);
+	g_ptr_array_free (ctx.pending, TRUE);
+	g_array_free (ctx.buf, TRUE);
+	g_free (pfds);
+	g_free (pids);
+	rspamd_stat_close ();
+
+	exit (EXIT_SUCCESS);
+}
@@ -16,6 +16,7 @@
 #include "config.h"
 #include "rspamadm.h"
 #include "lua/lua_common.h"
+#include "libstat/backends/backends.h"
 
 #include "contrib/uthash/utlist.h"
 
@@ -37,6 +38,9 @@ static gchar *redis_db = NULL;
 static gchar *redis_password = NULL;
 static gboolean reset_previous = FALSE;
 
+/* Mmaped statfiles to convert */
+static gchar **mmap_files = NULL;
+
 static void rspamadm_statconvert (gint argc, gchar **argv,
 								  const struct rspamadm_command *cmd);
 static const char *rspamadm_statconvert_help (gboolean full_help,
@@ -74,6 +78,8 @@ static GOptionEntry entries[] = {
 				"Password to connect to redis", NULL},
 		{"redis-db", 'd', 0, G_OPTION_ARG_STRING, &redis_db,
 				"Redis database (should be numeric)", NULL},
+		{"mmap", 'm', 0, G_OPTION_ARG_FILENAME_ARRAY, &mmap_files,
+				"Convert mmap statfile to the current format (can be repeated)", NULL},
 		{NULL,     0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
 };
 
@@ -86,6 +92,7 @@ rspamadm_statconvert_help (gboolean full_help, const struct rspamadm_command *cm
 	if (full_help) {
 		help_str = "Convert statistics from sqlite3 to redis\n\n"
 				"Usage: rspamadm statconvert -c /etc/rspamd.conf [-r]\n"
+				"       rspamadm statconvert -m /var/lib/rspamd/bayes.spam\n"
 				"Where options are:\n\n"
 				"-c: config file to read data from\n"
 				"-r: reset previous data instead of increasing values\n"
@@ -99,6 +106,8 @@ rspamadm_statconvert_help (gboolean full_help, const struct rspamadm_command *cm
 				"--ham-db: sqlite3 input file for ham data\n"
 				"--symbol-spam: symbol in redis for spam (e.g. BAYES_SPAM)\n"
 				"--symbol-ham: symbol in redis for ham (e.g. BAYES_HAM)\n"
+				"** Or convert mmap statfiles in place **\n"
+				"-m: mmap statfile to convert to the current format\n"
 				;
 	}
 	else {
@@ -132,6 +141,28 @@ rspamadm_statconvert (gint argc, gchar **argv, const struct rspamadm_command *cm
 		exit (1);
 	}
 
+	if (mmap_files) {
+		rspamd_mempool_t *pool;
+		gchar **pfile;
+		gint ret = EXIT_SUCCESS;
+
+		/* Statfiles are converted with no redis involved */
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "statconvert");
+
+		for (pfile = mmap_files; *pfile != NULL; pfile ++) {
+			if (rspamd_mmaped_file_convert (pool, *pfile) != 0) {
+				rspamd_fprintf (stderr, "cannot convert %s\n", *pfile);
+				ret = EXIT_FAILURE;
+			}
+			else {
+				rspamd_printf ("converted %s\n", *pfile);
+			}
+		}
+
+		rspamd_mempool_delete (pool);
+		exit (ret);
+	}
+
 	if (config_file) {
 		/* Load config file, assuming that it has all information required */
 		struct ucl_parser *parser;
@@ -19,6 +19,7 @@
 #include "lua/lua_common.h"
 #include "libserver/worker_util.h"
 #include "libserver/rspamd_control.h"
+#include "libmime/part_cache.h"
 #include "ottery.h"
 #include "cryptobox.h"
 #include "utlist.h"
@@ -558,6 +559,16 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 		cf = cur->data;
 		listen_ok = FALSE;
 
+		if (cf->worker && (cf->worker->flags & RSPAMD_WORKER_SCANNER) &&
+				cf->enabled && cf->count > 0 &&
+				rspamd_main->cfg->part_cache == NULL &&
+				rspamd_main->cfg->part_cache_size > 0) {
+			/* Shared by scanners only, so it is not allocated in rspamadm */
+			rspamd_main->cfg->part_cache = rspamd_part_cache_new (
+					rspamd_main->cfg->cfg_pool,
+					rspamd_main->cfg->part_cache_size);
+		}
+
 		if (cf->worker == NULL) {
 			msg_err_main ("type of worker is unspecified, skip spawning");
 		}
@@ -77,6 +77,7 @@ struct rspamd_worker {
 	GQuark type;                    /**< process type									*/
 	GHashTable *signal_events;      /**< signal events									*/
 	GList *accept_events;           /**< socket events									*/
+	struct event trim_ev;           /**< memory pool cache trim timer					*/
 	struct rspamd_worker_conf *cf;  /**< worker config data								*/
 	gpointer ctx;                   /**< worker's specific data							*/
 	enum rspamd_worker_flags flags; /**< worker's flags									*/
@@ -252,6 +253,21 @@ struct rspamd_stat {
 	guint connections_count;                            /**< total connections count						*/
 	guint control_connections_count;                    /**< connections count to control interface			*/
 	guint messages_learned;                             /**< messages learned								*/
+	guint task_arenas_allocated;                        /**< task skeletons allocated from heap				*/
+	guint task_arenas_reused;                           /**< task skeletons reused from freelist			*/
+	guint bayes_cache_hits;                             /**< bayes tokens found in the shared cache			*/
+	guint bayes_cache_misses;                           /**< bayes tokens requested from the backend		*/
+	guint64 bayes_cache_saved_bytes;                    /**< backend traffic saved by the tokens cache		*/
+	guint learn_cache_lookups;                          /**< learn cache lookups passed by the filter		*/
+	guint learn_cache_skipped;                          /**< learn cache lookups skipped by the filter		*/
+	guint learn_cache_false_positives;                  /**< lookups passed by the filter but not found		*/
+	guint text_stages_skipped;                          /**< text parts processing stages not required		*/
+	guint text_stages_total;                            /**< all text parts processing stages				*/
+	guint part_cache_hits;                              /**< parts results found in the shared cache		*/
+	guint part_cache_misses;                            /**< parts results not found in the shared cache	*/
+	guint images_normalized;                            /**< images normalized to get DCT signature			*/
+	guint images_cache_hits;                            /**< DCT signatures found in the shared cache		*/
+	guint64 images_normalize_time;                      /**< time spent on images normalization (usec)		*/
 };
 
 /**
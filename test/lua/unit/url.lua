@@ -98,6 +98,15 @@ context("URL check functions", function()
     {"http:www.twitter.com#test", true, {
       host = 'www.twitter.com', fragment = 'test'
     }},
+    {"http://www.example.za.org.", true, {
+      host = 'www.example.za.org', tld = 'example.za.org'
+    }},
+    {"http://foo.bar.ck", true, {
+      host = 'foo.bar.ck', tld = 'foo.bar.ck'
+    }},
+    {"http://foo.www.ck", true, {
+      host = 'foo.www.ck', tld = 'www.ck'
+    }},
   }
 
   -- Some cases from https://code.google.com/p/google-url/source/browse/trunk/src/url_canon_unittest.cc
@@ -2,6 +2,8 @@
 #include "mem_pool.h"
 #include "tests.h"
 #include "unix-std.h"
+#include "util.h"
+#include "logger.h"
 #include <math.h>
 
 #ifdef HAVE_SYS_WAIT_H
@@ -11,6 +13,43 @@
 #define TEST_BUF "test bufffer"
 #define TEST2_BUF "test bufffertest bufffer"
 
+static const guint churn_iters = 20000;
+
+/*
+ * Simulates task sized pools churn: each pool has several small allocations
+ * and a couple of large ones (e.g. decoded parts)
+ */
+static gdouble
+rspamd_mem_pool_churn (void)
+{
+	rspamd_mempool_t *pool;
+	gdouble ts1, ts2;
+	guint i, j;
+	gchar *p;
+
+	ts1 = rspamd_get_ticks (TRUE);
+
+	for (i = 0; i < churn_iters; i ++) {
+		pool = rspamd_mempool_new (16384, "test");
+
+		for (j = 0; j < 64; j ++) {
+			p = rspamd_mempool_alloc (pool, 32 + j * 8);
+			p[0] = (gchar)j;
+		}
+
+		p = rspamd_mempool_alloc (pool, 65536 + (i % 8) * 4096);
+		p[0] = 'a';
+		p = rspamd_mempool_alloc_tmp (pool, 8192);
+		p[0] = 'b';
+		rspamd_mempool_cleanup_tmp (pool);
+		rspamd_mempool_delete (pool);
+	}
+
+	ts2 = rspamd_get_ticks (TRUE);
+
+	return ts2 - ts1;
+}
+
 void
 rspamd_mem_pool_test_func ()
 {
@@ -19,6 +58,8 @@ rspamd_mem_pool_test_func ()
 	char *tmp, *tmp2, *tmp3;
 	pid_t pid;
 	int ret;
+	gdouble diff_nocache, diff_cache;
+	guint hits;
 
 	pool = rspamd_mempool_new (sizeof (TEST_BUF), NULL);
 	tmp = rspamd_mempool_alloc (pool, sizeof (TEST_BUF));
@@ -35,5 +76,22 @@ rspamd_mem_pool_test_func ()
 	
 	rspamd_mempool_delete (pool);
 	rspamd_mempool_stat (&st);
-	
+
+	/* Chains cache */
+	rspamd_mempool_chain_cache_limit (0);
+	diff_nocache = rspamd_mem_pool_churn ();
+	rspamd_mempool_stat (&st);
+	hits = st.chain_cache_hits;
+	rspamd_mempool_chain_cache_limit (RSPAMD_MEMPOOL_CHAIN_CACHE_LIMIT);
+	diff_cache = rspamd_mem_pool_churn ();
+	rspamd_mempool_stat (&st);
+	g_assert (st.chain_cache_hits > hits);
+	msg_notice ("pools churn (%ud pools): %.0f ticks without chains cache, "
+			"%.0f ticks with chains cache, %ud cache hits",
+			churn_iters, diff_nocache, diff_cache, st.chain_cache_hits - hits);
+
+	/* Trimmed chains must still be usable */
+	rspamd_mempool_chain_cache_trim ();
+	rspamd_mempool_chain_cache_trim ();
+	rspamd_mem_pool_churn ();
 }
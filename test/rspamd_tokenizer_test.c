@@ -0,0 +1,142 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libstat/tokenizers/tokenizers.h"
+#include "ottery.h"
+
+static const guint niter = 100000;
+static const guint max_pieces = 48;
+static const guint max_exceptions = 4;
+
+/* ASCII, punctuation, whitespace, multibyte and broken UTF8 pieces */
+static const gchar *pieces[] = {
+	"hello", "World", "abc123", "x", "Q", "42", " ", "  ", "\n", "\r\n",
+	".", ",", "--", "__", "-", "_", "!!", "\t", "\x01", "\x7f",
+	"a-b", "ab_cd", "...........................",
+	"abcdefghijklmnopqrstuvwxyz0123456789ABCDEF",
+	"\xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82",
+	"\xe4\xb8\xad\xe6\x96\x87", "\xc3\xa9t\xc3\xa9", "\xe2\x80\x94",
+	"\xff", "\xc3",
+};
+
+static gsize
+rspamd_tokenizer_test_text (gchar *text, gsize size)
+{
+	gsize len = 0, plen;
+	guint i, npieces;
+	const gchar *piece;
+
+	npieces = ottery_rand_range (max_pieces);
+
+	for (i = 0; i < npieces; i ++) {
+		piece = pieces[ottery_rand_range (G_N_ELEMENTS (pieces) - 1)];
+		plen = strlen (piece);
+
+		if (len + plen > size) {
+			break;
+		}
+
+		memcpy (text + len, piece, plen);
+		len += plen;
+	}
+
+	/* Some random bytes */
+	if (len > 0 && ottery_rand_range (4) == 0) {
+		for (i = 0; i < 3; i ++) {
+			text[ottery_rand_range (len - 1)] = ottery_rand_range (255);
+		}
+	}
+
+	return len;
+}
+
+static GList *
+rspamd_tokenizer_test_exceptions (struct rspamd_process_exception *ex,
+		gsize len)
+{
+	GList *res = NULL;
+	goffset pos = 0;
+	guint i, nex;
+
+	if (len == 0) {
+		return NULL;
+	}
+
+	nex = ottery_rand_range (max_exceptions);
+
+	for (i = 0; i < nex; i ++) {
+		pos += ottery_rand_range (len / max_exceptions);
+
+		if ((gsize)pos >= len) {
+			break;
+		}
+
+		ex[i].pos = pos;
+		ex[i].len = 1 + ottery_rand_range (5);
+		ex[i].type = ottery_rand_range (1) ?
+				RSPAMD_EXCEPTION_URL : RSPAMD_EXCEPTION_NEWLINE;
+		res = g_list_prepend (res, &ex[i]);
+
+		/* Allow nested exceptions */
+		if (ottery_rand_range (2) != 0) {
+			pos += ex[i].len;
+		}
+	}
+
+	return g_list_reverse (res);
+}
+
+void
+rspamd_tokenizer_test_func (void)
+{
+	gchar text[1024];
+	struct rspamd_process_exception ex[4];
+	rspamd_stat_token_t *t1, *t2;
+	GArray *fast, *generic;
+	GList *exceptions;
+	guint64 h1, h2;
+	gsize len;
+	guint i, j;
+
+	/* ASCII fast path must produce exactly the same words as ICU path */
+	for (i = 0; i < niter; i ++) {
+		len = rspamd_tokenizer_test_text (text, sizeof (text));
+		exceptions = rspamd_tokenizer_test_exceptions (ex, len);
+
+		fast = rspamd_tokenize_text (text, len, RSPAMD_TOKENIZE_UTF, NULL,
+				exceptions, &h1);
+		generic = rspamd_tokenize_text (text, len, RSPAMD_TOKENIZE_UTF_GENERIC,
+				NULL, exceptions, &h2);
+
+		g_assert (fast->len == generic->len);
+		g_assert (h1 == h2);
+
+		for (j = 0; j < fast->len; j ++) {
+			t1 = &g_array_index (fast, rspamd_stat_token_t, j);
+			t2 = &g_array_index (generic, rspamd_stat_token_t, j);
+
+			g_assert (t1->begin == t2->begin);
+			g_assert (t1->len == t2->len);
+			g_assert (t1->flags == t2->flags);
+		}
+
+		g_array_free (fast, TRUE);
+		g_array_free (generic, TRUE);
+		g_list_free (exceptions);
+	}
+}
@@ -0,0 +1,294 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compares fuzzy backend lookups issued in batches of 1, 16 and 256 digests
+ * via rspamd_fuzzy_backend_check_many. Half of the queried digests are
+ * present in the storage.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "printf.h"
+#include "cfg_file.h"
+#include "fuzzy_backend.h"
+#include "fuzzy_wire.h"
+#include "redis_pool.h"
+#include "upstream.h"
+#include "unix-std.h"
+
+static gchar *backend_type = "sqlite";
+static gchar *hashfile = NULL;
+static gchar *servers = "127.0.0.1";
+static guint ndigests = 10000;
+static guint nchecks = 100000;
+
+static GOptionEntry entries[] = {
+		{"backend", 'b', 0, G_OPTION_ARG_STRING, &backend_type,
+				"Backend type: sqlite, memory or redis (default: sqlite)", NULL},
+		{"file", 'f', 0, G_OPTION_ARG_STRING, &hashfile,
+				"Database file to use (default: temporary file)", NULL},
+		{"servers", 's', 0, G_OPTION_ARG_STRING, &servers,
+				"Redis servers (default: 127.0.0.1)", NULL},
+		{"digests", 'd', 0, G_OPTION_ARG_INT, &ndigests,
+				"Number of digests to store (default: 10000)", NULL},
+		{"checks", 'n', 0, G_OPTION_ARG_INT, &nchecks,
+				"Number of digests to check per batch size (default: 100000)", NULL},
+		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const guint batch_sizes[] = {1, 16, 256};
+
+struct fuzzy_backend_bench_cbdata {
+	struct event_base *ev_base;
+	guint64 found;
+	gboolean done;
+};
+
+static void
+rspamd_fuzzy_backend_bench_digest (struct rspamd_fuzzy_cmd *cmd, guint64 id)
+{
+	memset (cmd, 0, sizeof (*cmd));
+	cmd->version = RSPAMD_FUZZY_VERSION;
+	cmd->flag = 1;
+	rspamd_cryptobox_hash ((guchar *)cmd->digest, (const guchar *)&id,
+			sizeof (id), NULL, 0);
+}
+
+static void
+rspamd_fuzzy_backend_bench_update_cb (gboolean success,
+		guint nadded,
+		guint ndeleted,
+		guint nextended,
+		guint nignored,
+		void *ud)
+{
+	struct fuzzy_backend_bench_cbdata *cbd = ud;
+
+	if (!success) {
+		rspamd_fprintf (stderr, "cannot store digests\n");
+		exit (EXIT_FAILURE);
+	}
+
+	cbd->done = TRUE;
+}
+
+static void
+rspamd_fuzzy_backend_bench_check_cb (struct rspamd_fuzzy_reply *reps,
+		guint nreps, void *ud)
+{
+	struct fuzzy_backend_bench_cbdata *cbd = ud;
+	guint i;
+
+	for (i = 0; i < nreps; i ++) {
+		if (reps[i].v1.prob > 0.5) {
+			cbd->found ++;
+		}
+	}
+
+	cbd->done = TRUE;
+}
+
+static void
+rspamd_fuzzy_backend_bench_wait (struct fuzzy_backend_bench_cbdata *cbd)
+{
+	/* Sqlite replies synchronously, redis needs the event loop */
+	while (!cbd->done) {
+		event_base_loop (cbd->ev_base, EVLOOP_ONCE);
+	}
+
+	cbd->done = FALSE;
+}
+
+static void
+rspamd_fuzzy_backend_bench_populate (struct rspamd_fuzzy_backend *bk,
+		struct fuzzy_backend_bench_cbdata *cbd)
+{
+	GArray *updates;
+	struct fuzzy_peer_cmd io_cmd;
+	guint i;
+
+	updates = g_array_sized_new (FALSE, FALSE, sizeof (io_cmd), ndigests);
+
+	for (i = 0; i < ndigests; i ++) {
+		memset (&io_cmd, 0, sizeof (io_cmd));
+		/* Even ids are stored, odd ones are misses */
+		rspamd_fuzzy_backend_bench_digest (&io_cmd.cmd.normal, i * 2);
+		io_cmd.cmd.normal.cmd = FUZZY_WRITE;
+		io_cmd.cmd.normal.value = 1;
+		g_array_append_val (updates, io_cmd);
+	}
+
+	rspamd_fuzzy_backend_process_updates (bk, updates, "bench",
+			rspamd_fuzzy_backend_bench_update_cb, cbd);
+	rspamd_fuzzy_backend_bench_wait (cbd);
+	g_array_free (updates, TRUE);
+}
+
+static gdouble
+rspamd_fuzzy_backend_bench_run (struct rspamd_fuzzy_backend *bk,
+		struct fuzzy_backend_bench_cbdata *cbd, guint batch_size)
+{
+	struct rspamd_fuzzy_cmd *cmds;
+	const struct rspamd_fuzzy_cmd **pcmds;
+	gdouble t1, t2;
+	guint i, j, nbatch;
+	guint64 id = 0;
+
+	cmds = g_malloc (sizeof (*cmds) * batch_size);
+	pcmds = g_malloc (sizeof (*pcmds) * batch_size);
+	cbd->found = 0;
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < nchecks; i += nbatch) {
+		nbatch = MIN (batch_size, nchecks - i);
+
+		for (j = 0; j < nbatch; j ++) {
+			rspamd_fuzzy_backend_bench_digest (&cmds[j], id % (ndigests * 2));
+			cmds[j].cmd = FUZZY_CHECK;
+			pcmds[j] = &cmds[j];
+			id ++;
+		}
+
+		rspamd_fuzzy_backend_check_many (bk, pcmds, nbatch,
+				rspamd_fuzzy_backend_bench_check_cb, cbd);
+		rspamd_fuzzy_backend_bench_wait (cbd);
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	g_free (cmds);
+	g_free (pcmds);
+
+	return t2 - t1;
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamd_config *cfg;
+	struct rspamd_fuzzy_backend *bk;
+	struct fuzzy_backend_bench_cbdata cbd;
+	rspamd_logger_t *logger = NULL;
+	ucl_object_t *obj;
+	gchar tmpfile[] = "/tmp/rspamd-fuzzy-bench-XXXXXX";
+	gboolean remove_file = FALSE;
+	gdouble elapsed;
+	guint i;
+	gint fd;
+
+	context = g_option_context_new (
+			"rspamd-fuzzy-backend-bench - batched fuzzy backend lookups");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd fuzzy backend benchmark "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	ndigests = MAX (ndigests, 1);
+
+	cfg = rspamd_config_new (RSPAMD_CONFIG_INIT_DEFAULT);
+	cfg->libs_ctx = rspamd_init_libs ();
+	cfg->log_type = RSPAMD_LOG_CONSOLE;
+	cfg->log_level = G_LOG_LEVEL_WARNING;
+	rspamd_set_logger (cfg, g_quark_from_static_string ("fuzzy_bench"), &logger,
+			NULL);
+	(void) rspamd_log_open (logger);
+	g_log_set_default_handler (rspamd_glib_log_function, logger);
+
+	memset (&cbd, 0, sizeof (cbd));
+	cbd.ev_base = event_init ();
+	rspamd_upstreams_library_config (cfg, cfg->ups_ctx, cbd.ev_base, NULL);
+#ifdef WITH_HIREDIS
+	rspamd_redis_pool_config (cfg->redis_pool, cfg, cbd.ev_base);
+#endif
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromstring (backend_type),
+			"backend", 0, false);
+
+	if (strcmp (backend_type, "redis") == 0) {
+		ucl_object_insert_key (obj, ucl_object_fromstring (servers),
+				"servers", 0, false);
+		ucl_object_insert_key (obj, ucl_object_fromstring ("fuzzy_bench"),
+				"prefix", 0, false);
+	}
+	else {
+		if (hashfile == NULL) {
+			fd = mkstemp (tmpfile);
+
+			if (fd == -1) {
+				rspamd_fprintf (stderr, "cannot create temporary file: %s\n",
+						strerror (errno));
+				exit (1);
+			}
+
+			close (fd);
+			unlink (tmpfile);
+			hashfile = tmpfile;
+			remove_file = TRUE;
+		}
+
+		ucl_object_insert_key (obj, ucl_object_fromstring (hashfile),
+				"hashfile", 0, false);
+	}
+
+	bk = rspamd_fuzzy_backend_create (cbd.ev_base, obj, cfg, &error);
+
+	if (bk == NULL) {
+		rspamd_fprintf (stderr, "cannot create backend: %e\n", error);
+		g_error_free (error);
+		exit (1);
+	}
+
+	rspamd_fuzzy_backend_bench_populate (bk, &cbd);
+	rspamd_printf ("Stored %ud digests in %s backend, checking %ud digests\n",
+			ndigests, backend_type, nchecks);
+
+	for (i = 0; i < G_N_ELEMENTS (batch_sizes); i ++) {
+		elapsed = rspamd_fuzzy_backend_bench_run (bk, &cbd, batch_sizes[i]);
+		rspamd_printf ("Batch size %3ud: %.3f seconds, %.2f microseconds "
+				"per digest, %L found\n",
+				batch_sizes[i], elapsed,
+				nchecks > 0 ? elapsed / nchecks * 1e6 : 0.0,
+				(gint64)cbd.found);
+	}
+
+	rspamd_fuzzy_backend_close (bk);
+	ucl_object_unref (obj);
+
+	if (remove_file) {
+		gchar logfile[sizeof (tmpfile) + sizeof (".log")];
+
+		unlink (tmpfile);
+		/* Memory backend log */
+		rspamd_snprintf (logfile, sizeof (logfile), "%s.log", tmpfile);
+		unlink (logfile);
+	}
+
+	rspamd_log_close (logger);
+	REF_RELEASE (cfg);
+
+	return 0;
+}
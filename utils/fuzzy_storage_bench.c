@@ -0,0 +1,211 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Load generator for the fuzzy storage worker: each client process keeps
+ * a window of unencrypted check commands in flight and sends a new command
+ * as soon as a reply is received.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "util.h"
+#include "fuzzy_wire.h"
+#include "ottery.h"
+#include "unix-std.h"
+#include <poll.h>
+
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+static guint port = 11335;
+static gchar *host = "127.0.0.1";
+static guint nclients = 1;
+static guint window = 64;
+static guint ndigests = 100000;
+static gdouble test_time = 10.0;
+
+static GOptionEntry entries[] = {
+		{"port",    'p', 0, G_OPTION_ARG_INT,  &port,
+				"Port number (default: 11335)",            NULL},
+		{"host", 'h', 0, G_OPTION_ARG_STRING, &host,
+				"Connect to the specified host (default: localhost)", NULL},
+		{"clients", 'n', 0, G_OPTION_ARG_INT,  &nclients,
+				"Number of client processes to start (default: 1)", NULL},
+		{"window", 'w', 0, G_OPTION_ARG_INT, &window,
+				"Number of requests in flight per client (default: 64)", NULL},
+		{"digests", 'd', 0, G_OPTION_ARG_INT, &ndigests,
+				"Number of distinct digests to query (default: 100000)", NULL},
+		{"time", 't', 0, G_OPTION_ARG_DOUBLE, &test_time,
+				"Time to run tests (default: 10.0 sec)", NULL},
+		{NULL,      0,   0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+struct fuzzy_bench_result {
+	guint64 sent;
+	guint64 received;
+	guint64 lost;
+};
+
+static gboolean
+rspamd_fuzzy_bench_send (gint fd, guint64 seed)
+{
+	struct rspamd_fuzzy_cmd cmd;
+	guint64 digest_id;
+
+	memset (&cmd, 0, sizeof (cmd));
+	cmd.version = RSPAMD_FUZZY_VERSION;
+	cmd.cmd = FUZZY_CHECK;
+	cmd.flag = 1;
+	cmd.tag = ottery_rand_uint32 ();
+	/* Keep a limited working set to have both hits and misses */
+	digest_id = seed % ndigests;
+	rspamd_cryptobox_hash ((guchar *)cmd.digest, (const guchar *)&digest_id,
+			sizeof (digest_id), NULL, 0);
+
+	return send (fd, &cmd, sizeof (cmd), 0) == sizeof (cmd);
+}
+
+static void
+rspamd_fuzzy_bench_client (rspamd_inet_addr_t *addr,
+		struct fuzzy_bench_result *res)
+{
+	struct rspamd_fuzzy_reply rep;
+	struct pollfd pfd;
+	gdouble start, now;
+	guint64 seed;
+	guint inflight = 0;
+	gint fd;
+
+	fd = rspamd_inet_address_connect (addr, SOCK_DGRAM, TRUE);
+	g_assert (fd != -1);
+	seed = ottery_rand_uint64 ();
+	start = rspamd_get_ticks (FALSE);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		now = rspamd_get_ticks (FALSE);
+
+		if (now - start > test_time) {
+			break;
+		}
+
+		while (inflight < window) {
+			if (!rspamd_fuzzy_bench_send (fd, seed ++)) {
+				break;
+			}
+
+			inflight ++;
+			res->sent ++;
+		}
+
+		if (poll (&pfd, 1, 100) <= 0) {
+			/* Consider all requests in flight as lost */
+			res->lost += inflight;
+			inflight = 0;
+			continue;
+		}
+
+		while (recv (fd, &rep, sizeof (rep), 0) > 0) {
+			res->received ++;
+
+			if (inflight > 0) {
+				inflight --;
+			}
+		}
+	}
+
+	res->lost += inflight;
+	close (fd);
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	rspamd_inet_addr_t *addr;
+	struct fuzzy_bench_result *results, total;
+	pid_t *pids;
+	gint status;
+	guint i;
+
+	rspamd_init_libs ();
+
+	context = g_option_context_new (
+			"rspamd-fuzzy-bench - load generator for fuzzy storage");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd fuzzy storage benchmark "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	if (!rspamd_parse_inet_address (&addr, host, 0)) {
+		rspamd_fprintf (stderr, "bad address: %s\n", host);
+		exit (1);
+	}
+
+	rspamd_inet_address_set_port (addr, port);
+	ndigests = MAX (ndigests, 1);
+
+	results = mmap (NULL, sizeof (*results) * nclients, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_ANON, -1, 0);
+	g_assert (results != MAP_FAILED);
+	memset (results, 0, sizeof (*results) * nclients);
+	pids = g_malloc (sizeof (*pids) * nclients);
+
+	for (i = 0; i < nclients; i ++) {
+		pids[i] = fork ();
+		g_assert (pids[i] != -1);
+
+		if (pids[i] == 0) {
+			rspamd_fuzzy_bench_client (addr, &results[i]);
+			exit (EXIT_SUCCESS);
+		}
+	}
+
+	memset (&total, 0, sizeof (total));
+
+	for (i = 0; i < nclients; i ++) {
+		waitpid (pids[i], &status, 0);
+		total.sent += results[i].sent;
+		total.received += results[i].received;
+		total.lost += results[i].lost;
+	}
+
+	rspamd_printf ("Sent %L requests by %ud clients (window %ud) in %.2fs\n"
+			"Received %L replies, %.1f replies per second\n"
+			"Lost %L requests (%.2f%%)\n",
+			total.sent, nclients, window, test_time,
+			total.received, total.received / test_time,
+			total.lost,
+			total.sent > 0 ? total.lost * 100.0 / total.sent : 0.0);
+
+	munmap (results, sizeof (*results) * nclients);
+	g_free (pids);
+	rspamd_inet_address_free (addr);
+
+	return 0;
+}
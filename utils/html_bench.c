@@ -0,0 +1,181 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures HTML parsing throughput. HTML is either read from files specified
+ * or generated from blocks typical for marketing messages: nested tables,
+ * styled text, links, images and entities.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "printf.h"
+#include "ottery.h"
+#include "html.h"
+#include "url.h"
+#include "unix-std.h"
+
+static guint niter = 100;
+static guint gen_size = 512 * 1024;
+static gchar *tld_file = NULL;
+
+static GOptionEntry entries[] = {
+		{"iterations", 'n', 0, G_OPTION_ARG_INT, &niter,
+				"Number of iterations (default: 100)", NULL},
+		{"size", 's', 0, G_OPTION_ARG_INT, &gen_size,
+				"Size of generated HTML (default: 512K)", NULL},
+		{"tld", 't', 0, G_OPTION_ARG_FILENAME, &tld_file,
+				"Public suffix list file", NULL},
+		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const gchar *blocks[] = {
+	"<table width=\"100%\" cellpadding=\"0\" bgcolor=\"#f4f4f4\"><tr><td>",
+	"</td></tr></table>\n",
+	"<div style=\"font-family: Arial, sans-serif; font-size: 14px; "
+			"color: #333333; line-height: 20px;\">",
+	"</div>\n",
+	"<p>Dear customer, we are glad to offer you the best deals of the "
+			"season &mdash; up to 70&#37; off on selected items!</p>\n",
+	"<a href=\"https://click.example.com/track?id=12345&amp;u=https%3A%2F%2F"
+			"shop.example.com%2Fsale\">Shop now &raquo;</a>\n",
+	"<img src=\"https://img.example.com/banner.png\" width=\"600\" "
+			"height=\"200\" alt=\"Sale\" style=\"display:block\" />\n",
+	"<font color=\"#ff0000\" size=\"2\">Limited&nbsp;offer</font>\n",
+	"<span class='footer'>You received this email because you "
+			"subscribed.</span><br>\n",
+	"<!-- tracking block -->\n",
+};
+
+static gchar *
+rspamd_html_bench_generate (gsize *len)
+{
+	GString *out;
+	const gchar *b;
+
+	out = g_string_sized_new (gen_size + 1024);
+	g_string_append (out, "<html><head><title>Sale</title></head>"
+			"<body bgcolor=\"#ffffff\">\n");
+
+	while (out->len < gen_size) {
+		b = blocks[ottery_rand_range (G_N_ELEMENTS (blocks) - 1)];
+		g_string_append (out, b);
+	}
+
+	g_string_append (out, "</body></html>\n");
+	*len = out->len;
+
+	return g_string_free (out, FALSE);
+}
+
+static void
+rspamd_html_bench_text (const gchar *name, const gchar *text, gsize len)
+{
+	rspamd_mempool_t *pool;
+	struct html_content *hc;
+	GByteArray *in, *out;
+	gdouble t1, t2;
+	guint i, ntags = 0;
+	gsize outlen = 0;
+
+	in = g_byte_array_sized_new (len);
+	g_byte_array_append (in, text, len);
+
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < niter; i ++) {
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "html_bench");
+		hc = rspamd_mempool_alloc0 (pool, sizeof (*hc));
+		out = rspamd_html_process_part (pool, hc, in);
+		ntags = hc->total_tags;
+		outlen = out->len;
+		g_byte_array_free (out, TRUE);
+		rspamd_mempool_delete (pool);
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rspamd_printf ("%s, %Hz: %.3f seconds, %.2f MB/s, "
+			"%.3f milliseconds per part, %ud tags, %Hz of text\n",
+			name, len, t2 - t1,
+			t2 > t1 ? (gdouble)len * niter / (t2 - t1) / 1e6 : 0.0,
+			(t2 - t1) / niter * 1e3,
+			ntags, outlen);
+
+	g_byte_array_free (in, TRUE);
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	gchar *text;
+	gsize len;
+	gint i;
+
+	rspamd_init_libs ();
+
+	context = g_option_context_new (
+			"rspamd-html-bench [file...] - HTML parsing speed");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd HTML parser benchmark "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	niter = MAX (niter, 1);
+
+	if (tld_file == NULL) {
+		tld_file = RSPAMD_PLUGINSDIR G_DIR_SEPARATOR_S "effective_tld_names.dat";
+
+		if (access (tld_file, R_OK) == -1) {
+			/* Urls in links are parsed but not resolved */
+			tld_file = NULL;
+		}
+	}
+
+	rspamd_url_init (tld_file);
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i ++) {
+			if (!g_file_get_contents (argv[i], &text, &len, &error)) {
+				rspamd_fprintf (stderr, "cannot read %s: %e\n", argv[i], error);
+				g_error_free (error);
+				error = NULL;
+				continue;
+			}
+
+			rspamd_html_bench_text (argv[i], text, len);
+			g_free (text);
+		}
+	}
+	else {
+		text = rspamd_html_bench_generate (&len);
+		rspamd_html_bench_text ("Generated HTML", text, len);
+		g_free (text);
+	}
+
+	rspamd_url_deinit ();
+
+	return 0;
+}
@@ -0,0 +1,309 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compares the redis traffic pattern of the Bayes redis backend when each
+ * task uses its own connection and request with the batched mode, where
+ * lookups of several tasks share one pooled connection and duplicate tokens
+ * are requested once. Tokens are drawn from a set of frequent tokens and
+ * a larger uniform set, like in real messages.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "printf.h"
+#include "ottery.h"
+#include "hiredis.h"
+#include "khash.h"
+
+static gchar *host = "127.0.0.1";
+static guint port = 6379;
+static gchar *prefix = "RSBENCH";
+static guint ntasks = 10000;
+static guint ntokens = 500;
+static guint nuniverse = 200000;
+static guint nhot = 2000;
+static guint batch = 32;
+
+static GOptionEntry entries[] = {
+		{"host", 'h', 0, G_OPTION_ARG_STRING, &host,
+				"Redis host (default: 127.0.0.1)", NULL},
+		{"port", 'p', 0, G_OPTION_ARG_INT, &port,
+				"Redis port (default: 6379)", NULL},
+		{"tasks", 'n', 0, G_OPTION_ARG_INT, &ntasks,
+				"Number of tasks to emulate (default: 10000)", NULL},
+		{"tokens", 't', 0, G_OPTION_ARG_INT, &ntokens,
+				"Number of tokens per task (default: 500)", NULL},
+		{"universe", 'u', 0, G_OPTION_ARG_INT, &nuniverse,
+				"Number of stored tokens (default: 200000)", NULL},
+		{"hot", 'H', 0, G_OPTION_ARG_INT, &nhot,
+				"Number of frequent tokens (default: 2000)", NULL},
+		{"batch", 'b', 0, G_OPTION_ARG_INT, &batch,
+				"Number of tasks coalesced in a batch (default: 32)", NULL},
+		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+KHASH_SET_INIT_INT64 (bench_tokens);
+
+struct redis_stat_bench_result {
+	gdouble elapsed;
+	gdouble latency;
+	guint64 requested;
+};
+
+static guint64
+rspamd_redis_bench_token (void)
+{
+	/* Half of tokens are frequent ones */
+	if (ottery_rand_range (1)) {
+		return ottery_rand_range (nhot - 1);
+	}
+
+	return ottery_rand_range (nuniverse - 1);
+}
+
+static redisContext *
+rspamd_redis_bench_connect (void)
+{
+	redisContext *redis;
+
+	redis = redisConnect (host, port);
+
+	if (redis == NULL || redis->err) {
+		rspamd_fprintf (stderr, "cannot connect to redis at %s:%ud: %s\n",
+				host, port, redis ? redis->errstr : "no memory");
+		exit (EXIT_FAILURE);
+	}
+
+	return redis;
+}
+
+static void
+rspamd_redis_bench_reply (redisContext *redis)
+{
+	redisReply *reply;
+
+	if (redisGetReply (redis, (void **)&reply) != REDIS_OK) {
+		rspamd_fprintf (stderr, "cannot get reply: %s\n", redis->errstr);
+		exit (EXIT_FAILURE);
+	}
+
+	freeReplyObject (reply);
+}
+
+/* Appends HMGET <prefix> <tokens...> */
+static void
+rspamd_redis_bench_hmget (redisContext *redis, guint64 *tokens, guint n)
+{
+	const gchar **argv;
+	gsize *argvlen;
+	gchar (*bufs)[32];
+	guint i;
+
+	argv = g_malloc (sizeof (*argv) * (n + 2));
+	argvlen = g_malloc (sizeof (*argvlen) * (n + 2));
+	bufs = g_malloc (sizeof (*bufs) * n);
+	argv[0] = "HMGET";
+	argvlen[0] = 5;
+	argv[1] = prefix;
+	argvlen[1] = strlen (prefix);
+
+	for (i = 0; i < n; i ++) {
+		argvlen[i + 2] = rspamd_snprintf (bufs[i], sizeof (bufs[i]), "%uL",
+				tokens[i]);
+		argv[i + 2] = bufs[i];
+	}
+
+	redisAppendCommandArgv (redis, n + 2, argv, argvlen);
+	g_free (argv);
+	g_free (argvlen);
+	g_free (bufs);
+}
+
+static void
+rspamd_redis_bench_populate (void)
+{
+	redisContext *redis;
+	guint i, j, chunk = 1000;
+
+	redis = rspamd_redis_bench_connect ();
+	redisAppendCommand (redis, "DEL %s", prefix);
+	rspamd_redis_bench_reply (redis);
+
+	for (i = 0; i < nuniverse; i += chunk) {
+		for (j = i; j < MIN (i + chunk, nuniverse); j ++) {
+			redisAppendCommand (redis, "HSET %s %L %ud", prefix, (gint64)j,
+					ottery_rand_range (100));
+		}
+
+		for (j = i; j < MIN (i + chunk, nuniverse); j ++) {
+			rspamd_redis_bench_reply (redis);
+		}
+	}
+
+	redisAppendCommand (redis, "HSET %s learns %ud", prefix, 1000);
+	rspamd_redis_bench_reply (redis);
+	redisFree (redis);
+}
+
+/* Each task connects, asks for learns and all its tokens */
+static void
+rspamd_redis_bench_tasks (struct redis_stat_bench_result *res)
+{
+	redisContext *redis;
+	guint64 *tokens;
+	gdouble t1, t2, start;
+	guint i, j;
+
+	tokens = g_malloc (sizeof (*tokens) * ntokens);
+	memset (res, 0, sizeof (*res));
+	start = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < ntasks; i ++) {
+		for (j = 0; j < ntokens; j ++) {
+			tokens[j] = rspamd_redis_bench_token ();
+		}
+
+		t1 = rspamd_get_ticks (FALSE);
+		redis = rspamd_redis_bench_connect ();
+		redisAppendCommand (redis, "HGET %s learns", prefix);
+		rspamd_redis_bench_hmget (redis, tokens, ntokens);
+		rspamd_redis_bench_reply (redis);
+		rspamd_redis_bench_reply (redis);
+		redisFree (redis);
+		t2 = rspamd_get_ticks (FALSE);
+
+		res->latency += t2 - t1;
+		res->requested += ntokens;
+	}
+
+	res->elapsed = rspamd_get_ticks (FALSE) - start;
+	res->latency /= ntasks;
+	g_free (tokens);
+}
+
+/* Tasks are grouped by batch, tokens are deduplicated within a group */
+static void
+rspamd_redis_bench_batches (struct redis_stat_bench_result *res)
+{
+	redisContext *redis;
+	khash_t(bench_tokens) *seen;
+	guint64 *tokens, tok;
+	gdouble t1, t2, start;
+	guint i, j, n, ngroup;
+	gint r;
+
+	tokens = g_malloc (sizeof (*tokens) * ntokens * batch);
+	seen = kh_init (bench_tokens);
+	memset (res, 0, sizeof (*res));
+	start = rspamd_get_ticks (FALSE);
+	/* Connection is kept in the pool */
+	redis = rspamd_redis_bench_connect ();
+
+	for (i = 0; i < ntasks; i += ngroup) {
+		ngroup = MIN (batch, ntasks - i);
+		kh_clear (bench_tokens, seen);
+		n = 0;
+
+		for (j = 0; j < ngroup * ntokens; j ++) {
+			tok = rspamd_redis_bench_token ();
+			kh_put (bench_tokens, seen, tok, &r);
+
+			if (r != 0) {
+				tokens[n ++] = tok;
+			}
+		}
+
+		t1 = rspamd_get_ticks (FALSE);
+		redisAppendCommand (redis, "HGET %s learns", prefix);
+		rspamd_redis_bench_hmget (redis, tokens, n);
+		rspamd_redis_bench_reply (redis);
+		rspamd_redis_bench_reply (redis);
+		t2 = rspamd_get_ticks (FALSE);
+
+		/* All tasks in a group wait for the same reply */
+		res->latency += (t2 - t1) * ngroup;
+		res->requested += n;
+	}
+
+	res->elapsed = rspamd_get_ticks (FALSE) - start;
+	res->latency /= ntasks;
+	redisFree (redis);
+	kh_destroy (bench_tokens, seen);
+	g_free (tokens);
+}
+
+static void
+rspamd_redis_bench_print (const gchar *name,
+		struct redis_stat_bench_result *res)
+{
+	rspamd_printf ("%s: %.3f seconds, %.1f tasks per second, "
+			"%.3f ms average redis latency per task, "
+			"%L tokens requested (%.1f per task)\n",
+			name, res->elapsed,
+			res->elapsed > 0 ? ntasks / res->elapsed : 0.0,
+			res->latency * 1000.0,
+			(gint64)res->requested,
+			(gdouble)res->requested / ntasks);
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct redis_stat_bench_result res;
+	redisContext *redis;
+
+	rspamd_init_libs ();
+
+	context = g_option_context_new (
+			"rspamd-redis-stat-bench - batched bayes lookups in redis");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd redis statistics benchmark "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	ntasks = MAX (ntasks, 1);
+	ntokens = MAX (ntokens, 1);
+	batch = MAX (batch, 1);
+	nuniverse = MAX (nuniverse, 1);
+	nhot = MAX (MIN (nhot, nuniverse), 1);
+
+	rspamd_redis_bench_populate ();
+	rspamd_printf ("Stored %ud tokens, %ud tasks with %ud tokens each, "
+			"%ud frequent tokens\n", nuniverse, ntasks, ntokens, nhot);
+
+	rspamd_redis_bench_tasks (&res);
+	rspamd_redis_bench_print ("Per task requests", &res);
+	rspamd_redis_bench_batches (&res);
+	rspamd_redis_bench_print ("Batched requests ", &res);
+
+	redis = rspamd_redis_bench_connect ();
+	redisAppendCommand (redis, "DEL %s", prefix);
+	rspamd_redis_bench_reply (redis);
+	redisFree (redis);
+
+	return 0;
+}
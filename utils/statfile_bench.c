@@ -0,0 +1,267 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures lookups throughput of mmaped statfiles filled with 1M and 10M
+ * tokens. Lookups in the previous format (linear probing over 16 bytes
+ * blocks) are emulated in memory for the same file size as a reference.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "printf.h"
+#include "ottery.h"
+#include "cfg_file.h"
+#include "libstat/backends/backends.h"
+#include "unix-std.h"
+
+#define OLD_CHAIN_LENGTH 128
+
+static guint ntokens = 0;
+static guint nlookups = 10000000;
+static gchar *dir = "/tmp";
+
+static GOptionEntry entries[] = {
+		{"tokens", 'n', 0, G_OPTION_ARG_INT, &ntokens,
+				"Number of tokens to store (default: 1M and 10M)", NULL},
+		{"lookups", 'l', 0, G_OPTION_ARG_INT, &nlookups,
+				"Number of lookups to perform (default: 10M)", NULL},
+		{"dir", 'd', 0, G_OPTION_ARG_FILENAME, &dir,
+				"Directory for temporary statfiles (default: /tmp)", NULL},
+		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+struct statfile_bench_old_block {
+	guint32 hash1;
+	guint32 hash2;
+	double value;
+};
+
+static double
+rspamd_statfile_bench_old_get (struct statfile_bench_old_block *blocks,
+		guint64 nblocks, guint32 h1, guint32 h2)
+{
+	guint64 i, blocknum;
+
+	blocknum = h1 % nblocks;
+
+	for (i = blocknum; i < nblocks && i < blocknum + OLD_CHAIN_LENGTH; i ++) {
+		if (blocks[i].hash1 == h1 && blocks[i].hash2 == h2) {
+			return blocks[i].value;
+		}
+	}
+
+	return 0;
+}
+
+static gboolean
+rspamd_statfile_bench_old_set (struct statfile_bench_old_block *blocks,
+		guint64 nblocks, guint32 h1, guint32 h2, double value)
+{
+	guint64 i, blocknum;
+
+	blocknum = h1 % nblocks;
+
+	for (i = blocknum; i < nblocks && i < blocknum + OLD_CHAIN_LENGTH; i ++) {
+		if (blocks[i].hash1 == 0 && blocks[i].hash2 == 0) {
+			blocks[i].hash1 = h1;
+			blocks[i].hash2 = h2;
+			blocks[i].value = value;
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Tokens are generated from a seed to avoid storing them */
+static inline void
+rspamd_statfile_bench_token (guint64 seed, guint64 idx, guint32 *h1,
+		guint32 *h2)
+{
+	guint64 h;
+
+	h = rspamd_hash_seed () ^ seed;
+	h = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
+			&idx, sizeof (idx), h);
+	*h1 = h & 0xffffffff;
+	*h2 = h >> 32;
+}
+
+static void
+rspamd_statfile_bench_print (const gchar *name, gdouble elapsed, guint n,
+		guint64 found)
+{
+	rspamd_printf ("  %s: %.3f seconds, %.2f M lookups per second, "
+			"%L found\n",
+			name, elapsed, elapsed > 0 ? n / elapsed / 1e6 : 0.0,
+			(gint64)found);
+}
+
+static void
+rspamd_statfile_bench_run (rspamd_mempool_t *pool,
+		struct rspamd_statfile_config *stcf, guint n)
+{
+	rspamd_mmaped_file_t *mf;
+	struct statfile_bench_old_block *blocks;
+	gchar *filename;
+	gsize size;
+	guint64 seed, nblocks, i, found, dropped = 0;
+	guint32 h1, h2;
+	gdouble t1, t2;
+
+	/* Leave room for about 70% load of cuckoo buckets */
+	size = (gsize)n * 24 + 4096;
+	filename = g_strdup_printf ("%s/rspamd-statfile-bench-%d", dir, getpid ());
+	seed = ottery_rand_uint64 ();
+	unlink (filename);
+
+	if (rspamd_mmaped_file_create (filename, size, stcf, pool) != 0 ||
+			(mf = rspamd_mmaped_file_open (pool, filename, size, stcf)) == NULL) {
+		rspamd_fprintf (stderr, "cannot create statfile %s\n", filename);
+		exit (EXIT_FAILURE);
+	}
+
+	rspamd_printf ("%ud tokens, %Hz file:\n", n, size);
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < n; i ++) {
+		rspamd_statfile_bench_token (seed, i, &h1, &h2);
+		rspamd_mmaped_file_set_block (pool, mf, h1, h2, 1 + i % 100);
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rspamd_printf ("  cuckoo inserts: %.3f seconds\n", t2 - t1);
+
+	found = 0;
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < nlookups; i ++) {
+		rspamd_statfile_bench_token (seed, ottery_rand_range (n - 1), &h1, &h2);
+
+		if (rspamd_mmaped_file_get_block (mf, h1, h2) != 0) {
+			found ++;
+		}
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rspamd_statfile_bench_print ("cuckoo hits", t2 - t1, nlookups, found);
+	found = 0;
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < nlookups; i ++) {
+		rspamd_statfile_bench_token (seed, n + i, &h1, &h2);
+
+		if (rspamd_mmaped_file_get_block (mf, h1, h2) != 0) {
+			found ++;
+		}
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rspamd_statfile_bench_print ("cuckoo misses", t2 - t1, nlookups, found);
+	rspamd_mmaped_file_close_file (pool, mf);
+	unlink (filename);
+	g_free (filename);
+
+	/* The same amount of memory in the previous format */
+	nblocks = size / sizeof (*blocks);
+	blocks = g_malloc0 (nblocks * sizeof (*blocks));
+
+	for (i = 0; i < n; i ++) {
+		rspamd_statfile_bench_token (seed, i, &h1, &h2);
+
+		if (!rspamd_statfile_bench_old_set (blocks, nblocks, h1, h2,
+				1 + i % 100)) {
+			dropped ++;
+		}
+	}
+
+	found = 0;
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < nlookups; i ++) {
+		rspamd_statfile_bench_token (seed, ottery_rand_range (n - 1), &h1, &h2);
+
+		if (rspamd_statfile_bench_old_get (blocks, nblocks, h1, h2) != 0) {
+			found ++;
+		}
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rspamd_statfile_bench_print ("old hits", t2 - t1, nlookups, found);
+	found = 0;
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < nlookups; i ++) {
+		rspamd_statfile_bench_token (seed, n + i, &h1, &h2);
+
+		if (rspamd_statfile_bench_old_get (blocks, nblocks, h1, h2) != 0) {
+			found ++;
+		}
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rspamd_statfile_bench_print ("old misses", t2 - t1, nlookups, found);
+	rspamd_printf ("  old format dropped %L tokens\n", (gint64)dropped);
+	g_free (blocks);
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	rspamd_mempool_t *pool;
+	struct rspamd_statfile_config stcf;
+	struct rspamd_classifier_config clcf;
+
+	rspamd_init_libs ();
+
+	context = g_option_context_new (
+			"rspamd-statfile-bench - mmaped statfiles lookups");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd statfile benchmark "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "statfile_bench");
+	/* No tokenizer configuration is stored in statfiles */
+	memset (&clcf, 0, sizeof (clcf));
+	memset (&stcf, 0, sizeof (stcf));
+	stcf.clcf = &clcf;
+	stcf.symbol = "BENCH";
+
+	if (ntokens > 0) {
+		rspamd_statfile_bench_run (pool, &stcf, ntokens);
+	}
+	else {
+		rspamd_statfile_bench_run (pool, &stcf, 1000000);
+		rspamd_statfile_bench_run (pool, &stcf, 10000000);
+	}
+
+	rspamd_mempool_delete (pool);
+
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures per task scheduling overhead of the symbols cache: all symbols
+ * are no-op callbacks, so the time spent is the cost of walking the
+ * execution plan, dependencies and processed bits.
+ *
+ * Usage: rspamd-symcache-bench [symbols [tasks [deps_percent]]]
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "printf.h"
+#include "task.h"
+#include "events.h"
+#include "symbols_cache.h"
+#include "cfg_file.h"
+
+static gulong nexecuted = 0;
+
+static void
+rspamd_symcache_bench_cb (struct rspamd_task *task, gpointer ud)
+{
+	nexecuted ++;
+}
+
+static void
+rspamd_symcache_bench_register (struct symbols_cache *cache,
+		guint nsymbols, guint deps_percent)
+{
+	gchar name[32], dep_name[32];
+	guint i, j, ndeps;
+	gint id;
+
+	for (i = 0; i < nsymbols; i ++) {
+		rspamd_snprintf (name, sizeof (name), "BENCH_SYMBOL_%ud", i);
+
+		if (i % 100 == 0) {
+			id = rspamd_symbols_cache_add_symbol (cache, name, 0,
+					rspamd_symcache_bench_cb, NULL, SYMBOL_TYPE_PREFILTER, -1);
+		}
+		else if (i % 100 == 1) {
+			id = rspamd_symbols_cache_add_symbol (cache, name, 0,
+					rspamd_symcache_bench_cb, NULL, SYMBOL_TYPE_POSTFILTER, -1);
+		}
+		else {
+			id = rspamd_symbols_cache_add_symbol (cache, name, 0,
+					rspamd_symcache_bench_cb, NULL, SYMBOL_TYPE_NORMAL, -1);
+		}
+
+		if (id == -1 || i == 0) {
+			continue;
+		}
+
+		if (rspamd_random_double_fast () * 100.0 < deps_percent) {
+			ndeps = 1 + rspamd_random_uint64_fast () % 3;
+
+			for (j = 0; j < ndeps; j ++) {
+				/* Depend on some previously registered symbol to avoid cycles */
+				rspamd_snprintf (dep_name, sizeof (dep_name), "BENCH_SYMBOL_%ud",
+						(guint)(rspamd_random_uint64_fast () % i));
+				rspamd_symbols_cache_add_dependency (cache, id, dep_name);
+			}
+		}
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	struct rspamd_config *cfg;
+	struct rspamd_task *task;
+	rspamd_logger_t *logger = NULL;
+	guint nsymbols = 1500, ntasks = 10000, deps_percent = 10, i;
+	gdouble t1, t2, total = 0;
+
+	if (argc > 1) {
+		nsymbols = strtoul (argv[1], NULL, 10);
+	}
+	if (argc > 2) {
+		ntasks = strtoul (argv[2], NULL, 10);
+	}
+	if (argc > 3) {
+		deps_percent = strtoul (argv[3], NULL, 10);
+	}
+
+	cfg = rspamd_config_new (RSPAMD_CONFIG_INIT_DEFAULT);
+	cfg->libs_ctx = rspamd_init_libs ();
+	cfg->log_type = RSPAMD_LOG_CONSOLE;
+	cfg->log_level = G_LOG_LEVEL_WARNING;
+	rspamd_set_logger (cfg, g_quark_from_static_string ("symcache"), &logger,
+			NULL);
+	(void) rspamd_log_open (logger);
+	g_log_set_default_handler (rspamd_glib_log_function, logger);
+
+	rspamd_symcache_bench_register (cfg->cache, nsymbols, deps_percent);
+	rspamd_symbols_cache_init (cfg->cache);
+
+	for (i = 0; i < ntasks; i ++) {
+		task = rspamd_task_new (NULL, cfg, NULL, NULL);
+		task->s = rspamd_session_create (task->task_pool, NULL, NULL, NULL,
+				task);
+		task->flags |= RSPAMD_TASK_FLAG_PASS_ALL;
+
+		t1 = rspamd_get_virtual_ticks ();
+		rspamd_symbols_cache_process_symbols (task, cfg->cache,
+				RSPAMD_TASK_STAGE_PRE_FILTERS);
+		rspamd_symbols_cache_process_symbols (task, cfg->cache,
+				RSPAMD_TASK_STAGE_FILTERS);
+		rspamd_symbols_cache_process_symbols (task, cfg->cache,
+				RSPAMD_TASK_STAGE_POST_FILTERS);
+		rspamd_symbols_cache_process_symbols (task, cfg->cache,
+				RSPAMD_TASK_STAGE_IDEMPOTENT);
+		t2 = rspamd_get_virtual_ticks ();
+		total += t2 - t1;
+
+		rspamd_task_free (task);
+	}
+
+	rspamd_printf ("Processed %ud tasks with %ud symbols (%ud%% with deps) "
+			"in %.3f seconds\n"
+			"Executed callbacks: %L\n"
+			"Scheduling overhead per task: %.2f microseconds\n"
+			"Scheduling overhead per symbol: %.2f nanoseconds\n",
+			ntasks, nsymbols, deps_percent, total,
+			(gint64)nexecuted,
+			total / ntasks * 1e6,
+			total / ntasks / nsymbols * 1e9);
+
+	rspamd_log_close (logger);
+	REF_RELEASE (cfg);
+
+	return 0;
+}
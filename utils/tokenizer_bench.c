@@ -0,0 +1,249 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compares UTF words segmentation with and without ASCII fast path and
+ * measures OSB tokens generation for each hash type over messages of the
+ * typical size. Text is either read from files specified or generated from
+ * ASCII words.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "printf.h"
+#include "ottery.h"
+#include "cfg_file.h"
+#include "libstat/stat_internal.h"
+#include "libstat/tokenizers/tokenizers.h"
+
+static guint niter = 100;
+static guint gen_size = 1024 * 1024;
+static guint msg_size = 8192;
+
+static GOptionEntry entries[] = {
+		{"iterations", 'n', 0, G_OPTION_ARG_INT, &niter,
+				"Number of iterations (default: 100)", NULL},
+		{"size", 's', 0, G_OPTION_ARG_INT, &gen_size,
+				"Size of generated text (default: 1M)", NULL},
+		{"message-size", 'm', 0, G_OPTION_ARG_INT, &msg_size,
+				"Size of a message for OSB tokenization (default: 8K)", NULL},
+		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const gchar *words[] = {
+	"the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+	"Message", "Hello,", "world.", "12345", "-", "unsubscribe",
+};
+
+static gchar *
+rspamd_tokenizer_bench_generate (gsize *len)
+{
+	gchar *text;
+	const gchar *w;
+	gsize wlen, cur = 0;
+
+	text = g_malloc (gen_size);
+
+	while (cur < gen_size) {
+		w = words[ottery_rand_range (G_N_ELEMENTS (words) - 1)];
+		wlen = MIN (strlen (w), gen_size - cur);
+		memcpy (text + cur, w, wlen);
+		cur += wlen;
+
+		if (cur < gen_size) {
+			text[cur ++] = ottery_rand_range (8) == 0 ? '\n' : ' ';
+		}
+	}
+
+	*len = cur;
+
+	return text;
+}
+
+static void
+rspamd_tokenizer_bench_run (const gchar *name, const gchar *text, gsize len,
+		enum rspamd_tokenize_type how)
+{
+	GArray *res;
+	gdouble t1, t2;
+	guint i, nwords = 0;
+
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < niter; i ++) {
+		res = rspamd_tokenize_text (text, len, how, NULL, NULL, NULL);
+		nwords = res->len;
+		g_array_free (res, TRUE);
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rspamd_printf ("  %s: %.3f seconds, %.2f MB/s, %.2f M words/s, "
+			"%ud words\n",
+			name, t2 - t1,
+			t2 > t1 ? (gdouble)len * niter / (t2 - t1) / 1e6 : 0.0,
+			t2 > t1 ? (gdouble)nwords * niter / (t2 - t1) / 1e6 : 0.0,
+			nwords);
+}
+
+static void
+rspamd_tokenizer_bench_osb (const gchar *name, ucl_object_t *opts,
+		GPtrArray *messages)
+{
+	struct rspamd_stat_ctx ctx;
+	struct rspamd_tokenizer_config tkcf;
+	rspamd_mempool_t *pool, *cfg_pool;
+	GPtrArray *result;
+	GArray *words;
+	gdouble t1, t2;
+	guint64 ntokens = 0;
+	guint i, j;
+
+	cfg_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "osb_bench");
+	memset (&ctx, 0, sizeof (ctx));
+	tkcf.opts = opts;
+	tkcf.name = "osb";
+	ctx.tkcf = rspamd_tokenizer_osb_get_config (cfg_pool, &tkcf, NULL);
+	/* Spam and ham statfiles */
+	ctx.statfiles = g_ptr_array_new ();
+	g_ptr_array_add (ctx.statfiles, NULL);
+	g_ptr_array_add (ctx.statfiles, NULL);
+
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < niter; i ++) {
+		for (j = 0; j < messages->len; j ++) {
+			words = g_ptr_array_index (messages, j);
+			pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "osb");
+			result = g_ptr_array_sized_new (words->len);
+			rspamd_tokenizer_osb (&ctx, pool, words, TRUE, NULL, result);
+			ntokens += result->len;
+			g_ptr_array_free (result, TRUE);
+			rspamd_mempool_delete (pool);
+		}
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rspamd_printf ("  osb %s: %.3f seconds, %.2f M tokens/s, "
+			"%.2f microseconds per message\n",
+			name, t2 - t1,
+			t2 > t1 ? ntokens / (t2 - t1) / 1e6 : 0.0,
+			(t2 - t1) / (niter * messages->len) * 1e6);
+
+	g_ptr_array_free (ctx.statfiles, TRUE);
+	rspamd_mempool_delete (cfg_pool);
+}
+
+static void
+rspamd_tokenizer_bench_text (const gchar *name, const gchar *text, gsize len)
+{
+	GPtrArray *messages;
+	ucl_object_t *opts;
+	guchar key[16];
+	gchar *b32_key;
+	gsize off, mlen;
+	guint i;
+
+	rspamd_printf ("%s, %Hz:\n", name, len);
+	rspamd_tokenizer_bench_run ("generic", text, len,
+			RSPAMD_TOKENIZE_UTF_GENERIC);
+	rspamd_tokenizer_bench_run ("ascii fast path", text, len,
+			RSPAMD_TOKENIZE_UTF);
+
+	/* Split text to messages */
+	messages = g_ptr_array_new ();
+
+	for (off = 0; off < len; off += mlen) {
+		mlen = MIN (msg_size, len - off);
+		g_ptr_array_add (messages, rspamd_tokenize_text (text + off, mlen,
+				RSPAMD_TOKENIZE_UTF, NULL, NULL, NULL));
+	}
+
+	rspamd_printf ("%ud messages of %ud bytes:\n", messages->len, msg_size);
+	rspamd_tokenizer_bench_osb ("xxhash", NULL, messages);
+
+	opts = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (opts, ucl_object_frombool (true), "compat", 0, false);
+	rspamd_tokenizer_bench_osb ("compat", opts, messages);
+	ucl_object_unref (opts);
+
+	ottery_rand_bytes (key, sizeof (key));
+	b32_key = rspamd_encode_base32 (key, sizeof (key));
+	opts = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (opts, ucl_object_fromstring ("siphash"), "hash",
+			0, false);
+	ucl_object_insert_key (opts, ucl_object_fromstring (b32_key), "key",
+			0, false);
+	rspamd_tokenizer_bench_osb ("siphash", opts, messages);
+	ucl_object_unref (opts);
+	g_free (b32_key);
+
+	for (i = 0; i < messages->len; i ++) {
+		g_array_free (g_ptr_array_index (messages, i), TRUE);
+	}
+
+	g_ptr_array_free (messages, TRUE);
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	gchar *text;
+	gsize len;
+	gint i;
+
+	rspamd_init_libs ();
+
+	context = g_option_context_new (
+			"rspamd-tokenizer-bench [file...] - words segmentation and OSB speed");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd tokenizer benchmark "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	niter = MAX (niter, 1);
+	msg_size = MAX (msg_size, 1);
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i ++) {
+			if (!g_file_get_contents (argv[i], &text, &len, &error)) {
+				rspamd_fprintf (stderr, "cannot read %s: %e\n", argv[i], error);
+				g_error_free (error);
+				error = NULL;
+				continue;
+			}
+
+			rspamd_tokenizer_bench_text (argv[i], text, len);
+			g_free (text);
+		}
+	}
+	else {
+		text = rspamd_tokenizer_bench_generate (&len);
+		rspamd_tokenizer_bench_text ("Generated ASCII text", text, len);
+		g_free (text);
+	}
+
+	return 0;
+}
@@ -0,0 +1,441 @@
+/*-
+ * Copyright 2018 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measures urls extraction over URL-heavy text and compares TLD resolution
+ * by the public suffix table with a multipattern lookup over a host. Text is
+ * either read from files specified or generated from words, urls and emails.
+ * Text is also split to parts to compare scanning them one by one with a
+ * single vectored scan.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "printf.h"
+#include "ottery.h"
+#include "url.h"
+#include "multipattern.h"
+#include "unix-std.h"
+
+static guint niter = 100;
+static guint gen_size = 1024 * 1024;
+static guint nparts = 8;
+static gchar *tld_file = NULL;
+
+static GOptionEntry entries[] = {
+		{"iterations", 'n', 0, G_OPTION_ARG_INT, &niter,
+				"Number of iterations (default: 100)", NULL},
+		{"size", 's', 0, G_OPTION_ARG_INT, &gen_size,
+				"Size of generated text (default: 1M)", NULL},
+		{"parts", 'p', 0, G_OPTION_ARG_INT, &nparts,
+				"Number of parts for vectored scan (default: 8)", NULL},
+		{"tld", 't', 0, G_OPTION_ARG_FILENAME, &tld_file,
+				"Public suffix list file", NULL},
+		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+static const gchar *words[] = {
+	"the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+	"Click", "here:", "unsubscribe", "Visit", "or", "write", "to",
+	"http://www.example.com/", "https://login.secure-bank.co.uk/auth?id=1",
+	"http://track.mail.example.org/c/1234/open?u=http://evil.com/",
+	"www.shop.example.net/item/42", "foo.bar.ck", "city.kawasaki.jp",
+	"support@example.com", "mailto:info@news.example.co.jp",
+	"https://bit.ly/2abcdef", "http://192.168.1.1/login",
+};
+
+struct url_bench_cbdata {
+	GPtrArray *hosts;
+	guint nurls;
+};
+
+static gchar *
+rspamd_url_bench_generate (gsize *len)
+{
+	gchar *text;
+	const gchar *w;
+	gsize wlen, cur = 0;
+
+	text = g_malloc (gen_size);
+
+	while (cur < gen_size) {
+		w = words[ottery_rand_range (G_N_ELEMENTS (words) - 1)];
+		wlen = MIN (strlen (w), gen_size - cur);
+		memcpy (text + cur, w, wlen);
+		cur += wlen;
+
+		if (cur < gen_size) {
+			text[cur ++] = ottery_rand_range (8) == 0 ? '\n' : ' ';
+		}
+	}
+
+	*len = cur;
+
+	return text;
+}
+
+static void
+rspamd_url_bench_callback (struct rspamd_url *url, gsize start_offset,
+		gsize end_offset, gpointer ud)
+{
+	struct url_bench_cbdata *cbd = ud;
+
+	cbd->nurls ++;
+
+	if (cbd->hosts) {
+		g_ptr_array_add (cbd->hosts, g_strndup (url->host, url->hostlen));
+	}
+}
+
+static GPtrArray *
+rspamd_url_bench_extract (const gchar *text, gsize len)
+{
+	struct url_bench_cbdata cbd;
+	rspamd_mempool_t *pool;
+	GPtrArray *hosts;
+	gdouble t1, t2;
+	guint i;
+
+	/* Collect hosts for TLD resolution */
+	hosts = g_ptr_array_new_with_free_func (g_free);
+	cbd.hosts = hosts;
+	cbd.nurls = 0;
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "url_bench");
+	rspamd_url_find_multiple (pool, text, len, FALSE, NULL,
+			rspamd_url_bench_callback, &cbd);
+	rspamd_mempool_delete (pool);
+
+	cbd.hosts = NULL;
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < niter; i ++) {
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "url_bench");
+		cbd.nurls = 0;
+		rspamd_url_find_multiple (pool, text, len, FALSE, NULL,
+				rspamd_url_bench_callback, &cbd);
+		rspamd_mempool_delete (pool);
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rspamd_printf ("  extraction: %.3f seconds, %.2f MB/s, %.2f K urls/s, "
+			"%ud urls\n",
+			t2 - t1,
+			t2 > t1 ? (gdouble)len * niter / (t2 - t1) / 1e6 : 0.0,
+			t2 > t1 ? (gdouble)cbd.nurls * niter / (t2 - t1) / 1e3 : 0.0,
+			cbd.nurls);
+
+	return hosts;
+}
+
+static gint
+rspamd_url_bench_scan_callback (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	guint *nfound = context;
+
+	(*nfound) ++;
+
+	return 0;
+}
+
+static gint
+rspamd_url_bench_vec_callback (struct rspamd_multipattern *mp,
+		guint idx,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	guint *nfound = context;
+
+	(*nfound) ++;
+
+	return 0;
+}
+
+static void
+rspamd_url_bench_vectored (const gchar *text, gsize len,
+		struct rspamd_multipattern *mp)
+{
+	const gchar **bufs;
+	gsize *lens, cur = 0, plen;
+	guint i, j, cnt = 0, nfound;
+	gdouble t1, t2;
+
+	bufs = g_new (const gchar *, nparts);
+	lens = g_new (gsize, nparts);
+	plen = len / nparts + 1;
+
+	while (cur < len && cnt < nparts) {
+		bufs[cnt] = text + cur;
+		lens[cnt] = MIN (plen, len - cur);
+		cur += lens[cnt];
+		cnt ++;
+	}
+
+	nfound = 0;
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < niter; i ++) {
+		for (j = 0; j < cnt; j ++) {
+			rspamd_multipattern_lookup (mp, bufs[j], lens[j],
+					rspamd_url_bench_scan_callback, &nfound, NULL);
+		}
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rspamd_printf ("  %ud parts one by one: %.3f seconds, %.2f MB/s, "
+			"%ud matches\n",
+			cnt, t2 - t1,
+			t2 > t1 ? (gdouble)len * niter / (t2 - t1) / 1e6 : 0.0,
+			nfound / niter);
+
+	nfound = 0;
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < niter; i ++) {
+		rspamd_multipattern_lookup_vectored (mp, bufs, lens, cnt,
+				rspamd_url_bench_vec_callback, &nfound, NULL);
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rspamd_printf ("  %ud parts vectored: %.3f seconds, %.2f MB/s, "
+			"%ud matches\n",
+			cnt, t2 - t1,
+			t2 > t1 ? (gdouble)len * niter / (t2 - t1) / 1e6 : 0.0,
+			nfound / niter);
+
+	g_free (bufs);
+	g_free (lens);
+}
+
+static gint
+rspamd_url_bench_tld_callback (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	gsize *tldlen = context;
+
+	if (match_pos == (gint)len && text[match_start] == '.' &&
+			len - match_start > *tldlen) {
+		*tldlen = len - match_start;
+	}
+
+	return 0;
+}
+
+static struct rspamd_multipattern *
+rspamd_url_bench_load_tlds (const gchar *fname)
+{
+	struct rspamd_multipattern *mp;
+	FILE *f;
+	gchar *linebuf = NULL, *p;
+	gsize buflen = 0;
+	GError *err = NULL;
+
+	f = fopen (fname, "r");
+
+	if (f == NULL) {
+		return NULL;
+	}
+
+	mp = rspamd_multipattern_create_sized (13000,
+			RSPAMD_MULTIPATTERN_TLD | RSPAMD_MULTIPATTERN_ICASE |
+			RSPAMD_MULTIPATTERN_VECTORED);
+
+	while (getline (&linebuf, &buflen, f) > 0) {
+		if (linebuf[0] == '/' || linebuf[0] == '!' ||
+				g_ascii_isspace (linebuf[0])) {
+			continue;
+		}
+
+		g_strchomp (linebuf);
+		p = linebuf;
+
+#ifndef WITH_HYPERSCAN
+		if (p[0] == '*' && p[1] == '.') {
+			p += 2;
+		}
+#endif
+
+		rspamd_multipattern_add_pattern (mp, p,
+				RSPAMD_MULTIPATTERN_TLD | RSPAMD_MULTIPATTERN_ICASE);
+	}
+
+	free (linebuf);
+	fclose (f);
+
+	if (!rspamd_multipattern_compile (mp, &err)) {
+		rspamd_fprintf (stderr, "cannot compile tld patterns: %e\n", err);
+		g_error_free (err);
+		rspamd_multipattern_destroy (mp);
+
+		return NULL;
+	}
+
+	return mp;
+}
+
+static void
+rspamd_url_bench_tld (GPtrArray *hosts, struct rspamd_multipattern *mp)
+{
+	rspamd_ftok_t tld;
+	const gchar *host;
+	gsize tldlen, found = 0;
+	gdouble t1, t2;
+	guint i, j;
+
+	if (hosts->len == 0) {
+		return;
+	}
+
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < niter; i ++) {
+		PTR_ARRAY_FOREACH (hosts, j, host) {
+			found += rspamd_url_find_tld (host, strlen (host), &tld);
+		}
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rspamd_printf ("  suffix table: %.3f seconds, %.1f nanoseconds per host, "
+			"%z resolved\n",
+			t2 - t1, (t2 - t1) / ((gdouble)niter * hosts->len) * 1e9,
+			found / niter);
+
+	if (mp == NULL) {
+		return;
+	}
+
+	found = 0;
+	t1 = rspamd_get_ticks (FALSE);
+
+	for (i = 0; i < niter; i ++) {
+		PTR_ARRAY_FOREACH (hosts, j, host) {
+			tldlen = 0;
+			rspamd_multipattern_lookup (mp, host, strlen (host),
+					rspamd_url_bench_tld_callback, &tldlen, NULL);
+			found += tldlen > 0;
+		}
+	}
+
+	t2 = rspamd_get_ticks (FALSE);
+	rspamd_printf ("  multipattern: %.3f seconds, %.1f nanoseconds per host, "
+			"%z resolved\n",
+			t2 - t1, (t2 - t1) / ((gdouble)niter * hosts->len) * 1e9,
+			found / niter);
+}
+
+static void
+rspamd_url_bench_text (const gchar *name, const gchar *text, gsize len,
+		struct rspamd_multipattern *mp)
+{
+	GPtrArray *hosts;
+
+	rspamd_printf ("%s, %Hz:\n", name, len);
+	hosts = rspamd_url_bench_extract (text, len);
+	rspamd_printf ("%ud hosts:\n", hosts->len);
+	rspamd_url_bench_tld (hosts, mp);
+	g_ptr_array_free (hosts, TRUE);
+
+	if (mp) {
+		rspamd_printf ("TLD patterns scan:\n");
+		rspamd_url_bench_vectored (text, len, mp);
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamd_multipattern *mp;
+	gchar *text;
+	gsize len;
+	gint i;
+
+	rspamd_init_libs ();
+
+	context = g_option_context_new (
+			"rspamd-url-bench [file...] - urls extraction and TLD resolution speed");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd urls extraction benchmark "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	niter = MAX (niter, 1);
+	nparts = MAX (nparts, 1);
+
+	if (tld_file == NULL) {
+		tld_file = RSPAMD_PLUGINSDIR G_DIR_SEPARATOR_S "effective_tld_names.dat";
+	}
+
+	if (access (tld_file, R_OK) == -1) {
+		rspamd_fprintf (stderr, "cannot access tld file %s: %s\n", tld_file,
+				strerror (errno));
+		exit (1);
+	}
+
+	rspamd_multipattern_library_init (NULL);
+	rspamd_url_init (tld_file);
+	mp = rspamd_url_bench_load_tlds (tld_file);
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i ++) {
+			if (!g_file_get_contents (argv[i], &text, &len, &error)) {
+				rspamd_fprintf (stderr, "cannot read %s: %e\n", argv[i], error);
+				g_error_free (error);
+				error = NULL;
+				continue;
+			}
+
+			rspamd_url_bench_text (argv[i], text, len, mp);
+			g_free (text);
+		}
+	}
+	else {
+		text = rspamd_url_bench_generate (&len);
+		rspamd_url_bench_text ("Generated URL-heavy text", text, len, mp);
+		g_free (text);
+	}
+
+	if (mp) {
+		rspamd_multipattern_destroy (mp);
+	}
+
+	rspamd_url_deinit ();
+
+	return 0;
+}